@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "xutil.h"
+#include "regs.h"
+#include "attrib.h"
+
+/*
+ * CR3 without the PCID and the no-flush bit, and without bit 12: with
+ * page table isolation the user half of a process runs on the page right
+ * after that of its kernel half, both are the one process
+ */
+#define ATTRIB_CR3_MASK         (0x000fffffffffe000ULL)
+/* the PPN of satp, without the mode and the ASID */
+#define ATTRIB_SATP_MASK        (0x00000fffffffffffULL)
+
+static void
+attrib_table_init(struct attrib_table *t, unsigned int slots)
+{
+        memset(t, 0, sizeof(struct attrib_table));
+        t->e = xcalloc(slots, sizeof(struct attrib_entry));
+        t->mask = slots - 1;
+}
+
+void
+attrib_init(struct attrib *a)
+{
+        memset(a, 0, sizeof(struct attrib));
+        attrib_table_init(&a->procs, ATTRIB_PROCS);
+        attrib_table_init(&a->pages, ATTRIB_PAGES);
+}
+
+int
+attrib_as(const struct qregs *regs, uint64_t *as, unsigned int *cpl)
+{
+        switch (regs->mode) {
+        case X86:
+        case X64:
+                *as = regs->cr3 & ATTRIB_CR3_MASK;
+                *cpl = regs->cpl;
+                return 0;
+        case RISCV64:
+                /* the privilege mode is not in 'info registers' */
+                *as = regs->riscv64.satp & ATTRIB_SATP_MASK;
+                *cpl = ATTRIB_CPL_UNKNOWN;
+                return 0;
+        default:
+                /* TTBR0_EL1 is not in 'info registers' */
+                return -1;
+        }
+}
+
+static uint64_t
+attrib_hash(uint64_t as, uint64_t key)
+{
+        uint64_t h = as ^ (key * 0x9e3779b97f4a7c15ULL);
+
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+}
+
+static void
+attrib_count(struct attrib_table *t, uint64_t as, uint64_t key)
+{
+        uint64_t h = attrib_hash(as, key);
+        struct attrib_entry *e, *cold = NULL;
+        unsigned int i;
+
+        /* ageing frees slots, the key may be past a free one */
+        for (i = 0; i < ATTRIB_PROBE; i++) {
+                e = &t->e[(h + i) & t->mask];
+
+                if (e->count && e->as == as && e->key == key) {
+                        e->count++;
+                        return;
+                }
+                if (!cold || (cold->count && e->count < cold->count))
+                        cold = e;
+        }
+
+        if (cold->count) {
+                t->evictions++;
+                t->evicted += cold->count;
+        }
+
+        cold->as = as;
+        cold->key = key;
+        cold->count = 1;
+}
+
+void
+attrib_record(struct attrib *a, uint64_t as, unsigned int cpl, uint64_t pc)
+{
+        attrib_count(&a->procs, as, cpl);
+        attrib_count(&a->pages, as, pc >> ATTRIB_PAGE_SHIFT);
+        a->samples++;
+}
+
+void
+attrib_idle(struct attrib *a)
+{
+        a->idle++;
+        a->samples++;
+}
+
+static void
+attrib_table_age(struct attrib_table *t)
+{
+        unsigned int i;
+
+        for (i = 0; i <= t->mask; i++)
+                t->e[i].count >>= 1;
+        t->evictions >>= 1;
+        t->evicted >>= 1;
+}
+
+void
+attrib_age(struct attrib *a)
+{
+        if (!a->procs.e)
+                return;
+
+        attrib_table_age(&a->procs);
+        attrib_table_age(&a->pages);
+        a->samples >>= 1;
+        a->idle >>= 1;
+}
+
+static uint64_t
+attrib_total(const struct attrib_proc *p)
+{
+        return p->user + p->kernel + p->unknown;
+}
+
+unsigned int
+attrib_top(const struct attrib *a, struct attrib_proc *top, unsigned int n)
+{
+        struct attrib_proc *procs, tmp;
+        const struct attrib_entry *e;
+        unsigned int i, j, count = 0, best;
+
+        if (!a->procs.e)
+                return 0;
+
+        /* a process has an entry per CPL it ran at */
+        procs = xcalloc(ATTRIB_PROCS, sizeof(struct attrib_proc));
+        for (i = 0; i <= a->procs.mask; i++) {
+                e = &a->procs.e[i];
+                if (!e->count)
+                        continue;
+
+                for (j = 0; j < count && procs[j].as != e->as; j++)
+                        ;
+                if (j == count)
+                        procs[count++].as = e->as;
+
+                if (e->key == ATTRIB_CPL_UNKNOWN)
+                        procs[j].unknown += e->count;
+                else if (e->key == 3)
+                        procs[j].user += e->count;
+                else
+                        procs[j].kernel += e->count;
+        }
+
+        if (n > count)
+                n = count;
+
+        for (i = 0; i < n; i++) {
+                for (j = i + 1, best = i; j < count; j++) {
+                        if (attrib_total(&procs[j]) >
+                            attrib_total(&procs[best]))
+                                best = j;
+                }
+                tmp = procs[i];
+                procs[i] = procs[best];
+                procs[best] = tmp;
+
+                top[i] = procs[i];
+                for (j = 0; j <= a->pages.mask; j++) {
+                        e = &a->pages.e[j];
+                        if (e->count && e->as == top[i].as &&
+                            e->count > top[i].page_count) {
+                                top[i].page = e->key << ATTRIB_PAGE_SHIFT;
+                                top[i].page_count = e->count;
+                        }
+                }
+        }
+
+        xfree(procs);
+        return n;
+}
+
+void
+attrib_release(struct attrib *a)
+{
+        xfree(a->procs.e);
+        xfree(a->pages.e);
+        memset(a, 0, sizeof(struct attrib));
+}
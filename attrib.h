@@ -0,0 +1,107 @@
+#ifndef __ATTRIB_H
+#define __ATTRIB_H
+
+/*
+ * CPU time of guest processes, told apart by their address space: CR3 on
+ * x86, the root page table of satp on riscv64. Each sample of a vCPU
+ * counts once for its (address space, CPL) and once for its (address
+ * space, page of the PC), so that the share of a process, its user and
+ * kernel parts and where it spends them come out without anything in the
+ * guest. Kernel threads run on whichever address space was last there,
+ * their time goes to that process.
+ *
+ * Both are open addressing tables of a fixed size, a key looked for in
+ * the ATTRIB_PROBE slots from its hash on. When they are all taken, the
+ * coldest of them, the fewest samples, makes room and its samples are
+ * counted as evicted: memory stays bounded however many processes and
+ * pages go by, at the cost of the short lived ones. attrib_age() halves
+ * every count, so that a process that was hot long ago gives way to those
+ * running now, and frees the slots that get to 0.
+ */
+
+/* slots of the tables, powers of two */
+#define ATTRIB_PROCS            (256)
+#define ATTRIB_PAGES            (4096)
+#define ATTRIB_PROBE            (8)
+#define ATTRIB_PAGE_SHIFT       (12)
+/* the CPL of an architecture that does not tell, riscv64 */
+#define ATTRIB_CPL_UNKNOWN      (4)
+
+struct qregs;
+
+struct attrib_entry {
+        uint64_t as;
+        /* the CPL, or the page of the PC */
+        uint64_t key;
+        /* samples, 0 if the slot is free */
+        uint64_t count;
+};
+
+struct attrib_table {
+        struct attrib_entry *e;
+        unsigned int mask;
+        /* entries that made room, and their samples */
+        uint64_t evictions;
+        uint64_t evicted;
+};
+
+struct attrib {
+        struct attrib_table procs;
+        struct attrib_table pages;
+        /* samples recorded, and those of a halted vCPU */
+        uint64_t samples;
+        uint64_t idle;
+};
+
+/* a process, as attrib_top() tells it */
+struct attrib_proc {
+        uint64_t as;
+        uint64_t user;
+        uint64_t kernel;
+        /* samples that tell neither */
+        uint64_t unknown;
+        /* its hottest page */
+        uint64_t page;
+        uint64_t page_count;
+};
+
+extern void
+attrib_init(struct attrib *a);
+
+/**
+ * @brief the address space and the CPL of a sample, ATTRIB_CPL_UNKNOWN if
+ * the registers do not tell user from kernel
+ * @retval 0 on success, -1 if the architecture does not tell the space
+ */
+extern int
+attrib_as(const struct qregs *regs, uint64_t *as, unsigned int *cpl);
+
+/**
+ * @brief count a sample of a vCPU running in 'as' at 'cpl' and 'pc'
+ */
+extern void
+attrib_record(struct attrib *a, uint64_t as, unsigned int cpl, uint64_t pc);
+
+/**
+ * @brief count a sample of a halted vCPU
+ */
+extern void
+attrib_idle(struct attrib *a);
+
+/**
+ * @brief halve every count, the samples and the evicted ones alike
+ */
+extern void
+attrib_age(struct attrib *a);
+
+/**
+ * @brief the 'n' processes with the most samples, the most first
+ * @retval the amount of entries of 'top' filled
+ */
+extern unsigned int
+attrib_top(const struct attrib *a, struct attrib_proc *top, unsigned int n);
+
+extern void
+attrib_release(struct attrib *a);
+
+#endif /* __ATTRIB_H */
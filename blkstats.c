@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "json.h"
+#include "qmp.h"
+#include "blkstats.h"
+
+/*
+ * {"device": "drive-virtio-disk0", "qdev": "/machine/peripheral/...",
+ *  "stats": {"rd_bytes": 1024, "wr_bytes": 0, "rd_operations": 2, ...}}
+ */
+static int
+blkstats_parse(const char *obj, size_t len, char *name,
+               struct blkstats_counters *c)
+{
+        static const struct {
+                const char *key;
+                size_t off;
+        } fields[] = {
+                { "rd_bytes", offsetof(struct blkstats_counters, rd_bytes) },
+                { "wr_bytes", offsetof(struct blkstats_counters, wr_bytes) },
+                { "rd_operations",
+                  offsetof(struct blkstats_counters, rd_ops) },
+                { "wr_operations",
+                  offsetof(struct blkstats_counters, wr_ops) },
+                { "flush_operations",
+                  offsetof(struct blkstats_counters, flush_ops) },
+                { "rd_total_time_ns",
+                  offsetof(struct blkstats_counters, rd_time_ns) },
+                { "wr_total_time_ns",
+                  offsetof(struct blkstats_counters, wr_time_ns) },
+                { "flush_total_time_ns",
+                  offsetof(struct blkstats_counters, flush_time_ns) },
+        };
+        const char *val, *stats;
+        size_t vlen, slen, i;
+
+        if ((json_get_member(obj, len, "device", &val, &vlen) == -1 ||
+             vlen <= 2) &&
+            json_get_member(obj, len, "qdev", &val, &vlen) == -1 &&
+            json_get_member(obj, len, "node-name", &val, &vlen) == -1) {
+                return -1;
+        }
+        if (vlen < 2 || *val != '"')
+                return -1;
+
+        /* unquoted, truncated if need be */
+        vlen -= 2;
+        if (vlen >= BLKSTATS_NAME_LEN)
+                vlen = BLKSTATS_NAME_LEN - 1;
+        memcpy(name, val + 1, vlen);
+        name[vlen] = '\0';
+
+        if (json_get_member(obj, len, "stats", &stats, &slen) == -1) {
+                return -1;
+        }
+
+        for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+                uint64_t *field = (uint64_t *) ((char *) c + fields[i].off);
+
+                *field = json_get_member(stats, slen, fields[i].key, &val,
+                                         &vlen) == 0 ?
+                         json_to_u64(val, vlen) : 0;
+        }
+
+        return 0;
+}
+
+/*
+ * qemu lists the devices in the same order every time, try the slot of
+ * the previous sample before scanning
+ */
+static struct blkstats_dev *
+blkstats_find(struct blkstats *bs, unsigned int hint, const char *name)
+{
+        unsigned int i;
+
+        if (hint < bs->count && streq(bs->devs[hint].name, name))
+                return &bs->devs[hint];
+
+        for (i = 0; i < bs->count; i++) {
+                if (streq(bs->devs[i].name, name))
+                        return &bs->devs[i];
+        }
+
+        if (bs->count == bs->size) {
+                bs->size = bs->size ? bs->size * 2 : 16;
+                bs->devs = xrealloc(bs->devs,
+                                    bs->size * sizeof(struct blkstats_dev));
+        }
+
+        memset(&bs->devs[bs->count], 0, sizeof(struct blkstats_dev));
+        xstrlcpy(bs->devs[bs->count].name, name, BLKSTATS_NAME_LEN);
+
+        return &bs->devs[bs->count++];
+}
+
+static float
+blkstats_lat(uint64_t time_ns, uint64_t ops)
+{
+        return ops ? time_ns / 1e3 / ops : 0.0;
+}
+
+static void
+blkstats_update(struct blkstats_dev *dev, const struct blkstats_counters *c,
+                uint64_t now)
+{
+        const struct blkstats_counters *p = &dev->prev;
+        struct blkstats_rate *r;
+        double elapsed = (now - dev->prev_ns) / 1e9;
+
+        /* first sample, or the counters were reset (the disk was reopened) */
+        if (dev->prev_ns == 0 || c->rd_ops < p->rd_ops ||
+            c->wr_ops < p->wr_ops || c->flush_ops < p->flush_ops ||
+            c->rd_bytes < p->rd_bytes || c->wr_bytes < p->wr_bytes ||
+            c->rd_time_ns < p->rd_time_ns || c->wr_time_ns < p->wr_time_ns ||
+            c->flush_time_ns < p->flush_time_ns || elapsed <= 0.0) {
+                goto out;
+        }
+
+        if (dev->count < BLKSTATS_RING) {
+                r = &dev->ring[(dev->head + dev->count++) % BLKSTATS_RING];
+        } else {
+                r = &dev->ring[dev->head];
+                dev->head = (dev->head + 1) % BLKSTATS_RING;
+        }
+
+        r->when = now;
+        r->rd_iops = (c->rd_ops - p->rd_ops) / elapsed;
+        r->wr_iops = (c->wr_ops - p->wr_ops) / elapsed;
+        r->flush_iops = (c->flush_ops - p->flush_ops) / elapsed;
+        r->rd_bps = (c->rd_bytes - p->rd_bytes) / elapsed;
+        r->wr_bps = (c->wr_bytes - p->wr_bytes) / elapsed;
+        r->rd_lat = blkstats_lat(c->rd_time_ns - p->rd_time_ns,
+                                 c->rd_ops - p->rd_ops);
+        r->wr_lat = blkstats_lat(c->wr_time_ns - p->wr_time_ns,
+                                 c->wr_ops - p->wr_ops);
+        r->flush_lat = blkstats_lat(c->flush_time_ns - p->flush_time_ns,
+                                    c->flush_ops - p->flush_ops);
+
+out:
+        dev->prev = *c;
+        dev->prev_ns = now;
+        dev->seen = 1;
+}
+
+int
+blkstats_sample(struct blkstats *bs, const struct qmp_conn *qmpc)
+{
+        struct blkstats_counters c;
+        char name[BLKSTATS_NAME_LEN];
+        const char *arr, *elem;
+        size_t nread, alen, elen, pos = 0;
+        unsigned int i, idx = 0;
+        uint64_t now;
+        int r;
+
+        if (!bs->buf)
+                bs->buf = xmalloc(BLKSTATS_BUF_LEN);
+
+        /* rates need fresh counters, never a cached reply */
+        if (qmp_execute_uncached(qmpc, QMP_COMMAND_QUERY_BLOCKSTATS, bs->buf,
+                                 BLKSTATS_BUF_LEN, &nread) == -1) {
+                return -1;
+        }
+        now = xclock_ns();
+
+        if (qmp_reply_return(bs->buf, nread, &arr, &alen) == -1) {
+                return -1;
+        }
+
+        for (i = 0; i < bs->count; i++)
+                bs->devs[i].seen = 0;
+
+        while ((r = json_array_next(arr, alen, &pos, &elem, &elen)) == 1) {
+                if (blkstats_parse(elem, elen, name, &c) == -1)
+                        continue;
+                blkstats_update(blkstats_find(bs, idx++, name), &c, now);
+        }
+
+        /* hot-unplugged disks */
+        for (i = 0; i < bs->count; ) {
+                if (!bs->devs[i].seen)
+                        bs->devs[i] = bs->devs[--bs->count];
+                else
+                        i++;
+        }
+
+        return r == -1 ? -1 : 0;
+}
+
+const struct blkstats_rate *
+blkstats_last(const struct blkstats_dev *dev)
+{
+        if (dev->count == 0)
+                return NULL;
+
+        return &dev->ring[(dev->head + dev->count - 1) % BLKSTATS_RING];
+}
+
+void
+blkstats_dump(const struct blkstats *bs)
+{
+        unsigned int i;
+
+        for (i = 0; i < bs->count; i++) {
+                const struct blkstats_rate *r = blkstats_last(&bs->devs[i]);
+
+                if (!r)
+                        continue;
+
+                dprintf("%s: rd %.0f IOPS %.1f KB/s %.1fus, wr %.0f IOPS "
+                        "%.1f KB/s %.1fus, flush %.0f/s %.1fus\n",
+                        bs->devs[i].name, r->rd_iops, r->rd_bps / 1024.0,
+                        r->rd_lat, r->wr_iops, r->wr_bps / 1024.0, r->wr_lat,
+                        r->flush_iops, r->flush_lat);
+        }
+}
+
+void
+blkstats_release(struct blkstats *bs)
+{
+        xfree(bs->devs);
+        xfree(bs->buf);
+        memset(bs, 0, sizeof(struct blkstats));
+}
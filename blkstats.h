@@ -0,0 +1,77 @@
+#ifndef __BLKSTATS_H
+#define __BLKSTATS_H
+
+/*
+ * Per disk I/O rates from query-blockstats. The counters of the previous
+ * sample live next to each device in one flat array, the derived rates in
+ * a fixed ring per device, so memory does not grow with the run time.
+ */
+
+/* rates kept per device */
+#define BLKSTATS_RING           (64)
+#define BLKSTATS_NAME_LEN       (64)
+/* the reply of a VM with many disks */
+#define BLKSTATS_BUF_LEN        (256 * 1024)
+
+#define QMP_COMMAND_QUERY_BLOCKSTATS    "{\"execute\": \"query-blockstats\"}"
+
+struct blkstats_counters {
+        uint64_t rd_bytes, wr_bytes;
+        uint64_t rd_ops, wr_ops, flush_ops;
+        uint64_t rd_time_ns, wr_time_ns, flush_time_ns;
+};
+
+/* one interval */
+struct blkstats_rate {
+        /* end of the interval, CLOCK_MONOTONIC ns */
+        uint64_t when;
+        float rd_iops, wr_iops, flush_iops;
+        /* bytes per second */
+        float rd_bps, wr_bps;
+        /* mean time per operation, in us, 0 without operations */
+        float rd_lat, wr_lat, flush_lat;
+};
+
+struct blkstats_dev {
+        /* the block backend, or the qdev path for -blockdev setups */
+        char name[BLKSTATS_NAME_LEN];
+        struct blkstats_counters prev;
+        uint64_t prev_ns;
+        /* the oldest rate is ring[head], 'count' of them are valid */
+        unsigned int head, count;
+        struct blkstats_rate ring[BLKSTATS_RING];
+        /* still reported by the last sample */
+        int seen;
+};
+
+struct blkstats {
+        struct blkstats_dev *devs;
+        unsigned int count;
+        unsigned int size;
+        /* reply buffer, reused by every sample */
+        char *buf;
+};
+
+/**
+ * @brief poll every device once, devices that went away are dropped
+ * @retval 0 on success, -1 if qemu did not answer
+ */
+extern int
+blkstats_sample(struct blkstats *bs, const struct qmp_conn *qmpc);
+
+/**
+ * @brief the latest rate of a device, NULL before its second sample
+ */
+extern const struct blkstats_rate *
+blkstats_last(const struct blkstats_dev *dev);
+
+/**
+ * @brief print the latest rate of every device
+ */
+extern void
+blkstats_dump(const struct blkstats *bs);
+
+extern void
+blkstats_release(struct blkstats *bs);
+
+#endif /* __BLKSTATS_H */
@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "json.h"
+#include "cache.h"
+
+#define NSEC_PER_MSEC           (1000000ULL)
+
+/* FNV-1a over the VM and the command */
+static uint64_t
+qmp_cache_hash(const char *vm, const char *cmd)
+{
+        uint64_t h = 0xcbf29ce484222325ULL;
+
+        for (; *vm; vm++)
+                h = (h ^ (unsigned char) *vm) * 0x100000001b3ULL;
+        h = (h ^ 0xff) * 0x100000001b3ULL;
+        for (; *cmd; cmd++)
+                h = (h ^ (unsigned char) *cmd) * 0x100000001b3ULL;
+
+        return h;
+}
+
+/*
+ * commands are keyed by their compacted text, so that spacing does not
+ * split the same command over several entries
+ */
+static char *
+qmp_cache_key(const char *cmd)
+{
+        size_t len = strlen(cmd);
+        char *key = xmalloc(len + 1);
+
+        json_compact(key, len + 1, cmd, len);
+        return key;
+}
+
+struct qmp_cache *
+qmp_cache_new(uint32_t ttl_ms, uint32_t neg_ttl_ms)
+{
+        struct qmp_cache *cache = xmalloc(sizeof(struct qmp_cache));
+
+        cache->ttl_ms = ttl_ms;
+        cache->neg_ttl_ms = neg_ttl_ms;
+
+        return cache;
+}
+
+static void
+qmp_cache_free_entry(struct qmp_cache_entry *e)
+{
+        xfree(e->vm);
+        xfree(e->cmd);
+        xfree(e->reply);
+        xfree(e);
+}
+
+void
+qmp_cache_free(struct qmp_cache *cache)
+{
+        struct qmp_cache_ttl *t = cache->ttls;
+        unsigned int i;
+
+        for (i = 0; i < QMP_CACHE_BUCKETS; i++) {
+                struct qmp_cache_entry *e = cache->buckets[i];
+
+                while (e) {
+                        struct qmp_cache_entry *en = e->next;
+
+                        qmp_cache_free_entry(e);
+                        e = en;
+                }
+        }
+
+        while (t) {
+                struct qmp_cache_ttl *tn = t->next;
+
+                xfree(t->cmd);
+                xfree(t);
+                t = tn;
+        }
+
+        xfree(cache);
+}
+
+void
+qmp_cache_set_ttl(struct qmp_cache *cache, const char *cmd,
+                  uint32_t ttl_ms, uint32_t neg_ttl_ms)
+{
+        char *key = qmp_cache_key(cmd);
+        struct qmp_cache_ttl *t;
+
+        for (t = cache->ttls; t != NULL; t = t->next) {
+                if (streq(t->cmd, key)) {
+                        xfree(key);
+                        break;
+                }
+        }
+
+        if (!t) {
+                t = xmalloc(sizeof(struct qmp_cache_ttl));
+                t->cmd = key;
+                t->next = cache->ttls;
+                cache->ttls = t;
+        }
+
+        t->ttl_ms = ttl_ms;
+        t->neg_ttl_ms = neg_ttl_ms;
+}
+
+static uint32_t
+qmp_cache_ttl(const struct qmp_cache *cache, const char *key, int error)
+{
+        struct qmp_cache_ttl *t;
+
+        for (t = cache->ttls; t != NULL; t = t->next) {
+                if (streq(t->cmd, key))
+                        return error ? t->neg_ttl_ms : t->ttl_ms;
+        }
+
+        return error ? cache->neg_ttl_ms : cache->ttl_ms;
+}
+
+int
+qmp_cache_readonly(const char *cmd, size_t len)
+{
+        const char *exec, *args, *cl;
+        size_t elen, alen, cllen;
+
+        if (json_get_member(cmd, len, "execute", &exec, &elen) == -1) {
+                return 0;
+        }
+
+        if (elen > 8 && !strncmp(exec, "\"query-", 7)) {
+                return 1;
+        }
+
+        if (!json_string_eq(exec, elen, "human-monitor-command")) {
+                return 0;
+        }
+
+        if (json_get_member(cmd, len, "arguments", &args, &alen) == -1 ||
+            json_get_member(args, alen, "command-line", &cl, &cllen) == -1) {
+                return 0;
+        }
+
+        return (cllen > 6 && !strncmp(cl, "\"info ", 6));
+}
+
+static struct qmp_cache_entry *
+qmp_cache_find(struct qmp_cache *cache, uint64_t hash,
+               const char *vm, const char *key)
+{
+        struct qmp_cache_entry *e;
+
+        e = cache->buckets[hash % QMP_CACHE_BUCKETS];
+        for (; e != NULL; e = e->next) {
+                if (e->hash == hash && streq(e->vm, vm) && streq(e->cmd, key))
+                        return e;
+        }
+
+        return NULL;
+}
+
+/* drop the expired entries of the bucket of 'hash' */
+static void
+qmp_cache_sweep(struct qmp_cache *cache, uint64_t hash, uint64_t now)
+{
+        struct qmp_cache_entry **pe = &cache->buckets[hash % QMP_CACHE_BUCKETS];
+
+        while (*pe) {
+                struct qmp_cache_entry *e = *pe;
+
+                if (e->expires <= now) {
+                        *pe = e->next;
+                        qmp_cache_free_entry(e);
+                } else {
+                        pe = &e->next;
+                }
+        }
+}
+
+int
+qmp_cache_lookup(struct qmp_cache *cache, const char *vm, const char *cmd,
+                 char *buf, size_t size, size_t *len)
+{
+        struct qmp_cache_entry *e;
+        char *key = qmp_cache_key(cmd);
+        uint64_t hash = qmp_cache_hash(vm, key), now = xclock_ns();
+
+        e = qmp_cache_find(cache, hash, vm, key);
+        xfree(key);
+
+        if (e && e->expires <= now) {
+                qmp_cache_sweep(cache, hash, now);
+                e = NULL;
+        }
+
+        if (!e || e->len >= size) {
+                cache->stats.misses++;
+                return -1;
+        }
+
+        memcpy(buf, e->reply, e->len);
+        buf[e->len] = '\0';
+        *len = e->len;
+
+        if (e->error) {
+                cache->stats.neg_hits++;
+        } else {
+                cache->stats.hits++;
+        }
+
+        return 0;
+}
+
+static void
+qmp_cache_store(struct qmp_cache *cache, const char *vm, const char *cmd,
+                const char *reply, size_t len)
+{
+        struct qmp_cache_entry *e;
+        const char *val;
+        size_t vlen;
+        uint32_t ttl;
+        uint64_t hash;
+        char *key;
+        int error;
+
+        error = (json_get_member(reply, len, "error", &val, &vlen) == 0);
+
+        key = qmp_cache_key(cmd);
+        if ((ttl = qmp_cache_ttl(cache, key, error)) == 0) {
+                xfree(key);
+                return;
+        }
+
+        hash = qmp_cache_hash(vm, key);
+        /* keys not asked for again would stay until their VM is flushed */
+        qmp_cache_sweep(cache, hash, xclock_ns());
+        if ((e = qmp_cache_find(cache, hash, vm, key)) != NULL) {
+                xfree(key);
+                xfree(e->reply);
+        } else {
+                e = xmalloc(sizeof(struct qmp_cache_entry));
+                e->hash = hash;
+                e->vm = xstrdup(vm);
+                e->cmd = key;
+                e->next = cache->buckets[hash % QMP_CACHE_BUCKETS];
+                cache->buckets[hash % QMP_CACHE_BUCKETS] = e;
+        }
+
+        e->reply = xmalloc(len + 1);
+        memcpy(e->reply, reply, len);
+        e->len = len;
+        e->error = error;
+        e->expires = xclock_ns() + ttl * NSEC_PER_MSEC;
+
+        cache->stats.stores++;
+}
+
+void
+qmp_cache_invalidate(struct qmp_cache *cache, const char *vm)
+{
+        unsigned int i;
+
+        for (i = 0; i < QMP_CACHE_BUCKETS; i++) {
+                struct qmp_cache_entry **pe = &cache->buckets[i];
+
+                while (*pe) {
+                        struct qmp_cache_entry *e = *pe;
+
+                        if (streq(e->vm, vm)) {
+                                *pe = e->next;
+                                qmp_cache_free_entry(e);
+                        } else {
+                                pe = &e->next;
+                        }
+                }
+        }
+
+        cache->stats.invalidations++;
+}
+
+/*
+ * a stopped, resumed or reset guest makes every cached reply stale
+ */
+static int
+qmp_cache_event_flushes(const char *obj, size_t len)
+{
+        const char *ev;
+        size_t evlen;
+
+        if (json_get_member(obj, len, "event", &ev, &evlen) == -1) {
+                return 0;
+        }
+
+        return (json_string_eq(ev, evlen, "STOP") ||
+                json_string_eq(ev, evlen, "RESUME") ||
+                json_string_eq(ev, evlen, "RESET"));
+}
+
+void
+qmp_cache_observe(struct qmp_cache *cache, const char *vm,
+                  const char *buf, size_t len)
+{
+        qmp_cache_update(cache, vm, NULL, buf, len);
+}
+
+void
+qmp_cache_update(struct qmp_cache *cache, const char *vm, const char *cmd,
+                 const char *buf, size_t len)
+{
+        const char *reply = NULL;
+        size_t off = 0, skip, rlen = 0;
+        ssize_t olen;
+
+        /* events may arrive before and after the reply */
+        while ((olen = json_object_len(buf + off, len - off, &skip)) > 0) {
+                const char *obj = buf + off + skip;
+                const char *val;
+                size_t vlen;
+
+                if (json_get_member(obj, olen, "event", &val, &vlen) == 0) {
+                        if (qmp_cache_event_flushes(obj, olen)) {
+                                qmp_cache_invalidate(cache, vm);
+                                /* a reply read along with it is stale too */
+                                reply = NULL;
+                        }
+                } else if (!reply) {
+                        reply = obj;
+                        rlen = olen;
+                }
+
+                off += skip + olen;
+        }
+
+        if (cmd && reply && qmp_cache_readonly(cmd, strlen(cmd))) {
+                qmp_cache_store(cache, vm, cmd, reply, rlen);
+        }
+}
+
+void
+qmp_cache_dump_stats(const struct qmp_cache *cache)
+{
+        const struct qmp_cache_stats *st = &cache->stats;
+        uint64_t lookups = st->hits + st->neg_hits + st->misses;
+
+        dprintf("Cache: %lu lookups, %lu hits, %lu negative hits, "
+                "%lu misses (%.1f%% hit rate)\n", lookups, st->hits,
+                st->neg_hits, st->misses, lookups ?
+                100.0 * (st->hits + st->neg_hits) / lookups : 0.0);
+        dprintf("Cache: %lu stores, %lu invalidations\n",
+                st->stores, st->invalidations);
+}
@@ -0,0 +1,119 @@
+#ifndef __CACHE_H
+#define __CACHE_H
+
+/* hash buckets, entries are chained */
+#define QMP_CACHE_BUCKETS       (256)
+/* default freshness windows, in milliseconds */
+#define QMP_CACHE_TTL           (250)
+#define QMP_CACHE_NEG_TTL       (1000)
+
+struct qmp_cache_entry {
+        uint64_t hash;
+        /* the VM, i.e. the monitor socket path */
+        char *vm;
+        /* the compacted command */
+        char *cmd;
+        /* the reply object, without any event sent along with it */
+        char *reply;
+        size_t len;
+        /* negative entry, qemu answered with an error */
+        int error;
+        uint64_t expires;
+        struct qmp_cache_entry *next;
+};
+
+/* per command freshness windows */
+struct qmp_cache_ttl {
+        char *cmd;
+        uint32_t ttl_ms;
+        uint32_t neg_ttl_ms;
+        struct qmp_cache_ttl *next;
+};
+
+struct qmp_cache_stats {
+        uint64_t hits;
+        uint64_t neg_hits;
+        uint64_t misses;
+        uint64_t stores;
+        /* VM-wide flushes caused by STOP/RESUME/RESET */
+        uint64_t invalidations;
+};
+
+struct qmp_cache {
+        struct qmp_cache_entry *buckets[QMP_CACHE_BUCKETS];
+        struct qmp_cache_ttl *ttls;
+        uint32_t ttl_ms;
+        uint32_t neg_ttl_ms;
+        struct qmp_cache_stats stats;
+};
+
+/**
+ * @brief allocate a cache
+ * @param ttl_ms freshness window of successful replies not configured
+ * with qmp_cache_set_ttl()
+ * @param neg_ttl_ms the same for error replies, 0 disables negative caching
+ */
+extern struct qmp_cache *
+qmp_cache_new(uint32_t ttl_ms, uint32_t neg_ttl_ms);
+
+/**
+ * @brief release a cache and all of its entries
+ */
+extern void
+qmp_cache_free(struct qmp_cache *cache);
+
+/**
+ * @brief set the freshness windows of a single command
+ * @param cmd the command, as it is sent to qemu
+ */
+extern void
+qmp_cache_set_ttl(struct qmp_cache *cache, const char *cmd,
+                  uint32_t ttl_ms, uint32_t neg_ttl_ms);
+
+/**
+ * @brief tell whether a command is a read-only query, only those are cached
+ */
+extern int
+qmp_cache_readonly(const char *cmd, size_t len);
+
+/**
+ * @brief look up a fresh reply of 'cmd' on 'vm', dropping it if expired
+ * @param buf filled with the cached reply, NUL terminated
+ * @param size the size of 'buf'
+ * @param len set to the length of the reply
+ * @retval 0 on a hit, -1 on a miss
+ */
+extern int
+qmp_cache_lookup(struct qmp_cache *cache, const char *vm, const char *cmd,
+                 char *buf, size_t size, size_t *len);
+
+/**
+ * @brief feed what qemu answered to 'cmd': events are checked for
+ * invalidation and the reply, if any and if 'cmd' is read-only, is stored
+ * after the expired entries of its bucket are dropped
+ */
+extern void
+qmp_cache_update(struct qmp_cache *cache, const char *vm, const char *cmd,
+                 const char *buf, size_t len);
+
+/**
+ * @brief drop every entry of 'vm' if 'buf' carries a STOP, RESUME or RESET
+ * event
+ */
+extern void
+qmp_cache_observe(struct qmp_cache *cache, const char *vm,
+                  const char *buf, size_t len);
+
+/**
+ * @brief drop every entry of 'vm'
+ */
+extern void
+qmp_cache_invalidate(struct qmp_cache *cache, const char *vm);
+
+/**
+ * @brief print hit/miss counters
+ */
+extern void
+qmp_cache_dump_stats(const struct qmp_cache *cache);
+
+#endif /* __CACHE_H */
@@ -0,0 +1,841 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "regs.h"
+#include "qmp.h"
+#include "unwind.h"
+#include "zio.h"
+#include "ticker.h"
+#include "duty.h"
+#include "attrib.h"
+#include "collector.h"
+
+#define COLL_MS                 (1000000UL)
+#define COLL_S                  (1000000000UL)
+/* per mille of 'total', as %u.%u */
+#define COLL_PM(n, total)       (unsigned int) ((n) * 1000 / (total) / 10), \
+                                (unsigned int) ((n) * 1000 / (total) % 10)
+
+int
+coll_init(struct collector *c, unsigned int nworkers,
+          unsigned int interval_ms, int fd, unsigned int depth)
+{
+        uint64_t i;
+
+        if (nworkers == 0 || nworkers > COLL_MAX_WORKERS) {
+                dprintf("collector: 1 to %u workers\n", COLL_MAX_WORKERS);
+                return -1;
+        }
+
+        if (depth > COLL_MAX_DEPTH) {
+                dprintf("collector: stacks of at most %u frames\n",
+                        COLL_MAX_DEPTH);
+                return -1;
+        }
+
+        memset(c, 0, sizeof(struct collector));
+        c->nworkers = nworkers;
+        c->depth = depth;
+        c->interval_ms = interval_ms ? interval_ms : COLL_INTERVAL;
+        c->fd = fd;
+        c->cpu = -1;
+        c->jitter = xcalloc(1, sizeof(struct tick_hist));
+
+        c->conns = xcalloc(COLL_MAX_VMS, sizeof(struct qmp_conn *));
+        c->state = xcalloc(COLL_MAX_VMS, sizeof(int));
+        c->heal = xcalloc(COLL_MAX_VMS, sizeof(int));
+        c->errors = xcalloc(COLL_MAX_VMS, sizeof(unsigned int));
+        c->health = xcalloc(COLL_MAX_VMS, sizeof(struct qmp_health));
+        c->duty = xcalloc(COLL_MAX_VMS, sizeof(struct duty));
+        if (depth)
+                c->uw = xcalloc(COLL_MAX_VMS, sizeof(struct unwind_cache));
+
+        c->q.cells = xcalloc(COLL_QUEUE_LEN, sizeof(struct coll_cell));
+        c->q.mask = COLL_QUEUE_LEN - 1;
+        for (i = 0; i < COLL_QUEUE_LEN; i++)
+                c->q.cells[i].seq = i;
+
+        return 0;
+}
+
+void
+coll_reap(struct collector *c)
+{
+        unsigned int i;
+
+        for (i = 0; i < c->count; i++) {
+                if (__atomic_load_n(&c->state[i], __ATOMIC_ACQUIRE) !=
+                    COLL_GONE)
+                        continue;
+
+                c->conns[i]->health = NULL;
+                if (c->gone)
+                        c->gone(c->conns[i], c->arg);
+                c->conns[i] = NULL;
+                __atomic_store_n(&c->state[i], COLL_FREE, __ATOMIC_RELAXED);
+        }
+}
+
+int
+coll_add(struct collector *c, struct qmp_conn *qmpc)
+{
+        unsigned int i;
+
+        coll_reap(c);
+
+        /* only this thread frees slots, and only this thread fills them */
+        for (i = 0; i < COLL_MAX_VMS; i++) {
+                if (__atomic_load_n(&c->state[i], __ATOMIC_RELAXED) ==
+                    COLL_FREE)
+                        break;
+        }
+        if (i == COLL_MAX_VMS) {
+                dprintf("collector: at most %u VMs\n", COLL_MAX_VMS);
+                return -1;
+        }
+
+        c->conns[i] = qmpc;
+        c->errors[i] = 0;
+        memset(&c->health[i], 0, sizeof(struct qmp_health));
+        c->health[i].timeout_ms = c->timeout_ms;
+        qmpc->health = &c->health[i];
+        duty_init(&c->duty[i]);
+        if (c->depth)
+                unwind_init(&c->uw[i]);
+
+        /* the worker sees the slot filled once it sees it live */
+        __atomic_store_n(&c->heal[i], COLL_HEAL_IDLE, __ATOMIC_RELEASE);
+        __atomic_store_n(&c->state[i], COLL_LIVE, __ATOMIC_RELEASE);
+        if (i >= c->count)
+                __atomic_store_n(&c->count, i + 1, __ATOMIC_RELEASE);
+
+        return 0;
+}
+
+int
+coll_remove(struct collector *c, const char *path)
+{
+        unsigned int i;
+        int live;
+
+        coll_reap(c);
+
+        for (i = 0; i < c->count; i++) {
+                /* a slot not free is not freed under this thread */
+                if (!c->conns[i] || !streq(c->conns[i]->qmp_sock_path, path))
+                        continue;
+
+                /* it may have been given up on meanwhile */
+                live = COLL_LIVE;
+                if (__atomic_compare_exchange_n(&c->state[i], &live,
+                                                COLL_LEAVING, 0,
+                                                __ATOMIC_RELAXED,
+                                                __ATOMIC_RELAXED))
+                        return 0;
+        }
+
+        return -1;
+}
+
+static int
+coll_try_push(struct coll_queue *q, const struct coll_sample *s)
+{
+        uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        struct coll_cell *cell;
+
+        for (;;) {
+                int64_t diff;
+
+                cell = &q->cells[pos & q->mask];
+                diff = (int64_t) (__atomic_load_n(&cell->seq,
+                                                  __ATOMIC_ACQUIRE) - pos);
+
+                if (diff == 0) {
+                        /* free, claim it; on failure pos is reloaded */
+                        if (__atomic_compare_exchange_n(&q->tail, &pos,
+                                                        pos + 1, 1,
+                                                        __ATOMIC_RELAXED,
+                                                        __ATOMIC_RELAXED))
+                                break;
+                } else if (diff < 0) {
+                        /* the writer did not get to it a lap ago */
+                        return -1;
+                } else {
+                        pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+                }
+        }
+
+        cell->s = *s;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        return 0;
+}
+
+int
+coll_push(struct coll_queue *q, const struct coll_sample *s)
+{
+        if (coll_try_push(q, s) == 0)
+                return 0;
+
+        __atomic_fetch_add(&q->drops, 1, __ATOMIC_RELAXED);
+        return -1;
+}
+
+int
+coll_pop(struct coll_queue *q, struct coll_sample *s)
+{
+        struct coll_cell *cell = &q->cells[q->head & q->mask];
+
+        if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != q->head + 1)
+                return -1;
+
+        *s = cell->s;
+        /* free for the producer one lap ahead */
+        __atomic_store_n(&cell->seq, q->head + q->mask + 1, __ATOMIC_RELEASE);
+        q->head++;
+        return 0;
+}
+
+/*
+ * the registers of every listed vCPU go to its process, in the order of
+ * the vCPU ids, those of a halted one as halted and those of one in an
+ * unknown state nowhere
+ */
+static void
+coll_attribute(struct collector *c, unsigned int vm, const struct qregs *all,
+               unsigned int nregs, const uint64_t *listed,
+               const uint64_t *seen, const uint64_t *running)
+{
+        struct attrib *a = &c->attrib[vm];
+        unsigned int id, n = 0, cpl;
+        uint64_t as, bit;
+
+        /* the VM's tables are its worker's, from its first sample on */
+        if (!a->procs.e)
+                attrib_init(a);
+
+        for (id = 0; id < DUTY_MAX_VCPUS && n < nregs; id++) {
+                bit = 1ULL << (id % 64);
+                if (!(listed[id / 64] & bit))
+                        continue;
+
+                if (!(seen[id / 64] & bit)) {
+                        n++;
+                        continue;
+                }
+
+                if (!(running[id / 64] & bit))
+                        attrib_idle(a);
+                else if (attrib_as(&all[n], &as, &cpl) == 0)
+                        attrib_record(a, as, cpl, all[n].pc);
+                n++;
+        }
+}
+
+static int
+coll_sample(struct collector *c, unsigned int vm, unsigned int worker,
+            uint64_t deadline)
+{
+        const struct qmp_conn *qmpc = c->conns[vm];
+        uint64_t listed[DUTY_ROW_WORDS], seen[DUTY_ROW_WORDS];
+        uint64_t running[DUTY_ROW_WORDS];
+        struct qregs one, *all = NULL, *regs = &one;
+        unsigned int nregs = 0;
+        struct coll_sample s;
+        struct vcpus vcpus;
+        struct vcpu *v;
+        int peak, r, ret = -1;
+
+        memset(&s, 0, sizeof(struct coll_sample));
+        s.duty = s.duty_long = s.peak = -1;
+        s.vm = vm;
+        s.worker = worker;
+        s.when = xclock_ns();
+        if (s.when > deadline)
+                s.late = s.when - deadline;
+
+        if (qmp_query_vcpus(qmpc, &vcpus) == 0) {
+                /* every vCPU for attribution, vCPU 0 first */
+                if (c->attrib) {
+                        r = qmp_query_regs_all(qmpc, &all, &nregs);
+                        if (r == 0 && nregs)
+                                regs = &all[0];
+                        else
+                                r = -1;
+                } else {
+                        r = qmp_query_regs(qmpc, &one);
+                }
+
+                if (r == 0) {
+                        s.up = 1;
+                        s.pc = regs->pc;
+                        s.user = regs->user;
+                        /* the VM is only ever sampled by this worker */
+                        if (c->depth)
+                                s.depth = unwind_stack(&c->uw[vm], qmpc, 0,
+                                                       regs, s.stack,
+                                                       c->depth);
+                        memset(listed, 0, sizeof(listed));
+                        memset(seen, 0, sizeof(seen));
+                        memset(running, 0, sizeof(running));
+                        for (v = vcpus.vcpu; v != NULL; v = v->next) {
+                                uint64_t bit = 1ULL << (v->id % 64);
+
+                                s.nvcpus++;
+                                listed[v->id / 64] |= bit;
+                                /* a state we could not tell is no sample */
+                                if (v->state == UNDEFINED)
+                                        continue;
+                                seen[v->id / 64] |= bit;
+                                if (v->state == HALTED)
+                                        s.halted++;
+                                else if (v->state == RUNNING)
+                                        running[v->id / 64] |= bit;
+                        }
+
+                        duty_record(&c->duty[vm], seen, running);
+                        s.duty = duty_vm(&c->duty[vm], COLL_DUTY_SHORT,
+                                         &peak);
+                        s.duty_long = duty_vm(&c->duty[vm], DUTY_HISTORY,
+                                              &peak);
+                        s.peak = peak;
+                        if (c->attrib)
+                                coll_attribute(c, vm, all, nregs, listed,
+                                               seen, running);
+                        ret = 0;
+                }
+                xfree(all);
+                qmp_release_vcpus(&vcpus);
+        }
+
+        s.rtt = xclock_ns() - s.when;
+        s.timeouts = __atomic_load_n(&c->health[vm].timeouts,
+                                     __ATOMIC_RELAXED);
+        coll_push(&c->q, &s);
+        return ret;
+}
+
+/* down, as far as anyone can tell, without asking */
+static void
+coll_quarantined(struct collector *c, unsigned int vm, unsigned int worker,
+                 uint64_t deadline)
+{
+        struct coll_sample s;
+
+        memset(&s, 0, sizeof(struct coll_sample));
+        s.duty = s.duty_long = s.peak = -1;
+        s.vm = vm;
+        s.worker = worker;
+        s.when = xclock_ns();
+        if (s.when > deadline)
+                s.late = s.when - deadline;
+        s.timeouts = __atomic_load_n(&c->health[vm].timeouts,
+                                     __ATOMIC_RELAXED);
+        coll_push(&c->q, &s);
+}
+
+/*
+ * the top processes of a VM, from its worker: the slot is not let go
+ * under it
+ */
+static void
+coll_attrib_report(struct collector *c, unsigned int vm)
+{
+        const struct attrib *a = &c->attrib[vm];
+        struct attrib_proc top[COLL_MAX_TOP];
+        /* "255:100.0% " per vCPU */
+        char duty[DUTY_MAX_VCPUS * 12];
+        const char *path;
+        unsigned int i, n;
+        uint64_t total;
+        size_t len = 0;
+        int pm;
+
+        if (!a->samples)
+                return;
+
+        path = c->conns[vm]->qmp_sock_path;
+        n = attrib_top(a, top, c->top);
+        dprintf("collector: %s %lu vCPU samples, %u.%u%% halted, "
+                "%lu of processes and %lu of pages evicted\n", path,
+                a->samples, COLL_PM(a->idle, a->samples), a->procs.evicted,
+                a->pages.evicted);
+
+        /* which vCPUs the running samples come from, over the long window */
+        for (i = 0; i < c->duty[vm].count; i++) {
+                if ((pm = duty_vcpu(&c->duty[vm], i, DUTY_HISTORY)) == -1)
+                        continue;
+                len += snprintf(duty + len, sizeof(duty) - len, " %u:%d.%d%%",
+                                i, pm / 10, pm % 10);
+        }
+        if (len)
+                dprintf("collector: %s running%s\n", path, duty);
+
+        for (i = 0; i < n; i++) {
+                total = top[i].user + top[i].kernel + top[i].unknown;
+
+                /* no split where user and kernel cannot be told apart */
+                if (top[i].unknown) {
+                        dprintf("collector: %s as=0x%.16lx %u.%u%% "
+                                "hot 0x%.16lx %u.%u%%\n", path, top[i].as,
+                                COLL_PM(total, a->samples), top[i].page,
+                                COLL_PM(top[i].page_count, a->samples));
+                        continue;
+                }
+
+                dprintf("collector: %s as=0x%.16lx %u.%u%% user %u.%u%% "
+                        "kernel %u.%u%% hot 0x%.16lx %u.%u%%\n", path,
+                        top[i].as, COLL_PM(total, a->samples),
+                        COLL_PM(top[i].user, a->samples),
+                        COLL_PM(top[i].kernel, a->samples), top[i].page,
+                        COLL_PM(top[i].page_count, a->samples));
+        }
+}
+
+/* after its last sample, the writer lets the VM go once it gets there */
+static void
+coll_let_go(struct collector *c, unsigned int vm, unsigned int worker,
+            int dropped)
+{
+        struct coll_sample s;
+        int idle = COLL_HEAL_IDLE;
+
+        /* its connection is not handed back under the healer */
+        while (!__atomic_compare_exchange_n(&c->heal[vm], &idle,
+                                            COLL_HEAL_OFF, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                idle = COLL_HEAL_IDLE;
+                usleep(COLL_FLUSH_MS * 1000);
+        }
+
+        if (c->attrib)
+                coll_attrib_report(c, vm);
+
+        __atomic_store_n(&c->state[vm], COLL_DEAD, __ATOMIC_RELAXED);
+
+        memset(&s, 0, sizeof(struct coll_sample));
+        s.vm = vm;
+        s.worker = worker;
+        s.gone = 1;
+        s.dropped = dropped;
+
+        /* never dropped, or the slot would never be freed */
+        while (coll_try_push(&c->q, &s) == -1)
+                usleep(COLL_FLUSH_MS * 1000);
+}
+
+static void *
+coll_worker_run(void *arg)
+{
+        struct coll_worker *w = arg;
+        struct collector *c = w->c;
+        uint64_t deadline, report = xclock_ns() + COLL_REPORT_MS * COLL_MS;
+        struct ticker t;
+        unsigned int i, n, live;
+        int ticking = 1, failed;
+
+        /* best effort, sampling goes on without */
+        if (c->cpu >= 0)
+                ticker_pin(c->cpu + w->id);
+        if (c->prio > 0)
+                ticker_fifo(c->prio);
+
+        if (ticker_init(&t, c->interval_ms * COLL_MS) == -1) {
+                dprintf("collector: worker %u cannot tick\n", w->id);
+                __atomic_store_n(&c->failed, 1, __ATOMIC_RELAXED);
+                ticking = 0;
+        }
+        deadline = t.deadline;
+
+        for (;;) {
+                /* the VMs of a worker that cannot tick would never be
+                 * sampled nor let go, the pool stops as a whole */
+                failed = __atomic_load_n(&c->failed, __ATOMIC_RELAXED);
+                n = __atomic_load_n(&c->count, __ATOMIC_ACQUIRE);
+
+                for (i = w->id, live = 0; i < n; i += c->nworkers) {
+                        switch (__atomic_load_n(&c->state[i],
+                                                __ATOMIC_ACQUIRE)) {
+                        case COLL_LIVE:
+                                break;
+                        case COLL_LEAVING:
+                                coll_let_go(c, i, w->id, 0);
+                                continue;
+                        default:
+                                continue;
+                        }
+
+                        /* so that its VMs are still let go */
+                        if (failed) {
+                                coll_let_go(c, i, w->id, 0);
+                                continue;
+                        }
+
+                        /* the healer's until it is healthy again */
+                        if (__atomic_load_n(&c->health[i].until,
+                                            __ATOMIC_ACQUIRE)) {
+                                if (__atomic_load_n(&c->health[i].attempts,
+                                                    __ATOMIC_RELAXED) <
+                                    COLL_MAX_RECONNECTS) {
+                                        coll_quarantined(c, i, w->id,
+                                                         deadline);
+                                        live++;
+                                        continue;
+                                }
+                                dprintf("collector: dropping '%s', it does "
+                                        "not answer\n",
+                                        c->conns[i]->qmp_sock_path);
+                                coll_let_go(c, i, w->id, 1);
+                                continue;
+                        }
+
+                        if (coll_sample(c, i, w->id, deadline) == 0) {
+                                c->errors[i] = 0;
+                                live++;
+                        } else if (__atomic_load_n(&c->health[i].until,
+                                                   __ATOMIC_RELAXED)) {
+                                /* quarantined by this sample */
+                                live++;
+                        } else if (++c->errors[i] == COLL_MAX_FAILURES) {
+                                dprintf("collector: dropping '%s'\n",
+                                        c->conns[i]->qmp_sock_path);
+                                coll_let_go(c, i, w->id, 1);
+                        } else {
+                                live++;
+                        }
+                }
+
+                if (failed || (!live && !c->watching))
+                        break;
+
+                /* its own VMs, the others are not its to look at */
+                if (c->attrib && xclock_ns() >= report) {
+                        for (i = w->id; i < n; i += c->nworkers) {
+                                if (__atomic_load_n(&c->state[i],
+                                                    __ATOMIC_ACQUIRE) ==
+                                    COLL_LIVE) {
+                                        coll_attrib_report(c, i);
+                                        attrib_age(&c->attrib[i]);
+                                }
+                        }
+                        report += COLL_REPORT_MS * COLL_MS;
+                }
+
+                if ((deadline = ticker_wait(&t)) == 0) {
+                        dprintf("collector: worker %u lost its ticker\n",
+                                w->id);
+                        __atomic_store_n(&c->failed, 1, __ATOMIC_RELAXED);
+                        continue;
+                }
+                if (t.missed) {
+                        __atomic_fetch_add(&c->missed, t.missed,
+                                           __ATOMIC_RELAXED);
+                        t.missed = 0;
+                }
+        }
+
+        if (ticking)
+                ticker_close(&t);
+        __atomic_fetch_sub(&c->running, 1, __ATOMIC_RELEASE);
+        return NULL;
+}
+
+/*
+ * the reconnects, off the workers: a monitor slow to come back holds this
+ * thread, not the other VMs of its worker
+ */
+static void *
+coll_healer_run(void *arg)
+{
+        struct collector *c = arg;
+        unsigned int i, n;
+        int idle;
+
+        while (__atomic_load_n(&c->running, __ATOMIC_ACQUIRE)) {
+                n = __atomic_load_n(&c->count, __ATOMIC_ACQUIRE);
+
+                for (i = 0; i < n; i++) {
+                        idle = COLL_HEAL_IDLE;
+                        if (!__atomic_compare_exchange_n(&c->heal[i], &idle,
+                                                         COLL_HEAL_BUSY, 0,
+                                                         __ATOMIC_ACQ_REL,
+                                                         __ATOMIC_RELAXED))
+                                continue;
+
+                        /* a no-op unless quarantined and its backoff over */
+                        qmp_heal(c->conns[i]);
+                        __atomic_store_n(&c->heal[i], COLL_HEAL_IDLE,
+                                         __ATOMIC_RELEASE);
+                }
+
+                usleep(COLL_HEAL_MS * 1000);
+        }
+
+        return NULL;
+}
+
+static size_t
+coll_format(const struct collector *c, const struct coll_sample *s,
+            char *buf, size_t len)
+{
+        size_t off;
+        int n, i;
+
+        n = snprintf(buf, len, "%lu.%03lu %s worker=%u up=%u vcpus=%u "
+                     "halted=%u pc=0x%.16lx mode=%s rtt=%luus late=%luus timeouts=%u",
+                     s->when / COLL_S,
+                     (s->when / COLL_MS) % 1000, c->conns[s->vm]->qmp_sock_path,
+                     s->worker, s->up, s->nvcpus, s->halted, s->pc,
+                     s->user ? "user" : "kernel", s->rtt / 1000,
+                     s->late / 1000, s->timeouts);
+
+        if (n < 0)
+                return 0;
+        off = (size_t) n < len ? (size_t) n : len - 1;
+
+        if (s->duty >= 0 && off < len) {
+                n = snprintf(buf + off, len - off,
+                             " duty=%d.%d%%/%d.%d%% peak=%d.%d%%",
+                             s->duty / 10, s->duty % 10, s->duty_long / 10,
+                             s->duty_long % 10, s->peak / 10, s->peak % 10);
+                if (n < 0)
+                        return 0;
+                off += n;
+        }
+
+        /* folded, outermost first, as flame graphs take it */
+        for (i = s->depth - 1; i >= 0 && off < len; i--) {
+                n = snprintf(buf + off, len - off, "%s%lx",
+                             i == s->depth - 1 ? " stack=" : ";",
+                             s->stack[i]);
+                if (n < 0)
+                        return 0;
+                off += n;
+        }
+
+        if (off >= len - 1)
+                off = len - 2;
+        buf[off++] = '\n';
+        return off;
+}
+
+static void
+coll_report(struct collector *c)
+{
+        const struct tick_hist *h = c->jitter;
+        char buf[COLL_LINE_LEN];
+
+        dprintf("collector: %lu samples in %lu writes, queue depth max "
+                "%lu of %u, %lu dropped\n", c->written, c->batches,
+                c->max_depth, COLL_QUEUE_LEN,
+                __atomic_load_n(&c->q.drops, __ATOMIC_RELAXED));
+        c->max_depth = 0;
+
+        if (!h->samples)
+                return;
+
+        /* since the start, a percentile is no good over a few samples */
+        tick_hist_format(h, buf, sizeof(buf));
+        dprintf("collector: late p50 <%luus p99 <%luus mean %luus max %luus, "
+                "%lu ticks missed\ncollector: late %s\n",
+                tick_hist_pct(h, 50), tick_hist_pct(h, 99),
+                h->sum / h->samples / 1000, h->max / 1000,
+                __atomic_load_n(&c->missed, __ATOMIC_RELAXED), buf);
+}
+
+/* nothing of the VM is left in the queue */
+static void
+coll_drained(struct collector *c, unsigned int vm, int dropped)
+{
+        if (dropped && c->dropped)
+                c->dropped(c->conns[vm], c->arg);
+
+        duty_release(&c->duty[vm]);
+
+        if (c->attrib)
+                attrib_release(&c->attrib[vm]);
+
+        if (c->depth) {
+                c->uw_hits += c->uw[vm].hits;
+                c->uw_misses += c->uw[vm].misses;
+                unwind_release(&c->uw[vm]);
+        }
+
+        __atomic_store_n(&c->state[vm], COLL_GONE, __ATOMIC_RELEASE);
+}
+
+static void *
+coll_writer_run(void *arg)
+{
+        struct collector *c = arg;
+        char *buf = xmalloc(COLL_BATCH * COLL_LINE_LEN);
+        uint64_t report = xclock_ns() + COLL_REPORT_MS * COLL_MS;
+        struct coll_sample s;
+        unsigned int n;
+        uint64_t depth;
+        size_t len;
+        int done;
+
+        for (;;) {
+                /* before draining: nothing is pushed after the last exit */
+                done = __atomic_load_n(&c->running, __ATOMIC_ACQUIRE) == 0;
+
+                depth = __atomic_load_n(&c->q.tail, __ATOMIC_RELAXED) -
+                        c->q.head;
+                if (depth > c->max_depth)
+                        c->max_depth = depth;
+
+                for (n = 0, len = 0; n < COLL_BATCH &&
+                     coll_pop(&c->q, &s) == 0; n++) {
+                        if (s.gone) {
+                                coll_drained(c, s.vm, s.dropped);
+                                continue;
+                        }
+                        len += coll_format(c, &s, buf + len, COLL_LINE_LEN);
+                        tick_hist_add(c->jitter, s.late);
+                }
+
+                if (len) {
+                        if (c->zw)
+                                zio_write(c->zw, buf, len);
+                        else
+                                xwrite(c->fd, buf, len);
+                        c->written += n;
+                        c->batches++;
+                }
+
+                if (xclock_ns() >= report) {
+                        /* a partial block is not held back for long */
+                        if (c->zw)
+                                zio_flush(c->zw);
+                        coll_report(c);
+                        report += COLL_REPORT_MS * COLL_MS;
+                }
+
+                if (n == COLL_BATCH)
+                        continue;
+                if (done)
+                        break;
+
+                /* let the next batch build up */
+                usleep(COLL_FLUSH_MS * 1000);
+        }
+
+        coll_report(c);
+        xfree(buf);
+        return NULL;
+}
+
+int
+coll_run(struct collector *c)
+{
+        unsigned int i, started = 0;
+        int ret = 0, writer = 0;
+
+        if (c->top > COLL_MAX_TOP) {
+                dprintf("collector: at most %u processes per VM\n",
+                        COLL_MAX_TOP);
+                return -1;
+        }
+        if (c->top)
+                c->attrib = xcalloc(COLL_MAX_VMS, sizeof(struct attrib));
+
+        /* VMs added later go to any worker */
+        if (!c->watching && c->nworkers > c->count)
+                c->nworkers = c->count;
+
+        c->workers = xcalloc(c->nworkers, sizeof(struct coll_worker));
+        for (i = 0; i < c->nworkers; i++) {
+                c->workers[i].c = c;
+                c->workers[i].id = i;
+        }
+
+        /* runs as long as the workers, quarantined VMs never heal without */
+        c->running = c->nworkers;
+        if (pthread_create(&c->healer, NULL, coll_healer_run, c) != 0) {
+                dprintf("collector: cannot start the healer\n");
+                return -1;
+        }
+
+        for (i = 0; i < c->nworkers; i++) {
+                if (pthread_create(&c->workers[i].thread, NULL,
+                                   coll_worker_run, &c->workers[i]) != 0) {
+                        dprintf("collector: cannot start worker %u\n", i);
+                        __atomic_fetch_sub(&c->running, c->nworkers - i,
+                                           __ATOMIC_RELEASE);
+                        ret = -1;
+                        break;
+                }
+                started++;
+        }
+
+        if (pthread_create(&c->writer, NULL, coll_writer_run, c) != 0) {
+                dprintf("collector: cannot start the writer\n");
+                /* nobody drains the queue, the workers drop everything */
+                ret = -1;
+        } else {
+                writer = 1;
+        }
+
+        for (i = 0; i < started; i++)
+                pthread_join(c->workers[i].thread, NULL);
+        pthread_join(c->healer, NULL);
+        if (writer)
+                pthread_join(c->writer, NULL);
+        if (c->failed)
+                ret = -1;
+
+        if (c->depth) {
+                uint64_t hits = c->uw_hits, misses = c->uw_misses;
+
+                for (i = 0; i < c->count; i++) {
+                        hits += c->uw[i].hits;
+                        misses += c->uw[i].misses;
+                }
+                dprintf("collector: stack pages %lu read, %lu from cache\n",
+                        misses, hits);
+        }
+
+        return ret;
+}
+
+void
+coll_release(struct collector *c)
+{
+        unsigned int i;
+
+        for (i = 0; i < c->count; i++) {
+                if (!c->conns[i])
+                        continue;
+                c->conns[i]->health = NULL;
+                if (c->gone)
+                        c->gone(c->conns[i], c->arg);
+        }
+
+        xfree(c->conns);
+        xfree(c->state);
+        xfree(c->heal);
+        xfree(c->errors);
+        xfree(c->health);
+        for (i = 0; i < c->count; i++)
+                duty_release(&c->duty[i]);
+        xfree(c->duty);
+        for (i = 0; c->uw && i < c->count; i++)
+                unwind_release(&c->uw[i]);
+        xfree(c->uw);
+        for (i = 0; c->attrib && i < c->count; i++)
+                attrib_release(&c->attrib[i]);
+        xfree(c->attrib);
+        xfree(c->workers);
+        xfree(c->q.cells);
+        xfree(c->jitter);
+        memset(c, 0, sizeof(struct collector));
+}
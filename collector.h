@@ -0,0 +1,282 @@
+#ifndef __COLLECTOR_H
+#define __COLLECTOR_H
+
+/*
+ * Sampling of many VMs by a pool of worker threads. Every worker owns a
+ * shard of the connections, VM i going to worker i % workers, so that no
+ * connection is ever shared. The samples are pushed into a bounded queue
+ * of preallocated cells, many producers and one consumer, without locks;
+ * a single writer thread drains it and formats whole batches into one
+ * write(2), instead of every sample taking the stdio lock on its own.
+ *
+ * A full queue does not block the workers, the sample is counted as
+ * dropped; the writer reports the drops and the deepest the queue got.
+ *
+ * VMs may come and go while the pool runs: a VM gets the first free of
+ * COLL_MAX_VMS slots, and a worker asked to let one go, or giving up on
+ * it, pushes a last word for it after its last sample; the writer, once
+ * it pops it, knows the VM is not referred to anymore and marks the slot
+ * gone, for the adding thread to hand back and reuse.
+ *
+ * A VM whose command misses its deadline is quarantined, see qmp.h, and
+ * put out as down without being asked until it reconnects. Reconnects are
+ * the healer thread's, so a worker waits on a hung monitor for one
+ * deadline, when it misses it, and its other VMs are sampled on while
+ * the healer waits for the rest. Timeouts are not failures, reconnects
+ * failing in a row are.
+ *
+ * Each worker keeps, for its VMs, which vCPUs were running in every
+ * sample, see duty.h; a sample carries the running share of the VM over
+ * the last COLL_DUTY_SHORT and DUTY_HISTORY samples, and that of its
+ * busiest vCPU over the latter, for telling idle guests from saturated
+ * ones.
+ *
+ * With attribution on, the registers of every vCPU are sampled and the
+ * worker of a VM counts them by guest process, see attrib.h; it reports
+ * the top ones every COLL_REPORT_MS, then halves the counts, and when it
+ * lets the VM go.
+ *
+ * Workers wake up on a ticker of the interval, see ticker.h; how late
+ * each sample was taken is kept in a histogram by the writer, reported
+ * with the queue counters. Workers may be pinned and run SCHED_FIFO so
+ * that the host scheduler adds as little as possible to it.
+ */
+
+/* cells of the queue, a power of two */
+#define COLL_QUEUE_LEN          (4096)
+/* samples formatted into one write */
+#define COLL_BATCH              (256)
+/* longest line of one sample, a full stack included */
+#define COLL_LINE_LEN           (1024)
+/* frames of a sampled stack */
+#define COLL_MAX_DEPTH          (32)
+/* the writer sleeps this long on an empty queue, in ms */
+#define COLL_FLUSH_MS           (10)
+/* default sampling interval, in ms */
+#define COLL_INTERVAL           (1000)
+/* print the queue counters this often, in ms */
+#define COLL_REPORT_MS          (5000)
+#define COLL_MAX_WORKERS        (64)
+/* VMs sampled at once */
+#define COLL_MAX_VMS            (1024)
+/* a VM is dropped after this many failed samples in a row */
+#define COLL_MAX_FAILURES       (3)
+/* or reconnects, the last one some 25s after the first with the backoff */
+#define COLL_MAX_RECONNECTS     (8)
+/* the healer looks for VMs to reconnect this often, in ms */
+#define COLL_HEAL_MS            (10)
+/* samples of the short duty cycle window, the long one is DUTY_HISTORY */
+#define COLL_DUTY_SHORT         (64)
+/* most processes reported per VM */
+#define COLL_MAX_TOP            (32)
+
+struct qmp_conn;
+struct qmp_health;
+struct unwind_cache;
+struct duty;
+struct attrib;
+struct zio_writer;
+struct tick_hist;
+
+enum coll_state {
+        COLL_FREE,
+        COLL_LIVE,
+        /* to be let go by its worker */
+        COLL_LEAVING,
+        /* its worker let go, the writer has yet to drain it */
+        COLL_DEAD,
+        /* drained, to be handed back by coll_reap() */
+        COLL_GONE,
+};
+
+/* who has the connection of a slot, while it is quarantined */
+enum coll_heal {
+        /* not live, the healer keeps off */
+        COLL_HEAL_OFF,
+        COLL_HEAL_IDLE,
+        /* the healer is reconnecting it */
+        COLL_HEAL_BUSY,
+};
+
+struct coll_sample {
+        /* CLOCK_MONOTONIC ns */
+        uint64_t when;
+        /* round trip of the commands, in ns */
+        uint64_t rtt;
+        /* past the deadline of its tick, in ns */
+        uint64_t late;
+        /* of vCPU 0 */
+        uint64_t pc;
+        /* index of the connection */
+        unsigned int vm;
+        unsigned int worker;
+        uint16_t nvcpus, halted;
+        uint8_t up, user;
+        /* commands of the VM that missed their deadline so far */
+        uint32_t timeouts;
+        /* running share, short and long windows and busiest vCPU, in per
+         * mille; -1 if not sampled */
+        int16_t duty, duty_long, peak;
+        /* not a sample but the last word of its VM, and whether the pool
+         * gave up on it rather than it going away */
+        uint8_t gone;
+        uint8_t dropped;
+        /* the PC then the return addresses, innermost first */
+        uint8_t depth;
+        uint64_t stack[COLL_MAX_DEPTH];
+};
+
+/*
+ * a cell is free for the producer claiming position pos when its seq is
+ * pos, and holds a sample for the consumer at pos when it is pos + 1
+ */
+struct coll_cell {
+        uint64_t seq;
+        struct coll_sample s;
+};
+
+struct coll_queue {
+        struct coll_cell *cells;
+        uint64_t mask;
+
+        /* each on its own line, the producers only share the tail */
+        uint64_t tail __attribute__((aligned(64)));
+        uint64_t head __attribute__((aligned(64)));
+        uint64_t drops __attribute__((aligned(64)));
+};
+
+struct collector;
+
+struct coll_worker {
+        pthread_t thread;
+        struct collector *c;
+        unsigned int id;
+};
+
+struct collector {
+        /* COLL_MAX_VMS slots, the first 'count' ever used */
+        struct qmp_conn **conns;
+        unsigned int count;
+        /* enum coll_state and enum coll_heal, per slot */
+        int *state;
+        int *heal;
+        /* consecutive failed samples, deadlines and duty cycles, per VM */
+        unsigned int *errors;
+        struct qmp_health *health;
+        struct duty *duty;
+        /* processes of each VM, if top; kept by its worker */
+        struct attrib *attrib;
+        /* frames unwound per sample, 0 for none, and the pages per VM */
+        unsigned int depth;
+        struct unwind_cache *uw;
+
+        struct coll_worker *workers;
+        unsigned int nworkers;
+        unsigned int interval_ms;
+        /* of a command, 0 for QMP_COMMAND_TIMEOUT; before coll_add() */
+        unsigned int timeout_ms;
+        /*
+         * worker i is pinned to CPU cpu + i, -1 for none, and runs
+         * SCHED_FIFO at prio, 0 for none; set before coll_run()
+         */
+        int cpu;
+        int prio;
+        /* processes reported per VM, 0 for no attribution; before coll_run() */
+        unsigned int top;
+        /* ticks the workers were still busy for */
+        uint64_t missed;
+        /* the pool runs on without VMs, they come and go; before coll_run() */
+        int watching;
+        /* a VM is handed back to it by coll_reap(), NULL to leave it be */
+        void (*gone)(struct qmp_conn *qmpc, void *arg);
+        /* a VM that does not answer is let go, told from the writer before
+         * coll_reap() hands it back, NULL to leave it be */
+        void (*dropped)(struct qmp_conn *qmpc, void *arg);
+        void *arg;
+
+        struct coll_queue q;
+        pthread_t writer;
+        pthread_t healer;
+        int fd;
+        /* compresses what goes to 'fd' instead, if set before coll_run() */
+        struct zio_writer *zw;
+        /* workers still running, and whether one of them could not tick */
+        unsigned int running;
+        int failed;
+
+        /* kept by the writer */
+        uint64_t written;
+        uint64_t batches;
+        uint64_t max_depth;
+        struct tick_hist *jitter;
+        /* stack pages of the VMs let go */
+        uint64_t uw_hits;
+        uint64_t uw_misses;
+};
+
+/**
+ * @brief set up an empty collector
+ * @param nworkers threads sampling the VMs, at most COLL_MAX_WORKERS
+ * @param fd where the writer puts one line per sample
+ * @param depth frames of the stack of vCPU 0 to add to each sample, at
+ * most COLL_MAX_DEPTH, 0 for none
+ * @retval 0 on success, -1 if nworkers or depth is out of range
+ */
+extern int
+coll_init(struct collector *c, unsigned int nworkers,
+          unsigned int interval_ms, int fd, unsigned int depth);
+
+/**
+ * @brief sample an established connection, from one thread only, before
+ * or while the pool runs
+ * @retval 0 on success, -1 if COLL_MAX_VMS are sampled already
+ */
+extern int
+coll_add(struct collector *c, struct qmp_conn *qmpc);
+
+/**
+ * @brief stop sampling the VM at 'path', from the thread that adds
+ * @retval 0 on success, -1 if it is not sampled
+ */
+extern int
+coll_remove(struct collector *c, const char *path);
+
+/**
+ * @brief hand the VMs let go to c->gone and free their slots, from the
+ * thread that adds; coll_add() and coll_remove() do it too
+ */
+extern void
+coll_reap(struct collector *c);
+
+/**
+ * @brief start the workers and the writer, return when every VM was
+ * dropped and the queue is drained; never, if watching, unless a worker
+ * cannot tick: then every VM is let go
+ * @retval 0 on success, -1 if a thread could not start or a worker could
+ * not tick
+ */
+extern int
+coll_run(struct collector *c);
+
+/**
+ * @brief push a sample, from any thread
+ * @retval 0 on success, -1 if the queue is full and it was dropped
+ */
+extern int
+coll_push(struct coll_queue *q, const struct coll_sample *s);
+
+/**
+ * @brief pop the oldest sample, from the writer only
+ * @retval 0 on success, -1 if the queue is empty
+ */
+extern int
+coll_pop(struct coll_queue *q, struct coll_sample *s);
+
+/**
+ * @brief detach from the connections; those still there go to c->gone,
+ * if set, otherwise they are not closed
+ */
+extern void
+coll_release(struct collector *c);
+
+#endif /* __COLLECTOR_H */
@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "discover.h"
+
+#define DISCOVER_MASK   (IN_CREATE | IN_MOVED_TO | IN_DELETE | \
+                         IN_MOVED_FROM | IN_ONLYDIR)
+#define DISCOVER_MS     (1000000UL)
+
+int
+discover_init(struct discover *d,
+              int (*added)(const char *path, void *arg),
+              void (*removed)(const char *path, void *arg), void *arg)
+{
+        memset(d, 0, sizeof(struct discover));
+        d->added = added;
+        d->removed = removed;
+        d->arg = arg;
+
+        if ((d->fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) == -1) {
+                dprintf("discover: inotify_init1: %s\n", strerror(errno));
+                return -1;
+        }
+
+        if ((d->stop = eventfd(0, EFD_CLOEXEC)) == -1 ||
+            (d->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+                dprintf("discover: eventfd: %s\n", strerror(errno));
+                if (d->stop != -1)
+                        close(d->stop);
+                close(d->fd);
+                return -1;
+        }
+
+        pthread_mutex_init(&d->lock, NULL);
+        return 0;
+}
+
+static struct discover_entry *
+discover_find(struct discover_entry *e, const char *path)
+{
+        for (; e != NULL; e = e->next) {
+                if (streq(e->path, path))
+                        return e;
+        }
+        return NULL;
+}
+
+/* unlinked, not freed */
+static void
+discover_unlink(struct discover_entry **head, struct discover_entry *e)
+{
+        struct discover_entry **pp;
+
+        for (pp = head; *pp != NULL; pp = &(*pp)->next) {
+                if (*pp == e) {
+                        *pp = e->next;
+                        return;
+                }
+        }
+}
+
+static void
+discover_free(struct discover_entry *e)
+{
+        xfree(e->path);
+        xfree(e);
+}
+
+static int
+discover_is_socket(const char *path)
+{
+        struct stat st;
+
+        return stat(path, &st) == 0 && (st.st_mode & S_IFMT) == S_IFSOCK;
+}
+
+static void
+discover_offer(struct discover *d, const char *path)
+{
+        struct discover_entry *e;
+
+        if (discover_find(d->known, path) || discover_find(d->pending, path))
+                return;
+
+        /* other files may live there too */
+        if (!discover_is_socket(path))
+                return;
+
+        e = xcalloc(1, sizeof(struct discover_entry));
+        e->path = xstrdup(path);
+
+        if (d->added(path, d->arg) == 0) {
+                e->next = d->known;
+                d->known = e;
+                return;
+        }
+
+        e->tries = 1;
+        e->when = xclock_ns() + DISCOVER_RETRY_MS * DISCOVER_MS;
+        e->next = d->pending;
+        d->pending = e;
+}
+
+static void
+discover_forget(struct discover *d, const char *path)
+{
+        struct discover_entry *e;
+
+        if ((e = discover_find(d->pending, path))) {
+                discover_unlink(&d->pending, e);
+                discover_free(e);
+        }
+
+        if ((e = discover_find(d->known, path))) {
+                discover_unlink(&d->known, e);
+                d->removed(path, d->arg);
+                discover_free(e);
+        }
+}
+
+static void
+discover_scan(struct discover *d, const char *dir)
+{
+        char path[PATH_MAX];
+        struct dirent *de;
+        DIR *dp;
+
+        if (!(dp = opendir(dir))) {
+                dprintf("discover: cannot read '%s': %s\n", dir,
+                        strerror(errno));
+                return;
+        }
+
+        while ((de = readdir(dp)) != NULL) {
+                if (de->d_name[0] == '.')
+                        continue;
+                if (snprintf(path, sizeof(path), "%s/%s", dir,
+                             de->d_name) >= (int) sizeof(path))
+                        continue;
+                discover_offer(d, path);
+        }
+
+        closedir(dp);
+}
+
+int
+discover_add_dir(struct discover *d, const char *dir)
+{
+        int wd;
+
+        if (d->ndirs == DISCOVER_MAX_DIRS) {
+                dprintf("discover: at most %u directories\n",
+                        DISCOVER_MAX_DIRS);
+                return -1;
+        }
+
+        /* watched first, so that nothing created meanwhile is missed */
+        if ((wd = inotify_add_watch(d->fd, dir, DISCOVER_MASK)) == -1) {
+                dprintf("discover: cannot watch '%s': %s\n", dir,
+                        strerror(errno));
+                return -1;
+        }
+
+        d->dirs[d->ndirs] = xstrdup(dir);
+        d->wds[d->ndirs] = wd;
+        d->ndirs++;
+
+        discover_scan(d, dir);
+        return 0;
+}
+
+/* after lost events, what is gone is told from the disk */
+static void
+discover_rescan(struct discover *d)
+{
+        struct discover_entry *e, *next;
+        unsigned int i;
+
+        dprintf("discover: events were lost, reading the directories again\n");
+
+        for (e = d->known; e != NULL; e = next) {
+                next = e->next;
+                if (!discover_is_socket(e->path))
+                        discover_forget(d, e->path);
+        }
+
+        for (i = 0; i < d->ndirs; i++) {
+                if (d->wds[i] != -1)
+                        discover_scan(d, d->dirs[i]);
+        }
+}
+
+static int
+discover_read(struct discover *d)
+{
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        const struct inotify_event *ev;
+        char path[PATH_MAX];
+        unsigned int i;
+        ssize_t n;
+        char *p;
+
+        for (;;) {
+                n = read(d->fd, buf, sizeof(buf));
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n == -1 && errno == EAGAIN)
+                        return 0;
+                if (n <= 0) {
+                        dprintf("discover: read: %s\n", strerror(errno));
+                        return -1;
+                }
+
+                for (p = buf; p < buf + n;
+                     p += sizeof(struct inotify_event) + ev->len) {
+                        ev = (const struct inotify_event *) p;
+
+                        if (ev->mask & IN_Q_OVERFLOW) {
+                                discover_rescan(d);
+                                continue;
+                        }
+
+                        for (i = 0; i < d->ndirs; i++) {
+                                if (d->wds[i] == ev->wd)
+                                        break;
+                        }
+                        if (i == d->ndirs)
+                                continue;
+
+                        /* removed, or on a file system that went away */
+                        if (ev->mask & IN_IGNORED) {
+                                dprintf("discover: '%s' is not watched "
+                                        "anymore\n", d->dirs[i]);
+                                d->wds[i] = -1;
+                                continue;
+                        }
+
+                        if (!ev->len || snprintf(path, sizeof(path), "%s/%s",
+                                                 d->dirs[i], ev->name) >=
+                            (int) sizeof(path))
+                                continue;
+
+                        if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                                discover_offer(d, path);
+                        else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                                discover_forget(d, path);
+                }
+        }
+}
+
+/* offer again what is due, return the ms until the next one, -1 if none */
+static int
+discover_retry(struct discover *d)
+{
+        struct discover_entry *e, *next;
+        uint64_t now = xclock_ns(), first = UINT64_MAX;
+
+        for (e = d->pending; e != NULL; e = next) {
+                next = e->next;
+
+                if (e->when > now) {
+                        if (e->when < first)
+                                first = e->when;
+                        continue;
+                }
+
+                discover_unlink(&d->pending, e);
+
+                if (discover_is_socket(e->path) &&
+                    d->added(e->path, d->arg) == 0) {
+                        e->next = d->known;
+                        d->known = e;
+                        continue;
+                }
+
+                if (++e->tries > DISCOVER_RETRIES ||
+                    !discover_is_socket(e->path)) {
+                        dprintf("discover: giving up on '%s'\n", e->path);
+                        discover_free(e);
+                        continue;
+                }
+
+                e->when = now + ((uint64_t) DISCOVER_RETRY_MS <<
+                                 (e->tries - 1)) * DISCOVER_MS;
+                if (e->when < first)
+                        first = e->when;
+                e->next = d->pending;
+                d->pending = e;
+        }
+
+        if (first == UINT64_MAX)
+                return -1;
+        return (first - now) / DISCOVER_MS + 1;
+}
+
+/* what was handed back goes pending, as if its first offer was refused */
+static void
+discover_take_requeued(struct discover *d)
+{
+        struct discover_entry *e, *next, *known;
+        uint64_t count;
+
+        if (read(d->wake, &count, sizeof(count)) != sizeof(count))
+                return;
+
+        pthread_mutex_lock(&d->lock);
+        e = d->requeued;
+        d->requeued = NULL;
+        pthread_mutex_unlock(&d->lock);
+
+        for (; e != NULL; e = next) {
+                next = e->next;
+
+                /* removed meanwhile, or offered again already */
+                if (!(known = discover_find(d->known, e->path))) {
+                        discover_free(e);
+                        continue;
+                }
+                discover_unlink(&d->known, known);
+                discover_free(known);
+
+                e->tries = 1;
+                e->when = xclock_ns() + DISCOVER_RETRY_MS * DISCOVER_MS;
+                e->next = d->pending;
+                d->pending = e;
+        }
+}
+
+void
+discover_run(struct discover *d)
+{
+        struct pollfd pfd[3] = {
+                { .fd = d->fd, .events = POLLIN },
+                { .fd = d->stop, .events = POLLIN },
+                { .fd = d->wake, .events = POLLIN },
+        };
+        int timeout;
+
+        for (;;) {
+                timeout = discover_retry(d);
+
+                if (poll(pfd, 3, timeout) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        dprintf("discover: poll: %s\n", strerror(errno));
+                        return;
+                }
+
+                if (pfd[1].revents)
+                        return;
+                if (pfd[2].revents & POLLIN)
+                        discover_take_requeued(d);
+                if ((pfd[0].revents & POLLIN) && discover_read(d) == -1)
+                        return;
+        }
+}
+
+void
+discover_requeue(struct discover *d, const char *path)
+{
+        struct discover_entry *e = xcalloc(1, sizeof(struct discover_entry));
+        uint64_t one = 1;
+
+        e->path = xstrdup(path);
+
+        pthread_mutex_lock(&d->lock);
+        e->next = d->requeued;
+        d->requeued = e;
+        pthread_mutex_unlock(&d->lock);
+
+        if (write(d->wake, &one, sizeof(one)) != sizeof(one))
+                dprintf("discover: cannot wake: %s\n", strerror(errno));
+}
+
+void
+discover_stop(struct discover *d)
+{
+        uint64_t one = 1;
+
+        if (write(d->stop, &one, sizeof(one)) != sizeof(one))
+                dprintf("discover: cannot stop: %s\n", strerror(errno));
+}
+
+void
+discover_release(struct discover *d)
+{
+        struct discover_entry *e, *next;
+        unsigned int i;
+
+        for (e = d->known; e != NULL; e = next) {
+                next = e->next;
+                discover_free(e);
+        }
+        for (e = d->pending; e != NULL; e = next) {
+                next = e->next;
+                discover_free(e);
+        }
+        for (e = d->requeued; e != NULL; e = next) {
+                next = e->next;
+                discover_free(e);
+        }
+        for (i = 0; i < d->ndirs; i++)
+                xfree(d->dirs[i]);
+
+        close(d->fd);
+        close(d->stop);
+        close(d->wake);
+        pthread_mutex_destroy(&d->lock);
+        memset(d, 0, sizeof(struct discover));
+}
@@ -0,0 +1,92 @@
+#ifndef __DISCOVER_H
+#define __DISCOVER_H
+
+/*
+ * QMP sockets found by watching directories with inotify. Sockets that
+ * are there when a directory is added, and those created or moved in
+ * later, are offered to 'added' once they pass the same S_IFSOCK check as
+ * -p; those deleted or moved out go to 'removed', if 'added' took them.
+ *
+ * qemu creates its socket on bind(), before listen(), so the first
+ * connect() may be refused: a socket 'added' did not take is offered
+ * again after DISCOVER_RETRY_MS, doubling up to DISCOVER_RETRIES times.
+ * A socket taken and given up on later, its VM dropped, is handed back
+ * with discover_requeue() and offered again the same way. When the kernel
+ * drops events, the directories are read again and what went unnoticed is
+ * added or removed then.
+ */
+
+#define DISCOVER_MAX_DIRS       (16)
+#define DISCOVER_RETRY_MS       (100)
+#define DISCOVER_RETRIES        (6)
+
+struct discover_entry {
+        char *path;
+        /* of a pending one, offers so far and the next, CLOCK_MONOTONIC ns */
+        unsigned int tries;
+        uint64_t when;
+        struct discover_entry *next;
+};
+
+struct discover {
+        /* inotify, an eventfd to stop discover_run() and one to wake it */
+        int fd;
+        int stop;
+        int wake;
+        char *dirs[DISCOVER_MAX_DIRS];
+        int wds[DISCOVER_MAX_DIRS];
+        unsigned int ndirs;
+
+        /* 0 if the socket was taken, -1 to be offered again */
+        int (*added)(const char *path, void *arg);
+        void (*removed)(const char *path, void *arg);
+        void *arg;
+
+        /* sockets taken, and those to be offered again */
+        struct discover_entry *known;
+        struct discover_entry *pending;
+        /* handed back by other threads, under the lock */
+        struct discover_entry *requeued;
+        pthread_mutex_t lock;
+};
+
+/**
+ * @retval 0 on success, -1 if inotify is not available
+ */
+extern int
+discover_init(struct discover *d,
+              int (*added)(const char *path, void *arg),
+              void (*removed)(const char *path, void *arg), void *arg);
+
+/**
+ * @brief watch 'dir' and offer the sockets already in it, from the thread
+ * that runs discover_run() or before it starts
+ * @retval 0 on success, -1 if 'dir' cannot be watched
+ */
+extern int
+discover_add_dir(struct discover *d, const char *dir);
+
+/**
+ * @brief call 'added' and 'removed' as sockets come and go, until
+ * discover_stop()
+ */
+extern void
+discover_run(struct discover *d);
+
+/**
+ * @brief offer 'path' again, taken before but given up on since, from any
+ * thread; nothing if it went away meanwhile
+ */
+extern void
+discover_requeue(struct discover *d, const char *path);
+
+/**
+ * @brief make discover_run() return, from any thread
+ */
+extern void
+discover_stop(struct discover *d);
+
+extern void
+discover_release(struct discover *d);
+
+#endif /* __DISCOVER_H */
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "xutil.h"
+#include "duty.h"
+
+void
+duty_init(struct duty *d)
+{
+        memset(d, 0, sizeof(struct duty));
+}
+
+void
+duty_record(struct duty *d, const uint64_t *seen, const uint64_t *running)
+{
+        unsigned int w = (d->samples / 64) % DUTY_WORDS, b = d->samples % 64;
+        unsigned int i, top = 0;
+        uint64_t bit = 1ULL << b;
+
+        for (i = 0; i < DUTY_MAX_VCPUS; i++) {
+                if (seen[i / 64] & (1ULL << (i % 64)))
+                        top = i + 1;
+        }
+
+        if (top > d->count) {
+                d->vcpus = xrealloc(d->vcpus, top * sizeof(struct duty_vcpu));
+                memset(d->vcpus + d->count, 0,
+                       (top - d->count) * sizeof(struct duty_vcpu));
+                for (i = d->count; i < top; i++)
+                        d->vcpus[i].first = d->samples;
+                d->count = top;
+        }
+
+        for (i = 0; i < d->count; i++) {
+                struct duty_vcpu *v = &d->vcpus[i];
+
+                /* the sample a lap ago goes, halted unless running now */
+                if (running[i / 64] & (1ULL << (i % 64)))
+                        v->bits[w] |= bit;
+                else
+                        v->bits[w] &= ~bit;
+        }
+
+        d->samples++;
+}
+
+/* set bits of samples [end - n, end) */
+static unsigned int
+duty_count(const struct duty_vcpu *v, uint64_t end, unsigned int n)
+{
+        uint64_t t = end - n, word;
+        unsigned int count = 0, b, span;
+
+        while (t < end) {
+                b = t % 64;
+                span = 64 - b;
+                if (span > end - t)
+                        span = end - t;
+
+                word = v->bits[(t / 64) % DUTY_WORDS] >> b;
+                if (span < 64)
+                        word &= (1ULL << span) - 1;
+                count += __builtin_popcountll(word);
+                t += span;
+        }
+
+        return count;
+}
+
+/* samples of the window the vCPU was around for */
+static unsigned int
+duty_span(const struct duty *d, const struct duty_vcpu *v,
+          unsigned int window)
+{
+        uint64_t n = d->samples - v->first;
+
+        if (window > DUTY_HISTORY)
+                window = DUTY_HISTORY;
+        return n < window ? n : window;
+}
+
+int
+duty_vcpu(const struct duty *d, unsigned int vcpu, unsigned int window)
+{
+        const struct duty_vcpu *v;
+        unsigned int n;
+
+        if (vcpu >= d->count)
+                return -1;
+
+        v = &d->vcpus[vcpu];
+        if ((n = duty_span(d, v, window)) == 0)
+                return -1;
+
+        return duty_count(v, d->samples, n) * 1000 / n;
+}
+
+int
+duty_vm(const struct duty *d, unsigned int window, int *peak)
+{
+        uint64_t ones = 0, total = 0;
+        unsigned int i, n, c;
+
+        *peak = -1;
+
+        for (i = 0; i < d->count; i++) {
+                const struct duty_vcpu *v = &d->vcpus[i];
+
+                if ((n = duty_span(d, v, window)) == 0)
+                        continue;
+
+                c = duty_count(v, d->samples, n);
+                ones += c;
+                total += n;
+                if ((int) (c * 1000 / n) > *peak)
+                        *peak = c * 1000 / n;
+        }
+
+        return total ? (int) (ones * 1000 / total) : -1;
+}
+
+void
+duty_release(struct duty *d)
+{
+        xfree(d->vcpus);
+        memset(d, 0, sizeof(struct duty));
+}
@@ -0,0 +1,66 @@
+#ifndef __DUTY_H
+#define __DUTY_H
+
+/*
+ * Running/halted duty cycle of vCPUs over time. Every sample is a row of
+ * one bit per vCPU, set if it was running; each vCPU keeps the last
+ * DUTY_HISTORY of its bits in a ring of 64 bit words, sample t at bit
+ * t % 64 of word t / 64, so that the running share over any window up to
+ * DUTY_HISTORY is a popcount of a few words and two masks.
+ *
+ * A vCPU that shows up late, hotplugged, only counts from its first
+ * sample on; one that goes away counts as halted.
+ */
+
+/* vCPU ids are 8 bit */
+#define DUTY_MAX_VCPUS          (256)
+#define DUTY_ROW_WORDS          (DUTY_MAX_VCPUS / 64)
+/* words of history per vCPU */
+#define DUTY_WORDS              (16)
+#define DUTY_HISTORY            (DUTY_WORDS * 64)
+
+struct duty_vcpu {
+        /* the sample it was first seen in */
+        uint64_t first;
+        uint64_t bits[DUTY_WORDS];
+};
+
+struct duty {
+        /* by id, 'count' of them seen so far */
+        struct duty_vcpu *vcpus;
+        unsigned int count;
+        /* samples recorded */
+        uint64_t samples;
+};
+
+extern void
+duty_init(struct duty *d);
+
+/**
+ * @brief record a sample
+ * @param seen bit i set if vCPU i was in the sample, in a known state
+ * @param running bit i set if vCPU i was running
+ */
+extern void
+duty_record(struct duty *d, const uint64_t *seen, const uint64_t *running);
+
+/**
+ * @brief the running share of vCPU 'vcpu' over the last 'window' samples,
+ * fewer if it has not been around for as many
+ * @retval in per mille, -1 if there is no sample of it
+ */
+extern int
+duty_vcpu(const struct duty *d, unsigned int vcpu, unsigned int window);
+
+/**
+ * @brief the running share of the whole VM, all of its vCPUs taken
+ * together, and of its busiest vCPU
+ * @retval in per mille, -1 if there is no sample
+ */
+extern int
+duty_vm(const struct duty *d, unsigned int window, int *peak);
+
+extern void
+duty_release(struct duty *d);
+
+#endif /* __DUTY_H */
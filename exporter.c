@@ -0,0 +1,727 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "regs.h"
+#include "qmp.h"
+#include "exporter.h"
+
+#define EXPORTER_MS             (1000000ULL)
+/* EFER.LMA */
+#define EXPORTER_EFER_LMA       (1ULL << 10)
+/* PSTATE.nRW, AArch32 */
+#define EXPORTER_PSTATE_NRW     (1ULL << 4)
+
+#define EXPORTER_NOT_FOUND      "HTTP/1.1 404 Not Found\r\n" \
+        "Content-Length: 0\r\n\r\n"
+
+struct exporter_client {
+        int fd;
+        size_t len;
+        char req[EXPORTER_REQ_LEN];
+        /* the part of the last response not taken yet */
+        char *out;
+        size_t olen, osize;
+        struct exporter_client *next;
+};
+
+static const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+} exporter_families[EXPORTER_FAMILIES] = {
+        [EXPORTER_UP] = { "qemu_up", "gauge",
+                "Whether the last sample of the monitor succeeded" },
+        [EXPORTER_VCPUS] = { "qemu_vcpus", "gauge",
+                "vCPUs by state" },
+        [EXPORTER_VCPU_HALTED] = { "qemu_vcpu_halted", "gauge",
+                "Whether the vCPU was halted" },
+        [EXPORTER_GUEST_MODE] = { "qemu_guest_mode_samples", "counter",
+                "Samples that found vCPU 0 in kernel or user mode" },
+        [EXPORTER_LONG_MODE] = { "qemu_guest_long_mode", "gauge",
+                "Whether vCPU 0 runs in 64 bit mode" },
+        [EXPORTER_LATENCY] = { "qemu_qmp_sample_seconds", "histogram",
+                "Round trip of the monitor commands of one sample" },
+        [EXPORTER_FAILURES] = { "qemu_qmp_sample_failures", "counter",
+                "Samples the monitor did not answer" },
+};
+
+static const uint64_t exporter_bounds[EXPORTER_LAT_BUCKETS] =
+        EXPORTER_LAT_BOUNDS;
+
+static int
+exporter_listen(const char *addr)
+{
+        struct addrinfo hints, *res, *ai;
+        char buf[256], *host = buf, *port;
+        size_t len;
+        int s = -1, r;
+
+        xstrlcpy(buf, addr, sizeof(buf));
+
+        /* "9100", ":9100", "127.0.0.1:9100" or "[::1]:9100" */
+        if ((port = strrchr(buf, ':')) != NULL) {
+                *port++ = '\0';
+        } else {
+                port = buf;
+                host = "";
+        }
+
+        len = strlen(host);
+        if (len > 2 && host[0] == '[' && host[len - 1] == ']') {
+                host[len - 1] = '\0';
+                host++;
+        }
+
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+
+        if ((r = getaddrinfo(host[0] ? host : NULL, port, &hints,
+                             &res)) != 0) {
+                dprintf("exporter: bad address '%s' ('%s')\n", addr,
+                        gai_strerror(r));
+                return -1;
+        }
+
+        for (ai = res; ai != NULL; ai = ai->ai_next) {
+                if ((s = socket(ai->ai_family, ai->ai_socktype,
+                                ai->ai_protocol)) == -1) {
+                        continue;
+                }
+
+                if (xset_tcp_reuseaddr(s) == 0 &&
+                    bind(s, ai->ai_addr, ai->ai_addrlen) == 0 &&
+                    listen(s, EXPORTER_BACKLOG) == 0) {
+                        break;
+                }
+
+                close(s);
+                s = -1;
+        }
+        freeaddrinfo(res);
+
+        if (s == -1) {
+                dprintf("exporter: failed to listen on '%s' ('%s')\n",
+                        addr, strerror(errno));
+        }
+
+        return s;
+}
+
+int
+exporter_init(struct exporter *e, const char *addr)
+{
+        memset(e, 0, sizeof(struct exporter));
+
+        if ((e->lfd = exporter_listen(addr)) == -1) {
+                return -1;
+        }
+
+        e->size = EXPORTER_BODY_LEN;
+        e->body = xmalloc(e->size);
+        e->stale = 1;
+        pthread_mutex_init(&e->lock, NULL);
+
+        return 0;
+}
+
+/* the label value, with the characters OpenMetrics wants escaped */
+static void
+exporter_escape(char *dst, size_t size, const char *src)
+{
+        size_t n = 0;
+
+        for (; *src && n + 3 < size; src++) {
+                if (*src == '"' || *src == '\\') {
+                        dst[n++] = '\\';
+                        dst[n++] = *src;
+                } else if (*src == '\n') {
+                        dst[n++] = '\\';
+                        dst[n++] = 'n';
+                } else {
+                        dst[n++] = *src;
+                }
+        }
+        dst[n] = '\0';
+}
+
+void
+exporter_add(struct exporter *e, struct qmp_conn *qmpc)
+{
+        struct exporter_vm *vm;
+        unsigned int i;
+
+        e->vms = xrealloc(e->vms, (e->count + 1) * sizeof(struct exporter_vm));
+        vm = &e->vms[e->count++];
+        memset(vm, 0, sizeof(struct exporter_vm));
+
+        vm->qmpc = qmpc;
+        exporter_escape(vm->label, sizeof(vm->label), qmpc->qmp_sock_path);
+        vm->size = EXPORTER_VM_LEN;
+        vm->text = xmalloc(vm->size);
+        vm->dirty = 1;
+        e->stale = 1;
+
+        /* the VMs moved */
+        for (i = 0; i < e->count; i++)
+                e->vms[i].qmpc->health = &e->vms[i].health;
+}
+
+/* what a sample saw, under the lock */
+static void
+exporter_update(struct exporter_vm *vm, const struct vcpus *vcpus,
+                const struct qregs *regs, uint64_t rtt)
+{
+        const struct vcpu *v;
+        unsigned int i;
+
+        vm->up = 1;
+        vm->running = vm->halted = 0;
+
+        /* the list is not in id order, nor are the ids dense */
+        vm->nvcpus = 0;
+        for (v = vcpus->vcpu; v != NULL; v = v->next) {
+                if (v->id >= vm->nvcpus)
+                        vm->nvcpus = v->id + 1;
+        }
+
+        if (vm->nvcpus > vm->vcpu_size) {
+                vm->vcpu_size = vm->nvcpus;
+                vm->vcpu_halted = xrealloc(vm->vcpu_halted, vm->vcpu_size);
+        }
+        if (vm->nvcpus)
+                memset(vm->vcpu_halted, EXPORTER_VCPU_NONE, vm->nvcpus);
+
+        for (v = vcpus->vcpu; v != NULL; v = v->next) {
+                vm->vcpu_halted[v->id] = v->state == HALTED;
+                if (v->state == HALTED)
+                        vm->halted++;
+                else if (v->state == RUNNING)
+                        vm->running++;
+        }
+
+        if (regs->user)
+                vm->user++;
+        else
+                vm->kernel++;
+
+        switch (regs->mode) {
+        case AARCH64:
+                vm->long_mode = !(regs->aarch64.pstate & EXPORTER_PSTATE_NRW);
+                break;
+        case RISCV64:
+                vm->long_mode = 1;
+                break;
+        default:
+                vm->long_mode = !!(regs->efer & EXPORTER_EFER_LMA);
+        }
+
+        for (i = 0; i < EXPORTER_LAT_BUCKETS; i++) {
+                if (rtt <= exporter_bounds[i] * 1000)
+                        break;
+        }
+        vm->lat[i]++;
+        vm->lat_count++;
+        vm->lat_sum_ns += rtt;
+}
+
+/* from the sampler, the monitor is asked without holding the lock */
+static void
+exporter_sample(struct exporter *e, struct exporter_vm *vm)
+{
+        struct vcpus vcpus;
+        struct qregs regs;
+        uint64_t start, rtt;
+        int up;
+
+        /* still down, and nothing changed since it was found so */
+        if (qmp_heal(vm->qmpc) == -1) {
+                return;
+        }
+
+        start = xclock_ns();
+        up = qmp_query_vcpus(vm->qmpc, &vcpus) == 0;
+        if (up && qmp_query_regs(vm->qmpc, &regs) == -1) {
+                qmp_release_vcpus(&vcpus);
+                up = 0;
+        }
+        rtt = xclock_ns() - start;
+
+        pthread_mutex_lock(&e->lock);
+        if (up) {
+                exporter_update(vm, &vcpus, &regs, rtt);
+        } else {
+                vm->up = 0;
+                vm->failures++;
+        }
+        vm->dirty = 1;
+        e->stale = 1;
+        pthread_mutex_unlock(&e->lock);
+
+        if (up) {
+                qmp_release_vcpus(&vcpus);
+                vm->errors = 0;
+        } else if (++vm->errors == EXPORTER_MAX_FAILURES) {
+                /* qemu may have gone away for good, or come back anew */
+                dprintf("exporter: '%s' down, reconnecting\n",
+                        vm->qmpc->qmp_sock_path);
+                vm->errors = 0;
+                qmp_quarantine(vm->qmpc);
+        }
+}
+
+/*
+ * the VMs spread over the interval, one at a time; a monitor slow to
+ * answer delays the other VMs, never a scrape
+ */
+static void *
+exporter_sampler_run(void *arg)
+{
+        struct exporter *e = arg;
+        uint64_t interval = EXPORTER_INTERVAL * EXPORTER_MS, now, next;
+        unsigned int i;
+
+        now = xclock_ns();
+        for (i = 0; i < e->count; i++)
+                e->vms[i].next = now + interval * i / e->count;
+
+        while (!__atomic_load_n(&e->stop, __ATOMIC_ACQUIRE)) {
+                now = xclock_ns();
+                next = now + interval;
+
+                for (i = 0; i < e->count; i++) {
+                        struct exporter_vm *vm = &e->vms[i];
+
+                        if (vm->next <= now) {
+                                exporter_sample(e, vm);
+                                vm->next += interval;
+                                now = xclock_ns();
+                                if (vm->next < now)
+                                        vm->next = now + interval;
+                        }
+                        if (vm->next < next)
+                                next = vm->next;
+                }
+
+                now = xclock_ns();
+                if (next > now)
+                        usleep((next - now) / 1000);
+        }
+
+        return NULL;
+}
+
+static void __attribute__((format(printf, 2, 3)))
+exporter_printf(struct exporter_vm *vm, const char *fmt, ...)
+{
+        va_list ap;
+        int n;
+
+        for (;;) {
+                va_start(ap, fmt);
+                n = vsnprintf(vm->text + vm->len, vm->size - vm->len, fmt, ap);
+                va_end(ap);
+
+                if (n < 0)
+                        return;
+                if ((size_t) n < vm->size - vm->len)
+                        break;
+
+                vm->size *= 2;
+                vm->text = xrealloc(vm->text, vm->size);
+        }
+
+        vm->len += n;
+}
+
+static void
+exporter_render(struct exporter_vm *vm)
+{
+        const char *l = vm->label;
+        uint64_t cum = 0;
+        unsigned int i;
+
+        vm->len = 0;
+
+        vm->off[EXPORTER_UP] = vm->len;
+        exporter_printf(vm, "qemu_up{vm=\"%s\"} %d\n", l, vm->up);
+
+        vm->off[EXPORTER_VCPUS] = vm->len;
+        if (vm->up) {
+                exporter_printf(vm, "qemu_vcpus{vm=\"%s\",state=\"running\"} "
+                                "%u\n", l, vm->running);
+                exporter_printf(vm, "qemu_vcpus{vm=\"%s\",state=\"halted\"} "
+                                "%u\n", l, vm->halted);
+        }
+
+        vm->off[EXPORTER_VCPU_HALTED] = vm->len;
+        for (i = 0; vm->up && i < vm->nvcpus; i++) {
+                if (vm->vcpu_halted[i] == EXPORTER_VCPU_NONE)
+                        continue;
+                exporter_printf(vm, "qemu_vcpu_halted{vm=\"%s\",vcpu=\"%u\"} "
+                                "%u\n", l, i, vm->vcpu_halted[i]);
+        }
+
+        vm->off[EXPORTER_GUEST_MODE] = vm->len;
+        exporter_printf(vm, "qemu_guest_mode_samples_total{vm=\"%s\","
+                        "mode=\"kernel\"} %lu\n", l, vm->kernel);
+        exporter_printf(vm, "qemu_guest_mode_samples_total{vm=\"%s\","
+                        "mode=\"user\"} %lu\n", l, vm->user);
+
+        vm->off[EXPORTER_LONG_MODE] = vm->len;
+        if (vm->up) {
+                exporter_printf(vm, "qemu_guest_long_mode{vm=\"%s\"} %d\n",
+                                l, vm->long_mode);
+        }
+
+        vm->off[EXPORTER_LATENCY] = vm->len;
+        for (i = 0; i < EXPORTER_LAT_BUCKETS; i++) {
+                cum += vm->lat[i];
+                exporter_printf(vm, "qemu_qmp_sample_seconds_bucket{vm=\"%s\","
+                                "le=\"%g\"} %lu\n", l,
+                                exporter_bounds[i] / 1e6, cum);
+        }
+        exporter_printf(vm, "qemu_qmp_sample_seconds_bucket{vm=\"%s\","
+                        "le=\"+Inf\"} %lu\n", l, vm->lat_count);
+        exporter_printf(vm, "qemu_qmp_sample_seconds_count{vm=\"%s\"} %lu\n",
+                        l, vm->lat_count);
+        exporter_printf(vm, "qemu_qmp_sample_seconds_sum{vm=\"%s\"} %.9f\n",
+                        l, vm->lat_sum_ns / 1e9);
+
+        vm->off[EXPORTER_FAILURES] = vm->len;
+        exporter_printf(vm, "qemu_qmp_sample_failures_total{vm=\"%s\"} %lu\n",
+                        l, vm->failures);
+
+        vm->off[EXPORTER_FAMILIES] = vm->len;
+        vm->dirty = 0;
+}
+
+static void
+exporter_append(struct exporter *e, const char *buf, size_t len)
+{
+        if (e->len + len > e->size) {
+                while (e->len + len > e->size)
+                        e->size *= 2;
+                e->body = xrealloc(e->body, e->size);
+        }
+
+        memcpy(e->body + e->len, buf, len);
+        e->len += len;
+}
+
+/*
+ * the samples of a family have to be contiguous, so the body interleaves
+ * the fragments of every VM family by family
+ */
+static void
+exporter_build(struct exporter *e)
+{
+        char hdr[256];
+        unsigned int f, i;
+        int n;
+
+        for (i = 0; i < e->count; i++) {
+                if (e->vms[i].dirty)
+                        exporter_render(&e->vms[i]);
+        }
+
+        e->len = 0;
+        for (f = 0; f < EXPORTER_FAMILIES; f++) {
+                n = snprintf(hdr, sizeof(hdr), "# TYPE %s %s\n# HELP %s %s\n",
+                             exporter_families[f].name,
+                             exporter_families[f].type,
+                             exporter_families[f].name,
+                             exporter_families[f].help);
+                exporter_append(e, hdr, n);
+
+                for (i = 0; i < e->count; i++) {
+                        const struct exporter_vm *vm = &e->vms[i];
+
+                        exporter_append(e, vm->text + vm->off[f],
+                                        vm->off[f + 1] - vm->off[f]);
+                }
+        }
+        exporter_append(e, "# EOF\n", 6);
+
+        e->stale = 0;
+}
+
+static void
+exporter_queue(struct exporter_client *c, const char *buf, size_t len)
+{
+        if (c->osize - c->olen < len) {
+                c->osize = c->olen + len;
+                c->out = xrealloc(c->out, c->osize);
+        }
+        memcpy(c->out + c->olen, buf, len);
+        c->olen += len;
+}
+
+/* what the scraper takes without blocking, the rest is queued */
+static int
+exporter_send(struct exporter_client *c, const char *buf, size_t len,
+              int more)
+{
+        ssize_t r;
+
+        /* behind what is queued already */
+        while (len && !c->olen) {
+                r = send(c->fd, buf, len,
+                         MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r < 0 && errno == EAGAIN)
+                        break;
+                if (r <= 0)
+                        return -1;
+
+                buf += r;
+                len -= r;
+        }
+
+        if (len)
+                exporter_queue(c, buf, len);
+        return 0;
+}
+
+static int
+exporter_flush(struct exporter_client *c)
+{
+        size_t off = 0;
+        ssize_t r;
+
+        while (off < c->olen) {
+                r = send(c->fd, c->out + off, c->olen - off, MSG_NOSIGNAL);
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r < 0 && errno == EAGAIN)
+                        break;
+                if (r <= 0)
+                        return -1;
+                off += r;
+        }
+
+        memmove(c->out, c->out + off, c->olen - off);
+        c->olen -= off;
+        return 0;
+}
+
+static int
+exporter_serve(struct exporter *e, struct exporter_client *c, const char *req)
+{
+        char hdr[256];
+        int n;
+
+        if (strncmp(req, "GET /metrics ", 13) != 0 &&
+            strncmp(req, "GET / ", 6) != 0) {
+                return exporter_send(c, EXPORTER_NOT_FOUND,
+                                     strlen(EXPORTER_NOT_FOUND), 0);
+        }
+
+        /* the body is this thread's, only the VMs are shared */
+        pthread_mutex_lock(&e->lock);
+        if (e->stale)
+                exporter_build(e);
+        pthread_mutex_unlock(&e->lock);
+        e->scrapes++;
+
+        n = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: " EXPORTER_CONTENT_TYPE "\r\n"
+                     "Content-Length: %zu\r\n\r\n", e->len);
+
+        if (exporter_send(c, hdr, n, 1) == -1 ||
+            exporter_send(c, e->body, e->len, 0) == -1) {
+                return -1;
+        }
+
+        return 0;
+}
+
+/*
+ * requests carry no body, everything up to the empty line is one request,
+ * the connection stays open for the next scrape; a request waits for the
+ * response to the previous one to be taken
+ */
+static int
+exporter_client_serve(struct exporter *e, struct exporter_client *c)
+{
+        char *end;
+
+        while (!c->olen && (end = strstr(c->req, "\r\n\r\n")) != NULL) {
+                *end = '\0';
+                if (exporter_serve(e, c, c->req) == -1) {
+                        return -1;
+                }
+
+                end += 4;
+                c->len -= end - c->req;
+                memmove(c->req, end, c->len + 1);
+        }
+
+        return 0;
+}
+
+static int
+exporter_client_read(struct exporter *e, struct exporter_client *c)
+{
+        ssize_t r;
+
+        r = recv(c->fd, c->req + c->len, sizeof(c->req) - 1 - c->len, 0);
+        if (r < 0 && (errno == EINTR || errno == EAGAIN)) {
+                return 0;
+        }
+        if (r <= 0) {
+                return -1;
+        }
+        c->len += r;
+        c->req[c->len] = '\0';
+
+        if (exporter_client_serve(e, c) == -1) {
+                return -1;
+        }
+
+        /* headers that do not fit */
+        if (c->len == sizeof(c->req) - 1 && !c->olen) {
+                return -1;
+        }
+
+        return 0;
+}
+
+static void
+exporter_drop_client(struct exporter *e, struct exporter_client *c)
+{
+        struct exporter_client **pc;
+
+        for (pc = &e->clients; *pc != NULL; pc = &(*pc)->next) {
+                if (*pc == c) {
+                        *pc = c->next;
+                        break;
+                }
+        }
+
+        close(c->fd);
+        xfree(c->out);
+        xfree(c);
+        e->nclients--;
+}
+
+static void
+exporter_accept(struct exporter *e)
+{
+        struct exporter_client *c;
+        int fd;
+
+        if ((fd = accept(e->lfd, NULL, NULL)) == -1) {
+                return;
+        }
+
+        if (e->nclients == EXPORTER_MAX_CLIENTS) {
+                dprintf("exporter: too many clients\n");
+                close(fd);
+                return;
+        }
+
+        xset_tcp_nodelay(fd, 1);
+        xset_tcp_keepalive(fd);
+        xsetnonblock(fd);
+
+        c = xcalloc(1, sizeof(struct exporter_client));
+        c->fd = fd;
+        c->next = e->clients;
+        e->clients = c;
+        e->nclients++;
+}
+
+void
+exporter_run(struct exporter *e)
+{
+        struct pollfd pfds[EXPORTER_MAX_CLIENTS + 1];
+        struct exporter_client *clients[EXPORTER_MAX_CLIENTS];
+        unsigned int i;
+        int r;
+
+        if (pthread_create(&e->sampler, NULL, exporter_sampler_run, e) != 0) {
+                dprintf("exporter: cannot start the sampler\n");
+                return;
+        }
+
+        for (;;) {
+                struct exporter_client *c;
+                unsigned int n = 0;
+
+                pfds[0].fd = e->lfd;
+                pfds[0].events = POLLIN;
+                for (c = e->clients; c != NULL; c = c->next) {
+                        clients[n] = c;
+                        pfds[n + 1].fd = c->fd;
+                        /* the next request once the response is taken */
+                        pfds[n + 1].events = c->olen ? POLLOUT : POLLIN;
+                        n++;
+                }
+
+                if (poll(pfds, n + 1, -1) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        break;
+                }
+
+                for (i = 0; i < n; i++) {
+                        c = clients[i];
+                        if (!pfds[i + 1].revents)
+                                continue;
+
+                        if (c->olen) {
+                                r = exporter_flush(c);
+                                if (r == 0 && !c->olen)
+                                        r = exporter_client_serve(e, c);
+                        } else {
+                                r = exporter_client_read(e, c);
+                        }
+                        if (r == -1)
+                                exporter_drop_client(e, c);
+                }
+
+                if (pfds[0].revents & POLLIN)
+                        exporter_accept(e);
+        }
+
+        __atomic_store_n(&e->stop, 1, __ATOMIC_RELEASE);
+        pthread_join(e->sampler, NULL);
+}
+
+void
+exporter_release(struct exporter *e)
+{
+        unsigned int i;
+
+        while (e->clients)
+                exporter_drop_client(e, e->clients);
+
+        for (i = 0; i < e->count; i++) {
+                e->vms[i].qmpc->health = NULL;
+                xfree(e->vms[i].vcpu_halted);
+                xfree(e->vms[i].text);
+        }
+
+        xfree(e->vms);
+        xfree(e->body);
+        if (e->lfd > 0)
+                close(e->lfd);
+        pthread_mutex_destroy(&e->lock);
+        memset(e, 0, sizeof(struct exporter));
+}
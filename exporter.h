@@ -0,0 +1,125 @@
+#ifndef __EXPORTER_H
+#define __EXPORTER_H
+
+/*
+ * OpenMetrics over HTTP. The VMs are sampled on their own schedule by a
+ * thread of their own, never because of a scrape, and a slow monitor
+ * never holds up a scrape; each VM keeps its metrics rendered in its own
+ * buffer, one fragment per metric family, re-rendered only after its data
+ * changed, and a scrape copies the fragments into one preallocated body.
+ *
+ * A VM that fails EXPORTER_MAX_FAILURES samples in a row, or misses a
+ * deadline, is quarantined and reconnected with backoff, see qmp.h; it is
+ * exported as down meanwhile, and not rendered again until it is back.
+ * Scrapers are written to without blocking: what a scraper does not take
+ * at once is queued, and its next request waits for the queue to drain.
+ */
+
+/* scrapers served at once */
+#define EXPORTER_MAX_CLIENTS    (64)
+#define EXPORTER_BACKLOG        (16)
+/* the request line and headers of a scrape */
+#define EXPORTER_REQ_LEN        (4096)
+/* how often each VM is sampled */
+#define EXPORTER_INTERVAL       (1000)
+/* failed samples in a row before a VM is reconnected */
+#define EXPORTER_MAX_FAILURES   (3)
+/* initial room for the body and for each VM */
+#define EXPORTER_BODY_LEN       (1024 * 1024)
+#define EXPORTER_VM_LEN         (4096)
+/* upper bounds of the command latency buckets, in us, +Inf is implied */
+#define EXPORTER_LAT_BOUNDS     { 50, 100, 250, 500, 1000, 2500, 5000, \
+                                  10000, 50000 }
+#define EXPORTER_LAT_BUCKETS    (9)
+/* a vCPU id missing from the last sample */
+#define EXPORTER_VCPU_NONE      (0xff)
+#define EXPORTER_CONTENT_TYPE   \
+        "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+enum exporter_family {
+        EXPORTER_UP,
+        EXPORTER_VCPUS,
+        EXPORTER_VCPU_HALTED,
+        EXPORTER_GUEST_MODE,
+        EXPORTER_LONG_MODE,
+        EXPORTER_LATENCY,
+        EXPORTER_FAILURES,
+        EXPORTER_FAMILIES
+};
+
+struct exporter_vm {
+        struct qmp_conn *qmpc;
+        /* the vm label, escaped */
+        char label[256];
+        /* kept by the sampler */
+        uint64_t next;
+        unsigned int errors;
+        struct qmp_health health;
+
+        /* what the last sample saw */
+        int up;
+        unsigned int running, halted;
+        /* largest vCPU id + 1 */
+        unsigned int nvcpus;
+        /* per vCPU, by id */
+        uint8_t *vcpu_halted;
+        unsigned int vcpu_size;
+        /* vCPU 0 was in the kernel (CPL 0) or user mode, samples so far */
+        uint64_t kernel, user;
+        int long_mode;
+        /* round trips of the samples */
+        uint64_t lat[EXPORTER_LAT_BUCKETS + 1];
+        uint64_t lat_count, lat_sum_ns;
+        uint64_t failures;
+
+        /* the rendered fragments, family f is text[off[f]..off[f + 1]] */
+        char *text;
+        size_t len, size;
+        size_t off[EXPORTER_FAMILIES + 1];
+        int dirty;
+};
+
+struct exporter {
+        int lfd;
+        struct exporter_vm *vms;
+        unsigned int count;
+
+        /* the sampler thread, and what it shares with the scrapes */
+        pthread_t sampler;
+        pthread_mutex_t lock;
+        int stop;
+
+        /* the last body, valid until a VM gets dirty; the server's */
+        char *body;
+        size_t len, size;
+        int stale;
+
+        struct exporter_client *clients;
+        unsigned int nclients;
+        uint64_t scrapes;
+};
+
+/**
+ * @brief listen on '[host:]port'
+ * @retval 0 on success, -1 if the address cannot be bound
+ */
+extern int
+exporter_init(struct exporter *e, const char *addr);
+
+/**
+ * @brief export an established connection, the exporter does not own it
+ */
+extern void
+exporter_add(struct exporter *e, struct qmp_conn *qmpc);
+
+/**
+ * @brief sample the VMs from a thread of their own and serve scrapes,
+ * forever
+ */
+extern void
+exporter_run(struct exporter *e);
+
+extern void
+exporter_release(struct exporter *e);
+
+#endif /* __EXPORTER_H */
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "qmp.h"
+#include "governor.h"
+
+#define GOV_MS          (1000000ULL)
+#define GOV_DROPPED     (UINT64_MAX)
+
+void
+gov_init(struct governor *g, double vm_pct, double host_pct,
+         gov_sample_fn sample, void *arg)
+{
+        memset(g, 0, sizeof(struct governor));
+        g->vm_budget = vm_pct / 100.0;
+        g->host_budget = host_pct / 100.0;
+        g->sample = sample;
+        g->arg = arg;
+}
+
+void
+gov_add(struct governor *g, struct qmp_conn *qmpc)
+{
+        struct gov_vm *vm;
+        unsigned int i;
+
+        g->vms = xrealloc(g->vms, (g->count + 1) * sizeof(struct gov_vm));
+        vm = &g->vms[g->count++];
+        memset(vm, 0, sizeof(struct gov_vm));
+
+        vm->qmpc = qmpc;
+        /* nothing is known yet, start fast and let the first samples tell */
+        vm->base = vm->interval = GOV_MIN_INTERVAL * GOV_MS;
+        vm->next = xclock_ns();
+
+        /* the array moved */
+        for (i = 0; i < g->count; i++) {
+                if (g->vms[i].next != GOV_DROPPED)
+                        g->vms[i].qmpc->timing = &g->vms[i].timing;
+        }
+}
+
+void
+gov_release(struct governor *g)
+{
+        unsigned int i;
+
+        for (i = 0; i < g->count; i++)
+                g->vms[i].qmpc->timing = NULL;
+
+        xfree(g->vms);
+        g->vms = NULL;
+        g->count = 0;
+        g->load = 0.0;
+}
+
+static uint64_t
+gov_clamp(double ns)
+{
+        if (ns < GOV_MIN_INTERVAL * GOV_MS)
+                return GOV_MIN_INTERVAL * GOV_MS;
+        if (ns > GOV_MAX_INTERVAL * GOV_MS)
+                return GOV_MAX_INTERVAL * GOV_MS;
+        return (uint64_t) ns;
+}
+
+/*
+ * a VM whose own budget allows one sample every base ns loads the host
+ * by service / base; when the sum is over the host budget every interval
+ * is stretched by the same factor
+ */
+static void
+gov_adjust(struct governor *g, struct gov_vm *vm)
+{
+        double scale = 1.0;
+
+        vm->base = gov_clamp(vm->service / g->vm_budget);
+
+        g->load -= vm->load;
+        vm->load = vm->service / vm->base;
+        g->load += vm->load;
+
+        if (g->load > g->host_budget)
+                scale = g->load / g->host_budget;
+
+        vm->interval = gov_clamp(vm->base * scale);
+}
+
+static void
+gov_drop(struct governor *g, struct gov_vm *vm)
+{
+        dprintf("governor: dropping '%s' after %u failed samples\n",
+                vm->qmpc->qmp_sock_path, vm->errors);
+
+        g->load -= vm->load;
+        vm->load = 0.0;
+        vm->next = GOV_DROPPED;
+        vm->qmpc->timing = NULL;
+}
+
+static void
+gov_sample(struct governor *g, struct gov_vm *vm)
+{
+        uint64_t service = vm->timing.service_ns;
+        uint64_t rtt = vm->timing.rtt_ns;
+        uint64_t start = xclock_ns();
+
+        if (g->sample(vm->qmpc, g->arg) == -1) {
+                vm->failures++;
+                if (++vm->errors >= GOV_MAX_FAILURES) {
+                        gov_drop(g, vm);
+                        return;
+                }
+                /* give a struggling monitor some room */
+                vm->next = start + GOV_MAX_INTERVAL * GOV_MS;
+                return;
+        }
+        vm->errors = 0;
+
+        /* replies served from a cache cost qemu nothing */
+        service = vm->timing.service_ns - service;
+        rtt = vm->timing.rtt_ns - rtt;
+
+        vm->samples++;
+        vm->busy_ns += service;
+        vm->rtt_ns += rtt;
+
+        if (vm->service == 0.0)
+                vm->service = service;
+        else
+                vm->service += GOV_EWMA_WEIGHT * (service - vm->service);
+
+        gov_adjust(g, vm);
+
+        /* keep the phase, unless we fell behind */
+        vm->next += vm->interval;
+        if (vm->next < start)
+                vm->next = start + vm->interval;
+}
+
+void
+gov_report(struct governor *g)
+{
+        uint64_t now = xclock_ns();
+        double elapsed = (now - g->window) / 1e9, busy = 0.0;
+        unsigned int i;
+
+        for (i = 0; i < g->count; i++) {
+                struct gov_vm *vm = &g->vms[i];
+
+                if (vm->next == GOV_DROPPED)
+                        continue;
+
+                dprintf("%s: %.2f samples/s (every %.1fms), busy %.3f%%, "
+                        "rtt %.1fus, service %.1fus, failures %lu\n",
+                        vm->qmpc->qmp_sock_path, vm->samples / elapsed,
+                        vm->interval / 1e6,
+                        vm->busy_ns / 1e7 / elapsed,
+                        vm->samples ? vm->rtt_ns / 1e3 / vm->samples : 0.0,
+                        vm->service / 1e3, vm->failures);
+
+                busy += vm->busy_ns / 1e9 / elapsed;
+                vm->samples = vm->failures = 0;
+                vm->busy_ns = vm->rtt_ns = 0;
+        }
+
+        dprintf("host: busy %.3f%% (budget %.3f%%), demand %.3f%%\n",
+                busy * 100.0, g->host_budget * 100.0, g->load * 100.0);
+
+        g->window = now;
+}
+
+void
+gov_run(struct governor *g, unsigned int report_ms)
+{
+        uint64_t report = GOV_DROPPED;
+        unsigned int i;
+
+        g->window = xclock_ns();
+        if (report_ms)
+                report = g->window + report_ms * GOV_MS;
+
+        for (;;) {
+                struct gov_vm *due = NULL;
+                uint64_t next = report;
+                struct timespec ts;
+
+                for (i = 0; i < g->count; i++) {
+                        if (g->vms[i].next == GOV_DROPPED)
+                                continue;
+                        if (!due || g->vms[i].next < due->next)
+                                due = &g->vms[i];
+                }
+
+                if (!due) {
+                        break;
+                }
+
+                if (due->next < next)
+                        next = due->next;
+
+                /* absolute deadlines, the time spent sampling is not lost */
+                ts.tv_sec = next / 1000000000ULL;
+                ts.tv_nsec = next % 1000000000ULL;
+                if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                                    NULL) != 0) {
+                        continue;
+                }
+
+                if (xclock_ns() >= report) {
+                        gov_report(g);
+                        report += report_ms * GOV_MS;
+                }
+
+                if (xclock_ns() >= due->next)
+                        gov_sample(g, due);
+        }
+}
@@ -0,0 +1,107 @@
+#ifndef __GOVERNOR_H
+#define __GOVERNOR_H
+
+/*
+ * Periodic sampling of many VMs, paced so that the monitor of every VM is
+ * kept busy at most a given fraction of the time. HMP commands take the
+ * big lock and may kick the vCPUs, sampling too often slows the guest.
+ *
+ * The time QEMU spends on a sample is measured from the command timing of
+ * the connection; the interval of a VM is that time over the per-VM
+ * budget, stretched for all VMs alike when their sum exceeds the host
+ * budget.
+ */
+
+/* interval bounds, in ms */
+#define GOV_MIN_INTERVAL        (10)
+#define GOV_MAX_INTERVAL        (10000)
+/* default budgets, percent of monitor time */
+#define GOV_VM_BUDGET           (1.0)
+#define GOV_HOST_BUDGET         (10.0)
+/* weight of the newest service time in its moving average */
+#define GOV_EWMA_WEIGHT         (0.2)
+/* a VM is dropped after this many failed samples in a row */
+#define GOV_MAX_FAILURES        (3)
+/* print the achieved rates this often, in ms */
+#define GOV_REPORT_MS           (5000)
+
+struct gov_vm {
+        struct qmp_conn *qmpc;
+        /* attached to qmpc, updated by every command */
+        struct qmp_timing timing;
+
+        /* the next sample is due, CLOCK_MONOTONIC ns */
+        uint64_t next;
+        /* interval from the VM budget alone, and the one in use, in ns */
+        uint64_t base;
+        uint64_t interval;
+        /* moving average of the monitor time per sample, in ns */
+        double service;
+        /* service / base, this VM's share of the host load */
+        double load;
+
+        /* consecutive failed samples, dropped at GOV_MAX_FAILURES */
+        unsigned int errors;
+
+        /* since the last report */
+        uint64_t samples;
+        uint64_t failures;
+        uint64_t busy_ns;
+        uint64_t rtt_ns;
+};
+
+/* take one sample of a VM */
+typedef int (*gov_sample_fn)(const struct qmp_conn *qmpc, void *arg);
+
+struct governor {
+        struct gov_vm *vms;
+        unsigned int count;
+
+        /* fractions of monitor time */
+        double vm_budget;
+        double host_budget;
+        /* sum of the per VM loads */
+        double load;
+
+        gov_sample_fn sample;
+        void *arg;
+
+        /* start of the current report window */
+        uint64_t window;
+};
+
+/**
+ * @brief set up an empty governor
+ * @param vm_pct budget of each VM, percent of its monitor time
+ * @param host_pct budget of all VMs together, same unit
+ */
+extern void
+gov_init(struct governor *g, double vm_pct, double host_pct,
+         gov_sample_fn sample, void *arg);
+
+/**
+ * @brief start sampling an established connection
+ */
+extern void
+gov_add(struct governor *g, struct qmp_conn *qmpc);
+
+/**
+ * @brief sample all VMs until every one of them was dropped
+ * @param report_ms print the achieved rates this often, 0 for never
+ */
+extern void
+gov_run(struct governor *g, unsigned int report_ms);
+
+/**
+ * @brief print per VM rates, busy time and round trips since the last call
+ */
+extern void
+gov_report(struct governor *g);
+
+/**
+ * @brief detach from the connections, they are not closed
+ */
+extern void
+gov_release(struct governor *g);
+
+#endif /* __GOVERNOR_H */
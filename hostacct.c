@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "qmp.h"
+#include "hostacct.h"
+
+#define HOSTACCT_LINE_LEN       (1024)
+
+static int
+hostacct_open(pid_t pid, pid_t tid, const char *file)
+{
+        char path[64];
+
+        snprintf(path, sizeof(path), "/proc/%d/task/%d/%s",
+                 (int) pid, (int) tid, file);
+        return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+static void
+hostacct_close(struct hostacct_vcpu *hv)
+{
+        if (hv->stat_fd != -1)
+                close(hv->stat_fd);
+        if (hv->schedstat_fd != -1)
+                close(hv->schedstat_fd);
+        hv->stat_fd = hv->schedstat_fd = -1;
+}
+
+void
+hostacct_release(struct hostacct *ha)
+{
+        unsigned int i;
+
+        for (i = 0; i < ha->count; i++)
+                hostacct_close(&ha->vcpus[i]);
+
+        xfree(ha->vcpus);
+        ha->vcpus = NULL;
+        ha->count = 0;
+        ha->last_ns = 0;
+}
+
+/*
+ * the list is short, compare it as a set of (id, tid)
+ */
+static int
+hostacct_same_set(const struct hostacct *ha, pid_t pid,
+                  const struct vcpus *vcpus)
+{
+        const struct vcpu *v;
+        unsigned int i;
+
+        if (ha->stale || ha->pid != pid || ha->count != vcpus->count) {
+                return 0;
+        }
+
+        for (v = vcpus->vcpu; v != NULL; v = v->next) {
+                for (i = 0; i < ha->count; i++) {
+                        if (ha->vcpus[i].id == v->id &&
+                            ha->vcpus[i].tid == v->thread_id)
+                                break;
+                }
+                if (i == ha->count)
+                        return 0;
+        }
+
+        return 1;
+}
+
+int
+hostacct_sync(struct hostacct *ha, pid_t pid, const struct vcpus *vcpus)
+{
+        const struct vcpu *v;
+        unsigned int i;
+
+        if (hostacct_same_set(ha, pid, vcpus)) {
+                return 0;
+        }
+
+        hostacct_release(ha);
+
+        if (pid == 0) {
+                dprintf("hostacct: unknown qemu pid\n");
+                return -1;
+        }
+
+        ha->pid = pid;
+        ha->stale = 0;
+        ha->count = vcpus->count;
+        ha->vcpus = xcalloc(vcpus->count, sizeof(struct hostacct_vcpu));
+        for (i = 0; i < ha->count; i++)
+                ha->vcpus[i].stat_fd = ha->vcpus[i].schedstat_fd = -1;
+
+        /* the list is built backwards, store it by ascending id */
+        for (v = vcpus->vcpu, i = vcpus->count; v != NULL; v = v->next) {
+                struct hostacct_vcpu *hv = &ha->vcpus[--i];
+
+                hv->id = v->id;
+                hv->tid = v->thread_id;
+                hv->stat_fd = hostacct_open(pid, v->thread_id, "stat");
+                hv->schedstat_fd = hostacct_open(pid, v->thread_id,
+                                                 "schedstat");
+
+                if (hv->stat_fd == -1 || hv->schedstat_fd == -1) {
+                        dprintf("hostacct: vCPU %u thread %d ('%s')\n",
+                                v->id, (int) v->thread_id, strerror(errno));
+                        hostacct_release(ha);
+                        return -1;
+                }
+        }
+
+        return 1;
+}
+
+static int
+hostacct_read(int fd, char *buf, size_t size)
+{
+        ssize_t r = pread(fd, buf, size - 1, 0);
+
+        if (r <= 0) {
+                return -1;
+        }
+
+        buf[r] = '\0';
+        return 0;
+}
+
+static int
+hostacct_read_vcpu(struct hostacct_vcpu *hv, uint64_t *utime,
+                   uint64_t *stime, uint64_t *run_ns, uint64_t *wait_ns,
+                   uint64_t *slices)
+{
+        char buf[HOSTACCT_LINE_LEN], *p;
+
+        /* run time, run-queue wait, timeslices */
+        if (hostacct_read(hv->schedstat_fd, buf, sizeof(buf)) == -1 ||
+            sscanf(buf, "%lu %lu %lu", run_ns, wait_ns, slices) != 3) {
+                return -1;
+        }
+
+        /* the command name may contain anything, skip past it */
+        if (hostacct_read(hv->stat_fd, buf, sizeof(buf)) == -1 ||
+            !(p = strrchr(buf, ')'))) {
+                return -1;
+        }
+
+        if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                   "%lu %lu", utime, stime) != 2) {
+                return -1;
+        }
+
+        return 0;
+}
+
+int
+hostacct_sample(struct hostacct *ha)
+{
+        static long ticks;
+        uint64_t now = xclock_ns();
+        double elapsed;
+        unsigned int i;
+
+        if (!ticks)
+                ticks = sysconf(_SC_CLK_TCK);
+
+        elapsed = ha->last_ns ? (now - ha->last_ns) / 1e9 : 0.0;
+
+        for (i = 0; i < ha->count; i++) {
+                struct hostacct_vcpu *hv = &ha->vcpus[i];
+                uint64_t utime, stime, run_ns, wait_ns, slices;
+
+                if (hostacct_read_vcpu(hv, &utime, &stime, &run_ns,
+                                       &wait_ns, &slices) == -1) {
+                        /* the thread exited, i.e. the vCPU set changed */
+                        ha->stale = 1;
+                        return -1;
+                }
+
+                if (elapsed > 0.0) {
+                        hv->util = (run_ns - hv->run_ns) / 1e9 / elapsed;
+                        hv->wait = (wait_ns - hv->wait_ns) / 1e9 / elapsed;
+                        hv->user = (double) (utime - hv->utime) / ticks /
+                                   elapsed;
+                        hv->sys = (double) (stime - hv->stime) / ticks /
+                                  elapsed;
+                        hv->switches = (slices - hv->slices) / elapsed;
+                }
+
+                hv->utime = utime;
+                hv->stime = stime;
+                hv->run_ns = run_ns;
+                hv->wait_ns = wait_ns;
+                hv->slices = slices;
+        }
+
+        ha->last_ns = now;
+        return 0;
+}
+
+void
+hostacct_dump(const struct hostacct *ha)
+{
+        unsigned int i;
+
+        for (i = 0; i < ha->count; i++) {
+                const struct hostacct_vcpu *hv = &ha->vcpus[i];
+
+                dprintf("CPU#%u, TID=%d, Util: %5.1f%% (usr %5.1f%%, "
+                        "sys %5.1f%%), Wait: %5.1f%%, Switches: %.0f/s\n",
+                        hv->id, (int) hv->tid, hv->util * 100.0,
+                        hv->user * 100.0, hv->sys * 100.0,
+                        hv->wait * 100.0, hv->switches);
+        }
+}
@@ -0,0 +1,69 @@
+#ifndef __HOSTACCT_H
+#define __HOSTACCT_H
+
+/*
+ * Host side accounting of the vCPU threads: CPU time, run-queue delay and
+ * context switches are read from /proc/<pid>/task/<tid>/{stat,schedstat},
+ * no monitor round trip involved once the thread ids are known.
+ */
+
+/* re-check the vCPU set over the monitor at most this often, in ms */
+#define HOSTACCT_RESYNC_MS      (10000)
+
+struct hostacct_vcpu {
+        uint8_t id;
+        pid_t tid;
+        /* kept open, sampled with pread() */
+        int stat_fd;
+        int schedstat_fd;
+
+        /* counters of the previous sample */
+        uint64_t utime, stime;          /* clock ticks */
+        uint64_t run_ns, wait_ns;
+        uint64_t slices;
+
+        /* rates over the last interval */
+        double util, user, sys;         /* fraction of one host CPU */
+        double wait;                    /* fraction of time runnable, not running */
+        double switches;                /* per second */
+};
+
+struct hostacct {
+        pid_t pid;
+        unsigned int count;
+        struct hostacct_vcpu *vcpus;
+        /* time of the previous sample, 0 before the first one */
+        uint64_t last_ns;
+        /* a thread went away, the vCPU set has to be fetched again */
+        int stale;
+};
+
+/**
+ * @brief (re)open the per thread files, only if the vCPU set changed
+ * @param pid the qemu process
+ * @param vcpus the vCPU list, with thread ids
+ * @retval 1 if the set changed, 0 if not, -1 on failure
+ */
+extern int
+hostacct_sync(struct hostacct *ha, pid_t pid, const struct vcpus *vcpus);
+
+/**
+ * @brief read all the counters and update the rates
+ * @retval 0 on success, -1 if a thread is gone (ha->stale is set)
+ */
+extern int
+hostacct_sample(struct hostacct *ha);
+
+/**
+ * @brief print the rates of the last interval
+ */
+extern void
+hostacct_dump(const struct hostacct *ha);
+
+/**
+ * @brief close all the files
+ */
+extern void
+hostacct_release(struct hostacct *ha);
+
+#endif /* __HOSTACCT_H */
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "json.h"
+
+static int
+json_is_ws(char c)
+{
+        return (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+}
+
+static const char *
+json_skip_ws(const char *p, const char *end)
+{
+        while (p < end && json_is_ws(*p))
+                p++;
+        return p;
+}
+
+/*
+ * 'p' points to the opening quote, returns a pointer past the closing
+ * quote or NULL if the string is not terminated within 'end'
+ */
+static const char *
+json_skip_string(const char *p, const char *end)
+{
+        for (p++; p < end; p++) {
+                if (*p == '\\') {
+                        p++;
+                        continue;
+                }
+                if (*p == '"')
+                        return p + 1;
+        }
+        return NULL;
+}
+
+static const char *
+json_skip_value(const char *p, const char *end)
+{
+        int depth = 0;
+
+        if (p >= end)
+                return NULL;
+
+        if (*p == '"')
+                return json_skip_string(p, end);
+
+        if (*p != '{' && *p != '[') {
+                /* number, true, false, null */
+                while (p < end && *p != ',' && *p != '}' && *p != ']' &&
+                       !json_is_ws(*p))
+                        p++;
+                return p;
+        }
+
+        while (p < end) {
+                switch (*p) {
+                case '"':
+                        p = json_skip_string(p, end);
+                        if (!p)
+                                return NULL;
+                        continue;
+                case '{':
+                case '[':
+                        depth++;
+                break;
+                case '}':
+                case ']':
+                        if (--depth == 0)
+                                return p + 1;
+                break;
+                }
+                p++;
+        }
+
+        return NULL;
+}
+
+ssize_t
+json_object_len(const char *buf, size_t len, size_t *skip)
+{
+        const char *start, *end = buf + len, *p;
+
+        start = json_skip_ws(buf, end);
+        *skip = start - buf;
+
+        if (start == end)
+                return 0;
+
+        if (*start != '{')
+                return -1;
+
+        p = json_skip_value(start, end);
+        if (!p)
+                return 0;
+
+        return p - start;
+}
+
+int
+json_get_member(const char *obj, size_t len, const char *key,
+                const char **val, size_t *vlen)
+{
+        const char *p, *end = obj + len;
+        size_t key_len = strlen(key);
+
+        p = json_skip_ws(obj, end);
+        if (p == end || *p != '{')
+                return -1;
+        p++;
+
+        for (;;) {
+                const char *kstart, *vstart;
+                size_t klen;
+
+                p = json_skip_ws(p, end);
+                if (p == end || *p != '"')
+                        return -1;
+
+                kstart = p + 1;
+                if (!(p = json_skip_string(p, end)))
+                        return -1;
+                klen = p - 1 - kstart;
+
+                p = json_skip_ws(p, end);
+                if (p == end || *p != ':')
+                        return -1;
+
+                vstart = p = json_skip_ws(p + 1, end);
+                if (!(p = json_skip_value(p, end)))
+                        return -1;
+
+                if (klen == key_len && !memcmp(kstart, key, key_len)) {
+                        *val = vstart;
+                        *vlen = p - vstart;
+                        return 0;
+                }
+
+                p = json_skip_ws(p, end);
+                if (p == end || *p != ',')
+                        return -1;
+                p++;
+        }
+}
+
+int
+json_string_eq(const char *val, size_t vlen, const char *str)
+{
+        size_t len = strlen(str);
+
+        return (vlen == len + 2 && val[0] == '"' &&
+                !memcmp(val + 1, str, len) && val[len + 1] == '"');
+}
+
+size_t
+json_compact(char *dst, size_t size, const char *src, size_t len)
+{
+        size_t i, n = 0;
+        int in_str = 0;
+
+        if (size == 0)
+                return 0;
+
+        for (i = 0; i < len && n + 1 < size; i++) {
+                char c = src[i];
+
+                if (in_str) {
+                        if (c == '\\' && i + 1 < len && n + 2 < size) {
+                                dst[n++] = c;
+                                c = src[++i];
+                        } else if (c == '"') {
+                                in_str = 0;
+                        }
+                } else if (c == '"') {
+                        in_str = 1;
+                } else if (json_is_ws(c)) {
+                        continue;
+                }
+                dst[n++] = c;
+        }
+
+        dst[n] = '\0';
+        return n;
+}
+
+int
+json_array_next(const char *arr, size_t len, size_t *pos,
+                const char **val, size_t *vlen)
+{
+        const char *p, *end = arr + len;
+
+        p = json_skip_ws(arr + *pos, end);
+        if (*pos == 0) {
+                if (p == end || *p != '[')
+                        return -1;
+                p = json_skip_ws(p + 1, end);
+        } else if (p < end && *p == ',') {
+                p = json_skip_ws(p + 1, end);
+        }
+
+        if (p == end)
+                return -1;
+        if (*p == ']')
+                return 0;
+
+        *val = p;
+        if (!(p = json_skip_value(p, end)))
+                return -1;
+        *vlen = p - *val;
+        *pos = p - arr;
+
+        return 1;
+}
+
+uint64_t
+json_to_u64(const char *val, size_t vlen)
+{
+        char num[24];
+
+        if (vlen >= 4 && !memcmp(val, "true", 4))
+                return 1;
+        if (vlen == 0 || vlen >= sizeof(num) || *val < '0' || *val > '9')
+                return 0;
+
+        memcpy(num, val, vlen);
+        num[vlen] = '\0';
+        return strtoull(num, NULL, 10);
+}
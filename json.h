@@ -0,0 +1,66 @@
+#ifndef __JSON_H
+#define __JSON_H
+
+/*
+ * Minimal JSON scanner, just enough to frame QMP messages and to pick
+ * top-level members out of them without building a tree.
+ */
+
+/**
+ * @brief compute the length of the first complete JSON object in 'buf'
+ * @param buf the receive buffer, leading whitespace is allowed
+ * @param len the amount of valid bytes in 'buf'
+ * @param skip set to the amount of leading whitespace before the object
+ * @retval length of the object (without 'skip'), 0 if the object is not
+ * complete yet, -1 if 'buf' does not start with an object
+ */
+extern ssize_t
+json_object_len(const char *buf, size_t len, size_t *skip);
+
+/**
+ * @brief locate the raw value of the top-level member 'key' of an object
+ * @param obj the object, as framed by json_object_len()
+ * @param len the length of the object
+ * @param key the member name, without quotes
+ * @param val set to the start of the raw value text
+ * @param vlen set to the length of the raw value text
+ * @retval 0 if found, -1 otherwise
+ */
+extern int
+json_get_member(const char *obj, size_t len, const char *key,
+                const char **val, size_t *vlen);
+
+/**
+ * @brief compare a raw JSON string value against 'str'
+ * @retval 1 if the raw value is the string "str", 0 otherwise
+ */
+extern int
+json_string_eq(const char *val, size_t vlen, const char *str);
+
+/**
+ * @brief copy 'len' bytes of 'src' into 'dst', dropping whitespace that is
+ * not part of a string, so equal values compare equal byte-wise
+ * @retval the amount of bytes written to 'dst', which is NUL terminated
+ */
+extern size_t
+json_compact(char *dst, size_t size, const char *src, size_t len);
+
+/**
+ * @brief step through the elements of an array
+ * @param arr the array, as returned by json_get_member()
+ * @param pos the scan position, 0 before the first call
+ * @param val set to the next element
+ * @retval 1 if an element was found, 0 at the end, -1 on malformed input
+ */
+extern int
+json_array_next(const char *arr, size_t len, size_t *pos,
+                const char **val, size_t *vlen);
+
+/**
+ * @brief parse an unsigned integer value, false, true and null are 0 or 1
+ * @retval the number, 0 if it is not one
+ */
+extern uint64_t
+json_to_u64(const char *val, size_t vlen);
+
+#endif /* __JSON_H */
@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "json.h"
+#include "qmp.h"
+#include "schema.h"
+#include "kvmstats.h"
+
+/* unaligned, a row starts wherever malloc put the matrix */
+typedef uint64_t kvmstats_u64v
+        __attribute__((vector_size(KVMSTATS_LANES * sizeof(uint64_t)),
+                       aligned(sizeof(uint64_t))));
+typedef int64_t kvmstats_i64v
+        __attribute__((vector_size(KVMSTATS_LANES * sizeof(int64_t)),
+                       aligned(sizeof(int64_t))));
+typedef double kvmstats_f64v
+        __attribute__((vector_size(KVMSTATS_LANES * sizeof(double)),
+                       aligned(sizeof(double))));
+
+static void
+kvmstats_add_column(struct kvmstats_table *t, const char *name, size_t len,
+                    int cumulative)
+{
+        if (len >= KVMSTATS_NAME_LEN)
+                len = KVMSTATS_NAME_LEN - 1;
+
+        t->names = xrealloc(t->names, (t->ncols + 1) * KVMSTATS_NAME_LEN);
+        t->cumulative = xrealloc(t->cumulative,
+                                 (t->ncols + 1) * sizeof(uint64_t));
+
+        memcpy(t->names[t->ncols], name, len);
+        t->names[t->ncols][len] = '\0';
+        t->cumulative[t->ncols++] = cumulative ? UINT64_MAX : 0;
+}
+
+/*
+ * {"provider": "kvm", "target": "vcpu", "stats": [{"name": "exits",
+ *  "type": "cumulative", "unit": ..., "base": 10, "exponent": 0}, ...]}
+ */
+static void
+kvmstats_parse_schema(struct kvmstats_table *t, const char *obj, size_t len)
+{
+        const char *stats, *stat, *val, *type;
+        size_t slen, len2, vlen, tlen, pos = 0;
+
+        if (json_get_member(obj, len, "stats", &stats, &slen) == -1)
+                return;
+
+        while (json_array_next(stats, slen, &pos, &stat, &len2) == 1) {
+                if (json_get_member(stat, len2, "name", &val, &vlen) == -1 ||
+                    json_get_member(stat, len2, "type", &type, &tlen) == -1 ||
+                    vlen < 2) {
+                        continue;
+                }
+
+                /* histograms do not fit a column */
+                if (json_string_eq(type, tlen, "cumulative"))
+                        kvmstats_add_column(t, val + 1, vlen - 2, 1);
+                else if (json_string_eq(type, tlen, "instant") ||
+                         json_string_eq(type, tlen, "peak"))
+                        kvmstats_add_column(t, val + 1, vlen - 2, 0);
+        }
+}
+
+static void
+kvmstats_table_setup(struct kvmstats_table *t)
+{
+        unsigned int i;
+
+        t->stride = (t->ncols + KVMSTATS_LANES - 1) & ~(KVMSTATS_LANES - 1);
+        t->cumulative = xrealloc(t->cumulative,
+                                 (t->stride ? t->stride : 1) *
+                                 sizeof(uint64_t));
+        for (i = t->ncols; i < t->stride; i++)
+                t->cumulative[i] = 0;
+        t->scale = xcalloc(t->stride ? t->stride : 1, sizeof(double));
+}
+
+int
+kvmstats_init(struct kvmstats *ks, const struct qmp_conn *qmpc)
+{
+        const char *arr, *elem, *val;
+        size_t nread, alen, elen, vlen, pos = 0;
+
+        memset(ks, 0, sizeof(struct kvmstats));
+        ks->vm.target = "vm";
+        ks->vm.cmd = QMP_COMMAND_QUERY_STATS_VM;
+        ks->vcpu.target = "vcpu";
+        ks->vcpu.cmd = QMP_COMMAND_QUERY_STATS_VCPU;
+
+        if (qmpc->schema && !qmp_schema_has(qmpc->schema, "query-stats")) {
+                return -1;
+        }
+
+        ks->buf = xmalloc(KVMSTATS_BUF_LEN);
+
+        if (qmp_execute(qmpc, QMP_COMMAND_QUERY_STATS_SCHEMAS, ks->buf,
+                        KVMSTATS_BUF_LEN, &nread) == -1 ||
+            qmp_reply_return(ks->buf, nread, &arr, &alen) == -1) {
+                return -1;
+        }
+
+        while (json_array_next(arr, alen, &pos, &elem, &elen) == 1) {
+                if (json_get_member(elem, elen, "provider", &val,
+                                    &vlen) == -1 ||
+                    !json_string_eq(val, vlen, "kvm") ||
+                    json_get_member(elem, elen, "target", &val, &vlen) == -1) {
+                        continue;
+                }
+
+                if (json_string_eq(val, vlen, ks->vm.target))
+                        kvmstats_parse_schema(&ks->vm, elem, elen);
+                else if (json_string_eq(val, vlen, ks->vcpu.target))
+                        kvmstats_parse_schema(&ks->vcpu, elem, elen);
+        }
+
+        kvmstats_table_setup(&ks->vm);
+        kvmstats_table_setup(&ks->vcpu);
+
+        return ks->vm.ncols + ks->vcpu.ncols ? 0 : -1;
+}
+
+/* the schema lists the counters in the order query-stats reports them */
+static int
+kvmstats_column(const struct kvmstats_table *t, unsigned int hint,
+                const char *val, size_t vlen)
+{
+        unsigned int i;
+
+        if (hint < t->ncols && json_string_eq(val, vlen, t->names[hint]))
+                return hint;
+
+        for (i = 0; i < t->ncols; i++) {
+                if (json_string_eq(val, vlen, t->names[i]))
+                        return i;
+        }
+
+        return -1;
+}
+
+static void
+kvmstats_grow(struct kvmstats_table *t, unsigned int rows)
+{
+        size_t cells;
+
+        if (rows <= t->size)
+                return;
+
+        t->size = t->size ? t->size * 2 : 8;
+        if (t->size < rows)
+                t->size = rows;
+
+        cells = (size_t) t->size * t->stride;
+        t->paths = xrealloc(t->paths, t->size * KVMSTATS_PATH_LEN);
+        t->cur = xrealloc(t->cur, cells * sizeof(uint64_t));
+        t->prev = xrealloc(t->prev, cells * sizeof(uint64_t));
+        t->rate = xrealloc(t->rate, cells * sizeof(double));
+}
+
+/*
+ * {"provider": "kvm", "qom-path": "/machine/unattached/device[0]",
+ *  "stats": [{"name": "exits", "value": 1234}, ...]}
+ * the VM wide result has no qom-path
+ */
+static int
+kvmstats_parse_row(struct kvmstats_table *t, unsigned int row,
+                   const char *obj, size_t len)
+{
+        uint64_t *cells = t->cur + (size_t) row * t->stride;
+        const char *stats, *stat, *val, *path;
+        size_t slen, len2, vlen, plen, pos = 0;
+        unsigned int i = 0;
+        int changed = 0, col;
+
+        if (json_get_member(obj, len, "qom-path", &path, &plen) == -1 ||
+            plen < 2) {
+                path = "\"\"";
+                plen = 2;
+        }
+
+        if (row >= t->rows || !json_string_eq(path, plen, t->paths[row])) {
+                plen -= 2;
+                if (plen >= KVMSTATS_PATH_LEN)
+                        plen = KVMSTATS_PATH_LEN - 1;
+                memcpy(t->paths[row], path + 1, plen);
+                t->paths[row][plen] = '\0';
+                changed = 1;
+        }
+
+        memset(cells, 0, t->stride * sizeof(uint64_t));
+
+        if (json_get_member(obj, len, "stats", &stats, &slen) == -1)
+                return changed;
+
+        while (json_array_next(stats, slen, &pos, &stat, &len2) == 1) {
+                if (json_get_member(stat, len2, "name", &val, &vlen) == -1)
+                        continue;
+                col = kvmstats_column(t, i++, val, vlen);
+                if (col == -1 ||
+                    json_get_member(stat, len2, "value", &val, &vlen) == -1) {
+                        continue;
+                }
+                cells[col] = json_to_u64(val, vlen);
+        }
+
+        return changed;
+}
+
+/*
+ * rate = (cur - prev) / interval for counters, cur for gauges, over every
+ * cell of the matrix; a counter that went backwards gives 0
+ */
+static void
+kvmstats_delta(struct kvmstats_table *t)
+{
+        size_t i, cells = (size_t) t->rows * t->stride;
+        unsigned int j = 0;
+
+        for (i = 0; i < cells; i += KVMSTATS_LANES) {
+                kvmstats_u64v cur = *(const kvmstats_u64v *) &t->cur[i];
+                kvmstats_u64v prev = *(const kvmstats_u64v *) &t->prev[i];
+                kvmstats_u64v mask = *(const kvmstats_u64v *)
+                                     &t->cumulative[j];
+                kvmstats_f64v scale = *(const kvmstats_f64v *) &t->scale[j];
+                kvmstats_u64v d;
+
+                d = (cur - prev) & (kvmstats_u64v) (cur >= prev);
+                d = (d & mask) | (cur & ~mask);
+
+                *(kvmstats_f64v *) &t->rate[i] =
+                        __builtin_convertvector((kvmstats_i64v) d,
+                                                kvmstats_f64v) * scale;
+
+                j += KVMSTATS_LANES;
+                if (j == t->stride)
+                        j = 0;
+        }
+}
+
+static int
+kvmstats_sample_table(struct kvmstats_table *t, const struct qmp_conn *qmpc,
+                      char *buf)
+{
+        const char *arr, *elem, *val;
+        size_t nread, alen, elen, vlen, pos = 0;
+        unsigned int row = 0, i;
+        uint64_t *tmp;
+        double inv;
+        int changed = 0, r;
+
+        if (t->ncols == 0)
+                return 0;
+
+        /* rates need fresh counters, never a cached reply */
+        if (qmp_execute_uncached(qmpc, t->cmd, buf, KVMSTATS_BUF_LEN,
+                                 &nread) == -1) {
+                return -1;
+        }
+        t->cur_ns = xclock_ns();
+
+        if (qmp_reply_return(buf, nread, &arr, &alen) == -1) {
+                return -1;
+        }
+
+        while ((r = json_array_next(arr, alen, &pos, &elem, &elen)) == 1) {
+                if (json_get_member(elem, elen, "provider", &val,
+                                    &vlen) == -1 ||
+                    !json_string_eq(val, vlen, "kvm")) {
+                        continue;
+                }
+
+                kvmstats_grow(t, row + 1);
+                changed |= kvmstats_parse_row(t, row++, elem, elen);
+        }
+
+        if (r == -1) {
+                return -1;
+        }
+
+        /* vCPUs came or went, start over */
+        if (row != t->rows)
+                changed = 1;
+        t->rows = row;
+
+        t->valid = 0;
+        if (!changed && t->prev_ns && t->cur_ns > t->prev_ns) {
+                inv = 1e9 / (t->cur_ns - t->prev_ns);
+                for (i = 0; i < t->ncols; i++)
+                        t->scale[i] = t->cumulative[i] ? inv : 1.0;
+
+                kvmstats_delta(t);
+                t->valid = 1;
+        }
+
+        tmp = t->prev;
+        t->prev = t->cur;
+        t->cur = tmp;
+        t->prev_ns = t->cur_ns;
+
+        return 0;
+}
+
+int
+kvmstats_sample(struct kvmstats *ks, const struct qmp_conn *qmpc)
+{
+        if (kvmstats_sample_table(&ks->vm, qmpc, ks->buf) == -1 ||
+            kvmstats_sample_table(&ks->vcpu, qmpc, ks->buf) == -1) {
+                return -1;
+        }
+
+        return 0;
+}
+
+static void
+kvmstats_dump_table(const struct kvmstats_table *t)
+{
+        unsigned int row, i;
+
+        if (!t->valid)
+                return;
+
+        for (row = 0; row < t->rows; row++) {
+                const double *rate = t->rate + (size_t) row * t->stride;
+
+                dprintf("%s", t->paths[row][0] ? t->paths[row] : t->target);
+                for (i = 0; i < t->ncols; i++) {
+                        if (rate[i] == 0.0)
+                                continue;
+                        dprintf(" %s=%.0f%s", t->names[i], rate[i],
+                                t->cumulative[i] ? "/s" : "");
+                }
+                dprintf("\n");
+        }
+}
+
+void
+kvmstats_dump(const struct kvmstats *ks)
+{
+        kvmstats_dump_table(&ks->vm);
+        kvmstats_dump_table(&ks->vcpu);
+}
+
+static void
+kvmstats_table_release(struct kvmstats_table *t)
+{
+        xfree(t->names);
+        xfree(t->cumulative);
+        xfree(t->scale);
+        xfree(t->paths);
+        xfree(t->cur);
+        xfree(t->prev);
+        xfree(t->rate);
+}
+
+void
+kvmstats_release(struct kvmstats *ks)
+{
+        kvmstats_table_release(&ks->vm);
+        kvmstats_table_release(&ks->vcpu);
+        xfree(ks->buf);
+        memset(ks, 0, sizeof(struct kvmstats));
+}
@@ -0,0 +1,77 @@
+#ifndef __KVMSTATS_H
+#define __KVMSTATS_H
+
+/*
+ * KVM counters from query-stats. The names are learned once from
+ * query-stats-schemas and given a fixed column, a sample is then a dense
+ * matrix of one row per vCPU (a single row for the VM wide counters), so
+ * the rates of all vCPUs and counters come out of one pass over two
+ * matrices.
+ */
+
+/* 64 bit lanes per vector, rows are padded to a multiple of it */
+#define KVMSTATS_LANES          (4)
+#define KVMSTATS_NAME_LEN       (64)
+#define KVMSTATS_PATH_LEN       (64)
+/* the reply for a few hundred vCPUs */
+#define KVMSTATS_BUF_LEN        (1024 * 1024)
+
+#define QMP_COMMAND_QUERY_STATS_SCHEMAS \
+        "{\"execute\": \"query-stats-schemas\", " \
+        "\"arguments\": {\"provider\": \"kvm\"}}"
+#define QMP_COMMAND_QUERY_STATS_VM \
+        "{\"execute\": \"query-stats\", \"arguments\": {\"target\": \"vm\"}}"
+#define QMP_COMMAND_QUERY_STATS_VCPU \
+        "{\"execute\": \"query-stats\", \"arguments\": {\"target\": \"vcpu\"}}"
+
+struct kvmstats_table {
+        const char *target;
+        const char *cmd;
+        /* columns, 'stride' of them per row, the padding is never set */
+        unsigned int ncols, stride;
+        char (*names)[KVMSTATS_NAME_LEN];
+        /* all ones in the columns of cumulative counters, 0 for gauges */
+        uint64_t *cumulative;
+        /* 1 / interval for cumulative counters, 1 for gauges */
+        double *scale;
+        /* rows, the qom-path of each vCPU */
+        unsigned int rows, size;
+        char (*paths)[KVMSTATS_PATH_LEN];
+        /* rows * stride each */
+        uint64_t *cur, *prev;
+        double *rate;
+        uint64_t cur_ns, prev_ns;
+        /* 'rate' holds the last interval */
+        int valid;
+};
+
+struct kvmstats {
+        struct kvmstats_table vm, vcpu;
+        /* reply buffer, reused by every sample */
+        char *buf;
+};
+
+/**
+ * @brief learn the counters of the qemu behind 'qmpc'
+ * @retval 0 on success, -1 if qemu or KVM has no query-stats
+ */
+extern int
+kvmstats_init(struct kvmstats *ks, const struct qmp_conn *qmpc);
+
+/**
+ * @brief read every counter once and derive the rates of the interval
+ * @retval 0 on success, -1 if qemu did not answer
+ */
+extern int
+kvmstats_sample(struct kvmstats *ks, const struct qmp_conn *qmpc);
+
+/**
+ * @brief print the non zero rates and gauges of the last interval
+ */
+extern void
+kvmstats_dump(const struct kvmstats *ks);
+
+extern void
+kvmstats_release(struct kvmstats *ks);
+
+#endif /* __KVMSTATS_H */
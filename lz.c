@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "lz.h"
+
+#define LZ_HASH_SIZE            (1 << LZ_HASH_LOG)
+/* a lookup more per 2^LZ_SKIP_SHIFT bytes without a match */
+#define LZ_SKIP_SHIFT           (6)
+
+static inline uint32_t
+lz_read32(const uint8_t *p)
+{
+        uint32_t v;
+
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+static inline uint32_t
+lz_hash(uint32_t v)
+{
+        return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+/* a length of 15 or more, past the 15 in the token */
+static uint8_t *
+lz_put_len(uint8_t *op, size_t n)
+{
+        for (; n >= 255; n -= 255)
+                *op++ = 255;
+        *op++ = n;
+        return op;
+}
+
+/*
+ * one sequence, the literals from 'lit' and, unless 'mlen' is 0, the
+ * match; NULL if 'end' would be overrun
+ */
+static uint8_t *
+lz_put_seq(uint8_t *op, const uint8_t *end, const uint8_t *lit,
+           size_t llen, size_t off, size_t mlen)
+{
+        uint8_t *token;
+
+        /* token, lengths, literals and offset */
+        if ((size_t) (end - op) < llen + llen / 255 + mlen / 255 + 5)
+                return NULL;
+        token = op++;
+
+        if (llen >= 15) {
+                *token = 15 << 4;
+                op = lz_put_len(op, llen - 15);
+        } else {
+                *token = llen << 4;
+        }
+
+        memcpy(op, lit, llen);
+        op += llen;
+
+        if (mlen == 0)
+                return op;
+
+        *op++ = off & 0xff;
+        *op++ = off >> 8;
+
+        mlen -= LZ_MIN_MATCH;
+        if (mlen >= 15) {
+                *token |= 15;
+                op = lz_put_len(op, mlen - 15);
+        } else {
+                *token |= mlen;
+        }
+
+        return op;
+}
+
+size_t
+lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+        uint32_t table[LZ_HASH_SIZE];
+        const uint8_t *end = dst + cap;
+        uint8_t *op = dst;
+        size_t pos = 0, anchor = 0, limit;
+
+        if (len > LZ_MFLIMIT) {
+                memset(table, 0, sizeof(table));
+                limit = len - LZ_MFLIMIT;
+
+                while (pos < limit) {
+                        uint32_t seq = lz_read32(src + pos);
+                        uint32_t h = lz_hash(seq);
+                        size_t cand = table[h], mlen;
+
+                        table[h] = pos;
+                        if (cand >= pos || pos - cand > LZ_MAX_OFFSET ||
+                            lz_read32(src + cand) != seq) {
+                                pos += 1 + ((pos - anchor) >> LZ_SKIP_SHIFT);
+                                continue;
+                        }
+
+                        /* the match may have started before */
+                        while (pos > anchor && cand > 0 &&
+                               src[pos - 1] == src[cand - 1]) {
+                                pos--;
+                                cand--;
+                        }
+
+                        mlen = LZ_MIN_MATCH;
+                        while (pos + mlen < len - LZ_LAST_LITERALS &&
+                               src[pos + mlen] == src[cand + mlen])
+                                mlen++;
+
+                        op = lz_put_seq(op, end, src + anchor, pos - anchor,
+                                        pos - cand, mlen);
+                        if (!op)
+                                return 0;
+
+                        pos += mlen;
+                        anchor = pos;
+                }
+        }
+
+        op = lz_put_seq(op, end, src + anchor, len - anchor, 0, 0);
+        return op ? (size_t) (op - dst) : 0;
+}
+
+ssize_t
+lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+        const uint8_t *ip = src, *iend = src + len;
+        uint8_t *op = dst, *oend = dst + cap;
+
+        while (ip < iend) {
+                uint8_t token = *ip++;
+                size_t llen = token >> 4, mlen = token & 15, off, i;
+                uint8_t b;
+
+                if (llen == 15) {
+                        do {
+                                if (ip == iend)
+                                        return -1;
+                                b = *ip++;
+                                llen += b;
+                        } while (b == 255);
+                }
+
+                if (llen > (size_t) (iend - ip) || llen > (size_t) (oend - op))
+                        return -1;
+                memcpy(op, ip, llen);
+                op += llen;
+                ip += llen;
+
+                /* the last sequence has no match */
+                if (ip == iend)
+                        break;
+
+                if (iend - ip < 2)
+                        return -1;
+                off = ip[0] | ip[1] << 8;
+                ip += 2;
+                if (off == 0 || off > (size_t) (op - dst))
+                        return -1;
+
+                if (mlen == 15) {
+                        do {
+                                if (ip == iend)
+                                        return -1;
+                                b = *ip++;
+                                mlen += b;
+                        } while (b == 255);
+                }
+                mlen += LZ_MIN_MATCH;
+                if (mlen > (size_t) (oend - op))
+                        return -1;
+
+                /* an overlapping match repeats what it just wrote */
+                if (off >= mlen) {
+                        memcpy(op, op - off, mlen);
+                } else {
+                        for (i = 0; i < mlen; i++)
+                                op[i] = op[i - off];
+                }
+                op += mlen;
+        }
+
+        return op - dst;
+}
@@ -0,0 +1,42 @@
+#ifndef __LZ_H
+#define __LZ_H
+
+/*
+ * LZ77 compression in the LZ4 block format: a block is a run of
+ * sequences, each a token (literal length << 4 | match length - 4),
+ * the literals, and a 16 bit offset back to where the match is; lengths
+ * of 15 and up go on in extra bytes of 255 and a remainder. The last
+ * sequence has literals only, and the last LZ_LAST_LITERALS bytes of a
+ * block are always literals, as LZ4 has it. Matches are found greedily
+ * through a hash of the next 4 bytes, skipping faster over data that does
+ * not compress; no entropy coding, speed over ratio. Self-contained, so
+ * that traces compress without a library to link.
+ */
+
+#define LZ_MIN_MATCH            (4)
+#define LZ_MAX_OFFSET           (65535)
+#define LZ_LAST_LITERALS        (5)
+/* a match starts at least this far from the end of the block */
+#define LZ_MFLIMIT              (12)
+/* entries of the match finder, 16K of stack */
+#define LZ_HASH_LOG             (12)
+
+/* worst case of a block of 'n' bytes that does not compress */
+#define LZ_BOUND(n)             ((n) + (n) / 255 + 16)
+
+/**
+ * @brief compress 'len' bytes of 'src' into at most 'cap' bytes of 'dst'
+ * @retval the compressed length, 0 if it does not fit
+ */
+extern size_t
+lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+/**
+ * @brief decompress a whole block, every offset and length checked
+ * @retval the decompressed length, -1 if the block is corrupt or does not
+ * fit in 'cap' bytes
+ */
+extern ssize_t
+lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+#endif /* __LZ_H */
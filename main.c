@@ -2,55 +2,263 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "log.h"
 #include "xutil.h"
+#include "regs.h"
 #include "qmp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "hostacct.h"
+#include "governor.h"
+#include "schema.h"
+#include "blkstats.h"
+#include "kvmstats.h"
+#include "exporter.h"
+#include "trigger.h"
+#include "collector.h"
+#include "record.h"
+#include "scan.h"
+#include "zio.h"
+#include "discover.h"
+#include "uring.h"
 
 /* create a new connection each time we talk to qemu */
 #define HAS_NEW_CONN    (1 << 1)
 #define HAS_PATH        (1 << 2)
+/* serve other QMP clients over our connection */
+#define HAS_PROXY       (1 << 3)
+/* sample the vCPU threads from the host side */
+#define HAS_HOSTACCT    (1 << 4)
+/* sample many VMs within a monitor time budget */
+#define HAS_GOVERNOR    (1 << 5)
+/* poll the block devices */
+#define HAS_BLKSTATS    (1 << 6)
+/* poll the KVM counters */
+#define HAS_KVMSTATS    (1 << 7)
+/* serve OpenMetrics over HTTP */
+#define HAS_EXPORTER    (1 << 8)
+/* watch the registers of every vCPU for conditions */
+#define HAS_TRIGGERS    (1 << 9)
+/* sample every VM from a pool of threads */
+#define HAS_COLLECTOR   (1 << 10)
+/* search a dump of guest memory, pulled with pmemsave if need be */
+#define HAS_SCAN        (1 << 11)
+/* compress the capture and the samples of the worker pool */
+#define HAS_COMPRESS    (1 << 12)
+/* VMs join the worker pool as their sockets show up in -d directories */
+#define HAS_DISCOVER    (1 << 13)
 
 uint32_t flags = 0x0;
 
+/* the modes exit from wherever they end, a compressed capture is closed then */
+static struct qmp_recorder *recorder;
+
+static void
+close_recorder(void)
+{
+        qmp_record_close(recorder);
+        recorder = NULL;
+}
+
 static void
 help(void)
 {
         dprintf("v -- VCPUs\n");
         dprintf("r -- Registers\n");
+        dprintf("R -- Registers of all vCPUs\n");
+        dprintf("s -- Cache statistics\n");
+        dprintf("p -- Probe, out of band if possible\n");
+        dprintf("S -- Snapshot of all vCPUs, the guest is paused meanwhile\n");
 }
 
 static void
 print_help(void)
 {
-        dprintf("qemu-qmp [-c] -p /path/to/qmp-sock\n");
+        dprintf("qemu-qmp [-A top] [-c] [-C ttl_ms] [-d /path/to/dir] [-D interval_ms] [-E [host:]port] [-F prio] [-G vm_pct[:host_pct]] [-H interval_ms] [-K interval_ms] [-M /path/to/dump[@addr[+size]]] [-m pattern] [-P cpu] [-R /path/to/capture] [-T transport] [-t deadline_ms] [-U depth] [-W condition] [-w workers[:interval_ms]] [-x /path/to/proxy-sock] [-Z] [-z /path/to/trace] -p /path/to/qmp-sock [-p ...]\n");
+        dprintf("\t-A -- with -w, attribute the samples of every vCPU to guest processes by CR3 and report the top ones of each VM\n");
         dprintf("\t-c -- create a new connection\n");
-        dprintf("\t-p -- path to UNIX socket\n");
+        dprintf("\t-C -- cache read-only queries for ttl_ms\n");
+        dprintf("\t-d -- with -w, also sample every QMP socket that shows up in dir, until it goes away\n");
+        dprintf("\t-D -- print disk IOPS, throughput and latency every interval_ms\n");
+        dprintf("\t-E -- export every -p VM as OpenMetrics on http://host:port/metrics\n");
+        dprintf("\t-F -- with -w, run the workers SCHED_FIFO at prio\n");
+        dprintf("\t-G -- sample every -p VM, keeping its monitor busy at most vm_pct%%, all of them host_pct%%\n");
+        dprintf("\t-H -- sample vCPU threads from /proc every interval_ms\n");
+        dprintf("\t-K -- print KVM exit, halt and interrupt rates every interval_ms\n");
+        dprintf("\t-M -- search the dump, its first byte at guest physical addr; with +size, have the first -p VM write it first\n");
+        dprintf("\t-m -- pattern for -M, hex if 0x..., text otherwise\n");
+        dprintf("\t-P -- with -w, pin worker i to host CPU cpu + i\n");
+        dprintf("\t-p -- path to UNIX socket, or tcp:host:port\n");
+        dprintf("\t-T -- transport, 'poll' (default) or 'uring' (not with -w or -x)\n");
+        dprintf("\t-t -- with -w, quarantine a VM whose command takes longer, and reconnect with backoff\n");
+        dprintf("\t-U -- with -w, add the guest call stack of vCPU 0, up to depth frames, to each sample\n");
+        dprintf("\t-W -- report every vCPU of every -p VM whose registers meet condition, e.g.\n"
+                "\t      'rip in 0xffffffff81000000..0xffffffff81200000 && cpl == 0' or 'rflags & 0x200 == 0 for 10'\n");
+        dprintf("\t-w -- sample every -p VM from workers threads every interval_ms, one line per sample\n");
+        dprintf("\t-x -- run as proxy, serving QMP clients on this UNIX socket\n");
+        dprintf("\t-Z -- compress the -R capture and the -w samples, on a thread of their own\n");
+        dprintf("\t-z -- decompress a -Z trace to stdout\n");
         exit(EXIT_FAILURE);
 }
 
 static void
 process_command(int act, const struct qmp_conn *qmpc)
 {
+        uint64_t rtt;
+        int r;
 
         switch (act) {
         case 'r':
                 if (qmp_show_regs(qmpc) == -1)
                         dprintf("Failed to get registers\n");
         break;
+        case 'R':
+                if (qmp_show_regs_all(qmpc) == -1)
+                        dprintf("Failed to get registers\n");
+        break;
         case 'v':
                 if (qmp_show_vcpus(qmpc) == -1)
                         dprintf("Failed to get cpus\n");
         break;
+        case 'p':
+                if ((r = qmp_probe(qmpc, &rtt)) == -1)
+                        dprintf("Probe failed\n");
+                else if (r == 0)
+                        dprintf("Probe unavailable, qemu runs no probe out "
+                                "of band\n");
+                else
+                        dprintf("Answered out of band, %.1fus\n",
+                                rtt / 1e3);
+        break;
+        case 'S':
+                if (qmp_show_snapshot(qmpc) == -1)
+                        dprintf("Failed to take a snapshot\n");
+        break;
+        case 's':
+                if (qmpc->cache)
+                        qmp_cache_dump_stats(qmpc->cache);
+        break;
         case 'h':
                 help();
         break;
         }
 }
 
+/*
+ * the monitor is asked for the vCPU threads only when they may have
+ * changed, every sample in between comes from /proc
+ */
+static void
+host_sampler(const struct qmp_conn *qmpc, unsigned int interval_ms)
+{
+        struct hostacct ha;
+        struct vcpus vcpus;
+        uint64_t last_sync = 0;
+        unsigned int samples = 0;
+
+        memset(&ha, 0, sizeof(struct hostacct));
+
+        for (;;) {
+                uint64_t now = xclock_ns();
+
+                if (ha.count == 0 || ha.stale ||
+                    now - last_sync >= HOSTACCT_RESYNC_MS * 1000000ULL) {
+                        if (qmp_query_vcpu_threads(qmpc, &vcpus) == -1) {
+                                dprintf("Failed to get cpus\n");
+                                break;
+                        }
+
+                        switch (hostacct_sync(&ha, qmpc->pid, &vcpus)) {
+                        case -1:
+                                qmp_release_vcpus(&vcpus);
+                                hostacct_release(&ha);
+                                return;
+                        case 1:
+                                samples = 0;
+                        break;
+                        }
+
+                        qmp_release_vcpus(&vcpus);
+                        last_sync = now;
+                }
+
+                if (hostacct_sample(&ha) == 0 && samples++ > 0) {
+                        hostacct_dump(&ha);
+                }
+
+                usleep(interval_ms * 1000);
+        }
+
+        hostacct_release(&ha);
+}
+
+static void
+blk_sampler(const struct qmp_conn *qmpc, unsigned int interval_ms)
+{
+        struct blkstats bs;
+
+        memset(&bs, 0, sizeof(struct blkstats));
+
+        for (;;) {
+                if (blkstats_sample(&bs, qmpc) == -1) {
+                        dprintf("Failed to get block statistics\n");
+                        break;
+                }
+
+                blkstats_dump(&bs);
+                usleep(interval_ms * 1000);
+        }
+
+        blkstats_release(&bs);
+}
+
+static void
+kvm_sampler(const struct qmp_conn *qmpc, unsigned int interval_ms)
+{
+        struct kvmstats ks;
+
+        if (kvmstats_init(&ks, qmpc) == -1) {
+                dprintf("No KVM statistics on '%s'\n", qmpc->qmp_sock_path);
+                kvmstats_release(&ks);
+                return;
+        }
+
+        for (;;) {
+                if (kvmstats_sample(&ks, qmpc) == -1) {
+                        dprintf("Failed to get KVM statistics\n");
+                        break;
+                }
+
+                kvmstats_dump(&ks);
+                usleep(interval_ms * 1000);
+        }
+
+        kvmstats_release(&ks);
+}
+
+static int
+gov_sample_regs(const struct qmp_conn *qmpc, void *arg)
+{
+        struct qregs regs;
+        struct vcpus vcpus;
+
+        (void) arg;
+
+        if (qmp_query_regs(qmpc, &regs) == -1 ||
+            qmp_query_vcpus(qmpc, &vcpus) == -1) {
+                return -1;
+        }
+
+        qmp_release_vcpus(&vcpus);
+        return 0;
+}
+
 static int
 qemu_qmp_conn(struct qmp_conn *qmpc)
 {
@@ -67,29 +275,617 @@ qemu_qmp_conn(struct qmp_conn *qmpc)
         r = qmp_negotiate(qmpc);
         if (r == -1) {
                 dprintf("Failed to negotiate qmp commands\n");
+                qmp_close_conn(qmpc);
                 goto err_exit;
         }
 
+        /* cheap after the first time, falls back to HMP if unknown */
+        qmpc->schema = qmp_schema_get(qmpc);
+        qmpc->arch = qmp_query_arch(qmpc);
+
         return 0;
 
 err_exit:
+        /* closed already, or never open */
+        qmpc->fd = -1;
         return -1;
 }
 
+static void
+governed_sampler(const struct qmp_conn *tmpl, char **paths,
+                 unsigned int npaths, double vm_pct, double host_pct)
+{
+        struct qmp_conn *conns = xcalloc(npaths, sizeof(struct qmp_conn));
+        struct governor g;
+        unsigned int i;
+
+        gov_init(&g, vm_pct, host_pct, gov_sample_regs, NULL);
+
+        for (i = 0; i < npaths; i++) {
+                conns[i].qmp_sock_path = paths[i];
+                conns[i].transport = tmpl->transport;
+                conns[i].recorder = tmpl->recorder;
+                conns[i].cache = tmpl->cache;
+
+                if (qemu_qmp_conn(&conns[i]) == -1) {
+                        dprintf("Skipping '%s'\n", paths[i]);
+                        continue;
+                }
+                gov_add(&g, &conns[i]);
+        }
+
+        if (g.count) {
+                gov_run(&g, GOV_REPORT_MS);
+        }
+
+        gov_release(&g);
+        for (i = 0; i < npaths; i++) {
+                if (conns[i].fd > 0)
+                        qmp_close_conn(&conns[i]);
+        }
+        xfree(conns);
+}
+
+static void
+exporting_sampler(const struct qmp_conn *tmpl, char **paths,
+                  unsigned int npaths, const char *addr)
+{
+        struct qmp_conn *conns = xcalloc(npaths, sizeof(struct qmp_conn));
+        struct exporter e;
+        unsigned int i;
+
+        if (exporter_init(&e, addr) == -1) {
+                xfree(conns);
+                return;
+        }
+
+        for (i = 0; i < npaths; i++) {
+                conns[i].qmp_sock_path = paths[i];
+                conns[i].transport = tmpl->transport;
+                conns[i].recorder = tmpl->recorder;
+                conns[i].cache = tmpl->cache;
+
+                if (qemu_qmp_conn(&conns[i]) == -1) {
+                        dprintf("Skipping '%s'\n", paths[i]);
+                        continue;
+                }
+                exporter_add(&e, &conns[i]);
+        }
+
+        if (e.count) {
+                dprintf("Exporting %u VMs on '%s'\n", e.count, addr);
+                exporter_run(&e);
+        }
+
+        exporter_release(&e);
+        for (i = 0; i < npaths; i++) {
+                if (conns[i].fd > 0)
+                        qmp_close_conn(&conns[i]);
+        }
+        xfree(conns);
+}
+
+struct coll_watch {
+        const struct qmp_conn *tmpl;
+        struct collector *c;
+        struct discover *d;
+};
+
+static void
+coll_watch_gone(struct qmp_conn *qmpc, void *arg)
+{
+        (void) arg;
+
+        /* not if it was quarantined and never came back */
+        if (qmpc->fd != -1)
+                qmp_close_conn(qmpc);
+        xfree(qmpc->qmp_sock_path);
+        xfree(qmpc);
+}
+
+/* from the writer: a socket still there may have a qemu answering anew */
+static void
+coll_watch_dropped(struct qmp_conn *qmpc, void *arg)
+{
+        struct coll_watch *cw = arg;
+
+        discover_requeue(cw->d, qmpc->qmp_sock_path);
+}
+
+/* from the discovery thread, or before it starts */
+static int
+coll_watch_added(const char *path, void *arg)
+{
+        struct coll_watch *cw = arg;
+        struct qmp_conn *qmpc = xcalloc(1, sizeof(struct qmp_conn));
+
+        qmpc->qmp_sock_path = strdup(path);
+        qmpc->transport = cw->tmpl->transport;
+        qmpc->recorder = cw->tmpl->recorder;
+
+        if (qemu_qmp_conn(qmpc) == -1) {
+                xfree(qmpc->qmp_sock_path);
+                xfree(qmpc);
+                return -1;
+        }
+
+        /* taken all the same, it is not to be offered again */
+        if (coll_add(cw->c, qmpc) == -1) {
+                coll_watch_gone(qmpc, NULL);
+                return 0;
+        }
+
+        dprintf("Sampling '%s'\n", path);
+        return 0;
+}
+
+static void
+coll_watch_removed(const char *path, void *arg)
+{
+        struct coll_watch *cw = arg;
+
+        if (coll_remove(cw->c, path) == 0)
+                dprintf("'%s' went away\n", path);
+}
+
+static void *
+coll_watch_run(void *arg)
+{
+        discover_run(arg);
+        return NULL;
+}
+
+/*
+ * with -d, every VM is allocated on its own and the collector hands it
+ * back once let go, -p ones included
+ */
+static void
+collecting_watcher(const struct qmp_conn *tmpl, struct collector *c,
+                   char **paths, unsigned int npaths, char **dirs,
+                   unsigned int ndirs)
+{
+        struct discover d;
+        struct coll_watch cw = { .tmpl = tmpl, .c = c, .d = &d };
+        pthread_t thread;
+        unsigned int i;
+
+        c->watching = 1;
+        c->gone = coll_watch_gone;
+        c->dropped = coll_watch_dropped;
+        c->arg = &cw;
+
+        if (discover_init(&d, coll_watch_added, coll_watch_removed,
+                          &cw) == -1)
+                return;
+
+        for (i = 0; i < npaths; i++) {
+                if (coll_watch_added(paths[i], &cw) == -1)
+                        dprintf("Skipping '%s'\n", paths[i]);
+        }
+
+        for (i = 0; i < ndirs; i++) {
+                if (discover_add_dir(&d, dirs[i]) == -1)
+                        goto out;
+        }
+
+        /* from now on VMs are only added and removed by the thread */
+        if (pthread_create(&thread, NULL, coll_watch_run, &d) != 0) {
+                dprintf("Cannot start watching\n");
+                goto out;
+        }
+
+        if (flags & HAS_COMPRESS)
+                c->zw = zio_writer_open(STDOUT_FILENO);
+        coll_run(c);
+        zio_writer_close(c->zw);
+
+        discover_stop(&d);
+        pthread_join(thread, NULL);
+out:
+        discover_release(&d);
+}
+
+static void
+collecting_sampler(const struct qmp_conn *tmpl, char **paths,
+                   unsigned int npaths, char **dirs, unsigned int ndirs,
+                   unsigned int nworkers, unsigned int interval_ms,
+                   unsigned int timeout_ms, unsigned int depth, int cpu,
+                   int prio, unsigned int top)
+{
+        struct qmp_conn *conns;
+        struct collector c;
+        unsigned int i;
+
+        if (coll_init(&c, nworkers, interval_ms, STDOUT_FILENO,
+                      depth) == -1) {
+                return;
+        }
+        c.cpu = cpu;
+        c.prio = prio;
+        c.timeout_ms = timeout_ms;
+        c.top = top;
+
+        if (ndirs) {
+                collecting_watcher(tmpl, &c, paths, npaths, dirs, ndirs);
+                coll_release(&c);
+                return;
+        }
+
+        conns = xcalloc(npaths, sizeof(struct qmp_conn));
+        for (i = 0; i < npaths; i++) {
+                conns[i].qmp_sock_path = paths[i];
+                conns[i].transport = tmpl->transport;
+                conns[i].recorder = tmpl->recorder;
+                /* the cache is not shared between threads */
+
+                if (qemu_qmp_conn(&conns[i]) == -1) {
+                        dprintf("Skipping '%s'\n", paths[i]);
+                        continue;
+                }
+                coll_add(&c, &conns[i]);
+        }
+
+        if (c.count) {
+                if (flags & HAS_COMPRESS)
+                        c.zw = zio_writer_open(STDOUT_FILENO);
+                coll_run(&c);
+                zio_writer_close(c.zw);
+        }
+
+        coll_release(&c);
+        for (i = 0; i < npaths; i++) {
+                if (conns[i].fd > 0)
+                        qmp_close_conn(&conns[i]);
+        }
+        xfree(conns);
+}
+
+struct watch {
+        struct qmp_conn **conns;
+        unsigned int n;
+        /* the first slot of each VM in the batch */
+        unsigned int *first;
+        const struct trig_set *ts;
+};
+
+static void
+watch_fire(const struct trig_record *rec, const struct qregs *regs, void *arg)
+{
+        const struct watch *w = arg;
+        unsigned int i = w->n - 1;
+
+        while (i > 0 && w->first[i] > rec->slot)
+                i--;
+
+        if (regs->mode != X86 && regs->mode != X64) {
+                dprintf("'%s' on %s CPU#%u: PC=0x%.16lx SP=0x%.16lx\n",
+                        w->ts->trigs[rec->trigger].expr,
+                        w->conns[i]->qmp_sock_path, rec->slot - w->first[i],
+                        regs->pc, regs->sp);
+                return;
+        }
+
+        dprintf("'%s' on %s CPU#%u: RIP=0x%.16lx CR3=0x%.16lx CPL=%lu\n",
+                w->ts->trigs[rec->trigger].expr, w->conns[i]->qmp_sock_path,
+                rec->slot - w->first[i], regs->rip, regs->cr3, regs->cpl);
+}
+
+static void
+watching_sampler(const struct qmp_conn *tmpl, char **paths,
+                 unsigned int npaths, char **conds, unsigned int nconds)
+{
+        struct qmp_conn *conns = xcalloc(npaths, sizeof(struct qmp_conn));
+        struct qregs *regs = NULL;
+        struct trig_set ts;
+        struct watch w;
+        char **bufs;
+        size_t *lens;
+        unsigned int i, nregs;
+
+        memset(&w, 0, sizeof(struct watch));
+        w.conns = xcalloc(npaths, sizeof(struct qmp_conn *));
+        w.first = xcalloc(npaths, sizeof(unsigned int));
+        w.ts = &ts;
+        trig_init(&ts, watch_fire, &w);
+
+        for (i = 0; i < nconds; i++) {
+                if (trig_add(&ts, conds[i]) == -1)
+                        goto out;
+        }
+
+        for (i = 0; i < npaths; i++) {
+                conns[i].qmp_sock_path = paths[i];
+                conns[i].transport = tmpl->transport;
+                conns[i].recorder = tmpl->recorder;
+
+                if (qemu_qmp_conn(&conns[i]) == -1) {
+                        dprintf("Skipping '%s'\n", paths[i]);
+                        continue;
+                }
+                w.conns[w.n++] = &conns[i];
+        }
+
+        bufs = xcalloc(w.n, sizeof(char *));
+        lens = xcalloc(w.n, sizeof(size_t));
+        for (i = 0; i < w.n; i++)
+                bufs[i] = xmalloc(QMP_SNAPSHOT_BUF_LEN);
+
+        while (w.n) {
+                /* every VM at once, then all of their vCPUs in one batch */
+                if (qmp_execute_all(w.conns, w.n, QMP_COMMAND_INFO_REGS_ALL,
+                                    bufs, QMP_SNAPSHOT_BUF_LEN - 1,
+                                    lens) == -1) {
+                        break;
+                }
+
+                nregs = 0;
+                for (i = 0; i < w.n; i++) {
+                        w.first[i] = nregs;
+                        if (lens[i] == 0)
+                                continue;
+                        bufs[i][lens[i]] = '\0';
+                        qmp_get_regs_all(w.conns[i]->arch, bufs[i], &regs,
+                                         &nregs);
+                }
+
+                trig_eval(&ts, regs, nregs);
+                usleep(TRIG_INTERVAL * 1000);
+        }
+
+        for (i = 0; i < w.n; i++)
+                xfree(bufs[i]);
+        xfree(bufs);
+        xfree(lens);
+out:
+        xfree(regs);
+        trig_release(&ts);
+        for (i = 0; i < npaths; i++) {
+                if (conns[i].fd > 0)
+                        qmp_close_conn(&conns[i]);
+        }
+        xfree(w.first);
+        xfree(w.conns);
+        xfree(conns);
+}
+
+/* "/path/to/dump[@addr[+size]]", split in place */
+static int
+scan_parse_spec(char *spec, uint64_t *addr, uint64_t *size)
+{
+        char *at = strrchr(spec, '@'), *plus, *end;
+
+        *addr = *size = 0;
+        if (!at)
+                return 0;
+
+        *at++ = '\0';
+        if ((plus = strchr(at, '+')) != NULL) {
+                *plus++ = '\0';
+                *size = strtoull(plus, &end, 0);
+                if (*end != '\0' || *size == 0)
+                        return -1;
+        }
+
+        *addr = strtoull(at, &end, 0);
+        return *end != '\0' ? -1 : 0;
+}
+
+static int
+memory_scanner(const struct qmp_conn *tmpl, char **paths,
+               unsigned int npaths, char *spec, char **pats,
+               unsigned int npats)
+{
+        struct qmp_conn conn;
+        struct scan_match *m;
+        struct scanner s;
+        uint64_t addr, size, wall;
+        size_t len;
+        ssize_t n, i;
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        unsigned int j;
+        int ret = -1;
+
+        if (scan_parse_spec(spec, &addr, &size) == -1) {
+                dprintf("scan: '%s' is not /path/to/dump[@addr[+size]]\n",
+                        spec);
+                return -1;
+        }
+
+        scan_init(&s);
+        for (j = 0; j < npats; j++) {
+                if (scan_add(&s, pats[j]) == -1)
+                        goto out;
+        }
+        if (s.count == 0) {
+                dprintf("scan: no -m pattern\n");
+                goto out;
+        }
+
+        if (size) {
+                if (npaths == 0) {
+                        dprintf("scan: a -p VM is needed to write the dump\n");
+                        goto out;
+                }
+
+                memset(&conn, 0, sizeof(struct qmp_conn));
+                conn.qmp_sock_path = paths[0];
+                conn.transport = tmpl->transport;
+                conn.recorder = tmpl->recorder;
+                if (qemu_qmp_conn(&conn) == -1 ||
+                    qmp_pmemsave(&conn, addr, size, spec) == -1) {
+                        if (conn.fd > 0)
+                                qmp_close_conn(&conn);
+                        goto out;
+                }
+                qmp_close_conn(&conn);
+        }
+
+        wall = xclock_ns();
+        n = scan_file(&s, spec, addr, ncpus > 0 ? ncpus : 1, &m, &len);
+        wall = xclock_ns() - wall;
+        if (n == -1)
+                goto out;
+
+        for (i = 0; i < n; i++)
+                printf("0x%.16lx %s\n", m[i].addr, s.pats[m[i].pattern].name);
+        fflush(stdout);
+
+        dprintf("scan: %zd matches in %zu bytes from 0x%.16lx, %.2f GB/s\n",
+                n, len, addr, len / (double) (wall ? wall : 1));
+        xfree(m);
+        ret = 0;
+out:
+        scan_release(&s);
+        return ret;
+}
+
+static int
+decompress_trace(const char *path)
+{
+        struct zio_reader zr;
+        char *buf = xmalloc(ZIO_BLOCK);
+        ssize_t n;
+        int fd;
+
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+                dprintf("Cannot open '%s'\n", path);
+                xfree(buf);
+                return -1;
+        }
+
+        if (zio_reader_open(&zr, fd) == -1) {
+                dprintf("'%s' is not a compressed trace\n", path);
+                n = -1;
+                goto out;
+        }
+
+        while ((n = zio_read(&zr, buf, ZIO_BLOCK)) > 0) {
+                if (xwrite(STDOUT_FILENO, buf, n) != (size_t) n) {
+                        n = -1;
+                        break;
+                }
+        }
+
+out:
+        zio_reader_close(&zr);
+        close(fd);
+        xfree(buf);
+        return n == -1 ? -1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
         struct qmp_conn qmpc;
         int act, c;
         struct stat st;
+        char *proxy_path = NULL, *export_addr = NULL, **paths = NULL;
+        char **conds = NULL, **pats = NULL, *scan_spec = NULL, **dirs = NULL;
+        char *record_path = NULL, *trace_path = NULL;
+        unsigned int host_interval = 0, blk_interval = 0, kvm_interval = 0;
+        unsigned int npaths = 0, nconds = 0, npats = 0, ndirs = 0, i;
+        unsigned int nworkers = 0, coll_interval = 0, depth = 0;
+        unsigned int coll_timeout = 0, coll_top = 0;
+        int coll_cpu = -1, coll_prio = 0;
+        double vm_pct = GOV_VM_BUDGET, host_pct = GOV_HOST_BUDGET;
 
-        while ((c = getopt(argc, argv, "hcp:")) != -1) {
+        memset(&qmpc, 0, sizeof(struct qmp_conn));
+
+        while ((c = getopt(argc, argv, "hA:cC:d:D:E:F:G:H:K:M:m:P:p:R:T:t:U:W:w:x:Zz:")) != -1) {
                 switch (c) {
+                case 'A':
+                        coll_top = atoi(optarg);
+                break;
                 case 'c':
                         flags |= HAS_NEW_CONN;
                 break;
+                case 'C':
+                        qmpc.cache = qmp_cache_new(atoi(optarg),
+                                                   QMP_CACHE_NEG_TTL);
+                        /* registers go stale faster than the vCPU list */
+                        qmp_cache_set_ttl(qmpc.cache, QMP_COMMAND_INFO_REGS,
+                                          atoi(optarg) / 2, QMP_CACHE_NEG_TTL);
+                break;
+                case 'D':
+                        flags |= HAS_BLKSTATS;
+                        blk_interval = atoi(optarg);
+                break;
+                case 'E':
+                        flags |= HAS_EXPORTER;
+                        export_addr = strdup(optarg);
+                break;
+                case 'G':
+                        flags |= HAS_GOVERNOR;
+                        if (sscanf(optarg, "%lf:%lf", &vm_pct,
+                                   &host_pct) < 1 || vm_pct <= 0.0 ||
+                            host_pct <= 0.0)
+                                print_help();
+                break;
+                case 'H':
+                        flags |= HAS_HOSTACCT;
+                        host_interval = atoi(optarg);
+                break;
+                case 'K':
+                        flags |= HAS_KVMSTATS;
+                        kvm_interval = atoi(optarg);
+                break;
+                case 'M':
+                        flags |= HAS_SCAN;
+                        scan_spec = strdup(optarg);
+                break;
+                case 'd':
+                        flags |= HAS_DISCOVER;
+                        dirs = xrealloc(dirs, (ndirs + 1) * sizeof(char *));
+                        dirs[ndirs++] = strdup(optarg);
+                break;
+                case 'm':
+                        pats = xrealloc(pats, (npats + 1) * sizeof(char *));
+                        pats[npats++] = strdup(optarg);
+                break;
                 case 'p':
                         flags |= HAS_PATH;
-                        qmpc.qmp_sock_path = strdup(optarg);
+                        paths = xrealloc(paths, (npaths + 1) * sizeof(char *));
+                        paths[npaths++] = strdup(optarg);
+                break;
+                case 'R':
+                        record_path = strdup(optarg);
+                break;
+                case 'T':
+                        qmpc.transport = qmp_transport_find(optarg);
+                        if (!qmpc.transport)
+                                FATAL("Unknown transport '%s'\n", optarg);
+                break;
+                case 't':
+                        coll_timeout = atoi(optarg);
+                break;
+                case 'U':
+                        depth = atoi(optarg);
+                break;
+                case 'F':
+                        coll_prio = atoi(optarg);
+                break;
+                case 'P':
+                        coll_cpu = atoi(optarg);
+                break;
+                case 'W':
+                        flags |= HAS_TRIGGERS;
+                        conds = xrealloc(conds, (nconds + 1) * sizeof(char *));
+                        conds[nconds++] = strdup(optarg);
+                break;
+                case 'w':
+                        flags |= HAS_COLLECTOR;
+                        if (sscanf(optarg, "%u:%u", &nworkers,
+                                   &coll_interval) < 1)
+                                print_help();
+                break;
+                case 'x':
+                        flags |= HAS_PROXY;
+                        proxy_path = strdup(optarg);
+                break;
+                case 'Z':
+                        flags |= HAS_COMPRESS;
+                break;
+                case 'z':
+                        trace_path = strdup(optarg);
                 break;
                 case 'h':
                 default:
@@ -97,19 +893,202 @@ int main(int argc, char *argv[])
                 }
         }
 
-        if (!(flags & HAS_PATH)) {
+        if (trace_path) {
+                int r = decompress_trace(trace_path);
+
+                xfree(trace_path);
+                exit(r == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+
+        /* -Z may come after -R */
+        if (record_path) {
+                qmpc.recorder = qmp_record_open(record_path,
+                                                !!(flags & HAS_COMPRESS));
+                xfree(record_path);
+                if (!qmpc.recorder)
+                        exit(EXIT_FAILURE);
+                recorder = qmpc.recorder;
+                atexit(close_recorder);
+        }
+
+        /* a dump already on disk needs no VM */
+        if (!(flags & (HAS_PATH | HAS_SCAN | HAS_DISCOVER))) {
+                print_help();
+        }
+
+        /* only the worker pool takes VMs that come and go */
+        if ((flags & HAS_DISCOVER) && !(flags & HAS_COLLECTOR)) {
+                print_help();
+        }
+
+        /* stacks are only added to the samples of the pool */
+        if (depth && !(flags & HAS_COLLECTOR)) {
                 print_help();
         }
 
-        /* check if the path really exists and is a UNIX sock */
-        if (stat(qmpc.qmp_sock_path, &st) == -1) {
+        /*
+         * the proxy reads and writes the upstream fd itself, past the
+         * transport and the recorder
+         */
+        if ((flags & HAS_PROXY) &&
+            (qmpc.transport == &qmp_uring_transport || qmpc.recorder)) {
+                print_help();
+        }
+
+        /* priority, pinning, deadlines and attribution tune the pool */
+        if ((coll_prio || coll_cpu >= 0 || coll_timeout || coll_top) &&
+            !(flags & HAS_COLLECTOR)) {
+                print_help();
+        }
+
+        /*
+         * a ring belongs to the thread that attached the connection, the
+         * workers and the healer would all drive the one of the opener
+         */
+        if (qmpc.transport == &qmp_uring_transport &&
+            (flags & (HAS_COLLECTOR | HAS_DISCOVER))) {
+                print_help();
+        }
+
+        /* check if the paths really exist and are UNIX socks */
+        for (i = 0; i < npaths; i++) {
+                const char *path = paths[i];
+
+                /* reachability of tcp:host:port is up to connect() */
+                if (qmp_is_tcp(path))
+                        continue;
+                if (!strncmp(path, QMP_UNIX_PREFIX, strlen(QMP_UNIX_PREFIX)))
+                        path += strlen(QMP_UNIX_PREFIX);
+
+                if (stat(path, &st) == -1) {
+                        FATAL("Failed stat on '%s'\n", path);
+                }
+
+                if ((st.st_mode & S_IFMT) != S_IFSOCK) {
+                        FATAL("'%s' not a socket file\n", path);
+                }
+        }
+
+        if (flags & HAS_SCAN) {
+                int r = memory_scanner(&qmpc, paths, npaths, scan_spec, pats,
+                                       npats);
+
+                for (i = 0; i < npaths; i++)
+                        xfree(paths[i]);
+                xfree(paths);
+                for (i = 0; i < npats; i++)
+                        xfree(pats[i]);
+                xfree(pats);
+                xfree(scan_spec);
+                exit(r == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+
+        if (flags & HAS_GOVERNOR) {
+                governed_sampler(&qmpc, paths, npaths, vm_pct, host_pct);
+
+                for (i = 0; i < npaths; i++)
+                        xfree(paths[i]);
+                xfree(paths);
+                exit(EXIT_FAILURE);
+        }
+
+        if (flags & HAS_EXPORTER) {
+                exporting_sampler(&qmpc, paths, npaths, export_addr);
+
+                for (i = 0; i < npaths; i++)
+                        xfree(paths[i]);
+                xfree(paths);
+                xfree(export_addr);
+                exit(EXIT_FAILURE);
+        }
+
+        if (flags & HAS_COLLECTOR) {
+                collecting_sampler(&qmpc, paths, npaths, dirs, ndirs,
+                                   nworkers, coll_interval, coll_timeout,
+                                   depth, coll_cpu, coll_prio, coll_top);
+
+                for (i = 0; i < npaths; i++)
+                        xfree(paths[i]);
+                xfree(paths);
+                for (i = 0; i < ndirs; i++)
+                        xfree(dirs[i]);
+                xfree(dirs);
+                exit(EXIT_FAILURE);
+        }
+
+        if (flags & HAS_TRIGGERS) {
+                watching_sampler(&qmpc, paths, npaths, conds, nconds);
+
+                for (i = 0; i < npaths; i++)
+                        xfree(paths[i]);
+                xfree(paths);
+                for (i = 0; i < nconds; i++)
+                        xfree(conds[i]);
+                xfree(conds);
+                exit(EXIT_FAILURE);
+        }
+
+        /* everything else talks to the first VM only */
+        qmpc.qmp_sock_path = paths[0];
+        for (i = 1; i < npaths; i++)
+                xfree(paths[i]);
+        xfree(paths);
+
+        if (flags & HAS_PROXY) {
+                /* a proxy needs one long lived upstream connection */
+                if (qemu_qmp_conn(&qmpc) == -1) {
+                        xfree(qmpc.qmp_sock_path);
+                        exit(EXIT_FAILURE);
+                }
+
+                dprintf("Proxying '%s' on '%s'\n", qmpc.qmp_sock_path,
+                                proxy_path);
+                proxy_run(&qmpc, proxy_path, NULL);
+
+                qmp_close_conn(&qmpc);
+                xfree(proxy_path);
+                xfree(qmpc.qmp_sock_path);
+                exit(EXIT_FAILURE);
+        }
+
+        if (flags & HAS_HOSTACCT) {
+                if (qemu_qmp_conn(&qmpc) == -1) {
+                        xfree(qmpc.qmp_sock_path);
+                        exit(EXIT_FAILURE);
+                }
+
+                host_sampler(&qmpc, host_interval);
+
+                qmp_close_conn(&qmpc);
                 xfree(qmpc.qmp_sock_path);
-                FATAL("Failed stat on '%s'\n", qmpc.qmp_sock_path);
+                exit(EXIT_FAILURE);
         }
 
-        if ((st.st_mode & S_IFMT) != S_IFSOCK) {
+        if (flags & HAS_BLKSTATS) {
+                if (qemu_qmp_conn(&qmpc) == -1) {
+                        xfree(qmpc.qmp_sock_path);
+                        exit(EXIT_FAILURE);
+                }
+
+                blk_sampler(&qmpc, blk_interval);
+
+                qmp_close_conn(&qmpc);
                 xfree(qmpc.qmp_sock_path);
-                FATAL("'%s' not a socket file\n", qmpc.qmp_sock_path);
+                exit(EXIT_FAILURE);
+        }
+
+        if (flags & HAS_KVMSTATS) {
+                if (qemu_qmp_conn(&qmpc) == -1) {
+                        xfree(qmpc.qmp_sock_path);
+                        exit(EXIT_FAILURE);
+                }
+
+                kvm_sampler(&qmpc, kvm_interval);
+
+                qmp_close_conn(&qmpc);
+                qmp_schema_release();
+                xfree(qmpc.qmp_sock_path);
+                exit(EXIT_FAILURE);
         }
 
         if (!(flags & HAS_NEW_CONN)) {
@@ -140,6 +1119,11 @@ int main(int argc, char *argv[])
                 qmp_close_conn(&qmpc);
         }
 
+        if (qmpc.cache)
+                qmp_cache_free(qmpc.cache);
+
+        qmp_schema_release();
+        close_recorder();
         xfree(qmpc.qmp_sock_path);
 
         return 0;
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "json.h"
+#include "qmp.h"
+#include "mock.h"
+
+#define MOCK_GREETING   "{\"QMP\": {\"version\": {\"qemu\": {\"micro\": 0, " \
+        "\"minor\": 2, \"major\": 8}, \"package\": \"\"}, " \
+        "\"capabilities\": []}}\r\n"
+
+#define MOCK_REGS       "\"" MOCK_REGS_BODY "\""
+
+#define MOCK_REGS_BODY  "RAX=ffffffff8101c9a0 RBX=ffffffff818e2880 " \
+        "RCX=ffffffff818550e0 RDX=0000000000000000\\r\\n" \
+        "RSI=0000000000000000 RDI=0000000000000000 RBP=ffffffff818c1f68 " \
+        "RSP=ffffffff818c1f68\\r\\n" \
+        "R8 =0000000000000000 R9 =0000000000000000 R10=0000000000000000 " \
+        "R11=0000000000000000\\r\\n" \
+        "R12=ffffffff81a17a68 R13=ffffffff81a17000 R14=0000000000000000 " \
+        "R15=0000000000000000\\r\\n" \
+        "RIP=ffffffff8101ca06 RFL=00000246 [---Z-P-] CPL=0 II=0 A20=1 " \
+        "SMM=0 HLT=1\\r\\n" \
+        "ES =0000 0000000000000000 ffffffff 00c00000\\r\\n" \
+        "CS =0010 0000000000000000 ffffffff 00a09b00 DPL=0 CS64 [-RA]\\r\\n" \
+        "SS =0018 0000000000000000 ffffffff 00c09300 DPL=0 DS   [-WA]\\r\\n" \
+        "DS =0000 0000000000000000 ffffffff 00c00000\\r\\n" \
+        "FS =0000 0000000000000000 ffffffff 00c00000\\r\\n" \
+        "GS =0000 ffff88007fc00000 ffffffff 00c00000\\r\\n" \
+        "CR0=8005003b CR2=00007f3b5c5a4000 CR3=000000007a2e4000 " \
+        "CR4=000006f0\\r\\n" \
+        "EFER=0000000000000d01\\r\\n"
+
+#define MOCK_STATUS     "{\"status\": \"running\", \"singlestep\": false, " \
+        "\"running\": true}"
+
+struct mock_client {
+        int fd;
+        size_t rlen;
+        char rbuf[QMP_BUF_LEN];
+};
+
+/* the 'info cpus' reply, vCPU threads are all the server itself */
+static char mock_cpus[MOCK_VCPUS * 80 + 8];
+/* the 'info registers -a' reply */
+static char mock_regs_all[MOCK_VCPUS * (sizeof(MOCK_REGS_BODY) + 16) + 8];
+/* of mock_server_start(), in the server */
+static int mock_flags;
+
+static void
+mock_init_cpus(void)
+{
+        size_t off;
+        int i;
+
+        off = xstrlcpy(mock_cpus, "\"", sizeof(mock_cpus));
+        for (i = 0; i < MOCK_VCPUS; i++) {
+                off += snprintf(mock_cpus + off, sizeof(mock_cpus) - off,
+                                "%sCPU #%d: pc=0xffffffff81051c02%s "
+                                "thread_id=%d\\r\\n", i ? "  " : "* ", i,
+                                i % 2 ? "" : " (halted)", (int) getpid());
+        }
+        xstrlcpy(mock_cpus + off, "\"", sizeof(mock_cpus) - off);
+
+        off = xstrlcpy(mock_regs_all, "\"", sizeof(mock_regs_all));
+        for (i = 0; i < MOCK_VCPUS; i++) {
+                off += snprintf(mock_regs_all + off,
+                                sizeof(mock_regs_all) - off,
+                                "CPU#%d\\r\\n" MOCK_REGS_BODY, i);
+        }
+        xstrlcpy(mock_regs_all + off, "\"", sizeof(mock_regs_all) - off);
+}
+
+static void
+mock_event(int fd, const char *name)
+{
+        struct timeval tv;
+        char buf[128];
+        int n;
+
+        gettimeofday(&tv, NULL);
+        n = snprintf(buf, sizeof(buf), "{\"timestamp\": {\"seconds\": %ld, "
+                     "\"microseconds\": %ld}, \"event\": \"%s\"}\r\n",
+                     (long) tv.tv_sec, (long) tv.tv_usec, name);
+
+        if (send(fd, buf, n, MSG_NOSIGNAL) == -1) {
+                /* the client is gone, poll() reports it */
+        }
+}
+
+static void
+mock_reply(int fd, const char *obj, size_t len)
+{
+        const char *exec, *args, *cl, *id = NULL, *ret = "{}";
+        size_t elen, alen, cllen, idlen = 0;
+        char buf[QMP_BUF_LEN];
+        int n, head;
+
+        if (json_get_member(obj, len, "execute", &exec, &elen) == -1) {
+                return;
+        }
+        json_get_member(obj, len, "id", &id, &idlen);
+
+        if (json_string_eq(exec, elen, "human-monitor-command") &&
+            json_get_member(obj, len, "arguments", &args, &alen) == 0 &&
+            json_get_member(args, alen, "command-line", &cl, &cllen) == 0) {
+                if (json_string_eq(cl, cllen, "info cpus")) {
+                        ret = mock_cpus;
+                } else if (json_string_eq(cl, cllen, "info registers")) {
+                        ret = MOCK_REGS;
+                } else if (json_string_eq(cl, cllen, "info registers -a")) {
+                        ret = mock_regs_all;
+                } else {
+                        ret = "\"\"";
+                }
+        } else if (json_string_eq(exec, elen, "query-status")) {
+                ret = MOCK_STATUS;
+        } else if (json_string_eq(exec, elen, "stop")) {
+                mock_event(fd, "STOP");
+        } else if (json_string_eq(exec, elen, "cont")) {
+                mock_event(fd, "RESUME");
+        }
+
+        head = snprintf(buf, sizeof(buf), "{\"return\": %s", ret);
+        if (id) {
+                n = head + snprintf(buf + head, sizeof(buf) - head,
+                                    ", \"id\": %.*s}\r\n", (int) idlen, id);
+        } else {
+                n = head + snprintf(buf + head, sizeof(buf) - head, "}\r\n");
+        }
+
+        if (!(mock_flags & MOCK_SPLIT))
+                head = n;
+
+        if (send(fd, buf, head, MSG_NOSIGNAL) == -1) {
+                /* the client is gone, poll() reports it */
+        }
+        if (head < n) {
+                usleep(MOCK_SPLIT_US);
+                if (send(fd, buf + head, n - head, MSG_NOSIGNAL) == -1) {
+                        /* same */
+                }
+        }
+}
+
+static int
+mock_client_read(struct mock_client *c)
+{
+        size_t skip, off = 0;
+        ssize_t r, olen;
+
+        r = read(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+        if (r <= 0)
+                return -1;
+        c->rlen += r;
+
+        while ((olen = json_object_len(c->rbuf + off, c->rlen - off,
+                                       &skip)) > 0) {
+                mock_reply(c->fd, c->rbuf + off + skip, olen);
+                off += skip + olen;
+        }
+
+        if (olen == -1)
+                return -1;
+
+        memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+        c->rlen -= off;
+
+        return 0;
+}
+
+static void
+mock_serve(int lfd)
+{
+        struct pollfd *pfds = xcalloc(MOCK_MAX_CLIENTS + 1,
+                                      sizeof(struct pollfd));
+        struct mock_client **clients = xcalloc(MOCK_MAX_CLIENTS,
+                                               sizeof(struct mock_client *));
+        unsigned int i, n = 0;
+
+        mock_init_cpus();
+
+        for (;;) {
+                pfds[0].fd = lfd;
+                pfds[0].events = POLLIN;
+                for (i = 0; i < n; i++) {
+                        pfds[i + 1].fd = clients[i]->fd;
+                        pfds[i + 1].events = POLLIN;
+                }
+
+                if (poll(pfds, n + 1, -1) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        break;
+                }
+
+                for (i = n; i > 0; i--) {
+                        struct mock_client *c = clients[i - 1];
+
+                        if (!pfds[i].revents || mock_client_read(c) == 0)
+                                continue;
+
+                        close(c->fd);
+                        xfree(c);
+                        clients[i - 1] = clients[--n];
+                }
+
+                if ((pfds[0].revents & POLLIN) && n < MOCK_MAX_CLIENTS) {
+                        int fd = accept(lfd, NULL, NULL);
+
+                        if (fd == -1)
+                                continue;
+
+                        if (send(fd, MOCK_GREETING, strlen(MOCK_GREETING),
+                                 MSG_NOSIGNAL) == -1) {
+                                close(fd);
+                                continue;
+                        }
+
+                        clients[n] = xmalloc(sizeof(struct mock_client));
+                        clients[n]->fd = fd;
+                        n++;
+                }
+        }
+
+        exit(EXIT_FAILURE);
+}
+
+pid_t
+mock_server_start(const char *path, int flags)
+{
+        struct sockaddr_un saddr;
+        pid_t pid;
+        int lfd;
+
+        if (strlen(path) >= sizeof(saddr.sun_path)) {
+                return -1;
+        }
+
+        if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+                return -1;
+        }
+
+        memset(&saddr, 0, sizeof(struct sockaddr_un));
+        saddr.sun_family = AF_UNIX;
+        xstrlcpy(saddr.sun_path, path, sizeof(saddr.sun_path));
+        unlink(path);
+
+        /* listening before the fork, clients may connect right away */
+        if (bind(lfd, (struct sockaddr *) &saddr, sizeof(saddr)) == -1 ||
+            listen(lfd, MOCK_MAX_CLIENTS) == -1) {
+                dprintf("mock: failed to listen on '%s' ('%s')\n",
+                        path, strerror(errno));
+                close(lfd);
+                return -1;
+        }
+
+        switch ((pid = fork())) {
+        case -1:
+                close(lfd);
+                return -1;
+        case 0:
+                mock_flags = flags;
+                mock_serve(lfd);
+        break;
+        }
+
+        close(lfd);
+        return pid;
+}
+
+void
+mock_server_stop(pid_t pid, const char *path)
+{
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        unlink(path);
+}
@@ -0,0 +1,37 @@
+#ifndef __MOCK_H
+#define __MOCK_H
+
+/*
+ * A mock QMP monitor, good enough to benchmark the client side without a
+ * running qemu: it greets, accepts qmp_capabilities and answers 'info
+ * cpus', 'info registers [-a]' and query-status with canned x86-64
+ * replies; stop and cont emit STOP and RESUME events.
+ *
+ * With MOCK_SPLIT every reply is sent in two writes, the second one from
+ * right past the value on, as a slow or busy monitor may deliver it.
+ */
+
+/* connections served at once */
+#define MOCK_MAX_CLIENTS        (4096)
+/* vCPUs reported by 'info cpus' and 'info registers -a' */
+#define MOCK_VCPUS              (4)
+/* flags of mock_server_start() */
+#define MOCK_SPLIT              (1 << 0)
+/* between the two writes of a split reply */
+#define MOCK_SPLIT_US           (1000)
+
+/**
+ * @brief fork a process serving a mock monitor on the unix socket 'path'
+ * @param flags MOCK_SPLIT, or 0
+ * @retval the pid of the server once it listens, -1 on failure
+ */
+extern pid_t
+mock_server_start(const char *path, int flags);
+
+/**
+ * @brief stop a server started with mock_server_start()
+ */
+extern void
+mock_server_stop(pid_t pid, const char *path);
+
+#endif /* __MOCK_H */
@@ -0,0 +1,698 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <stdint.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "json.h"
+#include "qmp.h"
+#include "proxy.h"
+#include "cache.h"
+
+#define PROXY_ERR_NEGOTIATE     "{\"class\": \"CommandNotFound\", " \
+        "\"desc\": \"Expecting capabilities negotiation with 'qmp_capabilities'\"}"
+#define PROXY_ERR_NEGOTIATED    "{\"class\": \"CommandNotFound\", " \
+        "\"desc\": \"Capabilities negotiation is already complete, command ignored\"}"
+#define PROXY_ERR_UPSTREAM      "{\"class\": \"GenericError\", " \
+        "\"desc\": \"Failed to forward command to qemu\"}"
+#define PROXY_ERR_SYNTAX        "{\"class\": \"GenericError\", " \
+        "\"desc\": \"QMP input must be a JSON object with member 'execute'\"}"
+#define PROXY_ERR_OOB           "{\"class\": \"GenericError\", " \
+        "\"desc\": \"QMP input member 'exec-oob' requires the 'oob' capability\"}"
+
+struct proxy_client {
+        int fd;
+        int negotiated;
+        /* asked for oob, granted only if the upstream connection has it */
+        int oob;
+        /* to be dropped once nothing refers to it, see proxy_reap() */
+        int dead;
+        size_t rlen;
+        char rbuf[QMP_BUF_LEN];
+        /* output the client did not take yet, flushed on POLLOUT */
+        char *wbuf;
+        size_t wlen, wsize;
+        struct proxy_client *next;
+};
+
+/* a downstream client waiting for the reply of an upstream command */
+struct proxy_waiter {
+        struct proxy_client *client;
+        /* the raw id of the downstream request, NULL if it had none */
+        char *id;
+        struct proxy_waiter *next;
+};
+
+/* a command sent to qemu and not answered yet */
+struct proxy_req {
+        uint64_t tag;
+        /* compacted command, only set for coalescable queries */
+        char *key;
+        struct proxy_waiter *waiters;
+        struct proxy_req *next;
+};
+
+struct proxy {
+        const struct qmp_conn *qmpc;
+        int lfd;
+        uint64_t next_tag;
+
+        /* upstream receive buffer, grows with the largest reply */
+        char *ubuf;
+        size_t ulen, usize;
+        /* replies served from the connection's cache */
+        char cbuf[QMP_BUF_LEN];
+
+        struct proxy_client *clients;
+        unsigned int nclients;
+        struct proxy_req *reqs;
+
+        struct proxy_stats *stats;
+};
+
+/* as much of the queue as the client takes without blocking */
+static int
+proxy_flush(struct proxy_client *c)
+{
+        size_t off = 0;
+        ssize_t r;
+
+        while (off < c->wlen) {
+                r = send(c->fd, c->wbuf + off, c->wlen - off, MSG_NOSIGNAL);
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r < 0 && errno == EAGAIN)
+                        break;
+                if (r <= 0)
+                        return -1;
+                off += r;
+        }
+
+        memmove(c->wbuf, c->wbuf + off, c->wlen - off);
+        c->wlen -= off;
+        return 0;
+}
+
+/*
+ * queue 'buf' for the client and send what it takes now; a client that
+ * lets PROXY_CLIENT_QUEUE bytes pile up is not reading and goes
+ */
+static void
+proxy_send(struct proxy *p, struct proxy_client *c, const char *buf,
+           size_t len)
+{
+        if (c->dead) {
+                return;
+        }
+
+        if (c->wlen + len > PROXY_CLIENT_QUEUE) {
+                dprintf("proxy: dropping client, it does not read\n");
+                p->stats->overflows++;
+                c->dead = 1;
+                return;
+        }
+
+        if (c->wsize - c->wlen < len) {
+                c->wsize = c->wlen + len + QMP_BUF_LEN;
+                c->wbuf = xrealloc(c->wbuf, c->wsize);
+        }
+        memcpy(c->wbuf + c->wlen, buf, len);
+        c->wlen += len;
+
+        if (proxy_flush(c) == -1)
+                c->dead = 1;
+}
+
+/*
+ * send {"<member>": <val>, "id": <id>} to a client, 'id' may be NULL
+ */
+static void
+proxy_reply(struct proxy *p, struct proxy_client *c, const char *member,
+            const char *val, size_t vlen, const char *id)
+{
+        size_t len = vlen + strlen(member) + (id ? strlen(id) : 0) + 32;
+        char *msg = xmalloc(len);
+        int n;
+
+        if (id) {
+                n = snprintf(msg, len, "{\"%s\": %.*s, \"id\": %s}\r\n",
+                             member, (int) vlen, val, id);
+        } else {
+                n = snprintf(msg, len, "{\"%s\": %.*s}\r\n",
+                             member, (int) vlen, val);
+        }
+
+        proxy_send(p, c, msg, n);
+        xfree(msg);
+}
+
+static char *
+proxy_strndup(const char *s, size_t len)
+{
+        char *d = xmalloc(len + 1);
+
+        memcpy(d, s, len);
+        d[len] = '\0';
+        return d;
+}
+
+/*
+ * relay the outcome of 'obj', a reply from qemu, to a client
+ */
+static void
+proxy_answer(struct proxy *p, struct proxy_client *c, const char *obj,
+             size_t len, const char *id)
+{
+        const char *val, *member = "return";
+        size_t vlen;
+
+        if (json_get_member(obj, len, "return", &val, &vlen) == -1) {
+                member = "error";
+                if (json_get_member(obj, len, "error", &val, &vlen) == -1) {
+                        val = "{}";
+                        vlen = 2;
+                }
+        }
+
+        proxy_reply(p, c, member, val, vlen, id);
+}
+
+static struct proxy_req *
+proxy_find_query(struct proxy *p, const char *key)
+{
+        struct proxy_req *r;
+
+        for (r = p->reqs; r != NULL; r = r->next) {
+                if (r->key && streq(r->key, key))
+                        return r;
+        }
+        return NULL;
+}
+
+static void
+proxy_add_waiter(struct proxy_req *r, struct proxy_client *c,
+                 const char *id, size_t idlen)
+{
+        struct proxy_waiter *w = xmalloc(sizeof(struct proxy_waiter));
+
+        w->client = c;
+        w->id = id ? proxy_strndup(id, idlen) : NULL;
+        w->next = r->waiters;
+        r->waiters = w;
+}
+
+static void
+proxy_free_req(struct proxy_req *r)
+{
+        struct proxy_waiter *w = r->waiters;
+
+        while (w) {
+                struct proxy_waiter *wn = w->next;
+
+                xfree(w->id);
+                xfree(w);
+                w = wn;
+        }
+        xfree(r->key);
+        xfree(r);
+}
+
+/*
+ * out of band commands are never coalesced nor cached, they overtake the
+ * in-band ones and their replies are matched by tag like any other
+ */
+static int
+proxy_forward(struct proxy *p, struct proxy_client *c,
+              const char *obj, size_t len, int oob)
+{
+        const char *exec, *args = NULL, *id = NULL;
+        const char *key_name = oob ? "exec-oob" : "execute";
+        size_t elen, alen = 0, idlen = 0, mlen, nread;
+        struct qmp_cache *cache = p->qmpc->cache;
+        struct proxy_req *r;
+        char *key = NULL, *msg;
+        int n;
+
+        json_get_member(obj, len, key_name, &exec, &elen);
+        if (json_get_member(obj, len, "arguments", &args, &alen) == -1)
+                args = NULL;
+        if (json_get_member(obj, len, "id", &id, &idlen) == -1)
+                id = NULL;
+
+        p->stats->requests++;
+
+        /* the command without any id, as the cache knows it */
+        mlen = len + 64;
+        msg = xmalloc(mlen);
+        if (args) {
+                n = snprintf(msg, mlen, "{\"%s\": %.*s, \"arguments\": %.*s}",
+                             key_name, (int) elen, exec, (int) alen, args);
+        } else {
+                n = snprintf(msg, mlen, "{\"%s\": %.*s}", key_name,
+                             (int) elen, exec);
+        }
+
+        if (!oob && qmp_cache_readonly(msg, n)) {
+                if (cache && qmp_cache_lookup(cache, p->qmpc->qmp_sock_path,
+                                              msg, p->cbuf, QMP_BUF_LEN,
+                                              &nread) == 0) {
+                        char *sid = id ? proxy_strndup(id, idlen) : NULL;
+
+                        proxy_answer(p, c, p->cbuf, nread, sid);
+                        p->stats->cached++;
+                        xfree(sid);
+                        xfree(msg);
+                        return 0;
+                }
+
+                key = xmalloc(n + 1);
+                json_compact(key, n + 1, msg, n);
+
+                if ((r = proxy_find_query(p, key)) != NULL) {
+                        proxy_add_waiter(r, c, id, idlen);
+                        p->stats->coalesced++;
+                        xfree(key);
+                        xfree(msg);
+                        return 0;
+                }
+        }
+
+        r = xmalloc(sizeof(struct proxy_req));
+        r->tag = p->next_tag++;
+        r->key = key;
+        proxy_add_waiter(r, c, id, idlen);
+
+        /* tag it, replacing the closing brace */
+        n += snprintf(msg + n - 1, mlen - n + 1, ", \"id\": %lu}", r->tag) - 1;
+
+        if (xwrite(p->qmpc->fd, msg, n) != (size_t) n) {
+                dprintf("Failed to forward command upstream\n");
+                xfree(msg);
+                proxy_free_req(r);
+                return -1;
+        }
+        xfree(msg);
+
+        r->next = p->reqs;
+        p->reqs = r;
+        p->stats->upstream++;
+
+        return 0;
+}
+
+/*
+ * {"execute": "qmp_capabilities", "arguments": {"enable": ["oob"]}}
+ */
+static int
+proxy_wants_oob(const char *obj, size_t len)
+{
+        const char *args, *en, *cap;
+        size_t alen, enlen, clen, pos = 0;
+
+        if (json_get_member(obj, len, "arguments", &args, &alen) == -1 ||
+            json_get_member(args, alen, "enable", &en, &enlen) == -1) {
+                return 0;
+        }
+
+        while (json_array_next(en, enlen, &pos, &cap, &clen) == 1) {
+                if (json_string_eq(cap, clen, "oob"))
+                        return 1;
+        }
+
+        return 0;
+}
+
+static void
+proxy_client_msg(struct proxy *p, struct proxy_client *c,
+                 const char *obj, size_t len)
+{
+        const char *exec, *id;
+        size_t elen, idlen;
+        char *sid = NULL;
+
+        if (json_get_member(obj, len, "id", &id, &idlen) == 0)
+                sid = proxy_strndup(id, idlen);
+
+        if (json_get_member(obj, len, "exec-oob", &exec, &elen) == 0) {
+                if (!c->negotiated) {
+                        proxy_reply(p, c, "error", PROXY_ERR_NEGOTIATE,
+                                    strlen(PROXY_ERR_NEGOTIATE), sid);
+                } else if (!c->oob) {
+                        proxy_reply(p, c, "error", PROXY_ERR_OOB,
+                                    strlen(PROXY_ERR_OOB), sid);
+                } else if (proxy_forward(p, c, obj, len, 1) == -1) {
+                        proxy_reply(p, c, "error", PROXY_ERR_UPSTREAM,
+                                    strlen(PROXY_ERR_UPSTREAM), sid);
+                }
+        } else if (json_get_member(obj, len, "execute", &exec, &elen) == -1) {
+                proxy_reply(p, c, "error", PROXY_ERR_SYNTAX,
+                            strlen(PROXY_ERR_SYNTAX), sid);
+        } else if (json_string_eq(exec, elen, "qmp_capabilities")) {
+                if (c->negotiated) {
+                        proxy_reply(p, c, "error", PROXY_ERR_NEGOTIATED,
+                                    strlen(PROXY_ERR_NEGOTIATED), sid);
+                } else {
+                        /* the upstream connection is negotiated already */
+                        c->negotiated = 1;
+                        c->oob = p->qmpc->oob && proxy_wants_oob(obj, len);
+                        proxy_reply(p, c, "return", "{}", 2, sid);
+                }
+        } else if (!c->negotiated) {
+                proxy_reply(p, c, "error", PROXY_ERR_NEGOTIATE,
+                            strlen(PROXY_ERR_NEGOTIATE), sid);
+        } else if (proxy_forward(p, c, obj, len, 0) == -1) {
+                proxy_reply(p, c, "error", PROXY_ERR_UPSTREAM,
+                            strlen(PROXY_ERR_UPSTREAM), sid);
+        }
+
+        xfree(sid);
+}
+
+static void
+proxy_drop_client(struct proxy *p, struct proxy_client *c)
+{
+        struct proxy_client **pc;
+        struct proxy_req *r;
+        struct proxy_waiter *w;
+
+        for (pc = &p->clients; *pc != NULL; pc = &(*pc)->next) {
+                if (*pc == c) {
+                        *pc = c->next;
+                        break;
+                }
+        }
+
+        /* replies still in flight for this client are discarded */
+        for (r = p->reqs; r != NULL; r = r->next) {
+                for (w = r->waiters; w != NULL; w = w->next) {
+                        if (w->client == c)
+                                w->client = NULL;
+                }
+        }
+
+        close(c->fd);
+        xfree(c->wbuf);
+        xfree(c);
+        p->nclients--;
+}
+
+/* after a round, no client is referred to from the stack anymore */
+static void
+proxy_reap(struct proxy *p)
+{
+        struct proxy_client *c = p->clients, *next;
+
+        while (c) {
+                next = c->next;
+                if (c->dead)
+                        proxy_drop_client(p, c);
+                c = next;
+        }
+}
+
+static int
+proxy_client_read(struct proxy *p, struct proxy_client *c)
+{
+        ssize_t r, olen;
+        size_t skip, off = 0;
+
+        r = read(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+        if (r < 0 && (errno == EINTR || errno == EAGAIN))
+                return 0;
+        if (r <= 0)
+                return -1;
+
+        c->rlen += r;
+
+        while ((olen = json_object_len(c->rbuf + off, c->rlen - off,
+                                       &skip)) > 0) {
+                proxy_client_msg(p, c, c->rbuf + off + skip, olen);
+                off += skip + olen;
+        }
+
+        if (olen == -1) {
+                dprintf("proxy: dropping client, invalid input\n");
+                return -1;
+        }
+
+        memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+        c->rlen -= off;
+
+        if (c->rlen == sizeof(c->rbuf)) {
+                dprintf("proxy: dropping client, command too large\n");
+                return -1;
+        }
+
+        return 0;
+}
+
+static void
+proxy_accept(struct proxy *p)
+{
+        struct proxy_client *c;
+        int fd;
+
+        if ((fd = accept(p->lfd, NULL, NULL)) == -1) {
+                return;
+        }
+
+        if (p->nclients == PROXY_MAX_CLIENTS) {
+                dprintf("proxy: too many clients\n");
+                close(fd);
+                return;
+        }
+
+        xsetnonblock(fd);
+
+        c = xcalloc(1, sizeof(struct proxy_client));
+        c->fd = fd;
+        c->next = p->clients;
+        p->clients = c;
+        p->nclients++;
+
+        proxy_send(p, c, p->qmpc->greeting, strlen(p->qmpc->greeting));
+}
+
+static void
+proxy_upstream_msg(struct proxy *p, const char *obj, size_t len)
+{
+        struct qmp_cache *cache = p->qmpc->cache;
+        struct proxy_req **pr, *r;
+        struct proxy_client *c;
+        struct proxy_waiter *w;
+        const char *val;
+        size_t vlen;
+        uint64_t tag;
+
+        if (json_get_member(obj, len, "event", &val, &vlen) == 0) {
+                if (cache)
+                        qmp_cache_observe(cache, p->qmpc->qmp_sock_path,
+                                          obj, len);
+
+                for (c = p->clients; c != NULL; c = c->next) {
+                        if (!c->negotiated)
+                                continue;
+                        proxy_send(p, c, obj, len);
+                        proxy_send(p, c, "\r\n", 2);
+                }
+                p->stats->events++;
+                return;
+        }
+
+        if (json_get_member(obj, len, "id", &val, &vlen) == -1) {
+                dprintf("proxy: dropping reply without id\n");
+                return;
+        }
+
+        tag = strtoull(val, NULL, 10);
+        for (pr = &p->reqs; *pr != NULL; pr = &(*pr)->next) {
+                if ((*pr)->tag == tag)
+                        break;
+        }
+
+        if (!(r = *pr)) {
+                dprintf("proxy: reply for unknown id %lu\n", tag);
+                return;
+        }
+        *pr = r->next;
+
+        if (cache && r->key)
+                qmp_cache_update(cache, p->qmpc->qmp_sock_path, r->key,
+                                 obj, len);
+
+        for (w = r->waiters; w != NULL; w = w->next) {
+                if (w->client)
+                        proxy_answer(p, w->client, obj, len, w->id);
+        }
+
+        proxy_free_req(r);
+}
+
+static int
+proxy_upstream_read(struct proxy *p)
+{
+        ssize_t r, olen;
+        size_t skip, off = 0;
+
+        for (;;) {
+                if (p->ulen == p->usize) {
+                        p->usize *= 2;
+                        p->ubuf = xrealloc(p->ubuf, p->usize);
+                }
+
+                r = read(p->qmpc->fd, p->ubuf + p->ulen, p->usize - p->ulen);
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r < 0 && errno == EAGAIN)
+                        break;
+                if (r <= 0) {
+                        dprintf("proxy: lost connection to qemu\n");
+                        return -1;
+                }
+                p->ulen += r;
+        }
+
+        while ((olen = json_object_len(p->ubuf + off, p->ulen - off,
+                                       &skip)) > 0) {
+                proxy_upstream_msg(p, p->ubuf + off + skip, olen);
+                off += skip + olen;
+        }
+
+        if (olen == -1) {
+                dprintf("proxy: invalid data from qemu\n");
+                return -1;
+        }
+
+        memmove(p->ubuf, p->ubuf + off, p->ulen - off);
+        p->ulen -= off;
+
+        return 0;
+}
+
+static int
+proxy_listen(const char *path)
+{
+        struct sockaddr_un saddr;
+        int s;
+
+        if (strlen(path) >= sizeof(saddr.sun_path)) {
+                dprintf("proxy: path '%s' too long\n", path);
+                return -1;
+        }
+
+        if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+                return -1;
+        }
+
+        memset(&saddr, 0, sizeof(struct sockaddr_un));
+        saddr.sun_family = AF_UNIX;
+        xstrlcpy(saddr.sun_path, path, sizeof(saddr.sun_path));
+
+        /* a stale socket from a previous run */
+        unlink(path);
+
+        if (bind(s, (struct sockaddr *) &saddr, sizeof(saddr)) == -1 ||
+            listen(s, PROXY_BACKLOG) == -1) {
+                dprintf("proxy: failed to listen on '%s' ('%s')\n",
+                        path, strerror(errno));
+                close(s);
+                return -1;
+        }
+
+        return s;
+}
+
+static void
+proxy_cleanup(struct proxy *p, const char *path)
+{
+        while (p->clients)
+                proxy_drop_client(p, p->clients);
+
+        while (p->reqs) {
+                struct proxy_req *r = p->reqs;
+
+                p->reqs = r->next;
+                proxy_free_req(r);
+        }
+
+        xfree(p->ubuf);
+        close(p->lfd);
+        unlink(path);
+}
+
+int
+proxy_run(const struct qmp_conn *qmpc, const char *path,
+          struct proxy_stats *stats)
+{
+        struct pollfd pfds[PROXY_MAX_CLIENTS + 2];
+        struct proxy_client *clients[PROXY_MAX_CLIENTS];
+        struct proxy_stats local_stats;
+        struct proxy p;
+
+        memset(&p, 0, sizeof(struct proxy));
+        memset(&local_stats, 0, sizeof(struct proxy_stats));
+
+        p.qmpc = qmpc;
+        p.stats = stats ? stats : &local_stats;
+        p.next_tag = 1;
+        p.usize = QMP_BUF_LEN;
+        p.ubuf = xmalloc(p.usize);
+
+        if ((p.lfd = proxy_listen(path)) == -1) {
+                xfree(p.ubuf);
+                return -1;
+        }
+
+        for (;;) {
+                struct proxy_client *c;
+                unsigned int i, n = 0;
+
+                pfds[0].fd = qmpc->fd;
+                pfds[0].events = POLLIN;
+                pfds[1].fd = p.lfd;
+                pfds[1].events = POLLIN;
+
+                for (c = p.clients; c != NULL; c = c->next) {
+                        clients[n] = c;
+                        pfds[n + 2].fd = c->fd;
+                        pfds[n + 2].events = POLLIN;
+                        if (c->wlen)
+                                pfds[n + 2].events |= POLLOUT;
+                        n++;
+                }
+
+                if (poll(pfds, n + 2, -1) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        break;
+                }
+
+                if (pfds[0].revents && proxy_upstream_read(&p) == -1)
+                        break;
+
+                for (i = 0; i < n; i++) {
+                        c = clients[i];
+                        if ((pfds[i + 2].revents & POLLOUT) && !c->dead &&
+                            proxy_flush(c) == -1)
+                                c->dead = 1;
+                        if ((pfds[i + 2].revents & ~POLLOUT) && !c->dead &&
+                            proxy_client_read(&p, c) == -1)
+                                c->dead = 1;
+                }
+
+                if (pfds[1].revents & POLLIN)
+                        proxy_accept(&p);
+
+                proxy_reap(&p);
+        }
+
+        proxy_cleanup(&p, path);
+        return -1;
+}
@@ -0,0 +1,46 @@
+#ifndef __PROXY_H
+#define __PROXY_H
+
+/* downstream clients served at once */
+#define PROXY_MAX_CLIENTS       (64)
+/* listen backlog of the proxy socket */
+#define PROXY_BACKLOG           (16)
+/* output held for a client that does not read, it is dropped past that */
+#define PROXY_CLIENT_QUEUE      (1024 * 1024)
+
+struct proxy_stats {
+        /* commands received from downstream clients */
+        uint64_t requests;
+        /* commands actually sent to qemu */
+        uint64_t upstream;
+        /* commands answered by an already in-flight upstream command */
+        uint64_t coalesced;
+        /* commands answered from the connection's cache */
+        uint64_t cached;
+        /* events broadcast to the clients */
+        uint64_t events;
+        /* clients dropped for not reading what they were sent */
+        uint64_t overflows;
+};
+
+/**
+ * @brief serve a QMP compatible unix socket at 'path', multiplexing all
+ * downstream clients over the single negotiated connection 'qmpc'
+ *
+ * Request ids are rewritten so that replies are routed back to the client
+ * that issued them, events are broadcast to every negotiated client and
+ * identical read-only queries in flight are coalesced into one upstream
+ * command. If 'qmpc' has a cache, fresh read-only replies are served
+ * from it. Clients never block the proxy: what they do not read is queued,
+ * up to PROXY_CLIENT_QUEUE bytes, and a client past that is dropped.
+ *
+ * @param qmpc an established and negotiated connection to qemu
+ * @param path the path of the unix socket to create
+ * @param stats if not NULL, updated while running
+ * @retval -1 when the upstream connection is lost or on setup failure
+ */
+extern int
+proxy_run(const struct qmp_conn *qmpc, const char *path,
+          struct proxy_stats *stats);
+
+#endif /* __PROXY_H */
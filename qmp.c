@@ -1,41 +1,115 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netdb.h>
 #include <poll.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "xutil.h"
 #include "log.h"
+#include "regs.h"
 #include "qmp.h"
+#include "json.h"
+#include "cache.h"
+#include "uring.h"
+#include "schema.h"
+#include "record.h"
+#include "stream.h"
 
+struct qmp_io_stats qmp_io_stats;
 
 /*
- * read over a non-block fd
+ * bytes read while waiting for one reply that belong to other ids,
+ * consumed by their own qmp_recv()
+ */
+struct qmp_pending {
+        char *buf;
+        size_t len;
+        size_t size;
+        uint32_t next_id;
+        /* sees the events met while waiting, if set */
+        void (*on_event)(const char *obj, size_t len, void *arg);
+        void *arg;
+        /*
+         * replies given up on that may still come, dropped when they do:
+         * by id, and those of commands sent without one
+         */
+        uint32_t stale[QMP_MAX_STALE];
+        unsigned int nstale;
+        unsigned int stale_untagged;
+};
+
+/*
+ * read over a non-block fd, at most 'size' - 1 bytes so that the
+ * caller always gets a NUL terminated buffer; returns once a whole
+ * reply, line ending included, is in, nothing more came for a while
+ * after the first bytes, or 'timeout_ms' went by
  */
 static int 
-qmp_read(int fd, void *buf, size_t *len)
+qmp_read(int fd, void *buf, size_t size, size_t *len, uint64_t *last_rx,
+         unsigned int timeout_ms)
 {
+        const char *start = buf;
+        uint64_t now, deadline = xclock_ns() + timeout_ms * 1000000ULL;
         struct pollfd pfd;
-        size_t tread = 0, nread;
-        int r;
+        size_t tread = 0;
+        ssize_t nread;
+        int r, wait;
 
         pfd.fd = fd;
         pfd.events = POLLIN;
 
-        while ((r = poll(&pfd, 1, QMP_POLL_TIMEOUT)) != 0) {
+        for (;;) {
+                if ((now = xclock_ns()) >= deadline)
+                        break;
+
+                /* the first bytes may take until the deadline */
+                wait = (deadline - now) / 1000000ULL + 1;
+                if (tread && wait > QMP_POLL_TIMEOUT)
+                        wait = QMP_POLL_TIMEOUT;
+
+                r = poll(&pfd, 1, wait);
+                QMP_IO_COUNT(syscalls, 1);
+
+                /* nothing more for QMP_POLL_TIMEOUT, the reply is done */
+                if (r == 0)
+                        break;
 
                 if (r == -1)
                         return -1;
 
                 if (pfd.revents & POLLIN) {
+                        size_t left = size - 1 - tread;
+
+                        if (left == 0)
+                                break;
+
                         /* read at max 1k at a time */
-                        nread = xread(fd, buf, 1024);
+                        nread = read(fd, buf, left < 1024 ? left : 1024);
+                        QMP_IO_COUNT(syscalls, 1);
+                        if (nread < 0 && (errno == EINTR || errno == EAGAIN))
+                                continue;
+                        /* readable but nothing read, peer went away */
+                        if (nread <= 0)
+                                break;
                         tread += nread;
                         buf += nread;
+                        if (last_rx)
+                                *last_rx = xclock_ns();
+                        /* no need to wait for the idle timeout */
+                        if (start[tread - 1] == '\n' &&
+                            qmp_reply_end(start, tread))
+                                break;
+                } else {
+                        /* POLLHUP or POLLERR alone */
+                        break;
                 }
         }
 
@@ -43,429 +117,1219 @@ qmp_read(int fd, void *buf, size_t *len)
         return 0;
 }
 
-int
-qmp_establish_conn(struct qmp_conn *qmpc)
+static int
+qmp_poll_read(const struct qmp_conn *qmpc, char *buf, size_t size,
+              size_t *len)
 {
-        int s;
-        struct sockaddr_un saddr;
-        size_t path_len;
-        size_t nread;
-
-        char buf[QMP_MAX_LENGTH];
-
-        if (!(path_len = strlen(qmpc->qmp_sock_path))) {
+        if (qmp_read(qmpc->fd, buf, size, len,
+                     qmpc->timing ? &qmpc->timing->last_rx : NULL,
+                     qmp_timeout(qmpc)) == -1) {
                 return -1;
         }
+        buf[*len] = '\0';
 
-        if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
-                return -1;
-        }
-
-        memset(&saddr, 0, sizeof(struct sockaddr_un));
-        saddr.sun_family = AF_UNIX;
-
-        strncpy(saddr.sun_path, qmpc->qmp_sock_path, path_len);
-        saddr.sun_path[path_len] = '\0';
+        return 0;
+}
 
-        qmpc->fd = s;
+static int
+qmp_poll_read_some(const struct qmp_conn *qmpc, char *buf, size_t size,
+                   size_t *len)
+{
+        struct pollfd pfd = { .fd = qmpc->fd, .events = POLLIN };
+        ssize_t nread;
+        int r;
 
-        /* connect to it */
-        if (connect(qmpc->fd, (struct sockaddr *) &saddr, 
-                        sizeof(struct sockaddr_un)) == -1) {
+        *len = 0;
 
-                dprintf("Failed to connect to '%s' ('%s')\n", 
-                        qmpc->qmp_sock_path, strerror(errno));
-                close(qmpc->fd);
+        r = poll(&pfd, 1, QMP_BATCH_TIMEOUT);
+        QMP_IO_COUNT(syscalls, 1);
+        if (r <= 0)
+                return r == -1 && errno != EINTR ? -1 : 0;
 
+        nread = read(qmpc->fd, buf, size - 1);
+        QMP_IO_COUNT(syscalls, 1);
+        if (nread < 0)
+                return errno == EINTR || errno == EAGAIN ? 0 : -1;
+        /* readable but nothing read, peer went away */
+        if (nread == 0)
                 return -1;
-        }
 
-        /* set non-block and read seq */
-        xsetnonblock(qmpc->fd);
+        buf[nread] = '\0';
+        *len = nread;
+        if (qmpc->timing)
+                qmpc->timing->last_rx = xclock_ns();
 
-        /* qmp would send a greeting message when connected */
-        memset(buf, 0, QMP_MAX_LENGTH);
+        return 0;
+}
 
-        if (qmp_read(qmpc->fd, buf, &nread) == -1) {
-                return -1;
-        }
+static size_t
+qmp_poll_write(const struct qmp_conn *qmpc, const char *buf, size_t len)
+{
+        size_t total = 0;
+        ssize_t ret;
 
-        if (nread == 0 && strncasecmp(buf, QMP_GREETING, 7)) {
-                dprintf("Failed to get QMP greeting message\n");
-                return -1;
+        QMP_IO_COUNT(syscalls, 1);
+
+        /* a VM that went away is an error, not a SIGPIPE for everyone */
+        while (total < len) {
+                ret = send(qmpc->fd, buf + total, len - total, MSG_NOSIGNAL);
+                if (ret < 0 && errno == EINTR)
+                        continue;
+                if (ret <= 0)
+                        break;
+                total += ret;
         }
 
-        return 0; 
+        return total;
 }
 
-int
-qmp_close_conn(const struct qmp_conn *qmpc)
+size_t
+qmp_reply_end(const char *buf, size_t len)
 {
-        if (close(qmpc->fd) == -1) {
-                return -1;
+        size_t off = 0, skip;
+        ssize_t olen;
+
+        while ((olen = json_object_len(buf + off, len - off, &skip)) > 0) {
+                const char *val;
+                size_t vlen;
+
+                off += skip + olen;
+                if (json_get_member(buf + off - olen, olen, "event",
+                                    &val, &vlen) == -1)
+                        return off;
         }
 
         return 0;
 }
 
 int
-qmp_negotiate(const struct qmp_conn *qmpc)
+qmp_reply_return(const char *buf, size_t len, const char **val,
+                 size_t *vlen)
 {
-        size_t cmd_len, nwrite, nread;
-        char buf[QMP_MAX_LENGTH];
+        size_t end = qmp_reply_end(buf, len), skip, off = 0;
+        ssize_t olen;
 
-        
-        cmd_len = strlen(QMP_ENTER_COMMAND_MODE);
-        nwrite = xwrite(qmpc->fd, QMP_ENTER_COMMAND_MODE, cmd_len);
-        if (nwrite == 0) {
-                goto err_exit;
+        if (end == 0) {
+                return -1;
         }
 
-        memset(buf, 0, QMP_MAX_LENGTH);
-        if (qmp_read(qmpc->fd, buf, &nread) == -1) {
-                goto err_exit;
-        }
+        /* the reply is the last object before 'end' */
+        while ((olen = json_object_len(buf + off, end - off, &skip)) > 0 &&
+               off + skip + olen < end)
+                off += skip + olen;
 
-        if (strncasecmp(buf, QMP_COMMAND_MODE_OK, nread)) {
-                goto err_exit;
+        if (olen <= 0) {
+                return -1;
         }
 
-        return 0;
-
-err_exit:
-        dprintf("Failed to enter in command mode\n");
-        return -1;
+        return json_get_member(buf + off + skip, olen, "return", val, vlen);
 }
 
 /*
- * json looks like
- *
- * {"return": "RAX=ffffffff8101c9a0 RBX=ffffffff818e2880 
- *      RCX=ffffffff818550e0 RDX=0000000000000000\r\n
+ * write everything first, then poll all the connections until each one
+ * has a complete reply
  */
 static int
-qmp_populate_reg(const char *buf, const char *reg_name, uint64_t *reg)
+qmp_poll_execute_all(struct qmp_conn **conns, unsigned int n,
+                     const char *cmd, char **bufs, size_t size, size_t *lens)
 {
-        char *start;
-        start = strstr(buf, reg_name);
+        struct pollfd *pfds = xcalloc(n, sizeof(struct pollfd));
+        unsigned int *idx = xcalloc(n, sizeof(unsigned int));
+        size_t cmd_len = strlen(cmd);
+        uint64_t deadline;
+        unsigned int i, pending = 0, done = 0;
 
-        if (!start) {
-                return -1;
+        for (i = 0; i < n; i++) {
+                lens[i] = 0;
+                if (qmp_poll_write(conns[i], cmd, cmd_len) == cmd_len)
+                        idx[pending++] = i;
         }
 
-        while (start && *start) {
-                if (*start == '=') {
-                        start++;
+        deadline = xclock_ns() + QMP_BATCH_TIMEOUT * 1000000ULL;
+
+        while (pending) {
+                uint64_t now = xclock_ns();
+                unsigned int j;
+                int r;
+
+                if (now >= deadline)
                         break;
+
+                for (j = 0; j < pending; j++) {
+                        pfds[j].fd = conns[idx[j]]->fd;
+                        pfds[j].events = POLLIN;
                 }
-                start++;
-        }
 
-        if (sscanf(start, "%lx", reg) != 1) {
-                return -1;
+                r = poll(pfds, pending, (deadline - now) / 1000000ULL + 1);
+                QMP_IO_COUNT(syscalls, 1);
+                if (r == -1 && errno != EINTR)
+                        break;
+
+                for (j = 0; j < pending; ) {
+                        ssize_t nread = 0;
+
+                        i = idx[j];
+                        if (pfds[j].revents) {
+                                nread = read(conns[i]->fd, bufs[i] + lens[i],
+                                             size - 1 - lens[i]);
+                                QMP_IO_COUNT(syscalls, 1);
+                                if (nread > 0)
+                                        lens[i] += nread;
+                        }
+
+                        if ((pfds[j].revents && nread == 0) ||
+                            qmp_reply_end(bufs[i], lens[i]) ||
+                            lens[i] == size - 1) {
+                                bufs[i][lens[i]] = '\0';
+                                if (qmp_reply_end(bufs[i], lens[i]))
+                                        done++;
+                                /* drop it from the pending set */
+                                idx[j] = idx[--pending];
+                                pfds[j] = pfds[pending];
+                                continue;
+                        }
+                        j++;
+                }
         }
 
-        return 0;
+        QMP_IO_COUNT(commands, n);
+
+        xfree(pfds);
+        xfree(idx);
+        return done;
 }
 
-static int
-__qmp_get_x64_regs(char *buf, struct qregs *regs)
+const struct qmp_transport qmp_poll_transport = {
+        .name = "poll",
+        .read = qmp_poll_read,
+        .write = qmp_poll_write,
+        .read_some = qmp_poll_read_some,
+        .execute_all = qmp_poll_execute_all,
+};
+
+static const struct qmp_transport *qmp_transports[] = {
+        &qmp_poll_transport,
+        &qmp_uring_transport,
+        NULL
+};
+
+const struct qmp_transport *
+qmp_transport_find(const char *name)
 {
-        if (qmp_populate_reg(buf, "RAX", &regs->rax) == -1) {
-                dprintf("Failed to get register RAX\n");
-                goto err_exit;
-        }
+        unsigned int i;
 
-        if (qmp_populate_reg(buf, "RBX", &regs->rbx) == -1) {
-                dprintf("Failed to get register RBX\n");
-                goto err_exit;
+        for (i = 0; qmp_transports[i] != NULL; i++) {
+                if (streq(qmp_transports[i]->name, name))
+                        return qmp_transports[i];
         }
 
-        if (qmp_populate_reg(buf, "RCX", &regs->rcx) == -1) {
-                dprintf("Failed to get register RCX\n");
-                goto err_exit;
-        }
+        return NULL;
+}
 
-        if (qmp_populate_reg(buf, "RDX", &regs->rdx) == -1) {
-                dprintf("Failed to get register RDX\n");
-                goto err_exit;
-        }
+static const struct qmp_transport *
+qmp_transport(const struct qmp_conn *qmpc)
+{
+        return qmpc->transport ? qmpc->transport : &qmp_poll_transport;
+}
 
-        if (qmp_populate_reg(buf, "RSI", &regs->rsi) == -1) {
-                dprintf("Failed to get register RSI\n");
-                goto err_exit;
-        }
+unsigned int
+qmp_timeout(const struct qmp_conn *qmpc)
+{
+        if (qmpc->health && qmpc->health->timeout_ms)
+                return qmpc->health->timeout_ms;
+        return QMP_COMMAND_TIMEOUT;
+}
 
-        if (qmp_populate_reg(buf, "RDI", &regs->rdi) == -1) {
-                dprintf("Failed to get register RDI\n");
-                goto err_exit;
-        }
+static int
+qmp_quarantined(const struct qmp_conn *qmpc)
+{
+        const struct qmp_health *h = qmpc->health;
 
-        if (qmp_populate_reg(buf, "RBP", &regs->rbp) == -1) {
-                dprintf("Failed to get register RBP\n");
-                goto err_exit;
-        }
+        return h && !h->healing && __atomic_load_n(&h->until,
+                                                   __ATOMIC_ACQUIRE);
+}
 
-        if (qmp_populate_reg(buf, "RSP", &regs->rsp) == -1) {
-                dprintf("Failed to get register RSP\n");
-                goto err_exit;
-        }
+/* whatever the reply, it is not waited for any more */
+static void
+qmp_timed_out(const struct qmp_conn *qmpc)
+{
+        struct qmp_health *h = qmpc->health;
 
-        if (qmp_populate_reg(buf, "RIP", &regs->rip) == -1) {
-                dprintf("Failed to get register RIP\n");
-                goto err_exit;
+        if (!h) {
+                return;
         }
 
-        if (qmp_populate_reg(buf, "R8", &regs->r8) == -1) {
-                dprintf("Failed to get register R8\n");
-                goto err_exit;
-        }
+        __atomic_fetch_add(&h->timeouts, 1, __ATOMIC_RELAXED);
+        dprintf("'%s' missed a deadline of %ums, quarantined\n",
+                qmpc->qmp_sock_path, qmp_timeout(qmpc));
 
-        if (qmp_populate_reg(buf, "R9", &regs->r9) == -1) {
-                dprintf("Failed to get register R9\n");
-                goto err_exit;
+        /* qmp_heal() fails the attempt itself */
+        if (h->healing) {
+                return;
         }
 
-        if (qmp_populate_reg(buf, "R10", &regs->r10) == -1) {
-                dprintf("Failed to get register R10\n");
-                goto err_exit;
-        }
+        qmp_quarantine(qmpc);
+}
 
-        if (qmp_populate_reg(buf, "R11", &regs->r11) == -1) {
-                dprintf("Failed to get register R11\n");
-                goto err_exit;
-        }
+void
+qmp_quarantine(const struct qmp_conn *qmpc)
+{
+        struct qmp_health *h = qmpc->health;
 
-        if (qmp_populate_reg(buf, "R12", &regs->r12) == -1) {
-                dprintf("Failed to get register R12\n");
-                goto err_exit;
+        if (!h) {
+                return;
         }
 
-        if (qmp_populate_reg(buf, "R13", &regs->r13) == -1) {
-                dprintf("Failed to get register R13\n");
-                goto err_exit;
-        }
+        h->backoff = QMP_BACKOFF_MIN;
+        h->attempts = 0;
+        __atomic_store_n(&h->until, xclock_ns() + h->backoff * 1000000ULL,
+                         __ATOMIC_RELEASE);
+}
 
-        if (qmp_populate_reg(buf, "R14", &regs->r14) == -1) {
-                dprintf("Failed to get register R14\n");
-                goto err_exit;
-        }
+/*
+ * without a health to quarantine it, the connection is used on after a
+ * missed deadline; the reply is dropped when it comes instead of being
+ * taken for that of the next command, which goes tagged until then
+ */
+static void
+qmp_abandon(const struct qmp_conn *qmpc, int tagged, uint32_t id)
+{
+        struct qmp_pending *pd = qmpc->pending;
 
-        if (qmp_populate_reg(buf, "R15", &regs->r15) == -1) {
-                dprintf("Failed to get register R15\n");
-                goto err_exit;
+        if (qmpc->health || !pd) {
+                return;
         }
 
-        if (qmp_populate_reg(buf, "CR0", &regs->cr0) == -1) {
-                dprintf("Failed to get register CR0\n");
-                goto err_exit;
+        if (!tagged) {
+                pd->stale_untagged++;
+                return;
         }
 
-        if (qmp_populate_reg(buf, "CR2", &regs->cr2) == -1) {
-                dprintf("Failed to get register CR2\n");
-                goto err_exit;
+        /* the oldest is the least likely to come still */
+        if (pd->nstale == QMP_MAX_STALE) {
+                memmove(pd->stale, pd->stale + 1,
+                        (QMP_MAX_STALE - 1) * sizeof(uint32_t));
+                pd->nstale--;
         }
+        pd->stale[pd->nstale++] = id;
+}
 
-        if (qmp_populate_reg(buf, "CR3", &regs->cr3) == -1) {
-                dprintf("Failed to get register CR3\n");
-                goto err_exit;
-        }
+static int
+qmp_owes(const struct qmp_conn *qmpc)
+{
+        const struct qmp_pending *pd = qmpc->pending;
 
-        if (qmp_populate_reg(buf, "CR4", &regs->cr4) == -1) {
-                dprintf("Failed to get register CR4\n");
-                goto err_exit;
-        }
+        return pd && (pd->nstale || pd->stale_untagged);
+}
 
-        if (qmp_populate_reg(buf, "ES", &regs->es) == -1) {
-                dprintf("Failed to get register ES\n");
-                goto err_exit;
-        }
+/* bytes read past a reply, for whoever reads the connection next */
+static void
+qmp_pending_put(const struct qmp_conn *qmpc, const char *buf, size_t len)
+{
+        struct qmp_pending *pd = qmpc->pending;
 
-        if (qmp_populate_reg(buf, "CS", &regs->cs) == -1) {
-                dprintf("Failed to get register CS\n");
-                goto err_exit;
+        while (len && isspace((unsigned char) *buf)) {
+                buf++;
+                len--;
         }
-
-        if (qmp_populate_reg(buf, "SS", &regs->ss) == -1) {
-                dprintf("Failed to get register SS\n");
-                goto err_exit;
+        if (!pd || len == 0) {
+                return;
         }
 
-        if (qmp_populate_reg(buf, "SS", &regs->ds) == -1) {
-                dprintf("Failed to get register DS\n");
-                goto err_exit;
+        if (pd->size - pd->len < len) {
+                pd->size = pd->len + len + QMP_BUF_LEN;
+                pd->buf = xrealloc(pd->buf, pd->size);
         }
+        memcpy(pd->buf + pd->len, buf, len);
+        pd->len += len;
+}
 
-        if (qmp_populate_reg(buf, "GS", &regs->gs) == -1) {
-                dprintf("Failed to get register GS\n");
-                goto err_exit;
+/* the transport, plus the capture if one is running */
+static int
+qmp_conn_read(const struct qmp_conn *qmpc, char *buf, size_t size,
+              size_t *len)
+{
+        if (qmp_transport(qmpc)->read(qmpc, buf, size, len) == -1) {
+                return -1;
         }
 
-        if (qmp_populate_reg(buf, "FS", &regs->fs) == -1) {
-                dprintf("Failed to get register FS\n");
-                goto err_exit;
-        }
+        if (qmpc->recorder && *len)
+                qmp_record(qmpc->recorder, qmpc->rec_conn, QMP_REC_READ, buf,
+                           *len);
+        return 0;
+}
 
-        if (qmp_populate_reg(buf, "RFL", &regs->rflags) == -1) {
-                dprintf("Failed to get register RFLAGS\n");
-                goto err_exit;
-        }
+/* the whole reply for a transport that cannot do better */
+static int
+qmp_conn_read_some(const struct qmp_conn *qmpc, char *buf, size_t size,
+                   size_t *len)
+{
+        const struct qmp_transport *t = qmp_transport(qmpc);
 
-        if (qmp_populate_reg(buf, "EFER", &regs->efer) == -1) {
-                dprintf("Failed to get register MSR_EFER\n");
-                goto err_exit;
+        if (!t->read_some) {
+                return qmp_conn_read(qmpc, buf, size, len);
         }
 
-        if (qmp_populate_reg(buf, "CPL", &regs->cpl) == -1) {
-                dprintf("Failed to get register CPL\n");
-                goto err_exit;
+        if (t->read_some(qmpc, buf, size, len) == -1) {
+                return -1;
         }
 
+        if (qmpc->recorder && *len)
+                qmp_record(qmpc->recorder, qmpc->rec_conn, QMP_REC_READ, buf,
+                           *len);
         return 0;
+}
 
-err_exit:
-        return -1;
+static size_t
+qmp_conn_write(const struct qmp_conn *qmpc, const char *buf, size_t len)
+{
+        size_t nwrite = qmp_transport(qmpc)->write(qmpc, buf, len);
+
+        if (qmpc->recorder && nwrite)
+                qmp_record(qmpc->recorder, qmpc->rec_conn, QMP_REC_WRITE, buf,
+                           nwrite);
+        return nwrite;
+}
+
+int
+qmp_is_tcp(const char *path)
+{
+        return !strncmp(path, QMP_TCP_PREFIX, strlen(QMP_TCP_PREFIX));
 }
 
 static int
-__qmp_get_x86_regs(char *buf, struct qregs *regs)
+qmp_connect_unix(const char *path)
 {
-        if (qmp_populate_reg(buf, "EAX", &regs->rax) == -1) {
-                dprintf("Failed to get register RAX\n");
-                goto err_exit;
-        }
+        struct sockaddr_un saddr;
+        size_t path_len;
+        int s;
 
-        if (qmp_populate_reg(buf, "EBX", &regs->rbx) == -1) {
-                dprintf("Failed to get register RBX\n");
-                goto err_exit;
-        }
+        /* what -qmp unix:... was given */
+        if (!strncmp(path, QMP_UNIX_PREFIX, strlen(QMP_UNIX_PREFIX)))
+                path += strlen(QMP_UNIX_PREFIX);
 
-        if (qmp_populate_reg(buf, "ECX", &regs->rcx) == -1) {
-                dprintf("Failed to get register RCX\n");
-                goto err_exit;
+        if (!(path_len = strlen(path)) || path_len >= sizeof(saddr.sun_path)) {
+                return -1;
         }
 
-        if (qmp_populate_reg(buf, "EDX", &regs->rdx) == -1) {
-                dprintf("Failed to get register RDX\n");
-                goto err_exit;
+        if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+                return -1;
         }
 
-        if (qmp_populate_reg(buf, "ESI", &regs->rsi) == -1) {
-                dprintf("Failed to get register RSI\n");
-                goto err_exit;
-        }
+        memset(&saddr, 0, sizeof(struct sockaddr_un));
+        saddr.sun_family = AF_UNIX;
 
-        if (qmp_populate_reg(buf, "EDI", &regs->rdi) == -1) {
-                dprintf("Failed to get register RDI\n");
-                goto err_exit;
-        }
+        xstrlcpy(saddr.sun_path, path, sizeof(saddr.sun_path));
 
-        if (qmp_populate_reg(buf, "EBP", &regs->rbp) == -1) {
-                dprintf("Failed to get register RBP\n");
-                goto err_exit;
+        /* connect to it */
+        if (connect(s, (struct sockaddr *) &saddr,
+                        sizeof(struct sockaddr_un)) == -1) {
+                close(s);
+                return -1;
         }
 
-        if (qmp_populate_reg(buf, "ESP", &regs->rsp) == -1) {
-                dprintf("Failed to get register RSP\n");
-                goto err_exit;
-        }
+        return s;
+}
 
-        if (qmp_populate_reg(buf, "EIP", &regs->rip) == -1) {
-                dprintf("Failed to get register RIP\n");
-                goto err_exit;
-        }
+/*
+ * tcp:host:port, as given to -qmp; commands are small and latency bound,
+ * Nagle would hold every one of them back for the previous reply's ACK
+ */
+static int
+qmp_connect_tcp(const char *addr)
+{
+        struct addrinfo hints, *res, *ai;
+        char buf[256], *host = buf, *port;
+        size_t len;
+        int s = -1, r;
 
-        if (qmp_populate_reg(buf, "CR0", &regs->cr0) == -1) {
-                dprintf("Failed to get register CR0\n");
-                goto err_exit;
-        }
+        xstrlcpy(buf, addr + strlen(QMP_TCP_PREFIX), sizeof(buf));
 
-        if (qmp_populate_reg(buf, "CR2", &regs->cr2) == -1) {
-                dprintf("Failed to get register CR2\n");
-                goto err_exit;
+        if ((port = strrchr(buf, ':')) == NULL) {
+                return -1;
         }
+        *port++ = '\0';
 
-        if (qmp_populate_reg(buf, "CR3", &regs->cr3) == -1) {
-                dprintf("Failed to get register CR3\n");
-                goto err_exit;
+        len = strlen(host);
+        if (len > 2 && host[0] == '[' && host[len - 1] == ']') {
+                host[len - 1] = '\0';
+                host++;
         }
 
-        if (qmp_populate_reg(buf, "CR4", &regs->cr4) == -1) {
-                dprintf("Failed to get register CR4\n");
-                goto err_exit;
-        }
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
 
-        if (qmp_populate_reg(buf, "ES", &regs->es) == -1) {
-                dprintf("Failed to get register ES\n");
-                goto err_exit;
+        /* errno does not tell what went wrong */
+        if ((r = getaddrinfo(host[0] ? host : NULL, port, &hints,
+                             &res)) != 0) {
+                dprintf("Cannot resolve '%s' ('%s')\n", addr,
+                        gai_strerror(r));
+                return -1;
         }
 
-        if (qmp_populate_reg(buf, "CS", &regs->cs) == -1) {
-                dprintf("Failed to get register CS\n");
-                goto err_exit;
-        }
+        for (ai = res; ai != NULL; ai = ai->ai_next) {
+                if ((s = socket(ai->ai_family, ai->ai_socktype,
+                                ai->ai_protocol)) == -1) {
+                        continue;
+                }
+                if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+                        break;
 
-        if (qmp_populate_reg(buf, "SS", &regs->ss) == -1) {
-                dprintf("Failed to get register SS\n");
-                goto err_exit;
+                close(s);
+                s = -1;
         }
+        freeaddrinfo(res);
 
-        if (qmp_populate_reg(buf, "SS", &regs->ds) == -1) {
-                dprintf("Failed to get register DS\n");
-                goto err_exit;
+        if (s == -1) {
+                return -1;
         }
 
-        if (qmp_populate_reg(buf, "GS", &regs->gs) == -1) {
-                dprintf("Failed to get register GS\n");
-                goto err_exit;
+        /* a dead host or a cut link shows up within seconds, not hours */
+        if (xset_tcp_nodelay(s, 1) == -1 || xset_tcp_keepalive(s) == -1 ||
+            xset_tcp_keepalive_timers(s, QMP_TCP_KEEPIDLE, QMP_TCP_KEEPINTVL,
+                                      QMP_TCP_KEEPCNT) == -1) {
+                close(s);
+                return -1;
         }
 
-        if (qmp_populate_reg(buf, "FS", &regs->fs) == -1) {
-                dprintf("Failed to get register FS\n");
-                goto err_exit;
-        }
+        return s;
+}
 
-        if (qmp_populate_reg(buf, "EFL", &regs->rflags) == -1) {
-                dprintf("Failed to get register RFLAGS\n");
-                goto err_exit;
-        }
+int
+qmp_establish_conn(struct qmp_conn *qmpc)
+{
+        struct ucred cred;
+        socklen_t cred_len;
+        size_t nread;
 
-        if (qmp_populate_reg(buf, "EFER", &regs->efer) == -1) {
-                dprintf("Failed to get register MSR_EFER\n");
-                goto err_exit;
+        char buf[QMP_MAX_LENGTH];
+
+        if (qmp_is_tcp(qmpc->qmp_sock_path))
+                qmpc->fd = qmp_connect_tcp(qmpc->qmp_sock_path);
+        else
+                qmpc->fd = qmp_connect_unix(qmpc->qmp_sock_path);
+
+        if (qmpc->fd == -1) {
+                dprintf("Failed to connect to '%s' ('%s')\n",
+                        qmpc->qmp_sock_path, strerror(errno));
+                return -1;
         }
 
-        if (qmp_populate_reg(buf, "CPL", &regs->cpl) == -1) {
-                dprintf("Failed to get register CPL\n");
-                goto err_exit;
+        /* the qemu process, its vCPU threads are accounted from /proc */
+        qmpc->pid = 0;
+        cred_len = sizeof(cred);
+        if (!qmp_is_tcp(qmpc->qmp_sock_path) &&
+            getsockopt(qmpc->fd, SOL_SOCKET, SO_PEERCRED, &cred,
+                       &cred_len) == 0) {
+                qmpc->pid = cred.pid;
         }
 
-        return 0;
+        /* set non-block and read seq */
+        xsetnonblock(qmpc->fd);
 
-err_exit:
-        return -1;
-}
+        qmpc->oob = 0;
+        qmpc->pending = xcalloc(1, sizeof(struct qmp_pending));
 
-static int
-qmp_get_regs(char *buf, struct qregs *regs)
-{
-        if (strstr(buf, "RAX")) {
-                if (__qmp_get_x64_regs(buf, regs) == -1)
-                        return -1;
-                regs->mode = X64;
-        } else {
-                if (__qmp_get_x86_regs(buf, regs) == -1)
+        if (qmpc->recorder)
+                qmpc->rec_conn = qmp_record_attach(qmpc->recorder,
+                                                   qmpc->qmp_sock_path);
+
+        qmpc->priv = NULL;
+        if (qmpc->transport && qmpc->transport->attach &&
+            qmpc->transport->attach(qmpc) == -1) {
+                dprintf("Transport '%s' unavailable, falling back to '%s'\n",
+                        qmpc->transport->name, qmp_poll_transport.name);
+                qmpc->transport = &qmp_poll_transport;
+        }
+
+        /* qmp would send a greeting message when connected */
+        memset(buf, 0, QMP_MAX_LENGTH);
+
+        if (qmp_conn_read(qmpc, buf, QMP_MAX_LENGTH, &nread) == -1) {
+                qmp_close_conn(qmpc);
+                return -1;
+        }
+
+        if (nread == 0 && strncasecmp(buf, QMP_GREETING, 7)) {
+                dprintf("Failed to get QMP greeting message\n");
+                qmp_close_conn(qmpc);
+                return -1;
+        }
+
+        xstrlcpy(qmpc->greeting, buf, QMP_MAX_LENGTH);
+
+        return 0; 
+}
+
+int
+qmp_close_conn(const struct qmp_conn *qmpc)
+{
+        if (qmp_transport(qmpc)->detach) {
+                qmp_transport(qmpc)->detach(qmpc);
+        }
+
+        if (qmpc->pending) {
+                xfree(qmpc->pending->buf);
+                xfree(qmpc->pending);
+        }
+
+        if (qmpc->recorder)
+                qmp_record(qmpc->recorder, qmpc->rec_conn, QMP_REC_CLOSE,
+                           NULL, 0);
+
+        if (close(qmpc->fd) == -1) {
+                return -1;
+        }
+
+        return 0;
+}
+
+/*
+ * {"QMP": {"version": {...}, "capabilities": ["oob"]}}
+ */
+static int
+qmp_greeting_has_oob(const char *greeting)
+{
+        const char *qmp, *caps, *cap;
+        size_t qlen, clen, len, pos = 0;
+
+        if (json_get_member(greeting, strlen(greeting), "QMP", &qmp,
+                            &qlen) == -1 ||
+            json_get_member(qmp, qlen, "capabilities", &caps, &clen) == -1) {
+                return 0;
+        }
+
+        while (json_array_next(caps, clen, &pos, &cap, &len) == 1) {
+                if (json_string_eq(cap, len, "oob"))
+                        return 1;
+        }
+
+        return 0;
+}
+
+int
+qmp_negotiate(struct qmp_conn *qmpc)
+{
+        size_t cmd_len, nwrite, nread;
+        char buf[QMP_MAX_LENGTH];
+        const char *cmd = QMP_ENTER_COMMAND_MODE;
+        int oob = qmp_greeting_has_oob(qmpc->greeting);
+
+        if (oob) {
+                cmd = QMP_ENTER_COMMAND_MODE_OOB;
+        }
+
+        cmd_len = strlen(cmd);
+        nwrite = qmp_conn_write(qmpc, cmd, cmd_len);
+        if (nwrite == 0) {
+                goto err_exit;
+        }
+
+        memset(buf, 0, QMP_MAX_LENGTH);
+        if (qmp_conn_read(qmpc, buf, QMP_MAX_LENGTH, &nread) == -1) {
+                goto err_exit;
+        }
+
+        if (strncasecmp(buf, QMP_COMMAND_MODE_OK, nread)) {
+                goto err_exit;
+        }
+        qmpc->oob = oob;
+
+        return 0;
+
+err_exit:
+        dprintf("Failed to enter in command mode\n");
+        return -1;
+}
+
+int
+qmp_heal(struct qmp_conn *qmpc)
+{
+        struct qmp_health *h = qmpc->health;
+        uint64_t until, timeouts;
+
+        if (!h || !(until = __atomic_load_n(&h->until, __ATOMIC_ACQUIRE))) {
+                return 0;
+        }
+
+        if (xclock_ns() < until) {
+                return -1;
+        }
+
+        /* the late reply goes away with the socket */
+        if (qmpc->fd != -1) {
+                qmp_close_conn(qmpc);
+        }
+        qmpc->fd = -1;
+        qmpc->pending = NULL;
+        qmpc->priv = NULL;
+
+        if (qmp_establish_conn(qmpc) == 0) {
+                if (qmp_negotiate(qmpc) == 0) {
+                        /* qemu may have been replaced by another version */
+                        timeouts = __atomic_load_n(&h->timeouts,
+                                                   __ATOMIC_RELAXED);
+                        h->healing = 1;
+                        qmpc->schema = qmp_schema_get(qmpc);
+                        qmpc->arch = qmp_query_arch(qmpc);
+                        h->healing = 0;
+
+                        if (__atomic_load_n(&h->timeouts, __ATOMIC_RELAXED) ==
+                            timeouts) {
+                                dprintf("'%s' reconnected\n",
+                                        qmpc->qmp_sock_path);
+                                h->attempts = 0;
+                                h->reconnects++;
+                                __atomic_store_n(&h->until, 0,
+                                                 __ATOMIC_RELEASE);
+                                return 0;
+                        }
+                }
+                qmp_close_conn(qmpc);
+        }
+        qmpc->fd = -1;
+        qmpc->pending = NULL;
+        qmpc->priv = NULL;
+
+        h->attempts++;
+        if (h->backoff < QMP_BACKOFF_MAX / 2)
+                h->backoff *= 2;
+        else
+                h->backoff = QMP_BACKOFF_MAX;
+        __atomic_store_n(&h->until, xclock_ns() + h->backoff * 1000000ULL,
+                         __ATOMIC_RELEASE);
+
+        return -1;
+}
+
+static int
+__qmp_execute(const struct qmp_conn *qmpc, const char *cmd,
+              char *buf, size_t size, size_t *nread)
+{
+        struct qmp_timing *tm = qmpc->timing;
+        size_t cmd_len = strlen(cmd);
+        uint64_t sent;
+        uint32_t id;
+
+        if (qmp_quarantined(qmpc)) {
+                return -1;
+        }
+
+        /* a late reply may come first, this one is told apart by its id */
+        if (qmp_owes(qmpc)) {
+                if (qmp_send(qmpc, cmd, 0, &id) == -1) {
                         return -1;
-                regs->mode = X86;
+                }
+                return qmp_recv(qmpc, id, buf, size, nread);
+        }
+
+        sent = xclock_ns();
+        if (tm) {
+                tm->sent = sent;
+        }
+
+        if (qmp_conn_write(qmpc, cmd, cmd_len) != cmd_len) {
+                return -1;
+        }
+
+        if (qmp_conn_read(qmpc, buf, size, nread) == -1) {
+                return -1;
+        }
+
+        /* cut off by the deadline, not by qemu going away */
+        if ((*nread == 0 || !qmp_reply_end(buf, *nread)) &&
+            xclock_ns() - sent >= qmp_timeout(qmpc) * 1000000ULL) {
+                qmp_timed_out(qmpc);
+                /* a part of it could not be told from the next */
+                if (*nread == 0)
+                        qmp_abandon(qmpc, 0, 0);
+                return -1;
+        }
+
+        if (*nread == 0) {
+                return -1;
+        }
+        QMP_IO_COUNT(commands, 1);
+
+        if (tm) {
+                uint64_t done = xclock_ns();
+
+                /* the poll transport idles a while after the last byte */
+                tm->rtt_ns += done - tm->sent;
+                tm->service_ns += (tm->last_rx > tm->sent ? tm->last_rx :
+                                   done) - tm->sent;
+                tm->commands++;
         }
 
         return 0;
 }
 
+int
+qmp_execute(const struct qmp_conn *qmpc, const char *cmd,
+            char *buf, size_t size, size_t *nread)
+{
+        /* a command that changes anything always goes to qemu */
+        if (qmpc->cache && qmp_cache_readonly(cmd, strlen(cmd)) &&
+            qmp_cache_lookup(qmpc->cache, qmpc->qmp_sock_path, cmd, buf,
+                             size, nread) == 0) {
+                return 0;
+        }
+
+        if (__qmp_execute(qmpc, cmd, buf, size, nread) == -1) {
+                return -1;
+        }
+
+        if (qmpc->cache) {
+                qmp_cache_update(qmpc->cache, qmpc->qmp_sock_path,
+                                 cmd, buf, *nread);
+        }
+
+        return 0;
+}
+
+int
+qmp_execute_uncached(const struct qmp_conn *qmpc, const char *cmd,
+                     char *buf, size_t size, size_t *nread)
+{
+        return __qmp_execute(qmpc, cmd, buf, size, nread);
+}
+
+int
+qmp_execute_stream(const struct qmp_conn *qmpc, const char *cmd,
+                   struct qmp_stream *s)
+{
+        struct qmp_timing *tm = qmpc->timing;
+        size_t cmd_len = strlen(cmd), len, used, fed = 0;
+        char *buf;
+        int r = 0;
+
+        if (qmp_quarantined(qmpc)) {
+                return -1;
+        }
+
+        /* a late reply may come first, the whole of this one is needed */
+        if (qmp_owes(qmpc)) {
+                buf = xmalloc(QMP_SNAPSHOT_BUF_LEN);
+                if (__qmp_execute(qmpc, cmd, buf, QMP_SNAPSHOT_BUF_LEN,
+                                  &len) == 0)
+                        r = qmp_stream_feed(s, buf, len, &used);
+                xfree(buf);
+                return r == 1 ? 0 : -1;
+        }
+
+        if (tm) {
+                tm->sent = xclock_ns();
+        }
+
+        if (qmp_conn_write(qmpc, cmd, cmd_len) != cmd_len) {
+                return -1;
+        }
+
+        buf = xmalloc(QMP_BUF_LEN);
+        while (r == 0) {
+                if (qmp_conn_read_some(qmpc, buf, QMP_BUF_LEN, &len) == -1) {
+                        r = -1;
+                        break;
+                }
+                /* nothing for QMP_BATCH_TIMEOUT */
+                if (len == 0) {
+                        qmp_timed_out(qmpc);
+                        if (fed == 0)
+                                qmp_abandon(qmpc, 0, 0);
+                        r = -1;
+                        break;
+                }
+                fed += len;
+                r = qmp_stream_feed(s, buf, len, &used);
+                /* events that came after it, not the next reply */
+                if (r != 0)
+                        qmp_pending_put(qmpc, buf + used, len - used);
+        }
+        xfree(buf);
+
+        if (r == -1) {
+                return -1;
+        }
+        QMP_IO_COUNT(commands, 1);
+
+        if (tm) {
+                uint64_t done = xclock_ns();
+
+                tm->rtt_ns += done - tm->sent;
+                tm->service_ns += (tm->last_rx > tm->sent ? tm->last_rx :
+                                   done) - tm->sent;
+                tm->commands++;
+        }
+
+        return 0;
+}
+
+/*
+ * "ffffffff818c1f68: 0xffffffff818c1f88 0xffffffff8101c9c6\r\n", or
+ * "ffffffff818c1f68: Cannot access memory" past the end of a mapping
+ */
+int
+qmp_read_guest(const struct qmp_conn *qmpc, unsigned int cpu, uint64_t addr,
+               uint8_t *dst, size_t len)
+{
+        char cmd[QMP_MAX_LENGTH];
+        size_t size = len * 4 + QMP_BUF_LEN, nread, vlen, n = 0;
+        const char *val, *p, *end;
+        char *buf, *q;
+        uint64_t v;
+        int r = -1;
+
+        if (len == 0 || len % 8 || len > QMP_MEMORY_DUMP_MAX) {
+                return -1;
+        }
+
+        snprintf(cmd, sizeof(cmd), QMP_COMMAND_MEMORY_DUMP, len / 8, addr,
+                 cpu);
+
+        buf = xmalloc(size);
+        if (qmp_execute_uncached(qmpc, cmd, buf, size, &nread) == -1 ||
+            qmp_reply_return(buf, nread, &val, &vlen) == -1 ||
+            memmem(val, vlen, "Cannot access", 13)) {
+                goto out;
+        }
+
+        for (p = val, end = val + vlen; n < len / 8 &&
+             (p = memmem(p, end - p, " 0x", 3)) != NULL; p = q) {
+                v = strtoull(p + 3, &q, 16);
+                if (q == p + 3)
+                        break;
+                memcpy(dst + n * 8, &v, 8);
+                n++;
+        }
+
+        if (n == len / 8)
+                r = 0;
+out:
+        xfree(buf);
+        return r;
+}
+
+int
+qmp_pmemsave(const struct qmp_conn *qmpc, uint64_t addr, uint64_t size,
+             const char *path)
+{
+        uint64_t deadline = xclock_ns() + QMP_PMEMSAVE_TIMEOUT * 1000000ULL;
+        size_t clen = strlen(QMP_COMMAND_PMEMSAVE) + strlen(path) + 64;
+        size_t len = 0, nread;
+        const char *val;
+        size_t vlen;
+        char *cmd, *buf;
+        int r = -1;
+
+        /* the path goes into a JSON string as is, and qemu has its own cwd */
+        if (path[0] != '/' || strpbrk(path, "\"\\")) {
+                dprintf("pmemsave: '%s' is not a plain absolute path\n", path);
+                return -1;
+        }
+
+        cmd = xmalloc(clen);
+        snprintf(cmd, clen, QMP_COMMAND_PMEMSAVE, addr, size, path);
+        if (qmp_conn_write(qmpc, cmd, strlen(cmd)) != strlen(cmd)) {
+                xfree(cmd);
+                return -1;
+        }
+        xfree(cmd);
+
+        /* the reply comes once the dump is on disk, past any idle timeout */
+        buf = xmalloc(QMP_BUF_LEN);
+        while (xclock_ns() < deadline && len < QMP_BUF_LEN - 1) {
+                if (qmp_conn_read_some(qmpc, buf + len, QMP_BUF_LEN - len,
+                                       &nread) == -1)
+                        break;
+                len += nread;
+                if (len && qmp_reply_end(buf, len)) {
+                        r = qmp_reply_return(buf, len, &val, &vlen);
+                        break;
+                }
+        }
+
+        if (r == -1)
+                dprintf("pmemsave: qemu did not write '%s'\n", path);
+        xfree(buf);
+        return r;
+}
+
+/*
+ * append 'cmd', tagged with the next id, to 'msg'; room for the command
+ * plus QMP_TAG_ROOM is enough
+ */
+static int
+qmp_format(const struct qmp_conn *qmpc, const char *cmd, int flags,
+           char *msg, size_t mlen, uint32_t *id)
+{
+        const char *exec, *args;
+        size_t elen, alen, skip;
+        char name[QMP_MAX_LENGTH];
+        ssize_t olen;
+        int oob = 0;
+
+        if ((olen = json_object_len(cmd, strlen(cmd), &skip)) <= 0) {
+                return -1;
+        }
+        cmd += skip;
+
+        if (json_get_member(cmd, olen, "execute", &exec, &elen) == -1 &&
+            json_get_member(cmd, olen, "exec-oob", &exec, &elen) == -1) {
+                return -1;
+        }
+        if (json_get_member(cmd, olen, "arguments", &args, &alen) == -1) {
+                args = NULL;
+        }
+
+        /* qemu refuses exec-oob for commands not marked allow-oob */
+        if ((flags & QMP_SEND_OOB) && qmpc->oob && qmpc->schema &&
+            elen >= 2 && elen - 2 < sizeof(name)) {
+                memcpy(name, exec + 1, elen - 2);
+                name[elen - 2] = '\0';
+                oob = qmp_schema_allows_oob(qmpc->schema, name);
+        }
+
+        *id = ++qmpc->pending->next_id;
+
+        return snprintf(msg, mlen, "{\"%s\": %.*s%s%.*s, \"id\": %u}",
+                        oob ? "exec-oob" : "execute", (int) elen, exec,
+                        args ? ", \"arguments\": " : "",
+                        args ? (int) alen : 0, args ? args : "", *id);
+}
+
+int
+qmp_send(const struct qmp_conn *qmpc, const char *cmd, int flags,
+         uint32_t *id)
+{
+        return qmp_send_batch(qmpc, &cmd, 1, flags, id);
+}
+
+int
+qmp_send_batch(const struct qmp_conn *qmpc, const char **cmds,
+               unsigned int n, int flags, uint32_t *ids)
+{
+        size_t mlen = 0, len = 0;
+        unsigned int i;
+        char *msg;
+        int r;
+
+        if (qmp_quarantined(qmpc)) {
+                return -1;
+        }
+
+        for (i = 0; i < n; i++)
+                mlen += strlen(cmds[i]) + QMP_TAG_ROOM;
+
+        msg = xmalloc(mlen);
+        for (i = 0; i < n; i++) {
+                r = qmp_format(qmpc, cmds[i], flags, msg + len, mlen - len,
+                               &ids[i]);
+                if (r < 0) {
+                        xfree(msg);
+                        return -1;
+                }
+                len += r;
+        }
+
+        /* one write, the whole batch reaches qemu at once */
+        if (qmp_conn_write(qmpc, msg, len) != len) {
+                xfree(msg);
+                return -1;
+        }
+
+        xfree(msg);
+        return 0;
+}
+
+/* the late reply to 'id', if it was given up on; it is not owed anymore */
+static int
+qmp_pending_stale(struct qmp_pending *pd, uint64_t id)
+{
+        unsigned int i;
+
+        for (i = 0; i < pd->nstale; i++) {
+                if (pd->stale[i] == id) {
+                        pd->stale[i] = pd->stale[--pd->nstale];
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * hand out the reply to 'id' if it is in, events are passed to the cache
+ * and dropped, and so are the replies given up on; replies to other ids
+ * are left where they are
+ */
+static int
+qmp_pending_take(const struct qmp_conn *qmpc, uint32_t id, char *buf,
+                 size_t size, size_t *nread)
+{
+        struct qmp_pending *pd = qmpc->pending;
+        size_t off = 0, skip, vlen, end;
+        const char *obj, *val;
+        ssize_t olen;
+        int taken = 0;
+
+        while ((olen = json_object_len(pd->buf + off, pd->len - off,
+                                       &skip)) > 0) {
+                obj = pd->buf + off + skip;
+                end = off + skip + olen;
+
+                if (json_get_member(obj, olen, "event", &val, &vlen) == 0) {
+                        if (qmpc->cache)
+                                qmp_cache_observe(qmpc->cache,
+                                                  qmpc->qmp_sock_path,
+                                                  obj, olen);
+                        if (pd->on_event)
+                                pd->on_event(obj, olen, pd->arg);
+                } else if (json_get_member(obj, olen, "id", &val,
+                                           &vlen) == -1) {
+                        /* in-band, so before any reply to a later command */
+                        if (!pd->stale_untagged) {
+                                off = end;
+                                continue;
+                        }
+                        pd->stale_untagged--;
+                } else if (json_to_u64(val, vlen) == id) {
+                        *nread = (size_t) olen < size - 1 ? (size_t) olen :
+                                                            size - 1;
+                        memcpy(buf, obj, *nread);
+                        buf[*nread] = '\0';
+                        taken = 1;
+                } else if (!qmp_pending_stale(pd, json_to_u64(val, vlen))) {
+                        off = end;
+                        continue;
+                }
+
+                memmove(pd->buf + off, pd->buf + end, pd->len - end);
+                pd->len -= end - off;
+
+                if (taken)
+                        return 0;
+        }
+
+        return -1;
+}
+
+int
+qmp_recv(const struct qmp_conn *qmpc, uint32_t id, char *buf, size_t size,
+         size_t *nread)
+{
+        struct qmp_pending *pd = qmpc->pending;
+        uint64_t deadline = xclock_ns() + QMP_BATCH_TIMEOUT * 1000000ULL;
+        size_t len;
+
+        for (;;) {
+                if (pd->len && qmp_pending_take(qmpc, id, buf, size,
+                                                nread) == 0) {
+                        QMP_IO_COUNT(commands, 1);
+                        return 0;
+                }
+
+                if (xclock_ns() >= deadline) {
+                        qmp_timed_out(qmpc);
+                        qmp_abandon(qmpc, 1, id);
+                        return -1;
+                }
+
+                if (pd->size - pd->len < QMP_BUF_LEN) {
+                        pd->size = pd->len + 2 * QMP_BUF_LEN;
+                        pd->buf = xrealloc(pd->buf, pd->size);
+                }
+
+                if (qmp_conn_read(qmpc, pd->buf + pd->len,
+                                  pd->size - pd->len, &len) == -1) {
+                        return -1;
+                }
+                pd->len += len;
+        }
+}
+
+int
+qmp_execute_oob(const struct qmp_conn *qmpc, const char *cmd,
+                char *buf, size_t size, size_t *nread)
+{
+        uint32_t id;
+
+        if (qmp_send(qmpc, cmd, QMP_SEND_OOB, &id) == -1) {
+                return -1;
+        }
+
+        return qmp_recv(qmpc, id, buf, size, nread);
+}
+
+int
+qmp_execute_all(struct qmp_conn **conns, unsigned int n, const char *cmd,
+                char **bufs, size_t size, size_t *lens)
+{
+        unsigned int i;
+        int r;
+
+        if (n == 0) {
+                return 0;
+        }
+
+        /* all the connections are expected to share one transport */
+        r = qmp_transport(conns[0])->execute_all(conns, n, cmd, bufs, size,
+                                                 lens);
+
+        /* the transport did the I/O, a whole reply counts as one read */
+        for (i = 0; i < n; i++) {
+                if (!conns[i]->recorder)
+                        continue;
+                qmp_record(conns[i]->recorder, conns[i]->rec_conn,
+                           QMP_REC_WRITE, cmd, strlen(cmd));
+                if (lens[i])
+                        qmp_record(conns[i]->recorder, conns[i]->rec_conn,
+                                   QMP_REC_READ, bufs[i], lens[i]);
+        }
+
+        return r;
+}
+
+/*
+ * json looks like
+ *
+ * {"return": "RAX=ffffffff8101c9a0 RBX=ffffffff818e2880
+ *      RCX=ffffffff818550e0 RDX=0000000000000000\r\n
+ */
+static int
+qmp_get_regs(const struct qregs_arch_desc *arch, const char *buf,
+             struct qregs *regs)
+{
+        if (qregs_parse(arch, buf, strlen(buf), regs) == -1) {
+                dprintf("Failed to get the program counter\n");
+                return -1;
+        }
+
+        return 0;
+}
+
+/* everything the table of the architecture has, four per line */
+static void
+qmp_dump_regs_generic(const struct qregs *regs)
+{
+        const struct qregs_arch_desc *arch = qregs_arch_get(regs->mode);
+        unsigned int i;
+
+        for (i = 0; arch && i < arch->count; i++) {
+                const struct qregs_desc *d = &arch->descs[i];
+
+                dprintf("%s=0x%.16lx%s", d->name,
+                        *(const uint64_t *) ((const char *) regs + d->off),
+                        i % 4 == 3 || i == arch->count - 1 ? "\n" : ", ");
+        }
+}
+
 static void
 qmp_dump_regs(const struct qregs *regs)
 {
-        if (regs->mode == X64) {
+        if (regs->mode != X64 && regs->mode != X86) {
+                qmp_dump_regs_generic(regs);
+        } else if (regs->mode == X64) {
                 dprintf("RAX=0x%.16lx, RBX=0x%.16lx, RCX=0x%.16lx, RDX=0x%.16lx\n",
                                 regs->rax, regs->rbx, regs->rcx, regs->rdx);
 
@@ -489,65 +1353,101 @@ qmp_dump_regs(const struct qregs *regs)
                 dprintf("ESI=0x%.8lx, EDI=0x%.8lx, EBP=0x%.8lx, ESP=0x%.8lx\n",
                                 regs->rsi, regs->rdi, regs->rbp, regs->rsp);
 
-                dprintf("EIP=0%.8lx, CPL=%.1lu\n", regs->rip, regs->cpl);
+                dprintf("EIP=0%.8lx, CPL=%.1lu\n", regs->rip, regs->cpl);
+
+                dprintf("CR0=0x%.8lx, CR2=0x%.8lx, CR3=0x%.8lx, CR4=0x%.8lx\n",
+                                regs->cr0, regs->cr2, regs->cr3, regs->cr4);
+        }
+}
+
+int
+qmp_query_regs(const struct qmp_conn *qmpc, struct qregs *regs)
+{
+        size_t nread;
+        char *buf;
+
+        buf = xmalloc(QMP_BUF_LEN);
+        memset(buf, 0, QMP_BUF_LEN);
+
+        if (qmp_execute(qmpc, QMP_COMMAND_INFO_REGS, buf, QMP_BUF_LEN,
+                        &nread) == -1) {
+                xfree(buf);
+                return -1;
+        }
+
+        memset(regs, 0, sizeof(struct qregs));
+
+        if (qmp_get_regs(qmpc->arch, buf, regs) == -1) {
+                xfree(buf);
+                return -1;
+        }
+
+        xfree(buf);
+
+        return 0;
+}
 
-                dprintf("CR0=0x%.8lx, CR2=0x%.8lx, CR3=0x%.8lx, CR4=0x%.8lx\n",
-                                regs->cr0, regs->cr2, regs->cr3, regs->cr4);
+const struct qregs_arch_desc *
+qmp_query_arch(const struct qmp_conn *qmpc)
+{
+        const struct qregs_arch_desc *arch = NULL;
+        const char *ret, *val;
+        size_t nread, rlen, vlen;
+        char *buf = xmalloc(QMP_BUF_LEN);
+
+        if (qmp_execute(qmpc, QMP_COMMAND_QUERY_TARGET, buf, QMP_BUF_LEN,
+                        &nread) == 0 &&
+            qmp_reply_return(buf, nread, &ret, &rlen) == 0 &&
+            json_get_member(ret, rlen, "arch", &val, &vlen) == 0 &&
+            vlen >= 2) {
+                arch = qregs_arch_find(val + 1, vlen - 2);
         }
+
+        xfree(buf);
+        return arch;
 }
 
 int
 qmp_show_regs(const struct qmp_conn *qmpc)
 {
-        size_t nread, nwrite, cmd_len_regs;
-        char *buf;
         struct qregs regs;
 
-        cmd_len_regs = strlen(QMP_COMMAND_INFO_REGS);
-        
-        nwrite = xwrite(qmpc->fd, QMP_COMMAND_INFO_REGS, cmd_len_regs);
-        if (nwrite != cmd_len_regs) {
-                return -1;
-        }
-
-        buf = xmalloc(QMP_BUF_LEN);
-        memset(buf, 0, QMP_BUF_LEN);
-
-        if (qmp_read(qmpc->fd, buf, &nread) == -1 || nread <= 0) {
-                return -1;
-        }
-
-        memset(&regs, 0, sizeof(struct qregs));
-
-        if (qmp_get_regs(buf, &regs) == -1) {
+        if (qmp_query_regs(qmpc, &regs) == -1) {
                 return -1;
         }
 
         qmp_dump_regs(&regs);
 
-        xfree(buf);
-
         return 0;
 }
 
-static int
+int
 qmp_parse_cpu_line(const char *str, struct vcpu *vcpu)
 {
         uint8_t id;
         uint64_t pc;
         char *state = NULL;
+        const char *tid;
         int r;
 
         /* allocate using glibc %m */
         r = sscanf(str, " #%hhu: pc=0x%lx (%m[a-z]*", &id, &pc, &state);
-        if (r < 2) {
+        if (r < 1) {
                 return -1;
         }
         
         vcpu->id = id;
-        vcpu->pc = pc;
+        vcpu->pc = r < 2 ? 0 : pc;
 
-        if (state) {
+        /* the host thread backing the vCPU */
+        if ((tid = strstr(str, "thread_id=")) != NULL) {
+                vcpu->thread_id = atoi(tid + 10);
+        }
+
+        if (r < 2) {
+                /* newer qemu prints the thread only */
+                vcpu->state = UNDEFINED;
+        } else if (state) {
                 if (!strncasecmp(state, "halted", 6)) {
                         vcpu->state = HALTED;
                 } else {
@@ -573,33 +1473,159 @@ qmp_parse_cpu_line(const char *str, struct vcpu *vcpu)
  *      CPU #1: pc=0xffffffff81051c02 (halted) thread_id=5133\r\n"}
  */
 static int
-qmp_get_vcpus(char *buf, struct vcpus *vcpus)
+qmp_get_vcpus(char *buf, size_t len, struct vcpus *vcpus)
+{
+        const char *p = buf, *end = buf + len, *next;
+        char line[QMP_MAX_LENGTH];
+        size_t llen;
+
+        /* a line runs up to the next vCPU, the escaped line ending in */
+        while ((p = memmem(p, end - p, "CPU #", 5)) != NULL) {
+                struct vcpu *vcpu;
+
+                p += 3;
+                next = memmem(p, end - p, "CPU #", 5);
+                llen = (next ? next : end) - p;
+                if (llen > sizeof(line) - 1)
+                        llen = sizeof(line) - 1;
+                memcpy(line, p, llen);
+                line[llen] = '\0';
+
+                vcpu = xmalloc(sizeof(struct vcpu));
+                if (qmp_parse_cpu_line(line, vcpu) == -1) {
+                        xfree(vcpu);
+                        return -1;
+                }
+
+                /* next vcpu */
+                vcpu->next = vcpus->vcpu;
+                vcpus->vcpu = vcpu;
+                vcpus->count++;
+        }
+
+        return vcpus->count ? 0 : -1;
+}
+
+/*
+ * query-cpus:
+ * {"return": [{"current": true, "CPU": 0, "pc": 18446744071579163650,
+ *      "halted": true, "qom_path": "/machine/unattached/device[0]",
+ *      "arch": "x86", "thread_id": 5132}, ...]}
+ *
+ * query-cpus-fast:
+ * {"return": [{"thread-id": 5132, "props": {...}, "qom-path": "...",
+ *      "cpu-index": 0, "target": "x86_64"}, ...]}
+ *
+ * the key names differ, anything missing is left 0
+ */
+static int
+qmp_get_vcpus_array(char *buf, size_t len, struct vcpus *vcpus,
+                    const char *id_key, const char *tid_key)
 {
-        char *r, *ptr;
+        const char *arr, *elem, *val;
+        size_t alen, elen, vlen, pos = 0;
+        int r;
 
-        if (!(r = strstr(buf, "CPU"))) {
+        if (qmp_reply_return(buf, len, &arr, &alen) == -1) {
                 return -1;
         }
 
-        ptr = strtok(r, "CPU");
-        while (ptr) {
-
-                struct vcpu *vcpu = xmalloc(sizeof(struct vcpu));
+        while ((r = json_array_next(arr, alen, &pos, &elem, &elen)) == 1) {
+                struct vcpu *vcpu;
 
-                if (qmp_parse_cpu_line(ptr, vcpu) == -1) {
-                        xfree(vcpu);
+                if (json_get_member(elem, elen, id_key, &val, &vlen) == -1)
                         return -1;
-                }
 
-                /* next vcpu */
+                vcpu = xcalloc(1, sizeof(struct vcpu));
+                vcpu->id = json_to_u64(val, vlen);
+                vcpu->state = UNDEFINED;
+
+                if (json_get_member(elem, elen, tid_key, &val, &vlen) == 0)
+                        vcpu->thread_id = json_to_u64(val, vlen);
+                if (json_get_member(elem, elen, "pc", &val, &vlen) == 0)
+                        vcpu->pc = json_to_u64(val, vlen);
+                if (json_get_member(elem, elen, "halted", &val, &vlen) == 0)
+                        vcpu->state = json_to_u64(val, vlen) ? HALTED :
+                                                               RUNNING;
+
+                /* same order as the HMP list */
                 vcpu->next = vcpus->vcpu;
                 vcpus->vcpu = vcpu;
                 vcpus->count++;
+        }
+
+        return r == -1 || vcpus->count == 0 ? -1 : 0;
+}
+
+static int
+qmp_get_query_cpus(char *buf, size_t len, struct vcpus *vcpus)
+{
+        return qmp_get_vcpus_array(buf, len, vcpus, "CPU", "thread_id");
+}
+
+static int
+qmp_get_query_cpus_fast(char *buf, size_t len, struct vcpus *vcpus)
+{
+        return qmp_get_vcpus_array(buf, len, vcpus, "cpu-index", "thread-id");
+}
+
+/*
+ * ways to carry out an operation, cheapest first; the last one is HMP,
+ * always there, and the only one tried when the schema is unknown
+ */
+struct qmp_vcpus_op {
+        /* the command that has to be in the schema */
+        const char *requires;
+        const char *cmd;
+        int (*parse)(char *buf, size_t len, struct vcpus *vcpus);
+};
 
-                ptr = strtok(NULL, "CPU");
+/*
+ * everything, pc and state included, which only HMP has: query-cpus is
+ * gone from qemu 6.0 and kicks every vCPU, query-cpus-fast lacks both
+ */
+static const struct qmp_vcpus_op qmp_vcpus_ops[] = {
+        { NULL, QMP_COMMAND_INFO_CPU, qmp_get_vcpus },
+};
+
+/* ids and threads, query-cpus-fast does not interrupt the guest */
+static const struct qmp_vcpus_op qmp_vcpu_threads_ops[] = {
+        { "query-cpus-fast", QMP_COMMAND_QUERY_CPUS_FAST,
+          qmp_get_query_cpus_fast },
+        { "query-cpus", QMP_COMMAND_QUERY_CPUS, qmp_get_query_cpus },
+        { NULL, QMP_COMMAND_INFO_CPU, qmp_get_vcpus },
+};
+
+static const struct qmp_vcpus_op *
+qmp_pick_op(const struct qmp_conn *qmpc, const struct qmp_vcpus_op *ops)
+{
+        for (; ops->requires; ops++) {
+                if (qmpc->schema && qmp_schema_has(qmpc->schema,
+                                                   ops->requires))
+                        break;
         }
 
-        return 0;
+        return ops;
+}
+
+static void
+qmp_dump_vcpu(const struct vcpu *cpu)
+{
+        dprintf("CPU#%u, PC=0x%lx, TID=%d, ", cpu->id, cpu->pc,
+                        (int) cpu->thread_id);
+        dprintf("State: ");
+        switch (cpu->state) {
+        case RUNNING:
+                dprintf("Running");
+        break;
+        case HALTED:
+                dprintf("Halted");
+        break;
+        case UNDEFINED:
+                dprintf("Undef");
+        break;
+        }
+        dprintf("\n");
 }
 
 static void
@@ -607,26 +1633,12 @@ qmp_dump_vcpus(const struct vcpus *vcpus)
 {
         struct vcpu *cpu;
 
-        for (cpu = vcpus->vcpu; cpu != NULL; cpu = cpu->next) {
-                dprintf("CPU#%u, PC=0x%lx, ", cpu->id, cpu->pc);
-                dprintf("State: ");
-                switch (cpu->state) {
-                case RUNNING:
-                        dprintf("Running");
-                break;
-                case HALTED:
-                        dprintf("Halted");
-                break;
-                case UNDEFINED:
-                        dprintf("Undef");
-                break;
-                }
-                dprintf("\n");
-        }
+        for (cpu = vcpus->vcpu; cpu != NULL; cpu = cpu->next)
+                qmp_dump_vcpu(cpu);
 }
 
-static void
-qmp_clean_vpcus(struct vcpus *vcpus)
+void
+qmp_release_vcpus(struct vcpus *vcpus)
 {
         struct vcpu *v = vcpus->vcpu;
 
@@ -641,42 +1653,438 @@ qmp_clean_vpcus(struct vcpus *vcpus)
                         v = vn;
                 }
         }
+
+        vcpus->vcpu = NULL;
+        vcpus->count = 0;
 }
 
-int
-qmp_show_vcpus(const struct qmp_conn *qmpc)
+static int
+__qmp_query_vcpus(const struct qmp_conn *qmpc, const struct qmp_vcpus_op *ops,
+                  struct vcpus *vcpus)
 {
-        size_t nread, nwrite, cmd_len_regs;
+        const struct qmp_vcpus_op *op = qmp_pick_op(qmpc, ops);
+        size_t nread;
         char *buf;
-        struct vcpus vcpus;
 
-        cmd_len_regs = strlen(QMP_COMMAND_INFO_CPU);
-        
-        nwrite = xwrite(qmpc->fd, QMP_COMMAND_INFO_CPU, cmd_len_regs);
-        if (nwrite != cmd_len_regs) {
+        buf = xmalloc(QMP_BUF_LEN);
+        memset(buf, 0, QMP_BUF_LEN);
+        memset(vcpus, 0, sizeof(struct vcpus));
+
+        if (qmp_execute(qmpc, op->cmd, buf, QMP_BUF_LEN, &nread) == -1) {
+                xfree(buf);
                 return -1;
         }
 
-        buf = xmalloc(QMP_BUF_LEN);
-        memset(buf, 0, QMP_BUF_LEN);
+        if (op->parse(buf, nread, vcpus) == -1) {
+                qmp_release_vcpus(vcpus);
+                xfree(buf);
+                return -1;
+        }
+
+        xfree(buf);
+
+        return 0;
+}
+
+int
+qmp_query_vcpus(const struct qmp_conn *qmpc, struct vcpus *vcpus)
+{
+        return __qmp_query_vcpus(qmpc, qmp_vcpus_ops, vcpus);
+}
+
+int
+qmp_query_vcpu_threads(const struct qmp_conn *qmpc, struct vcpus *vcpus)
+{
+        return __qmp_query_vcpus(qmpc, qmp_vcpu_threads_ops, vcpus);
+}
+
+/* commands qemu may run out of band that change nothing, best first */
+static const struct {
+        const char *name;
+        const char *cmd;
+} qmp_probe_cmds[] = {
+        { "query-yank", QMP_COMMAND_QUERY_YANK },
+        { "x-oob-test", QMP_COMMAND_OOB_TEST },
+};
+#define QMP_PROBES      (sizeof(qmp_probe_cmds) / sizeof(qmp_probe_cmds[0]))
+
+int
+qmp_probe(const struct qmp_conn *qmpc, uint64_t *rtt_ns)
+{
+        char buf[QMP_MAX_LENGTH];
+        uint64_t start;
+        unsigned int i;
+        size_t nread;
+
+        if (!qmpc->oob || !qmpc->schema) {
+                return 0;
+        }
+
+        for (i = 0; i < QMP_PROBES; i++) {
+                if (qmp_schema_allows_oob(qmpc->schema,
+                                          qmp_probe_cmds[i].name))
+                        break;
+        }
+        if (i == QMP_PROBES) {
+                return 0;
+        }
 
-        if (qmp_read(qmpc->fd, buf, &nread) == -1 || nread <= 0) {
+        /* an error is an answer too */
+        start = xclock_ns();
+        if (qmp_execute_oob(qmpc, qmp_probe_cmds[i].cmd, buf, sizeof(buf),
+                            &nread) == -1) {
                 return -1;
         }
+        *rtt_ns = xclock_ns() - start;
 
-        memset(&vcpus, 0, sizeof(struct vcpus));
+        return 1;
+}
 
-        if (qmp_get_vcpus(buf, &vcpus) == -1) {
-                xfree(buf);
+/* in-band: whether the guest runs is the main loop's to tell */
+static int
+qmp_query_running(const struct qmp_conn *qmpc)
+{
+        const char *ret, *val;
+        size_t nread, rlen, vlen;
+        char buf[QMP_MAX_LENGTH];
+
+        if (qmp_execute_uncached(qmpc, QMP_COMMAND_QUERY_STATUS, buf,
+                                 sizeof(buf), &nread) == -1 ||
+            qmp_reply_return(buf, nread, &ret, &rlen) == -1 ||
+            json_get_member(ret, rlen, "running", &val, &vlen) == -1) {
+                return -1;
+        }
+
+        return json_to_u64(val, vlen) ? 1 : 0;
+}
+
+static void
+qmp_show_vcpu(const struct vcpu *vcpu, void *arg)
+{
+        (void) arg;
+        qmp_dump_vcpu(vcpu);
+}
+
+int
+qmp_show_vcpus(const struct qmp_conn *qmpc)
+{
+        const struct qmp_vcpus_op *op = qmp_pick_op(qmpc, qmp_vcpus_ops);
+        struct qmp_stream s;
+        struct vcpus vcpus;
+
+        /* the HMP text is printed line by line, as it comes */
+        if (!op->requires) {
+                qmp_stream_init(&s, QMP_STREAM_VCPUS, NULL, qmp_show_vcpu,
+                                NULL, NULL);
+                if (qmp_execute_stream(qmpc, op->cmd, &s) == -1 ||
+                    s.count == 0) {
+                        return -1;
+                }
+                return 0;
+        }
+
+        if (qmp_query_vcpus(qmpc, &vcpus) == -1) {
                 return -1;
         }
 
         qmp_dump_vcpus(&vcpus);
 
         /* clean-up vcpus, as we used a linked list to store them */
-        qmp_clean_vpcus(&vcpus);
+        qmp_release_vcpus(&vcpus);
+
+        return 0;
+}
+
+static void
+qmp_show_regs_one(unsigned int n, const struct qregs *regs, void *arg)
+{
+        (void) arg;
+        dprintf("CPU#%u\n", n);
+        qmp_dump_regs(regs);
+}
+
+int
+qmp_show_regs_all(const struct qmp_conn *qmpc)
+{
+        struct qmp_stream s;
+        int r;
+
+        qmp_stream_init(&s, QMP_STREAM_REGS, qmpc->arch, NULL,
+                        qmp_show_regs_one, NULL);
+        r = qmp_execute_stream(qmpc, QMP_COMMAND_INFO_REGS_ALL, &s);
+        qmp_stream_release(&s);
+
+        return r == -1 || s.count == 0 ? -1 : 0;
+}
+
+/*
+ * 'info registers -a' prints "CPU#0\r\nRAX=..." for every vCPU, each
+ * block is parsed on its own
+ */
+int
+qmp_get_regs_all(const struct qregs_arch_desc *arch, const char *buf,
+                 struct qregs **regs, unsigned int *nregs)
+{
+        const char *p = strstr(buf, "CPU#"), *next;
+        struct qregs *r;
+
+        if (!p) {
+                /* a single vCPU, or a qemu without -a */
+                p = buf;
+        }
+
+        while (p) {
+                next = strstr(p + 1, "CPU#");
+
+                *regs = xrealloc(*regs, (*nregs + 1) * sizeof(struct qregs));
+                r = &(*regs)[*nregs];
+                memset(r, 0, sizeof(struct qregs));
+
+                if (qregs_parse(arch, p, next ? (size_t) (next - p) :
+                                strlen(p), r) == -1) {
+                        return -1;
+                }
+
+                (*nregs)++;
+                p = next;
+        }
+
+        return 0;
+}
+
+int
+qmp_query_regs_all(const struct qmp_conn *qmpc, struct qregs **regs,
+                   unsigned int *nregs)
+{
+        size_t nread;
+        char *buf;
+        int r = -1;
+
+        buf = xmalloc(QMP_SNAPSHOT_BUF_LEN);
+
+        if (qmp_execute(qmpc, QMP_COMMAND_INFO_REGS_ALL, buf,
+                        QMP_SNAPSHOT_BUF_LEN, &nread) == 0) {
+                buf[nread] = '\0';
+                r = qmp_get_regs_all(qmpc->arch, buf, regs, nregs);
+        }
+
+        xfree(buf);
+        return r;
+}
+
+/* the replies qmp_parse_reply() knows, by a part unique to the command */
+static const struct {
+        const char *match;
+        int (*parse)(char *buf, size_t len, struct vcpus *vcpus);
+} qmp_reply_parsers[] = {
+        { "\"query-cpus-fast\"", qmp_get_query_cpus_fast },
+        { "\"query-cpus\"", qmp_get_query_cpus },
+        { "\"info cpus\"", qmp_get_vcpus },
+};
+
+int
+qmp_parse_reply(const char *cmd, size_t clen, char *buf, size_t len,
+                const struct qregs_arch_desc **arch)
+{
+        struct qregs *regs = NULL;
+        unsigned int nregs = 0, i;
+        struct vcpus vcpus;
+        const char *val;
+        size_t vlen;
+        int ret;
+
+        if (memmem(cmd, clen, "\"info registers", 15)) {
+                ret = qmp_get_regs_all(*arch, buf, &regs, &nregs);
+                xfree(regs);
+                return ret;
+        }
+
+        if (memmem(cmd, clen, "\"query-target\"", 14)) {
+                if (qmp_reply_return(buf, len, &val, &vlen) == -1 ||
+                    json_get_member(val, vlen, "arch", &val, &vlen) == -1 ||
+                    vlen < 2)
+                        return -1;
+                *arch = qregs_arch_find(val + 1, vlen - 2);
+                return 0;
+        }
+
+        for (i = 0; i < sizeof(qmp_reply_parsers) /
+                        sizeof(qmp_reply_parsers[0]); i++) {
+                const char *m = qmp_reply_parsers[i].match;
+
+                if (!memmem(cmd, clen, m, strlen(m)))
+                        continue;
+
+                memset(&vcpus, 0, sizeof(struct vcpus));
+                ret = qmp_reply_parsers[i].parse(buf, len, &vcpus);
+                qmp_release_vcpus(&vcpus);
+                return ret;
+        }
+
+        return qmp_reply_return(buf, len, &val, &vlen);
+}
+
+struct qmp_snapshot_events {
+        uint64_t stopped;
+        uint64_t resumed;
+};
+
+/*
+ * {"timestamp": {"seconds": 1267020223, "microseconds": 435656},
+ *  "event": "STOP"}
+ */
+static void
+qmp_snapshot_event(const char *obj, size_t len, void *arg)
+{
+        struct qmp_snapshot_events *ev = arg;
+        const char *name, *ts, *val;
+        size_t nlen, tlen, vlen;
+        uint64_t t;
+
+        if (json_get_member(obj, len, "event", &name, &nlen) == -1 ||
+            json_get_member(obj, len, "timestamp", &ts, &tlen) == -1 ||
+            json_get_member(ts, tlen, "seconds", &val, &vlen) == -1) {
+                return;
+        }
+        t = json_to_u64(val, vlen) * 1000000000ULL;
+        if (json_get_member(ts, tlen, "microseconds", &val, &vlen) == 0)
+                t += json_to_u64(val, vlen) * 1000ULL;
+
+        if (json_string_eq(name, nlen, "STOP"))
+                ev->stopped = t;
+        else if (json_string_eq(name, nlen, "RESUME"))
+                ev->resumed = t;
+}
+
+static int
+qmp_reply_ok(const char *buf, size_t len)
+{
+        const char *val;
+        size_t vlen;
+
+        return json_get_member(buf, len, "return", &val, &vlen) == 0;
+}
+
+int
+qmp_snapshot(const struct qmp_conn *qmpc, struct qmp_snapshot *snap)
+{
+        const struct qmp_vcpus_op *op = qmp_pick_op(qmpc, qmp_vcpus_ops);
+        struct qmp_pending *pd = qmpc->pending;
+        struct qmp_snapshot_events ev = { 0, 0 };
+        const char *cmds[4];
+        uint32_t ids[4];
+        uint64_t start, stop_rx = 0;
+        unsigned int i, n = 0, vcpus_idx, regs_idx;
+        size_t nread;
+        int r, ret = 0, resumed = 0;
+        char *buf;
+
+        memset(snap, 0, sizeof(struct qmp_snapshot));
+
+        /* a guest paused by someone else stays paused */
+        if ((r = qmp_query_running(qmpc)) == -1) {
+                return -1;
+        }
+        snap->paused = r;
+
+        if (snap->paused)
+                cmds[n++] = QMP_COMMAND_STOP;
+        vcpus_idx = n;
+        cmds[n++] = op->cmd;
+        regs_idx = n;
+        cmds[n++] = QMP_COMMAND_INFO_REGS_ALL;
+        if (snap->paused)
+                cmds[n++] = QMP_COMMAND_CONT;
+
+        pd->on_event = qmp_snapshot_event;
+        pd->arg = &ev;
+
+        start = xclock_ns();
+        if (qmp_send_batch(qmpc, cmds, n, 0, ids) == -1) {
+                pd->on_event = NULL;
+                return -1;
+        }
+
+        buf = xmalloc(QMP_SNAPSHOT_BUF_LEN);
+
+        /* in order, each reply is parsed while qemu works on the next */
+        for (i = 0; i < n; i++) {
+                if (qmp_recv(qmpc, ids[i], buf, QMP_SNAPSHOT_BUF_LEN,
+                             &nread) == -1 || !qmp_reply_ok(buf, nread)) {
+                        ret = -1;
+                        continue;
+                }
+
+                if (i == vcpus_idx) {
+                        if (ret == 0)
+                                ret = op->parse(buf, nread, &snap->vcpus);
+                } else if (i == regs_idx) {
+                        if (ret == 0)
+                                ret = qmp_get_regs_all(qmpc->arch, buf,
+                                                       &snap->regs,
+                                                       &snap->nregs);
+                } else if (i == 0) {
+                        stop_rx = xclock_ns();
+                } else {
+                        resumed = 1;
+                        if (stop_rx)
+                                snap->window_ns = xclock_ns() - stop_rx;
+                }
+        }
+        snap->total_ns = xclock_ns() - start;
+
+        if (snap->paused && !resumed) {
+                /* cont got lost, do not leave the guest paused */
+                dprintf("snapshot: resuming the guest again\n");
+                if (qmp_send(qmpc, QMP_COMMAND_CONT, 0, &ids[0]) == 0)
+                        qmp_recv(qmpc, ids[0], buf, QMP_SNAPSHOT_BUF_LEN,
+                                 &nread);
+        }
 
+        pd->on_event = NULL;
         xfree(buf);
 
+        if (ev.stopped && ev.resumed > ev.stopped)
+                snap->pause_ns = ev.resumed - ev.stopped;
+
+        return ret;
+}
+
+void
+qmp_release_snapshot(struct qmp_snapshot *snap)
+{
+        qmp_release_vcpus(&snap->vcpus);
+        xfree(snap->regs);
+        snap->regs = NULL;
+        snap->nregs = 0;
+}
+
+int
+qmp_show_snapshot(const struct qmp_conn *qmpc)
+{
+        struct qmp_snapshot snap;
+        unsigned int i;
+
+        if (qmp_snapshot(qmpc, &snap) == -1) {
+                qmp_release_snapshot(&snap);
+                return -1;
+        }
+
+        qmp_dump_vcpus(&snap.vcpus);
+        for (i = 0; i < snap.nregs; i++) {
+                dprintf("CPU#%u\n", i);
+                qmp_dump_regs(&snap.regs[i]);
+        }
+
+        if (snap.paused) {
+                dprintf("Paused %.1fus (qemu), %.1fus between replies, "
+                        "%.1fus total\n", snap.pause_ns / 1e3,
+                        snap.window_ns / 1e3, snap.total_ns / 1e3);
+        } else {
+                dprintf("Guest was not running, %.1fus total\n",
+                        snap.total_ns / 1e3);
+        }
+
+        qmp_release_snapshot(&snap);
         return 0;
 }
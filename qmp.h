@@ -6,19 +6,180 @@
 #define QMP_BUF_LEN             (8 * 1024)
 /* timeout for polling */
 #define QMP_POLL_TIMEOUT        (10)
+/* how long a batch waits for all of its replies, in ms */
+#define QMP_BATCH_TIMEOUT       (1000)
+/* how long a command waits for its reply, unless its connection says */
+#define QMP_COMMAND_TIMEOUT     (1000)
+/* a quarantined connection is retried after this, doubling up to the max */
+#define QMP_BACKOFF_MIN         (100)
+#define QMP_BACKOFF_MAX         (30 * 1000)
+
+/* -qmp tcp:host:port, anything else is a UNIX socket path */
+#define QMP_TCP_PREFIX          "tcp:"
+#define QMP_UNIX_PREFIX         "unix:"
+/* keepalive of TCP connections: idle seconds, then probes every ... */
+#define QMP_TCP_KEEPIDLE        (10)
+#define QMP_TCP_KEEPINTVL       (2)
+#define QMP_TCP_KEEPCNT         (3)
 
 #define QMP_GREETING            "{\"QMP\":"
 #define QMP_ENTER_COMMAND_MODE  "{ \"execute\": \"qmp_capabilities\" }"
+#define QMP_ENTER_COMMAND_MODE_OOB      "{ \"execute\": \"qmp_capabilities\", \"arguments\": { \"enable\": [\"oob\"] } }"
 #define QMP_COMMAND_MODE_OK     "{\"return\": {}}\r\n"
 
 #define QMP_COMMAND_INFO_REGS   "{\"execute\": \"human-monitor-command\", \"arguments\": {\"command-line\": \"info registers\"}}"
 #define QMP_COMMAND_INFO_CPU    "{\"execute\": \"human-monitor-command\", \"arguments\": {\"command-line\": \"info cpus\"}}"
+/* structured alternatives, used when the schema lists them */
+#define QMP_COMMAND_QUERY_CPUS  "{\"execute\": \"query-cpus\"}"
+#define QMP_COMMAND_QUERY_CPUS_FAST     "{\"execute\": \"query-cpus-fast\"}"
+#define QMP_COMMAND_QUERY_STATUS        "{\"execute\": \"query-status\"}"
+#define QMP_COMMAND_INFO_REGS_ALL       "{\"execute\": \"human-monitor-command\", \"arguments\": {\"command-line\": \"info registers -a\"}}"
+#define QMP_COMMAND_QUERY_TARGET        "{\"execute\": \"query-target\"}"
+#define QMP_COMMAND_QUERY_YANK  "{\"execute\": \"query-yank\"}"
+#define QMP_COMMAND_OOB_TEST    "{\"execute\": \"x-oob-test\", \"arguments\": {\"lock\": false}}"
+#define QMP_COMMAND_STOP        "{\"execute\": \"stop\"}"
+#define QMP_COMMAND_CONT        "{\"execute\": \"cont\"}"
+/* guest physical address, size, and a path qemu can write to */
+#define QMP_COMMAND_PMEMSAVE    "{\"execute\": \"pmemsave\", \"arguments\": {\"val\": %lu, \"size\": %lu, \"filename\": \"%s\"}}"
+/* 'x /Ngx addr' through the page tables of one vCPU */
+#define QMP_COMMAND_MEMORY_DUMP "{\"execute\": \"human-monitor-command\", \"arguments\": {\"command-line\": \"x /%lugx 0x%lx\", \"cpu-index\": %u}}"
+/* most bytes read at once, the reply takes about 4 times as many */
+#define QMP_MEMORY_DUMP_MAX     (4096)
+/* how long qemu may take to write a dump, in ms */
+#define QMP_PMEMSAVE_TIMEOUT    (10 * 60 * 1000)
+
+/* 'info registers -a' of a large guest */
+#define QMP_SNAPSHOT_BUF_LEN    (256 * 1024)
+
+/* qmp_send() flags: out of band, if both qemu and the command allow it */
+#define QMP_SEND_OOB            (1 << 0)
+/* what tagging adds to a command, at most */
+#define QMP_TAG_ROOM            (64)
+/* late replies to drop when they come, at most */
+#define QMP_MAX_STALE           (16)
+
+struct qmp_cache;
+struct qmp_conn;
+struct qmp_schema;
+struct qmp_pending;
+struct qregs;
+struct qregs_arch_desc;
+struct qmp_recorder;
+struct qmp_stream;
+
+/*
+ * how bytes move between us and qemu, the default is poll() + read()
+ */
+struct qmp_transport {
+        const char *name;
+        /* set up per connection state, once connected */
+        int (*attach)(struct qmp_conn *qmpc);
+        void (*detach)(const struct qmp_conn *qmpc);
+        /* read what qemu answered, NUL terminated */
+        int (*read)(const struct qmp_conn *qmpc, char *buf, size_t size,
+                    size_t *len);
+        size_t (*write)(const struct qmp_conn *qmpc, const char *buf,
+                        size_t len);
+        /*
+         * whatever arrived, part of a reply possibly, waiting for the
+         * first bytes at most QMP_BATCH_TIMEOUT; 0 bytes if none came
+         */
+        int (*read_some)(const struct qmp_conn *qmpc, char *buf, size_t size,
+                         size_t *len);
+        /* send 'cmd' over every connection and collect all the replies */
+        int (*execute_all)(struct qmp_conn **conns, unsigned int n,
+                           const char *cmd, char **bufs, size_t size,
+                           size_t *lens);
+};
+
+/*
+ * A connection whose command missed its deadline is quarantined: the
+ * reply may still come and be taken for that of the next command, so
+ * every command fails at once until qmp_heal() reconnects, after a
+ * backoff doubling with each attempt that fails. The monitor of a VM
+ * holding the BQL for long costs its sampler one deadline per attempt,
+ * not one per command.
+ *
+ * While 'until' is set the connection belongs to whoever heals it, which
+ * may be another thread than the one sending the commands: 'until' is
+ * set and cleared with release stores, and read with acquire loads.
+ */
+struct qmp_health {
+        /* in ms, 0 for QMP_COMMAND_TIMEOUT */
+        unsigned int timeout_ms;
+        /* CLOCK_MONOTONIC ns the quarantine ends, 0 if healthy */
+        uint64_t until;
+        /* in ms, and the reconnects failed in a row */
+        uint64_t backoff;
+        unsigned int attempts;
+        /* qmp_heal() is asking qemu what it is, commands may go through */
+        int healing;
+
+        uint64_t timeouts;
+        uint64_t reconnects;
+};
+
+/*
+ * per connection command timing, filled in by qmp_execute() when the
+ * connection has one attached
+ */
+struct qmp_timing {
+        /* the last command was written */
+        uint64_t sent;
+        /* the last byte of its reply arrived */
+        uint64_t last_rx;
+        /* cumulative over all commands, in ns */
+        uint64_t rtt_ns;
+        /* time qemu spent producing replies, as seen from here */
+        uint64_t service_ns;
+        uint64_t commands;
+};
 
 struct qmp_conn {
         int fd;
         char *qmp_sock_path;
+        /* greeting as sent by qemu, replayed to proxy clients */
+        char greeting[QMP_MAX_LENGTH];
+        /* if set, read-only commands are answered from it when fresh */
+        struct qmp_cache *cache;
+        /* NULL means qmp_poll_transport */
+        const struct qmp_transport *transport;
+        /* transport private data */
+        void *priv;
+        /* pid of the qemu process, 0 if unknown */
+        pid_t pid;
+        /* if set, updated by every command that reaches qemu */
+        struct qmp_timing *timing;
+        /* what qemu supports, HMP is used for everything if NULL */
+        const struct qmp_schema *schema;
+        /* the oob capability was negotiated */
+        int oob;
+        /* replies read by qmp_recv() that were not asked for yet */
+        struct qmp_pending *pending;
+        /* the guest architecture, NULL means x86 */
+        const struct qregs_arch_desc *arch;
+        /* if set, every byte read and written is logged to it */
+        struct qmp_recorder *recorder;
+        /* the number of this connection in the log */
+        uint32_t rec_conn;
+        /* if set, missing a deadline quarantines the connection */
+        struct qmp_health *health;
 };
 
+/* syscalls issued by the transports, for benchmarking */
+struct qmp_io_stats {
+        uint64_t syscalls;
+        uint64_t commands;
+};
+
+/* the pool workers count from many threads at once */
+#define QMP_IO_COUNT(field, n)                                          \
+        __atomic_fetch_add(&qmp_io_stats.field, (n), __ATOMIC_RELAXED)
+
+extern struct qmp_io_stats qmp_io_stats;
+
+extern const struct qmp_transport qmp_poll_transport;
+
 enum vcpu_state {
         UNDEFINED,
         HALTED, 
@@ -29,6 +190,8 @@ struct vcpu {
         uint8_t id;
         enum vcpu_state state;
         uint64_t pc;
+        /* host thread running the vCPU */
+        pid_t thread_id;
         struct vcpu *next;
 };
 
@@ -37,42 +200,281 @@ struct vcpus {
         uint32_t count;
 };
 
-enum qregs_arch {
-        X86, X64
-};
-
-/*
- * for both x86 and x64
+/**
+ * @brief look up a transport by name
+ * @retval the transport, or NULL if unknown
  */
-struct qregs {
-        uint64_t rax, rbx, rcx, rdx;
-        uint64_t rsi, rdi, rbp, rsp;
-        uint64_t r8, r9, r10, r11;
-        uint64_t r12, r13, r14, r15;
-        uint64_t rip, rflags, efer;
+extern const struct qmp_transport *
+qmp_transport_find(const char *name);
 
-        /* these are unsigned shorts but it 
-         * easier to have one parsing method */
-        uint64_t es, cs, ss, ds, fs, gs, cpl;
+/**
+ * @brief find where the reply in 'buf' ends, events preceding it included
+ * @retval the offset past the reply, 0 if no complete reply is in 'buf'
+ */
+extern size_t
+qmp_reply_end(const char *buf, size_t len);
 
-        uint64_t cr0, cr2, cr3, cr4;
+/**
+ * @brief get the "return" member of the reply in 'buf', past any event
+ * @retval 0 if found, -1 for an error reply or no reply
+ */
+extern int
+qmp_reply_return(const char *buf, size_t len, const char **val,
+                 size_t *vlen);
 
-        enum qregs_arch mode;
-};
+/**
+ * @brief check whether 'path' is a tcp:host:port address
+ * @retval 1 if so, 0 for a UNIX socket
+ */
+extern int
+qmp_is_tcp(const char *path);
 
+/**
+ * @brief connect to the UNIX socket or tcp:host:port 'qmpc->qmp_sock_path'
+ * and read the greeting
+ */
 extern int
 qmp_establish_conn(struct qmp_conn *qmpc);
 
 extern int
-qmp_negotiate(const struct qmp_conn *qmpc);
+qmp_negotiate(struct qmp_conn *qmpc);
 
 extern int
 qmp_close_conn(const struct qmp_conn *qmpc);
 
+/**
+ * @brief the deadline of a command over 'qmpc', in ms
+ */
+extern unsigned int
+qmp_timeout(const struct qmp_conn *qmpc);
+
+/**
+ * @brief quarantine a connection that failed other than by a deadline,
+ * for qmp_heal() to reconnect; nothing without a health attached
+ */
+extern void
+qmp_quarantine(const struct qmp_conn *qmpc);
+
+/**
+ * @brief reconnect a quarantined connection once its backoff is over,
+ * negotiate and read its schema and architecture again, as for a new one;
+ * from the thread that owns it while it is quarantined
+ * @retval 0 if commands may be sent, -1 if it is still quarantined
+ */
+extern int
+qmp_heal(struct qmp_conn *qmpc);
+
+/**
+ * @brief send 'cmd' and read what qemu answered, going through the
+ * connection's cache, if any
+ * @param buf filled with the reply, NUL terminated
+ * @param size the size of 'buf'
+ * @param nread set to the length of the reply
+ */
+extern int
+qmp_execute(const struct qmp_conn *qmpc, const char *cmd,
+            char *buf, size_t size, size_t *nread);
+
+/**
+ * @brief same as qmp_execute(), never cached, for large one-off replies
+ */
+extern int
+qmp_execute_uncached(const struct qmp_conn *qmpc, const char *cmd,
+                     char *buf, size_t size, size_t *nread);
+
+/**
+ * @brief send 'cmd' tagged with a fresh id, without waiting for the reply
+ * @param flags QMP_SEND_OOB to pass in-band commands still queued
+ * @param id set to the id to hand to qmp_recv()
+ */
+extern int
+qmp_send(const struct qmp_conn *qmpc, const char *cmd, int flags,
+         uint32_t *id);
+
+/**
+ * @brief qmp_send() for several commands, written all at once
+ * @param ids set to the id of each command
+ */
+extern int
+qmp_send_batch(const struct qmp_conn *qmpc, const char **cmds,
+               unsigned int n, int flags, uint32_t *ids);
+
+/**
+ * @brief wait, at most QMP_BATCH_TIMEOUT, for the reply to 'id'; replies
+ * to other ids that arrive first are kept for their own qmp_recv(); past
+ * the deadline and without a health attached, the reply is dropped when
+ * it comes
+ */
+extern int
+qmp_recv(const struct qmp_conn *qmpc, uint32_t id, char *buf, size_t size,
+         size_t *nread);
+
+/**
+ * @brief qmp_send() + qmp_recv(), out of band when possible; the cache is
+ * bypassed, the point is to reach qemu
+ */
+extern int
+qmp_execute_oob(const struct qmp_conn *qmpc, const char *cmd,
+                char *buf, size_t size, size_t *nread);
+
+/**
+ * @brief send 'cmd' over every connection at once and wait, at most
+ * QMP_BATCH_TIMEOUT, for all the replies; the cache is bypassed
+ * @param bufs one buffer of 'size' bytes per connection
+ * @param lens set to the length of each reply, 0 if none arrived
+ * @retval the amount of replies received, -1 on error
+ */
+extern int
+qmp_execute_all(struct qmp_conn **conns, unsigned int n, const char *cmd,
+                char **bufs, size_t size, size_t *lens);
+
 extern int
 qmp_show_regs(const struct qmp_conn *qmpc);
 
+/**
+ * @brief fetch and parse the registers of the current vCPU
+ */
+extern int
+qmp_query_regs(const struct qmp_conn *qmpc, struct qregs *regs);
+
+/**
+ * @brief fetch and parse the registers of every vCPU, in the order of
+ * their ids
+ * @param regs grown as with qmp_get_regs_all(), for the caller to free
+ */
+extern int
+qmp_query_regs_all(const struct qmp_conn *qmpc, struct qregs **regs,
+                   unsigned int *nregs);
+
+/**
+ * @brief parse the reply of 'info registers -a', 'buf' is NUL terminated
+ * @param arch of the connection the reply came from
+ * @param regs grown by one entry per vCPU, appended after the 'nregs'
+ * already there
+ */
+extern int
+qmp_get_regs_all(const struct qregs_arch_desc *arch, const char *buf,
+                 struct qregs **regs, unsigned int *nregs);
+
+/**
+ * @brief parse a reply the way the query sending 'cmd' would, for
+ * replaying captured sessions; 'buf' is NUL terminated
+ * @param arch of the connection, set by the reply to query-target
+ * @retval 0 if it parses, -1 if not or for an error reply
+ */
+extern int
+qmp_parse_reply(const char *cmd, size_t clen, char *buf, size_t len,
+                const struct qregs_arch_desc **arch);
+
+/**
+ * @brief ask qemu for the guest architecture, once per connection
+ * @retval its register descriptors, NULL if qemu cannot tell
+ */
+extern const struct qregs_arch_desc *
+qmp_query_arch(const struct qmp_conn *qmpc);
+
+/**
+ * @brief print the vCPUs as their lines arrive
+ */
 extern int
 qmp_show_vcpus(const struct qmp_conn *qmpc);
 
+/**
+ * @brief print the registers of every vCPU as its block arrives
+ */
+extern int
+qmp_show_regs_all(const struct qmp_conn *qmpc);
+
+/**
+ * @brief send 'cmd' and feed its reply to 's' read by read, bypassing
+ * the cache; the parser runs while the rest is still on its way
+ * @retval 0 once 's' has the whole reply, -1 otherwise
+ */
+extern int
+qmp_execute_stream(const struct qmp_conn *qmpc, const char *cmd,
+                   struct qmp_stream *s);
+
+/**
+ * @brief have qemu write 'size' bytes of guest memory from guest physical
+ * 'addr' to the absolute 'path', waiting up to QMP_PMEMSAVE_TIMEOUT
+ */
+extern int
+qmp_pmemsave(const struct qmp_conn *qmpc, uint64_t addr, uint64_t size,
+             const char *path);
+
+/**
+ * @brief read 'len' bytes, a multiple of 8 up to QMP_MEMORY_DUMP_MAX, of
+ * guest virtual memory as vCPU 'cpu' sees it; little endian guests only
+ * @retval 0 on success, -1 if any of it is not mapped
+ */
+extern int
+qmp_read_guest(const struct qmp_conn *qmpc, unsigned int cpu, uint64_t addr,
+               uint8_t *dst, size_t len);
+
+/**
+ * @brief parse one line of 'info cpus', past its "CPU"
+ */
+extern int
+qmp_parse_cpu_line(const char *str, struct vcpu *vcpu);
+
+/**
+ * @brief health probe: a command without side effects that the schema
+ * marks allow-oob, sent out of band so that it is answered even while
+ * the main loop is held
+ * @param rtt_ns set to the round trip
+ * @retval 1 if qemu answered, 0 if it runs no such command out of band,
+ * -1 if it did not answer
+ */
+extern int
+qmp_probe(const struct qmp_conn *qmpc, uint64_t *rtt_ns);
+
+/**
+ * @brief fetch the vCPU list, to be released with qmp_release_vcpus()
+ */
+extern int
+qmp_query_vcpus(const struct qmp_conn *qmpc, struct vcpus *vcpus);
+
+/**
+ * @brief fetch the vCPU ids and threads only, pc and state may be missing,
+ * which lets qemu answer without interrupting the vCPUs
+ */
+extern int
+qmp_query_vcpu_threads(const struct qmp_conn *qmpc, struct vcpus *vcpus);
+
+extern void
+qmp_release_vcpus(struct vcpus *vcpus);
+
+/*
+ * every vCPU at one point in time
+ */
+struct qmp_snapshot {
+        struct vcpus vcpus;
+        /* one per vCPU, in 'info registers -a' order */
+        struct qregs *regs;
+        unsigned int nregs;
+        /* the guest was running and was paused for the snapshot */
+        int paused;
+        /* between the STOP and RESUME events, by qemu's clock, 0 if unknown */
+        uint64_t pause_ns;
+        /* between the stop and the cont replies, as seen here */
+        uint64_t window_ns;
+        /* from writing the batch to the last reply */
+        uint64_t total_ns;
+};
+
+/**
+ * @brief pause the guest, collect vCPUs and registers, resume it; all
+ * the commands go out in one write and the replies are parsed as they
+ * arrive, so the pause lasts about as long as qemu takes to answer
+ * @retval 0 on success, -1 on failure (the guest is resumed regardless)
+ */
+extern int
+qmp_snapshot(const struct qmp_conn *qmpc, struct qmp_snapshot *snap);
+
+extern int
+qmp_show_snapshot(const struct qmp_conn *qmpc);
+
+extern void
+qmp_release_snapshot(struct qmp_snapshot *snap);
+
 #endif /* __QMP_H */
@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "zio.h"
+#include "record.h"
+
+static size_t
+qmp_rec_put(uint8_t *p, uint64_t v)
+{
+        size_t n = 0;
+
+        do {
+                p[n] = v & 0x7f;
+                v >>= 7;
+                if (v)
+                        p[n] |= 0x80;
+                n++;
+        } while (v);
+
+        return n;
+}
+
+static int
+qmp_rec_get(struct qmp_replay *r, uint64_t *v)
+{
+        unsigned int shift = 0;
+        uint8_t b;
+
+        *v = 0;
+        do {
+                if (r->off == r->len || shift >= 64)
+                        return -1;
+                b = r->buf[r->off++];
+                *v |= (uint64_t) (b & 0x7f) << shift;
+                shift += 7;
+        } while (b & 0x80);
+
+        return 0;
+}
+
+struct qmp_recorder *
+qmp_record_open(const char *path, int compress)
+{
+        struct qmp_recorder *rec;
+        struct qmp_rec_header h;
+        struct zio_writer *zw = NULL;
+        struct timespec ts;
+        int fd;
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd == -1) {
+                dprintf("record: cannot open '%s': %s\n", path,
+                        strerror(errno));
+                return NULL;
+        }
+
+        memset(&h, 0, sizeof(struct qmp_rec_header));
+        memcpy(h.magic, QMP_REC_MAGIC, QMP_REC_MAGIC_LEN);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        h.start = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+        if (compress) {
+                if ((zw = zio_writer_open(fd)) == NULL ||
+                    zio_write(zw, &h, sizeof(h)) == -1) {
+                        zio_writer_close(zw);
+                        close(fd);
+                        return NULL;
+                }
+        } else if (xwrite(fd, (const char *) &h, sizeof(h)) != sizeof(h)) {
+                close(fd);
+                return NULL;
+        }
+
+        rec = xmalloc(sizeof(struct qmp_recorder));
+        rec->fd = fd;
+        rec->zw = zw;
+        pthread_mutex_init(&rec->lock, NULL);
+        rec->last = rec->flushed = xclock_ns();
+
+        return rec;
+}
+
+/* the timestamp is taken under the lock, the deltas never go backwards */
+static void
+qmp_record_locked(struct qmp_recorder *rec, uint32_t conn,
+                  enum qmp_rec_kind kind, const char *buf, size_t len)
+{
+        uint8_t hdr[3 * QMP_REC_VARINT_MAX];
+        struct iovec iov[2];
+        uint64_t now = xclock_ns();
+        size_t n = 0;
+
+        n += qmp_rec_put(hdr + n, now - rec->last);
+        n += qmp_rec_put(hdr + n, conn);
+        n += qmp_rec_put(hdr + n, (uint64_t) len << 2 | kind);
+        rec->last = now;
+
+        if (rec->zw) {
+                /* under the lock still, the records stay in order */
+                if (zio_write(rec->zw, hdr, n) == -1 ||
+                    zio_write(rec->zw, buf, len) == -1)
+                        dprintf("record: short write, the log is truncated\n");
+                if (now - rec->flushed >= QMP_REC_FLUSH_MS * 1000000ULL) {
+                        zio_flush(rec->zw);
+                        rec->flushed = now;
+                }
+                return;
+        }
+
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = n;
+        iov[1].iov_base = (void *) buf;
+        iov[1].iov_len = len;
+
+        /* a regular file, short only when out of space */
+        if (writev(rec->fd, iov, len ? 2 : 1) != (ssize_t) (n + len))
+                dprintf("record: short write, the log is truncated\n");
+}
+
+uint32_t
+qmp_record_attach(struct qmp_recorder *rec, const char *path)
+{
+        uint32_t conn;
+
+        pthread_mutex_lock(&rec->lock);
+        conn = rec->next_conn++;
+        qmp_record_locked(rec, conn, QMP_REC_OPEN, path, strlen(path));
+        pthread_mutex_unlock(&rec->lock);
+
+        return conn;
+}
+
+void
+qmp_record(struct qmp_recorder *rec, uint32_t conn, enum qmp_rec_kind kind,
+           const char *buf, size_t len)
+{
+        pthread_mutex_lock(&rec->lock);
+        qmp_record_locked(rec, conn, kind, buf, len);
+        pthread_mutex_unlock(&rec->lock);
+}
+
+void
+qmp_record_close(struct qmp_recorder *rec)
+{
+        if (!rec)
+                return;
+
+        zio_writer_close(rec->zw);
+        close(rec->fd);
+        pthread_mutex_destroy(&rec->lock);
+        xfree(rec);
+}
+
+/*
+ * at least 'need' bytes from r->off on in the window, fewer only at the
+ * end of the log; a compressed one cut short ends there, what came before
+ * is still good to replay
+ */
+static int
+qmp_replay_fill(struct qmp_replay *r, size_t need)
+{
+        ssize_t n;
+
+        if (r->len - r->off >= need || r->eof)
+                return 0;
+        if (need > QMP_REPLAY_MAX_RECORD)
+                return -1;
+
+        memmove(r->buf, r->buf + r->off, r->len - r->off);
+        r->len -= r->off;
+        r->off = 0;
+
+        if (need > r->size) {
+                r->size = need;
+                r->buf = xrealloc(r->buf, r->size);
+        }
+
+        while (r->len < need) {
+                if (r->zr)
+                        n = zio_read(r->zr, r->buf + r->len,
+                                     r->size - r->len);
+                else
+                        n = read(r->fd, r->buf + r->len, r->size - r->len);
+                if (n == -1 && !r->zr && errno == EINTR)
+                        continue;
+                if (n <= 0) {
+                        r->eof = 1;
+                        break;
+                }
+                r->len += n;
+        }
+
+        return 0;
+}
+
+int
+qmp_replay_rewind(struct qmp_replay *r)
+{
+        if (lseek(r->fd, 0, SEEK_SET) == -1)
+                return -1;
+
+        if (r->zr) {
+                zio_reader_close(r->zr);
+                if (zio_reader_open(r->zr, r->fd) == -1)
+                        return -1;
+        }
+
+        r->len = r->off = 0;
+        r->eof = 0;
+        r->when = 0;
+
+        if (qmp_replay_fill(r, sizeof(struct qmp_rec_header)) == -1 ||
+            r->len < sizeof(struct qmp_rec_header))
+                return -1;
+
+        memcpy(&r->header, r->buf, sizeof(struct qmp_rec_header));
+        if (memcmp(r->header.magic, QMP_REC_MAGIC, QMP_REC_MAGIC_LEN))
+                return -1;
+
+        r->off = sizeof(struct qmp_rec_header);
+        return 0;
+}
+
+int
+qmp_replay_open(struct qmp_replay *r, const char *path)
+{
+        struct zio_reader zr;
+
+        memset(r, 0, sizeof(struct qmp_replay));
+
+        if ((r->fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+                dprintf("replay: cannot open '%s': %s\n", path,
+                        strerror(errno));
+                return -1;
+        }
+
+        if (zio_reader_open(&zr, r->fd) == 0) {
+                r->zr = xmalloc(sizeof(struct zio_reader));
+                *r->zr = zr;
+        } else {
+                zio_reader_close(&zr);
+        }
+
+        r->size = QMP_REPLAY_WINDOW;
+        r->buf = xmalloc(r->size);
+
+        if (qmp_replay_rewind(r) == -1) {
+                dprintf("replay: '%s' is not a capture\n", path);
+                qmp_replay_close(r);
+                return -1;
+        }
+
+        return 0;
+}
+
+int
+qmp_replay_next(struct qmp_replay *r, struct qmp_rec *rec)
+{
+        uint64_t delta, conn, kind;
+
+        /* the longest a record header can be */
+        qmp_replay_fill(r, 3 * QMP_REC_VARINT_MAX);
+        if (r->off == r->len)
+                return 0;
+
+        if (qmp_rec_get(r, &delta) == -1 || qmp_rec_get(r, &conn) == -1 ||
+            qmp_rec_get(r, &kind) == -1 || conn > UINT32_MAX ||
+            qmp_replay_fill(r, kind >> 2) == -1 ||
+            (kind >> 2) > r->len - r->off) {
+                return -1;
+        }
+
+        r->when += delta;
+        rec->when = r->when;
+        rec->conn = conn;
+        rec->kind = kind & 3;
+        rec->len = kind >> 2;
+        rec->data = r->buf + r->off;
+        r->off += rec->len;
+
+        return 1;
+}
+
+void
+qmp_replay_close(struct qmp_replay *r)
+{
+        if (r->zr) {
+                zio_reader_close(r->zr);
+                xfree(r->zr);
+        }
+        if (r->fd > 0)
+                close(r->fd);
+        xfree(r->buf);
+        memset(r, 0, sizeof(struct qmp_replay));
+}
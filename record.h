@@ -0,0 +1,134 @@
+#ifndef __RECORD_H
+#define __RECORD_H
+
+/*
+ * Capture of the raw bytes of QMP sessions, for replaying them offline.
+ * The log is a header followed by one record per transport read or
+ * write, all of them unsigned LEB128 varints but for the bytes:
+ *
+ *      delta   ns since the previous record, the first one since the header
+ *      conn    connection number, from the order the connections opened in
+ *      kind    len << 2 | QMP_REC_*
+ *      bytes   'len' of them, as read or written; the path for an open
+ *
+ * A read is whatever one transport read returned, so the chunking the
+ * framing saw is kept. Every connection of the process goes to one log,
+ * a record is written as a whole, with one syscall, as it happens. A
+ * compressed log is the same bytes, header included, through zio.h; the
+ * records are then only copied, a thread of the writer's compresses.
+ */
+
+#define QMP_REC_MAGIC           "QMPREC01"
+#define QMP_REC_MAGIC_LEN       (8)
+/* a varint of a 64 bit value */
+#define QMP_REC_VARINT_MAX      (10)
+/* a compressed log holds back a partial block at most this long, in ms */
+#define QMP_REC_FLUSH_MS        (1000)
+/* a log is replayed through a window this long, grown for longer records */
+#define QMP_REPLAY_WINDOW       (256 * 1024)
+#define QMP_REPLAY_MAX_RECORD   (16 * 1024 * 1024)
+
+enum qmp_rec_kind {
+        QMP_REC_OPEN,
+        QMP_REC_READ,
+        QMP_REC_WRITE,
+        QMP_REC_CLOSE,
+};
+
+struct qmp_rec_header {
+        char magic[QMP_REC_MAGIC_LEN];
+        /* CLOCK_REALTIME ns the capture started at */
+        uint64_t start;
+};
+
+struct zio_writer;
+struct zio_reader;
+
+struct qmp_recorder {
+        int fd;
+        /* NULL unless compressed */
+        struct zio_writer *zw;
+        pthread_mutex_t lock;
+        /* CLOCK_MONOTONIC ns of the last record, and of the last flush */
+        uint64_t last;
+        uint64_t flushed;
+        uint32_t next_conn;
+};
+
+/* one record of a log being replayed */
+struct qmp_rec {
+        /* ns since the start of the capture */
+        uint64_t when;
+        uint32_t conn;
+        enum qmp_rec_kind kind;
+        /* into the log, not NUL terminated, until the next record */
+        const char *data;
+        size_t len;
+};
+
+struct qmp_replay {
+        struct qmp_rec_header header;
+        int fd;
+        /* NULL unless compressed */
+        struct zio_reader *zr;
+        /* the window: the record handed out and what was read past it */
+        char *buf;
+        size_t size;
+        size_t len;
+        size_t off;
+        /* nothing more to read */
+        int eof;
+        uint64_t when;
+};
+
+/**
+ * @brief start a capture, 'path' is truncated
+ * @param compress 1 to compress it as it is written
+ * @retval the recorder, NULL on failure
+ */
+extern struct qmp_recorder *
+qmp_record_open(const char *path, int compress);
+
+/**
+ * @brief log a connection to 'path'
+ * @retval its connection number
+ */
+extern uint32_t
+qmp_record_attach(struct qmp_recorder *rec, const char *path);
+
+/**
+ * @brief log bytes read or written, or the close of a connection
+ */
+extern void
+qmp_record(struct qmp_recorder *rec, uint32_t conn, enum qmp_rec_kind kind,
+           const char *buf, size_t len);
+
+extern void
+qmp_record_close(struct qmp_recorder *rec);
+
+/**
+ * @brief open a log, decompressing it if need be; it is read as it is
+ * replayed, a window at a time
+ * @retval 0 on success, -1 if it cannot be read or is not a log
+ */
+extern int
+qmp_replay_open(struct qmp_replay *r, const char *path);
+
+/**
+ * @brief the next record, 'rec' points into the log
+ * @retval 1 for a record, 0 at the end, -1 if the log is truncated
+ */
+extern int
+qmp_replay_next(struct qmp_replay *r, struct qmp_rec *rec);
+
+/**
+ * @brief start over from the first record
+ * @retval 0 on success, -1 if the log cannot be read again
+ */
+extern int
+qmp_replay_rewind(struct qmp_replay *r);
+
+extern void
+qmp_replay_close(struct qmp_replay *r);
+
+#endif /* __RECORD_H */
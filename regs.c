@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "regs.h"
+
+#define QREGS_DESC(name, member, bits, mode)                            \
+        { #name, sizeof(#name) - 1, bits, mode,                         \
+          offsetof(struct qregs, member) },
+#define QREGS_DESC_AARCH64(name, member, bits, mode)                    \
+        QREGS_DESC(name, aarch64.member, bits, mode)
+#define QREGS_DESC_RISCV64(name, member, bits, mode)                    \
+        QREGS_DESC(name, riscv64.member, bits, mode)
+
+static const struct qregs_desc qregs_x86_descs[] = {
+        QREGS_X86(QREGS_DESC)
+        QREGS_X86_32(QREGS_DESC)
+};
+
+static const struct qregs_desc qregs_aarch64_descs[] = {
+        QREGS_AARCH64(QREGS_DESC_AARCH64)
+};
+
+static const struct qregs_desc qregs_riscv64_descs[] = {
+        QREGS_RISCV64(QREGS_DESC_RISCV64)
+};
+
+#define QREGS_COUNT(d)  (sizeof(d) / sizeof(d[0]))
+
+static struct qregs_arch_desc qregs_archs[] = {
+        { "x86_64", X64, qregs_x86_descs, QREGS_COUNT(qregs_x86_descs), 0,
+          offsetof(struct qregs, rip), offsetof(struct qregs, rsp),
+          offsetof(struct qregs, rbp), 0, {0} },
+        { "i386", X86, qregs_x86_descs, QREGS_COUNT(qregs_x86_descs), 0,
+          offsetof(struct qregs, rip), offsetof(struct qregs, rsp),
+          offsetof(struct qregs, rbp), 0, {0} },
+        { "aarch64", AARCH64, qregs_aarch64_descs,
+          QREGS_COUNT(qregs_aarch64_descs), 0,
+          offsetof(struct qregs, aarch64.pc),
+          offsetof(struct qregs, aarch64.sp),
+          offsetof(struct qregs, aarch64.x29), 0, {0} },
+        { "riscv64", RISCV64, qregs_riscv64_descs,
+          QREGS_COUNT(qregs_riscv64_descs), 1,
+          offsetof(struct qregs, riscv64.pc),
+          offsetof(struct qregs, riscv64.x2),
+          offsetof(struct qregs, riscv64.x8), 0, {0} },
+};
+
+static int qregs_ready;
+
+static uint32_t
+qregs_hash(uint32_t seed, const char *name, size_t len)
+{
+        uint32_t h = 2166136261U ^ seed;
+
+        while (len--) {
+                h ^= (unsigned char) *name++;
+                h *= 16777619U;
+        }
+
+        return (h ^ (h >> 15)) & (QREGS_HASH_SIZE - 1);
+}
+
+/*
+ * C cannot hash strings at compile time, so the seed that spreads the
+ * names of a table over distinct slots is searched for once, on first
+ * use; a lookup is then one hash and one compare
+ */
+static void
+qregs_setup(void)
+{
+        unsigned int a, i;
+        uint32_t seed;
+
+        for (a = 0; a < QREGS_COUNT(qregs_archs); a++) {
+                struct qregs_arch_desc *arch = &qregs_archs[a];
+
+                for (seed = 1; seed != 0; seed++) {
+                        memset(arch->slots, 0, sizeof(arch->slots));
+
+                        for (i = 0; i < arch->count; i++) {
+                                const struct qregs_desc *d = &arch->descs[i];
+                                uint32_t h = qregs_hash(seed, d->name, d->len);
+
+                                if (arch->slots[h])
+                                        break;
+                                arch->slots[h] = i + 1;
+                        }
+
+                        if (i == arch->count)
+                                break;
+                }
+
+                if (seed == 0)
+                        FATAL("regs: no perfect hash for '%s'\n",
+                              arch->target);
+                arch->seed = seed;
+        }
+
+        qregs_ready = 1;
+}
+
+const struct qregs_arch_desc *
+qregs_arch_find(const char *target, size_t len)
+{
+        unsigned int a;
+
+        if (!qregs_ready)
+                qregs_setup();
+
+        for (a = 0; a < QREGS_COUNT(qregs_archs); a++) {
+                if (strlen(qregs_archs[a].target) == len &&
+                    !strncmp(qregs_archs[a].target, target, len))
+                        return &qregs_archs[a];
+        }
+
+        return NULL;
+}
+
+const struct qregs_arch_desc *
+qregs_arch_get(enum qregs_arch mode)
+{
+        unsigned int a;
+
+        if (!qregs_ready)
+                qregs_setup();
+
+        /* one block for both x86 modes */
+        if (mode == X86)
+                mode = X64;
+
+        for (a = 0; a < QREGS_COUNT(qregs_archs); a++) {
+                if (qregs_archs[a].arch == mode)
+                        return &qregs_archs[a];
+        }
+
+        return NULL;
+}
+
+static const struct qregs_desc *
+qregs_lookup(const struct qregs_arch_desc *arch, const char *name,
+             size_t len)
+{
+        uint8_t slot = arch->slots[qregs_hash(arch->seed, name, len)];
+        const struct qregs_desc *d;
+
+        if (!slot)
+                return NULL;
+
+        d = &arch->descs[slot - 1];
+        if (d->len != len || memcmp(d->name, name, len))
+                return NULL;
+
+        return d;
+}
+
+static int
+qregs_hex(int c)
+{
+        if (c >= '0' && c <= '9')
+                return c - '0';
+        if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+        return -1;
+}
+
+/*
+ * one pass over the text: every word is a candidate name, the value is
+ * the hex number after '=' (or after the blanks, for 'spaced' archs);
+ * the \r\n of the JSON string are separators like any other
+ */
+int
+qregs_parse(const struct qregs_arch_desc *arch, const char *buf,
+            size_t len, struct qregs *regs)
+{
+        const char *p = buf, *end = buf + len, *name;
+        const struct qregs_desc *d;
+        size_t nlen;
+        uint64_t v;
+        int pc = 0, x;
+
+        if (!qregs_ready)
+                qregs_setup();
+        if (!arch)
+                arch = &qregs_archs[0];
+
+        /* x86 code is 32 bit until a 64 bit name shows up */
+        regs->mode = arch->arch == X64 ? X86 : arch->arch;
+
+        while (p < end) {
+                if (*p == '\\') {
+                        p += 2;
+                        continue;
+                }
+                if (!isalnum((unsigned char) *p)) {
+                        p++;
+                        continue;
+                }
+
+                name = p;
+                while (p < end && (isalnum((unsigned char) *p) || *p == '_'))
+                        p++;
+                nlen = p - name;
+
+                /* "x1/ra" */
+                if (arch->spaced && p < end && *p == '/') {
+                        while (p < end && *p != ' ' && *p != '\\')
+                                p++;
+                }
+
+                while (p < end && *p == ' ')
+                        p++;
+                if (!arch->spaced) {
+                        if (p == end || *p != '=')
+                                continue;
+                        p++;
+                        while (p < end && *p == ' ')
+                                p++;
+                }
+
+                if ((d = qregs_lookup(arch, name, nlen)) == NULL)
+                        continue;
+
+                for (v = 0, name = p; p < end && (x = qregs_hex(*p)) != -1;
+                     p++)
+                        v = (v << 4) | x;
+                if (p == name)
+                        continue;
+
+                if (d->bits < 64)
+                        v &= (1ULL << d->bits) - 1;
+                *(uint64_t *) ((char *) regs + d->off) = v;
+
+                if (d->mode != QREGS_ANY)
+                        regs->mode = d->mode;
+                if (d->off == arch->pc_off)
+                        pc = 1;
+        }
+
+        if (!pc) {
+                return -1;
+        }
+
+        regs->pc = *(const uint64_t *) ((const char *) regs + arch->pc_off);
+        regs->sp = *(const uint64_t *) ((const char *) regs + arch->sp_off);
+        regs->fp = *(const uint64_t *) ((const char *) regs + arch->fp_off);
+
+        switch (arch->arch) {
+        case X86:
+        case X64:
+                regs->user = regs->cpl == 3;
+                break;
+        case AARCH64:
+                /* PSTATE.M[3:2], EL0 */
+                regs->user = ((regs->aarch64.pstate >> 2) & 3) == 0;
+                break;
+        default:
+                regs->user = 0;
+        }
+
+        return 0;
+}
@@ -0,0 +1,162 @@
+#ifndef __REGS_H
+#define __REGS_H
+
+/*
+ * Guest registers as printed by 'info registers'. Every architecture is
+ * one X-macro table, X(name, member, bits, mode), from which both the
+ * layout of struct qregs and the descriptors the parser looks the printed
+ * names up in are generated. 'mode' is the mode a name gives away, x86 and
+ * x86-64 share one block and tell themselves apart by the names printed.
+ */
+
+enum qregs_arch {
+        X86, X64, AARCH64, RISCV64
+};
+
+/* the name is printed in every mode */
+#define QREGS_ANY               (-1)
+/* slots of the name lookup table, a power of two */
+#define QREGS_HASH_SIZE         (256)
+
+#define QREGS_X86(X)                                                    \
+        X(RAX, rax, 64, X64) X(RBX, rbx, 64, X64)                       \
+        X(RCX, rcx, 64, X64) X(RDX, rdx, 64, X64)                       \
+        X(RSI, rsi, 64, X64) X(RDI, rdi, 64, X64)                       \
+        X(RBP, rbp, 64, X64) X(RSP, rsp, 64, X64)                       \
+        X(R8, r8, 64, X64) X(R9, r9, 64, X64)                           \
+        X(R10, r10, 64, X64) X(R11, r11, 64, X64)                       \
+        X(R12, r12, 64, X64) X(R13, r13, 64, X64)                       \
+        X(R14, r14, 64, X64) X(R15, r15, 64, X64)                       \
+        X(RIP, rip, 64, X64) X(RFL, rflags, 64, X64)                    \
+        X(EFER, efer, 64, QREGS_ANY)                                    \
+        X(ES, es, 16, QREGS_ANY) X(CS, cs, 16, QREGS_ANY)               \
+        X(SS, ss, 16, QREGS_ANY) X(DS, ds, 16, QREGS_ANY)               \
+        X(FS, fs, 16, QREGS_ANY) X(GS, gs, 16, QREGS_ANY)               \
+        X(CPL, cpl, 2, QREGS_ANY)                                       \
+        X(CR0, cr0, 64, QREGS_ANY) X(CR2, cr2, 64, QREGS_ANY)           \
+        X(CR3, cr3, 64, QREGS_ANY) X(CR4, cr4, 64, QREGS_ANY)
+
+/* what 32 bit code prints instead, into the same members */
+#define QREGS_X86_32(X)                                                 \
+        X(EAX, rax, 32, X86) X(EBX, rbx, 32, X86)                       \
+        X(ECX, rcx, 32, X86) X(EDX, rdx, 32, X86)                       \
+        X(ESI, rsi, 32, X86) X(EDI, rdi, 32, X86)                       \
+        X(EBP, rbp, 32, X86) X(ESP, rsp, 32, X86)                       \
+        X(EIP, rip, 32, X86) X(EFL, rflags, 32, X86)
+
+#define QREGS_AARCH64(X)                                                \
+        X(X00, x0, 64, AARCH64) X(X01, x1, 64, AARCH64)                 \
+        X(X02, x2, 64, AARCH64) X(X03, x3, 64, AARCH64)                 \
+        X(X04, x4, 64, AARCH64) X(X05, x5, 64, AARCH64)                 \
+        X(X06, x6, 64, AARCH64) X(X07, x7, 64, AARCH64)                 \
+        X(X08, x8, 64, AARCH64) X(X09, x9, 64, AARCH64)                 \
+        X(X10, x10, 64, AARCH64) X(X11, x11, 64, AARCH64)               \
+        X(X12, x12, 64, AARCH64) X(X13, x13, 64, AARCH64)               \
+        X(X14, x14, 64, AARCH64) X(X15, x15, 64, AARCH64)               \
+        X(X16, x16, 64, AARCH64) X(X17, x17, 64, AARCH64)               \
+        X(X18, x18, 64, AARCH64) X(X19, x19, 64, AARCH64)               \
+        X(X20, x20, 64, AARCH64) X(X21, x21, 64, AARCH64)               \
+        X(X22, x22, 64, AARCH64) X(X23, x23, 64, AARCH64)               \
+        X(X24, x24, 64, AARCH64) X(X25, x25, 64, AARCH64)               \
+        X(X26, x26, 64, AARCH64) X(X27, x27, 64, AARCH64)               \
+        X(X28, x28, 64, AARCH64) X(X29, x29, 64, AARCH64)               \
+        X(X30, x30, 64, AARCH64) X(SP, sp, 64, AARCH64)                 \
+        X(PC, pc, 64, AARCH64) X(PSTATE, pstate, 32, AARCH64)
+
+/* printed as "x1/ra   ffffffff80002b18", the ABI name is ignored */
+#define QREGS_RISCV64(X)                                                \
+        X(pc, pc, 64, RISCV64) X(mhartid, mhartid, 64, RISCV64)         \
+        X(mstatus, mstatus, 64, RISCV64) X(mepc, mepc, 64, RISCV64)     \
+        X(mcause, mcause, 64, RISCV64) X(mtval, mtval, 64, RISCV64)     \
+        X(sepc, sepc, 64, RISCV64) X(scause, scause, 64, RISCV64)       \
+        X(stval, stval, 64, RISCV64) X(satp, satp, 64, RISCV64)         \
+        X(x0, x0, 64, RISCV64) X(x1, x1, 64, RISCV64)                   \
+        X(x2, x2, 64, RISCV64) X(x3, x3, 64, RISCV64)                   \
+        X(x4, x4, 64, RISCV64) X(x5, x5, 64, RISCV64)                   \
+        X(x6, x6, 64, RISCV64) X(x7, x7, 64, RISCV64)                   \
+        X(x8, x8, 64, RISCV64) X(x9, x9, 64, RISCV64)                   \
+        X(x10, x10, 64, RISCV64) X(x11, x11, 64, RISCV64)               \
+        X(x12, x12, 64, RISCV64) X(x13, x13, 64, RISCV64)               \
+        X(x14, x14, 64, RISCV64) X(x15, x15, 64, RISCV64)               \
+        X(x16, x16, 64, RISCV64) X(x17, x17, 64, RISCV64)               \
+        X(x18, x18, 64, RISCV64) X(x19, x19, 64, RISCV64)               \
+        X(x20, x20, 64, RISCV64) X(x21, x21, 64, RISCV64)               \
+        X(x22, x22, 64, RISCV64) X(x23, x23, 64, RISCV64)               \
+        X(x24, x24, 64, RISCV64) X(x25, x25, 64, RISCV64)               \
+        X(x26, x26, 64, RISCV64) X(x27, x27, 64, RISCV64)               \
+        X(x28, x28, 64, RISCV64) X(x29, x29, 64, RISCV64)               \
+        X(x30, x30, 64, RISCV64) X(x31, x31, 64, RISCV64)
+
+#define QREGS_FIELD(name, member, bits, mode)   uint64_t member;
+
+struct qregs {
+        union {
+                /* X86 and X64, kept unnamed for the x86 only code */
+                struct {
+                        QREGS_X86(QREGS_FIELD)
+                };
+                struct {
+                        QREGS_AARCH64(QREGS_FIELD)
+                } aarch64;
+                struct {
+                        QREGS_RISCV64(QREGS_FIELD)
+                } riscv64;
+        };
+
+        /* the same on every architecture, filled in after parsing */
+        uint64_t pc, sp;
+        /* frame pointer: rbp, x29, s0 */
+        uint64_t fp;
+        /* the vCPU ran unprivileged code, unknown on riscv64 */
+        int user;
+
+        enum qregs_arch mode;
+};
+
+struct qregs_desc {
+        const char *name;
+        uint8_t len;
+        uint8_t bits;
+        int8_t mode;
+        uint16_t off;
+};
+
+struct qregs_arch_desc {
+        /* as query-target names it */
+        const char *target;
+        enum qregs_arch arch;
+        const struct qregs_desc *descs;
+        unsigned int count;
+        /* "NAME=value" or "name value" */
+        int spaced;
+        /* where the program counter, stack and frame pointers are */
+        uint16_t pc_off, sp_off, fp_off;
+
+        /* perfect hash of the names: descs[slots[hash] - 1] */
+        uint32_t seed;
+        uint8_t slots[QREGS_HASH_SIZE];
+};
+
+/**
+ * @brief look up an architecture by its query-target name
+ * @retval the descriptors, NULL if unknown
+ */
+extern const struct qregs_arch_desc *
+qregs_arch_find(const char *target, size_t len);
+
+/**
+ * @brief the descriptors of a parsed block
+ */
+extern const struct qregs_arch_desc *
+qregs_arch_get(enum qregs_arch mode);
+
+/**
+ * @brief parse one vCPU of 'info registers' in a single pass over 'buf'
+ * @param arch NULL for x86
+ * @retval 0 on success, -1 if the program counter was not found
+ */
+extern int
+qregs_parse(const struct qregs_arch_desc *arch, const char *buf,
+            size_t len, struct qregs *regs);
+
+#endif /* __REGS_H */
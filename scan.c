@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "xutil.h"
+#include "log.h"
+#include "scan.h"
+
+/* one range of the dump, and what was found in it */
+struct scan_job {
+        const struct scanner *s;
+        const uint8_t *buf;
+        /* of the whole dump, for the patterns that run past 'hi' */
+        size_t len;
+        /* the positions a match may start at */
+        size_t lo, hi;
+        uint64_t base;
+        pthread_t thread;
+
+        struct scan_match *m;
+        size_t n, size;
+};
+
+void
+scan_init(struct scanner *s)
+{
+        memset(s, 0, sizeof(struct scanner));
+#ifdef __AVX2__
+        s->simd = 1;
+#endif
+}
+
+static int
+scan_hex(const char *str, uint8_t *bytes, size_t *len)
+{
+        size_t n = strlen(str), i;
+
+        if (n == 0 || n % 2 || n / 2 > SCAN_MAX_LEN)
+                return -1;
+
+        for (i = 0; i < n; i += 2) {
+                char hex[3] = { str[i], str[i + 1], '\0' };
+                char *end;
+
+                bytes[i / 2] = strtoul(hex, &end, 16);
+                if (*end != '\0')
+                        return -1;
+        }
+
+        *len = n / 2;
+        return 0;
+}
+
+/* a pattern of one byte has no second byte to filter on */
+static void
+scan_set_second(struct scanner *s, const struct scan_pattern *p,
+                uint8_t bit)
+{
+        unsigned int i;
+
+        if (p->len > 1) {
+                s->lo1[p->bytes[1] & 0xf] |= bit;
+                s->hi1[p->bytes[1] >> 4] |= bit;
+                return;
+        }
+
+        for (i = 0; i < 16; i++) {
+                s->lo1[i] |= bit;
+                s->hi1[i] |= bit;
+        }
+}
+
+int
+scan_add(struct scanner *s, const char *spec)
+{
+        uint8_t bytes[SCAN_MAX_LEN];
+        struct scan_pattern *p;
+        unsigned int b;
+        uint8_t bit;
+        size_t len;
+
+        if (!strncmp(spec, SCAN_HEX_PREFIX, strlen(SCAN_HEX_PREFIX))) {
+                if (scan_hex(spec + strlen(SCAN_HEX_PREFIX), bytes,
+                             &len) == -1) {
+                        dprintf("scan: '%s' is not hex\n", spec);
+                        return -1;
+                }
+        } else {
+                len = strlen(spec);
+                if (len == 0 || len > SCAN_MAX_LEN) {
+                        dprintf("scan: patterns are 1 to %u bytes\n",
+                                SCAN_MAX_LEN);
+                        return -1;
+                }
+                memcpy(bytes, spec, len);
+        }
+
+        s->pats = xrealloc(s->pats, (s->count + 1) *
+                           sizeof(struct scan_pattern));
+        p = &s->pats[s->count];
+        p->name = xstrdup(spec);
+        p->bytes = xmalloc(len);
+        memcpy(p->bytes, bytes, len);
+        p->len = len;
+
+        if (len > s->maxlen)
+                s->maxlen = len;
+
+        b = s->count % SCAN_BUCKETS;
+        bit = 1 << b;
+        s->lo0[p->bytes[0] & 0xf] |= bit;
+        s->hi0[p->bytes[0] >> 4] |= bit;
+        scan_set_second(s, p, bit);
+
+        s->bucket[b] = xrealloc(s->bucket[b], (s->nbucket[b] + 1) *
+                                sizeof(unsigned int));
+        s->bucket[b][s->nbucket[b]++] = s->count;
+
+        s->count++;
+        return 0;
+}
+
+/* the patterns of the buckets in 'bits' against position 'pos' */
+static void
+scan_verify(struct scan_job *j, size_t pos, uint8_t bits)
+{
+        const struct scanner *s = j->s;
+        unsigned int b, i;
+
+        while (bits) {
+                b = __builtin_ctz(bits);
+                bits &= bits - 1;
+
+                for (i = 0; i < s->nbucket[b]; i++) {
+                        const struct scan_pattern *p =
+                                &s->pats[s->bucket[b][i]];
+
+                        if (p->len > j->len - pos ||
+                            memcmp(j->buf + pos, p->bytes, p->len))
+                                continue;
+
+                        if (j->n == j->size) {
+                                j->size = j->size ? j->size * 2 : 64;
+                                j->m = xrealloc(j->m, j->size *
+                                                sizeof(struct scan_match));
+                        }
+                        j->m[j->n].addr = j->base + pos;
+                        j->m[j->n].pattern = s->bucket[b][i];
+                        j->n++;
+                }
+        }
+}
+
+static void
+scan_scalar(struct scan_job *j, size_t pos)
+{
+        const struct scanner *s = j->s;
+        const uint8_t *buf = j->buf;
+        uint8_t bits;
+
+        for (; pos < j->hi; pos++) {
+                bits = s->lo0[buf[pos] & 0xf] & s->hi0[buf[pos] >> 4];
+                if (bits && pos + 1 < j->len)
+                        bits &= s->lo1[buf[pos + 1] & 0xf] &
+                                s->hi1[buf[pos + 1] >> 4];
+                if (bits)
+                        scan_verify(j, pos, bits);
+        }
+}
+
+#ifdef __AVX2__
+/*
+ * the second byte of the last position is the 33rd, the loads stop that
+ * far from the end of the dump and the rest is left to scan_scalar()
+ * @retval the first position not looked at
+ */
+static size_t
+scan_avx2(struct scan_job *j)
+{
+        const struct scanner *s = j->s;
+        const __m256i lo0 = _mm256_broadcastsi128_si256(
+                _mm_loadu_si128((const __m128i *) s->lo0));
+        const __m256i hi0 = _mm256_broadcastsi128_si256(
+                _mm_loadu_si128((const __m128i *) s->hi0));
+        const __m256i lo1 = _mm256_broadcastsi128_si256(
+                _mm_loadu_si128((const __m128i *) s->lo1));
+        const __m256i hi1 = _mm256_broadcastsi128_si256(
+                _mm_loadu_si128((const __m128i *) s->hi1));
+        const __m256i nibble = _mm256_set1_epi8(0x0f);
+        const __m256i zero = _mm256_setzero_si256();
+        uint8_t bits[SCAN_BLOCK];
+        size_t pos;
+
+        for (pos = j->lo; pos < j->hi && pos + SCAN_BLOCK + 1 <= j->len;
+             pos += SCAN_BLOCK) {
+                __m256i v0, v1, c0, c1, c;
+                uint32_t mask;
+
+                v0 = _mm256_loadu_si256((const __m256i *) (j->buf + pos));
+                v1 = _mm256_loadu_si256((const __m256i *) (j->buf + pos + 1));
+
+                c0 = _mm256_and_si256(
+                        _mm256_shuffle_epi8(lo0, _mm256_and_si256(v0, nibble)),
+                        _mm256_shuffle_epi8(hi0, _mm256_and_si256(
+                                _mm256_srli_epi16(v0, 4), nibble)));
+                c1 = _mm256_and_si256(
+                        _mm256_shuffle_epi8(lo1, _mm256_and_si256(v1, nibble)),
+                        _mm256_shuffle_epi8(hi1, _mm256_and_si256(
+                                _mm256_srli_epi16(v1, 4), nibble)));
+                c = _mm256_and_si256(c0, c1);
+
+                mask = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, zero));
+                if (mask == 0)
+                        continue;
+
+                _mm256_storeu_si256((__m256i *) bits, c);
+                while (mask) {
+                        unsigned int k = __builtin_ctz(mask);
+
+                        mask &= mask - 1;
+                        if (pos + k >= j->hi)
+                                break;
+                        scan_verify(j, pos + k, bits[k]);
+                }
+        }
+
+        return pos < j->hi ? pos : j->hi;
+}
+#endif
+
+static void *
+scan_job_run(void *arg)
+{
+        struct scan_job *j = arg;
+        size_t pos = j->lo;
+
+#ifdef __AVX2__
+        if (j->s->simd)
+                pos = scan_avx2(j);
+#endif
+        scan_scalar(j, pos);
+
+        return NULL;
+}
+
+ssize_t
+scan_run(const struct scanner *s, const uint8_t *buf, size_t len,
+         uint64_t base, unsigned int nthreads, struct scan_match **matches)
+{
+        struct scan_job *jobs;
+        size_t step, n = 0;
+        unsigned int i, started = 0;
+        ssize_t ret = -1;
+        int failed = 0;
+
+        *matches = NULL;
+        if (s->count == 0 || len == 0)
+                return 0;
+
+        if (nthreads == 0)
+                nthreads = 1;
+        if (nthreads > SCAN_MAX_THREADS)
+                nthreads = SCAN_MAX_THREADS;
+
+        /* page sized ranges, each thread faults in its own pages */
+        step = (len / nthreads + 4095) & ~(size_t) 4095;
+        if (step == 0)
+                step = len;
+
+        jobs = xcalloc(nthreads, sizeof(struct scan_job));
+        for (i = 0; i < nthreads; i++) {
+                jobs[i].s = s;
+                jobs[i].buf = buf;
+                jobs[i].len = len;
+                jobs[i].base = base;
+                jobs[i].lo = i * step < len ? i * step : len;
+                jobs[i].hi = jobs[i].lo + step < len ? jobs[i].lo + step : len;
+        }
+
+        /* the first range is scanned here, the others by threads */
+        for (i = 1; i < nthreads && jobs[i].lo < len; i++) {
+                if (pthread_create(&jobs[i].thread, NULL, scan_job_run,
+                                   &jobs[i]) != 0) {
+                        dprintf("scan: cannot start thread %u\n", i);
+                        failed = 1;
+                        break;
+                }
+                started++;
+        }
+        scan_job_run(&jobs[0]);
+        for (i = 1; i <= started; i++)
+                pthread_join(jobs[i].thread, NULL);
+
+        /* ranges go up, so do the matches once put back together */
+        if (!failed) {
+                for (i = 0; i <= started; i++)
+                        n += jobs[i].n;
+                if (n)
+                        *matches = xmalloc(n * sizeof(struct scan_match));
+                for (i = 0, n = 0; i <= started; i++) {
+                        if (jobs[i].n)
+                                memcpy(*matches + n, jobs[i].m, jobs[i].n *
+                                       sizeof(struct scan_match));
+                        n += jobs[i].n;
+                }
+                ret = n;
+        }
+
+        for (i = 0; i < nthreads; i++)
+                xfree(jobs[i].m);
+        xfree(jobs);
+
+        return ret;
+}
+
+ssize_t
+scan_file(const struct scanner *s, const char *path, uint64_t base,
+          unsigned int nthreads, struct scan_match **matches, size_t *size)
+{
+        struct stat st;
+        void *buf;
+        ssize_t ret;
+        int fd;
+
+        *matches = NULL;
+        *size = 0;
+
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+                dprintf("scan: cannot open '%s': %s\n", path,
+                        strerror(errno));
+                return -1;
+        }
+
+        if (fstat(fd, &st) == -1 || st.st_size == 0) {
+                dprintf("scan: '%s' is empty\n", path);
+                close(fd);
+                return -1;
+        }
+
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (buf == MAP_FAILED) {
+                dprintf("scan: cannot map '%s': %s\n", path,
+                        strerror(errno));
+                return -1;
+        }
+
+        /* read once, front to back, within each range */
+        madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+        ret = scan_run(s, buf, st.st_size, base, nthreads, matches);
+        *size = st.st_size;
+
+        munmap(buf, st.st_size);
+        return ret;
+}
+
+void
+scan_release(struct scanner *s)
+{
+        unsigned int i;
+
+        for (i = 0; i < s->count; i++) {
+                xfree(s->pats[i].name);
+                xfree(s->pats[i].bytes);
+        }
+        for (i = 0; i < SCAN_BUCKETS; i++)
+                xfree(s->bucket[i]);
+        xfree(s->pats);
+        memset(s, 0, sizeof(struct scanner));
+}
@@ -0,0 +1,83 @@
+#ifndef __SCAN_H
+#define __SCAN_H
+
+/*
+ * Multi-pattern search over dumps of guest physical memory, as written by
+ * pmemsave. Patterns are spread over SCAN_BUCKETS buckets, and the first
+ * two bytes of each one set the bucket bit in four nibble tables: a
+ * position is a candidate when both of its bytes, looked up by low and
+ * high nibble, share a bucket. With AVX2 the tables go through vpshufb
+ * for 32 positions at a time; candidates are checked with memcmp against
+ * the patterns of their buckets only. The dump is mmap'd and cut into one
+ * contiguous range per thread, each reading past its end by the longest
+ * pattern so that no match straddling two ranges is lost.
+ */
+
+/* a bit per bucket in the nibble tables */
+#define SCAN_BUCKETS            (8)
+#define SCAN_MAX_LEN            (256)
+#define SCAN_MAX_THREADS        (64)
+/* positions filtered at once */
+#define SCAN_BLOCK              (32)
+/* "0x4d5a9000" is hex, anything else is taken literally */
+#define SCAN_HEX_PREFIX         "0x"
+
+struct scan_pattern {
+        /* as given */
+        char *name;
+        uint8_t *bytes;
+        size_t len;
+};
+
+struct scan_match {
+        /* guest physical */
+        uint64_t addr;
+        unsigned int pattern;
+};
+
+struct scanner {
+        struct scan_pattern *pats;
+        unsigned int count;
+        size_t maxlen;
+
+        /* bucket bits, by nibble, of the first and the second byte */
+        uint8_t lo0[16], hi0[16];
+        uint8_t lo1[16], hi1[16];
+        unsigned int *bucket[SCAN_BUCKETS];
+        unsigned int nbucket[SCAN_BUCKETS];
+
+        /* 0 to filter one byte at a time even with AVX2 */
+        int simd;
+};
+
+extern void
+scan_init(struct scanner *s);
+
+/**
+ * @brief add a pattern, hex with SCAN_HEX_PREFIX or literal text
+ * @retval 0 on success, -1 if empty, too long or not hex
+ */
+extern int
+scan_add(struct scanner *s, const char *spec);
+
+/**
+ * @brief search 'len' bytes, the first of them at guest physical 'base'
+ * @param matches set to the matches by ascending address, to be freed
+ * @retval the amount of matches, -1 on error
+ */
+extern ssize_t
+scan_run(const struct scanner *s, const uint8_t *buf, size_t len,
+         uint64_t base, unsigned int nthreads, struct scan_match **matches);
+
+/**
+ * @brief scan_run() over the mmap'd dump at 'path'
+ * @param size set to the size of the dump
+ */
+extern ssize_t
+scan_file(const struct scanner *s, const char *path, uint64_t base,
+          unsigned int nthreads, struct scan_match **matches, size_t *size);
+
+extern void
+scan_release(struct scanner *s);
+
+#endif /* __SCAN_H */
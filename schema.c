@@ -0,0 +1,465 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "json.h"
+#include "qmp.h"
+#include "schema.h"
+
+#define QMP_COMMAND_QUERY_VERSION       "{\"execute\": \"query-version\"}"
+#define QMP_COMMAND_QUERY_SCHEMA        "{\"execute\": \"query-qmp-schema\"}"
+
+/* schemas loaded so far, one per qemu version */
+static struct qmp_schema *schemas;
+/* connections are set up and healed from several threads */
+static pthread_mutex_t schemas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t
+qmp_schema_sum(const char *p, size_t len)
+{
+        uint32_t h = 0x811c9dc5;
+
+        while (len--)
+                h = (h ^ (unsigned char) *p++) * 0x01000193;
+
+        return h;
+}
+
+/* room for the version, padded so that the offsets are aligned */
+static size_t
+qmp_schema_version_len(size_t len)
+{
+        return (len + 1 + 3) & ~(size_t) 3;
+}
+
+/*
+ * the version object as qemu reports it, the package string included,
+ * so distribution builds of the same release are told apart
+ */
+static int
+qmp_schema_version(const struct qmp_conn *qmpc, char *ver, size_t size)
+{
+        const char *qmp, *val;
+        size_t qlen, vlen, nread, skip;
+        ssize_t olen;
+        char *buf;
+
+        if (json_get_member(qmpc->greeting, strlen(qmpc->greeting), "QMP",
+                            &qmp, &qlen) == 0 &&
+            json_get_member(qmp, qlen, "version", &val, &vlen) == 0) {
+                json_compact(ver, size, val, vlen);
+                return 0;
+        }
+
+        /* the greeting did not fit, ask */
+        buf = xmalloc(QMP_BUF_LEN);
+        if (qmp_execute_uncached(qmpc, QMP_COMMAND_QUERY_VERSION, buf,
+                                 QMP_BUF_LEN, &nread) == -1 ||
+            (olen = json_object_len(buf, nread, &skip)) <= 0 ||
+            json_get_member(buf + skip, olen, "return", &val, &vlen) == -1) {
+                xfree(buf);
+                return -1;
+        }
+
+        json_compact(ver, size, val, vlen);
+        xfree(buf);
+        return 0;
+}
+
+static int
+qmp_schema_path(const char *ver, char *path, size_t size)
+{
+        const char *base = getenv("XDG_CACHE_HOME");
+        const char *home = getenv("HOME");
+        int n;
+
+        if (base && *base) {
+                n = snprintf(path, size, "%s/" QMP_SCHEMA_DIR, base);
+        } else if (home && *home) {
+                n = snprintf(path, size, "%s/.cache/" QMP_SCHEMA_DIR, home);
+        } else {
+                return -1;
+        }
+
+        if (n < 0 || (size_t) n >= size)
+                return -1;
+
+        n += snprintf(path + n, size - n, "/schema-%08x.bin",
+                      qmp_schema_sum(ver, strlen(ver)));
+
+        return (size_t) n < size ? 0 : -1;
+}
+
+/*
+ * point into the block and check that it is sane, the same code serves
+ * freshly built schemas and files of unknown origin
+ */
+static int
+qmp_schema_map(struct qmp_schema *schema, const char *ver)
+{
+        const struct qmp_schema_hdr *hdr;
+        size_t vlen, need;
+        uint32_t i;
+
+        if (schema->len < sizeof(struct qmp_schema_hdr))
+                return -1;
+
+        hdr = (const struct qmp_schema_hdr *) schema->data;
+        if (memcmp(hdr->magic, QMP_SCHEMA_MAGIC, 4) ||
+            hdr->format != QMP_SCHEMA_FORMAT)
+                return -1;
+
+        vlen = hdr->version_len;
+        need = sizeof(struct qmp_schema_hdr) + vlen +
+               (size_t) hdr->count * sizeof(uint32_t) + hdr->names_len;
+        if (need != schema->len || vlen % 4 || hdr->names_len == 0 ||
+            qmp_schema_sum(schema->data + sizeof(struct qmp_schema_hdr),
+                           schema->len - sizeof(struct qmp_schema_hdr)) !=
+            hdr->sum)
+                return -1;
+
+        schema->hdr = hdr;
+        schema->version = schema->data + sizeof(struct qmp_schema_hdr);
+        schema->offsets = (const uint32_t *) (schema->version + vlen);
+        schema->names = (const char *) (schema->offsets + hdr->count);
+
+        if (schema->version[vlen - 1] != '\0' ||
+            schema->names[hdr->names_len - 1] != '\0' ||
+            !streq(schema->version, ver))
+                return -1;
+
+        for (i = 0; i < hdr->count; i++) {
+                if ((schema->offsets[i] & ~QMP_SCHEMA_OOB) >= hdr->names_len)
+                        return -1;
+        }
+
+        return 0;
+}
+
+static struct qmp_schema *
+qmp_schema_load(const char *path, const char *ver)
+{
+        struct qmp_schema *schema;
+        struct stat st;
+        int fd;
+
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+                return NULL;
+        }
+
+        if (fstat(fd, &st) == -1 || st.st_size <= 0 ||
+            st.st_size > QMP_SCHEMA_BUF_LEN) {
+                close(fd);
+                return NULL;
+        }
+
+        schema = xcalloc(1, sizeof(struct qmp_schema));
+        schema->len = st.st_size;
+        schema->data = xmalloc(schema->len);
+
+        if (pread(fd, schema->data, schema->len, 0) != (ssize_t) schema->len ||
+            qmp_schema_map(schema, ver) == -1) {
+                dprintf("schema: ignoring '%s'\n", path);
+                close(fd);
+                xfree(schema->data);
+                xfree(schema);
+                return NULL;
+        }
+
+        close(fd);
+        return schema;
+}
+
+/*
+ * written aside and renamed, concurrent readers see the old file or the
+ * new one, never half of it
+ */
+static void
+qmp_schema_store(const struct qmp_schema *schema, const char *path)
+{
+        char tmp[PATH_MAX], *slash;
+        int fd;
+
+        snprintf(tmp, sizeof(tmp), "%s", path);
+        if ((slash = strrchr(tmp, '/')) != NULL) {
+                *slash = '\0';
+                /* ~/.cache may be missing too */
+                if ((slash = strrchr(tmp, '/')) != NULL) {
+                        *slash = '\0';
+                        mkdir(tmp, 0700);
+                        *slash = '/';
+                }
+                mkdir(tmp, 0700);
+        }
+
+        if (snprintf(tmp, sizeof(tmp), "%s.%d", path,
+                     (int) getpid()) >= (int) sizeof(tmp)) {
+                return;
+        }
+        if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                       0600)) == -1) {
+                return;
+        }
+
+        if (xwrite(fd, schema->data, schema->len) != schema->len ||
+            rename(tmp, path) == -1) {
+                dprintf("schema: failed to write '%s' ('%s')\n", path,
+                        strerror(errno));
+                unlink(tmp);
+        }
+
+        close(fd);
+}
+
+static const char *qmp_schema_sort_names;
+
+static int
+qmp_schema_cmp(const void *a, const void *b)
+{
+        return strcmp(qmp_schema_sort_names +
+                      (*(const uint32_t *) a & ~QMP_SCHEMA_OOB),
+                      qmp_schema_sort_names +
+                      (*(const uint32_t *) b & ~QMP_SCHEMA_OOB));
+}
+
+/*
+ * [{"name": "query-status", "ret-type": "5", "meta-type": "command",
+ *   "arg-type": "0"}, {"name": "migrate-pause", "meta-type": "command",
+ *   "allow-oob": true, ...}, {"name": "STOP", "meta-type": "event", ...}]
+ */
+static struct qmp_schema *
+qmp_schema_build(const char *arr, size_t alen, const char *ver)
+{
+        struct qmp_schema_hdr hdr;
+        struct qmp_schema *schema;
+        uint32_t *offsets;
+        char *names;
+        size_t pos = 0, nlen = 0, vlen, elen, mlen, namelen, off;
+        const char *elem, *meta, *name, *oob;
+        size_t olen;
+        uint32_t count = 0, room = 256;
+        int r;
+
+        /* the names are a fraction of the array they come from */
+        names = xmalloc(alen);
+        offsets = xmalloc(room * sizeof(uint32_t));
+
+        while ((r = json_array_next(arr, alen, &pos, &elem, &elen)) == 1) {
+                if (json_get_member(elem, elen, "meta-type", &meta,
+                                    &mlen) == -1 ||
+                    !json_string_eq(meta, mlen, "command") ||
+                    json_get_member(elem, elen, "name", &name,
+                                    &namelen) == -1 ||
+                    namelen < 2 || *name != '"')
+                        continue;
+
+                if (count == room) {
+                        room *= 2;
+                        offsets = xrealloc(offsets, room * sizeof(uint32_t));
+                }
+                offsets[count] = nlen;
+                if (json_get_member(elem, elen, "allow-oob", &oob,
+                                    &olen) == 0 && json_to_u64(oob, olen))
+                        offsets[count] |= QMP_SCHEMA_OOB;
+                count++;
+                memcpy(names + nlen, name + 1, namelen - 2);
+                nlen += namelen - 2;
+                names[nlen++] = '\0';
+        }
+
+        if (r == -1 || count == 0) {
+                xfree(offsets);
+                xfree(names);
+                return NULL;
+        }
+
+        qmp_schema_sort_names = names;
+        qsort(offsets, count, sizeof(uint32_t), qmp_schema_cmp);
+
+        vlen = qmp_schema_version_len(strlen(ver));
+
+        memset(&hdr, 0, sizeof(struct qmp_schema_hdr));
+        memcpy(hdr.magic, QMP_SCHEMA_MAGIC, 4);
+        hdr.format = QMP_SCHEMA_FORMAT;
+        hdr.count = count;
+        hdr.version_len = vlen;
+        hdr.names_len = nlen;
+
+        schema = xcalloc(1, sizeof(struct qmp_schema));
+        schema->len = sizeof(struct qmp_schema_hdr) + vlen +
+                      count * sizeof(uint32_t) + nlen;
+        schema->data = xcalloc(1, schema->len);
+
+        off = sizeof(struct qmp_schema_hdr);
+        memcpy(schema->data + off, ver, strlen(ver));
+        off += vlen;
+        memcpy(schema->data + off, offsets, count * sizeof(uint32_t));
+        off += count * sizeof(uint32_t);
+        memcpy(schema->data + off, names, nlen);
+
+        hdr.sum = qmp_schema_sum(schema->data + sizeof(struct qmp_schema_hdr),
+                                 schema->len - sizeof(struct qmp_schema_hdr));
+        memcpy(schema->data, &hdr, sizeof(struct qmp_schema_hdr));
+
+        xfree(offsets);
+        xfree(names);
+
+        if (qmp_schema_map(schema, ver) == -1) {
+                xfree(schema->data);
+                xfree(schema);
+                return NULL;
+        }
+
+        return schema;
+}
+
+static struct qmp_schema *
+qmp_schema_fetch(const struct qmp_conn *qmpc, const char *ver)
+{
+        struct qmp_schema *schema = NULL;
+        size_t nread, skip, off = 0, vlen;
+        const char *val;
+        ssize_t olen;
+        char *buf;
+
+        buf = xmalloc(QMP_SCHEMA_BUF_LEN);
+        if (qmp_execute_uncached(qmpc, QMP_COMMAND_QUERY_SCHEMA, buf,
+                                 QMP_SCHEMA_BUF_LEN, &nread) == -1) {
+                xfree(buf);
+                return NULL;
+        }
+
+        /* events may come first */
+        while ((olen = json_object_len(buf + off, nread - off, &skip)) > 0) {
+                off += skip;
+                if (json_get_member(buf + off, olen, "return", &val,
+                                    &vlen) == 0) {
+                        schema = qmp_schema_build(val, vlen, ver);
+                        break;
+                }
+                off += olen;
+        }
+
+        xfree(buf);
+        return schema;
+}
+
+/* under schemas_lock */
+static struct qmp_schema *
+qmp_schema_lookup(const char *ver)
+{
+        struct qmp_schema *schema;
+
+        for (schema = schemas; schema != NULL; schema = schema->next) {
+                if (streq(schema->version, ver))
+                        break;
+        }
+
+        return schema;
+}
+
+const struct qmp_schema *
+qmp_schema_get(const struct qmp_conn *qmpc)
+{
+        char ver[QMP_MAX_LENGTH], path[PATH_MAX];
+        struct qmp_schema *schema, *known;
+        int on_disk, fetched = 0;
+
+        if (qmp_schema_version(qmpc, ver, sizeof(ver)) == -1) {
+                return NULL;
+        }
+
+        pthread_mutex_lock(&schemas_lock);
+        schema = qmp_schema_lookup(ver);
+        pthread_mutex_unlock(&schemas_lock);
+        if (schema)
+                return schema;
+
+        /* the other VMs do not wait on this one's monitor */
+        on_disk = qmp_schema_path(ver, path, sizeof(path)) == 0;
+
+        if (!on_disk || !(schema = qmp_schema_load(path, ver))) {
+                if (!(schema = qmp_schema_fetch(qmpc, ver))) {
+                        dprintf("schema: qemu %s did not describe itself\n",
+                                ver);
+                        return NULL;
+                }
+                fetched = 1;
+        }
+
+        /* a VM of the same version may have got there first */
+        pthread_mutex_lock(&schemas_lock);
+        if ((known = qmp_schema_lookup(ver)) == NULL) {
+                schema->next = schemas;
+                schemas = schema;
+        }
+        pthread_mutex_unlock(&schemas_lock);
+
+        if (known) {
+                xfree(schema->data);
+                xfree(schema);
+                return known;
+        }
+
+        if (fetched && on_disk)
+                qmp_schema_store(schema, path);
+
+        return schema;
+}
+
+static const uint32_t *
+qmp_schema_find(const struct qmp_schema *schema, const char *cmd)
+{
+        uint32_t lo = 0, hi = schema->hdr->count;
+
+        while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                int r = strcmp(cmd, schema->names +
+                               (schema->offsets[mid] & ~QMP_SCHEMA_OOB));
+
+                if (r == 0)
+                        return &schema->offsets[mid];
+                if (r < 0)
+                        hi = mid;
+                else
+                        lo = mid + 1;
+        }
+
+        return NULL;
+}
+
+int
+qmp_schema_has(const struct qmp_schema *schema, const char *cmd)
+{
+        return qmp_schema_find(schema, cmd) != NULL;
+}
+
+int
+qmp_schema_allows_oob(const struct qmp_schema *schema, const char *cmd)
+{
+        const uint32_t *off = qmp_schema_find(schema, cmd);
+
+        return off && (*off & QMP_SCHEMA_OOB);
+}
+
+void
+qmp_schema_release(void)
+{
+        struct qmp_schema *schema;
+
+        while ((schema = schemas) != NULL) {
+                schemas = schema->next;
+                xfree(schema->data);
+                xfree(schema);
+        }
+}
@@ -0,0 +1,77 @@
+#ifndef __SCHEMA_H
+#define __SCHEMA_H
+
+/*
+ * What the connected qemu can do. The command names of query-qmp-schema
+ * are kept sorted in one block, and written to disk keyed by the qemu
+ * version, so that only the first connection to a given qemu build pays
+ * for the download (hundreds of KB) and its parsing.
+ */
+
+/* room for the query-qmp-schema reply */
+#define QMP_SCHEMA_BUF_LEN      (4 * 1024 * 1024)
+#define QMP_SCHEMA_MAGIC        "QQSC"
+/* bump when the file layout changes */
+#define QMP_SCHEMA_FORMAT       (2)
+/* set in the offset of commands that may be sent with exec-oob */
+#define QMP_SCHEMA_OOB          (1U << 31)
+/* below $XDG_CACHE_HOME or ~/.cache */
+#define QMP_SCHEMA_DIR          "qemu-qmp"
+
+struct qmp_conn;
+
+/*
+ * the on-disk layout is the in-memory one: header, version string,
+ * offsets of the names in ascending order, then the names, NUL terminated
+ */
+struct qmp_schema_hdr {
+        char magic[4];
+        uint32_t format;
+        uint32_t count;
+        uint32_t version_len;
+        uint32_t names_len;
+        /* FNV-1a of everything after the header */
+        uint32_t sum;
+};
+
+struct qmp_schema {
+        /* the whole file */
+        char *data;
+        size_t len;
+        const struct qmp_schema_hdr *hdr;
+        const char *version;
+        const uint32_t *offsets;
+        const char *names;
+        struct qmp_schema *next;
+};
+
+/**
+ * @brief get the schema of the qemu behind an established connection,
+ * from memory, from disk or by asking qemu, in that order
+ * @retval the schema, shared by all connections to the same version,
+ * NULL if qemu cannot tell
+ */
+extern const struct qmp_schema *
+qmp_schema_get(const struct qmp_conn *qmpc);
+
+/**
+ * @brief check for a command
+ * @retval 1 if qemu has it, 0 if not
+ */
+extern int
+qmp_schema_has(const struct qmp_schema *schema, const char *cmd);
+
+/**
+ * @brief check whether a command may be executed out of band
+ * @retval 1 if qemu has it and allows exec-oob for it, 0 if not
+ */
+extern int
+qmp_schema_allows_oob(const struct qmp_schema *schema, const char *cmd);
+
+/**
+ * @brief free all the schemas loaded so far
+ */
+extern void
+qmp_schema_release(void);
+
+#endif /* __SCHEMA_H */
@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "regs.h"
+#include "qmp.h"
+#include "stream.h"
+
+void
+qmp_stream_init(struct qmp_stream *s, enum qmp_stream_kind kind,
+                const struct qregs_arch_desc *arch,
+                qmp_stream_vcpu_fn on_vcpu, qmp_stream_regs_fn on_regs,
+                void *arg)
+{
+        memset(s, 0, sizeof(struct qmp_stream));
+        s->kind = kind;
+        s->state = QMP_STREAM_OBJECT;
+        s->arch = arch;
+        s->on_vcpu = on_vcpu;
+        s->on_regs = on_regs;
+        s->arg = arg;
+}
+
+static void
+qmp_stream_flush_block(struct qmp_stream *s)
+{
+        struct qregs regs;
+
+        if (s->blen == 0)
+                return;
+
+        memset(&regs, 0, sizeof(struct qregs));
+        if (qregs_parse(s->arch, s->block, s->blen, &regs) == 0) {
+                if (s->on_regs)
+                        s->on_regs(s->count, &regs, s->arg);
+                s->count++;
+        } else {
+                s->errors++;
+        }
+
+        s->blen = 0;
+}
+
+/* "* CPU #0: pc=0xffffffff81051c02 (halted) thread_id=5132" */
+static void
+qmp_stream_vcpu_line(struct qmp_stream *s)
+{
+        const char *cpu = strstr(s->line, "CPU");
+        struct vcpu vcpu;
+
+        if (!cpu)
+                return;
+
+        memset(&vcpu, 0, sizeof(struct vcpu));
+        if (qmp_parse_cpu_line(cpu + 3, &vcpu) == -1) {
+                s->errors++;
+                return;
+        }
+
+        if (s->on_vcpu)
+                s->on_vcpu(&vcpu, s->arg);
+        s->count++;
+}
+
+static void
+qmp_stream_regs_line(struct qmp_stream *s)
+{
+        const char *p = s->line;
+
+        while (isspace((unsigned char) *p))
+                p++;
+
+        /* the header of the next vCPU ends the current one */
+        if (!strncmp(p, "CPU#", 4))
+                qmp_stream_flush_block(s);
+
+        if (s->blen + s->llen + 1 > s->bsize) {
+                s->bsize = s->blen + s->llen + QMP_STREAM_LINE;
+                s->block = xrealloc(s->block, s->bsize);
+        }
+        memcpy(s->block + s->blen, s->line, s->llen);
+        s->blen += s->llen;
+        s->block[s->blen++] = '\n';
+}
+
+static void
+qmp_stream_line(struct qmp_stream *s)
+{
+        s->line[s->llen] = '\0';
+
+        if (s->kind == QMP_STREAM_VCPUS)
+                qmp_stream_vcpu_line(s);
+        else
+                qmp_stream_regs_line(s);
+
+        s->llen = 0;
+}
+
+static void
+qmp_stream_put(struct qmp_stream *s, char c)
+{
+        if (s->llen < QMP_STREAM_LINE - 1)
+                s->line[s->llen++] = c;
+}
+
+/* one character of the string, unescaped as it goes */
+static void
+qmp_stream_text(struct qmp_stream *s, char c)
+{
+        if (s->escape > 1) {
+                /* the digits of \uXXXX, nothing HMP prints */
+                if (++s->escape == 6) {
+                        s->escape = 0;
+                        qmp_stream_put(s, '?');
+                }
+                return;
+        }
+
+        if (s->escape == 1) {
+                s->escape = 0;
+                switch (c) {
+                case 'n':
+                        qmp_stream_line(s);
+                break;
+                case 'r':
+                break;
+                case 't':
+                        qmp_stream_put(s, ' ');
+                break;
+                case 'u':
+                        s->escape = 2;
+                break;
+                default:
+                        qmp_stream_put(s, c);
+                }
+                return;
+        }
+
+        if (c == '\\') {
+                s->escape = 1;
+        } else if (c == '"') {
+                /* the last line may come without a line ending */
+                if (s->llen)
+                        qmp_stream_line(s);
+                if (s->kind == QMP_STREAM_REGS)
+                        qmp_stream_flush_block(s);
+                /* the rest of the reply is still to come */
+                s->state = QMP_STREAM_TAIL;
+        } else {
+                qmp_stream_put(s, c);
+        }
+}
+
+/*
+ * the members of the objects before the text, the strings of the top
+ * level being candidate keys
+ * @retval 1 for the key of the text, -1 for an error reply, 0 otherwise
+ */
+static int
+qmp_stream_object(struct qmp_stream *s, char c)
+{
+        if (!s->in_string) {
+                if (c == '{' || c == '[') {
+                        s->depth++;
+                } else if ((c == '}' || c == ']') && s->depth) {
+                        s->depth--;
+                } else if (c == '"') {
+                        s->in_string = 1;
+                        s->klen = 0;
+                }
+                return 0;
+        }
+
+        if (s->escape) {
+                s->escape = 0;
+                s->klen = QMP_STREAM_KEY_LEN;
+                return 0;
+        }
+
+        if (c == '\\') {
+                s->escape = 1;
+                return 0;
+        }
+
+        if (c != '"') {
+                if (s->klen < QMP_STREAM_KEY_LEN)
+                        s->key[s->klen++] = c;
+                return 0;
+        }
+
+        s->in_string = 0;
+        if (s->depth != 1)
+                return 0;
+
+        if (s->klen == strlen(QMP_STREAM_KEY) &&
+            !memcmp(s->key, QMP_STREAM_KEY, s->klen))
+                return 1;
+        if (s->klen == strlen(QMP_STREAM_ERROR_KEY) &&
+            !memcmp(s->key, QMP_STREAM_ERROR_KEY, s->klen))
+                return -1;
+
+        return 0;
+}
+
+int
+qmp_stream_feed(struct qmp_stream *s, const char *buf, size_t len,
+                size_t *used)
+{
+        size_t i;
+        int r;
+
+        for (i = 0; i < len && s->state != QMP_STREAM_DONE; i++) {
+                char c = buf[i];
+
+                switch (s->state) {
+                case QMP_STREAM_OBJECT:
+                        if ((r = qmp_stream_object(s, c)) == -1) {
+                                s->error = 1;
+                                s->state = QMP_STREAM_TAIL;
+                        } else if (r == 1) {
+                                s->state = QMP_STREAM_KEY_COLON;
+                        }
+                break;
+                case QMP_STREAM_KEY_COLON:
+                        if (isspace((unsigned char) c))
+                                break;
+                        if (c == ':') {
+                                s->state = QMP_STREAM_VALUE;
+                                break;
+                        }
+                        /* a string value that looked like the key */
+                        s->state = QMP_STREAM_OBJECT;
+                        i--;
+                break;
+                case QMP_STREAM_VALUE:
+                        if (isspace((unsigned char) c))
+                                break;
+                        /* "return": {} or [], not HMP text */
+                        if (c != '"') {
+                                s->error = 1;
+                                s->state = QMP_STREAM_TAIL;
+                                i--;
+                                break;
+                        }
+                        s->state = QMP_STREAM_TEXT;
+                break;
+                case QMP_STREAM_TEXT:
+                        qmp_stream_text(s, c);
+                break;
+                case QMP_STREAM_TAIL:
+                        /* up to the brace that closes the reply */
+                        qmp_stream_object(s, c);
+                        if (s->depth == 0)
+                                s->state = QMP_STREAM_DONE;
+                break;
+                case QMP_STREAM_DONE:
+                break;
+                }
+        }
+
+        *used = i;
+        if (s->state != QMP_STREAM_DONE)
+                return 0;
+        return s->error ? -1 : 1;
+}
+
+void
+qmp_stream_release(struct qmp_stream *s)
+{
+        xfree(s->block);
+        s->block = NULL;
+        s->blen = s->bsize = 0;
+}
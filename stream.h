@@ -0,0 +1,105 @@
+#ifndef __STREAM_H
+#define __STREAM_H
+
+/*
+ * Push parser for the HMP text of 'info cpus' and 'info registers -a',
+ * fed whatever each read returned. The JSON string is unescaped on the
+ * fly and cut into lines; a vCPU is handed out as soon as its last line
+ * is in, so parsing keeps up with receiving and neither the reply nor
+ * the list of vCPUs has to be held. What is kept is one line, and for
+ * registers the block of the current vCPU.
+ */
+
+/* longest line kept, the rest of a longer one is dropped */
+#define QMP_STREAM_LINE         (512)
+/* where the text is, in {"return": "...", "id": 1} */
+#define QMP_STREAM_KEY          "return"
+/* an error reply, no need to wait for a text that is not coming */
+#define QMP_STREAM_ERROR_KEY    "error"
+/* longest key compared, anything longer is neither of them */
+#define QMP_STREAM_KEY_LEN      (8)
+
+struct vcpu;
+struct qregs;
+struct qregs_arch_desc;
+
+enum qmp_stream_kind {
+        /* 'info cpus', one line per vCPU */
+        QMP_STREAM_VCPUS,
+        /* 'info registers -a', a "CPU#n" line starts every vCPU */
+        QMP_STREAM_REGS,
+};
+
+enum qmp_stream_state {
+        /* looking for QMP_STREAM_KEY in a top level object, past events */
+        QMP_STREAM_OBJECT,
+        QMP_STREAM_KEY_COLON,
+        QMP_STREAM_VALUE,
+        /* inside the string */
+        QMP_STREAM_TEXT,
+        /* past the text or an error, until the reply object closes */
+        QMP_STREAM_TAIL,
+        QMP_STREAM_DONE,
+};
+
+typedef void (*qmp_stream_vcpu_fn)(const struct vcpu *vcpu, void *arg);
+typedef void (*qmp_stream_regs_fn)(unsigned int n, const struct qregs *regs,
+                                   void *arg);
+
+struct qmp_stream {
+        enum qmp_stream_kind kind;
+        enum qmp_stream_state state;
+        /* QMP_STREAM_OBJECT: nesting, and the string being read */
+        unsigned int depth;
+        int in_string;
+        char key[QMP_STREAM_KEY_LEN];
+        unsigned int klen;
+        /* 1 past a backslash, 2 to 5 within the digits of a \uXXXX */
+        unsigned int escape;
+        /* the reply is an error, or carries no text */
+        int error;
+
+        char line[QMP_STREAM_LINE];
+        size_t llen;
+
+        /* QMP_STREAM_REGS: the lines of the current vCPU */
+        char *block;
+        size_t blen, bsize;
+        const struct qregs_arch_desc *arch;
+
+        /* vCPUs handed out, and those that did not parse */
+        unsigned int count;
+        unsigned int errors;
+
+        qmp_stream_vcpu_fn on_vcpu;
+        qmp_stream_regs_fn on_regs;
+        void *arg;
+};
+
+/**
+ * @brief start parsing a reply
+ * @param arch for QMP_STREAM_REGS, NULL means x86
+ * @param on_vcpu called for each vCPU of QMP_STREAM_VCPUS
+ * @param on_regs called for each vCPU of QMP_STREAM_REGS
+ */
+extern void
+qmp_stream_init(struct qmp_stream *s, enum qmp_stream_kind kind,
+                const struct qregs_arch_desc *arch,
+                qmp_stream_vcpu_fn on_vcpu, qmp_stream_regs_fn on_regs,
+                void *arg);
+
+/**
+ * @brief parse the next 'len' bytes of the reply, up to the brace that
+ * closes it; what comes after, events or other replies, is left
+ * @param used the bytes of 'buf' that were the reply's
+ * @retval 1 once the reply is complete, 0 if more is needed, -1 once an
+ * error reply or one that carries no text is complete
+ */
+extern int
+qmp_stream_feed(struct qmp_stream *s, const char *buf, size_t len,
+                size_t *used);
+
+extern void
+qmp_stream_release(struct qmp_stream *s);
+
+#endif /* __STREAM_H */
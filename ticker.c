@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/timerfd.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "ticker.h"
+
+#define TICK_US                 (1000UL)
+#define TICK_S                  (1000000000UL)
+
+int
+ticker_init(struct ticker *t, uint64_t period_ns)
+{
+        struct itimerspec its;
+        uint64_t first;
+
+        memset(t, 0, sizeof(struct ticker));
+
+        if ((t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1) {
+                dprintf("ticker: timerfd_create: %s\n", strerror(errno));
+                return -1;
+        }
+
+        t->period = period_ns;
+        t->deadline = xclock_ns();
+        first = t->deadline + period_ns;
+
+        its.it_value.tv_sec = first / TICK_S;
+        its.it_value.tv_nsec = first % TICK_S;
+        its.it_interval.tv_sec = period_ns / TICK_S;
+        its.it_interval.tv_nsec = period_ns % TICK_S;
+
+        if (timerfd_settime(t->fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+                dprintf("ticker: timerfd_settime: %s\n", strerror(errno));
+                close(t->fd);
+                t->fd = -1;
+                return -1;
+        }
+
+        return 0;
+}
+
+uint64_t
+ticker_wait(struct ticker *t)
+{
+        uint64_t n;
+        ssize_t r;
+
+        do {
+                r = read(t->fd, &n, sizeof(n));
+        } while (r == -1 && errno == EINTR);
+
+        if (r != sizeof(n) || n == 0)
+                return 0;
+
+        /* only the latest tick is run, the ones before it are gone */
+        t->deadline += n * t->period;
+        t->missed += n - 1;
+        t->ticks += n;
+
+        return t->deadline;
+}
+
+void
+ticker_close(struct ticker *t)
+{
+        if (t->fd > 0)
+                close(t->fd);
+        t->fd = -1;
+}
+
+int
+ticker_pin(unsigned int cpu)
+{
+        cpu_set_t set;
+        int err;
+
+        if (cpu >= CPU_SETSIZE) {
+                dprintf("ticker: no CPU %u\n", cpu);
+                return -1;
+        }
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err) {
+                dprintf("ticker: cannot pin to CPU %u: %s\n", cpu,
+                        strerror(err));
+                return -1;
+        }
+
+        return 0;
+}
+
+int
+ticker_fifo(int prio)
+{
+        struct sched_param sp = { .sched_priority = prio };
+        int err;
+
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+        if (err) {
+                dprintf("ticker: cannot run SCHED_FIFO at %d: %s\n", prio,
+                        strerror(err));
+                return -1;
+        }
+
+        return 0;
+}
+
+void
+tick_hist_add(struct tick_hist *h, uint64_t late_ns)
+{
+        uint64_t us = late_ns / TICK_US;
+        unsigned int i = 0;
+
+        /* the bucket is the bit length of the us */
+        while (us && i < TICK_HIST_BUCKETS - 1) {
+                us >>= 1;
+                i++;
+        }
+
+        h->count[i]++;
+        h->samples++;
+        h->sum += late_ns;
+        if (late_ns > h->max)
+                h->max = late_ns;
+}
+
+uint64_t
+tick_hist_pct(const struct tick_hist *h, unsigned int pct)
+{
+        uint64_t want = (h->samples * pct + 99) / 100, seen = 0;
+        unsigned int i;
+
+        for (i = 0; i < TICK_HIST_BUCKETS - 1; i++) {
+                seen += h->count[i];
+                if (seen >= want)
+                        return 1UL << i;
+        }
+
+        return UINT64_MAX;
+}
+
+size_t
+tick_hist_format(const struct tick_hist *h, char *buf, size_t len)
+{
+        size_t off = 0;
+        unsigned int i;
+        int n;
+
+        if (len == 0)
+                return 0;
+        buf[0] = '\0';
+
+        for (i = 0; i < TICK_HIST_BUCKETS && off < len; i++) {
+                if (!h->count[i])
+                        continue;
+
+                if (i == TICK_HIST_BUCKETS - 1)
+                        n = snprintf(buf + off, len - off, "%s>=%luus:%lu",
+                                     off ? " " : "", 1UL << (i - 1),
+                                     h->count[i]);
+                else
+                        n = snprintf(buf + off, len - off, "%s<%luus:%lu",
+                                     off ? " " : "", 1UL << i, h->count[i]);
+                if (n < 0)
+                        break;
+                off += n;
+        }
+
+        return off < len ? off : len - 1;
+}
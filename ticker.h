@@ -0,0 +1,87 @@
+#ifndef __TICKER_H
+#define __TICKER_H
+
+/*
+ * Periodic wakeups for sampling. A ticker is a timerfd armed once at an
+ * absolute CLOCK_MONOTONIC deadline with the period as interval, so the
+ * kernel computes each deadline from the previous one, never from when
+ * the thread got around to waiting: the time spent sampling, and a late
+ * wakeup, do not shift the ticks that follow. Ticks that go by while the
+ * previous round still runs are counted as missed and skipped, rather
+ * than run back to back, which would bunch samples up.
+ *
+ * How late each sample was taken, against the deadline of its tick, goes
+ * into a histogram of power of two buckets of microseconds.
+ */
+
+/* <1us, then [2^(i-1), 2^i) us, the last one for 2^20 us (~1s) and more */
+#define TICK_HIST_BUCKETS       (22)
+
+struct ticker {
+        int fd;
+        /* in ns */
+        uint64_t period;
+        /* CLOCK_MONOTONIC ns of the tick last woken up for */
+        uint64_t deadline;
+        uint64_t ticks;
+        uint64_t missed;
+};
+
+struct tick_hist {
+        uint64_t count[TICK_HIST_BUCKETS];
+        uint64_t samples;
+        /* in ns */
+        uint64_t sum;
+        uint64_t max;
+};
+
+/**
+ * @brief arm a ticker of 'period_ns'; the first tick is now, the next one
+ * a period later
+ * @retval 0 on success, -1 if no timerfd could be armed
+ */
+extern int
+ticker_init(struct ticker *t, uint64_t period_ns);
+
+/**
+ * @brief block until the next tick
+ * @retval its deadline, in CLOCK_MONOTONIC ns, 0 on failure
+ */
+extern uint64_t
+ticker_wait(struct ticker *t);
+
+extern void
+ticker_close(struct ticker *t);
+
+/**
+ * @brief pin the calling thread to 'cpu'
+ * @retval 0 on success, -1 otherwise
+ */
+extern int
+ticker_pin(unsigned int cpu);
+
+/**
+ * @brief run the calling thread SCHED_FIFO at 'prio', CAP_SYS_NICE needed
+ * @retval 0 on success, -1 otherwise
+ */
+extern int
+ticker_fifo(int prio);
+
+extern void
+tick_hist_add(struct tick_hist *h, uint64_t late_ns);
+
+/**
+ * @brief the upper bound of the bucket the pct-th percentile falls in
+ * @retval in us, UINT64_MAX if it is in the last bucket
+ */
+extern uint64_t
+tick_hist_pct(const struct tick_hist *h, unsigned int pct);
+
+/**
+ * @brief the non-empty buckets on one line, as "<1us:N <2us:N ..."
+ * @retval the length written, without the NUL
+ */
+extern size_t
+tick_hist_format(const struct tick_hist *h, char *buf, size_t len);
+
+#endif /* __TICKER_H */
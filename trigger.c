@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "regs.h"
+#include "qmp.h"
+#include "trigger.h"
+
+/* unaligned, the columns start wherever malloc put them */
+typedef uint64_t trig_u64v
+        __attribute__((vector_size(TRIG_LANES * sizeof(uint64_t)),
+                       aligned(sizeof(uint64_t))));
+
+#define TRIG_REG(r)     { #r, offsetof(struct qregs, r) }
+
+static const struct {
+        const char *name;
+        size_t off;
+} trig_regs[] = {
+        TRIG_REG(rax), TRIG_REG(rbx), TRIG_REG(rcx), TRIG_REG(rdx),
+        TRIG_REG(rsi), TRIG_REG(rdi), TRIG_REG(rbp), TRIG_REG(rsp),
+        TRIG_REG(r8), TRIG_REG(r9), TRIG_REG(r10), TRIG_REG(r11),
+        TRIG_REG(r12), TRIG_REG(r13), TRIG_REG(r14), TRIG_REG(r15),
+        TRIG_REG(rip), TRIG_REG(rflags), TRIG_REG(efer),
+        TRIG_REG(es), TRIG_REG(cs), TRIG_REG(ss), TRIG_REG(ds),
+        TRIG_REG(fs), TRIG_REG(gs), TRIG_REG(cpl),
+        TRIG_REG(cr0), TRIG_REG(cr2), TRIG_REG(cr3), TRIG_REG(cr4),
+        /* whatever the architecture */
+        TRIG_REG(pc), TRIG_REG(sp),
+};
+
+#define TRIG_NREGS      (sizeof(trig_regs) / sizeof(trig_regs[0]))
+
+void
+trig_init(struct trig_set *ts, trig_fire_fn fire, void *arg)
+{
+        memset(ts, 0, sizeof(struct trig_set));
+        ts->fire = fire;
+        ts->arg = arg;
+}
+
+static const char *
+trig_skip(const char *p)
+{
+        while (isspace((unsigned char) *p))
+                p++;
+        return p;
+}
+
+/* 'word' followed by something that cannot continue it */
+static int
+trig_word(const char **p, const char *word)
+{
+        size_t len = strlen(word);
+
+        if (strncmp(*p, word, len) || isalnum((unsigned char) (*p)[len]))
+                return 0;
+
+        *p = trig_skip(*p + len);
+        return 1;
+}
+
+static int
+trig_number(const char **p, uint64_t *val)
+{
+        char *end;
+
+        if (!isdigit((unsigned char) **p))
+                return -1;
+
+        *val = strtoull(*p, &end, 0);
+        *p = trig_skip(end);
+        return 0;
+}
+
+static int
+trig_reg(const char **p)
+{
+        unsigned int i;
+
+        for (i = 0; i < TRIG_NREGS; i++) {
+                if (trig_word(p, trig_regs[i].name))
+                        return i;
+        }
+
+        return -1;
+}
+
+/*
+ * reg [& mask] (== | != | < | <= | > | >=) value
+ * reg [& mask] in lo..hi
+ * all of them become (reg & mask) - lo <= span, possibly negated
+ */
+static int
+trig_term(const char **p, struct trig_insn *insn)
+{
+        uint64_t v, hi;
+        int reg;
+
+        memset(insn, 0, sizeof(struct trig_insn));
+
+        if ((reg = trig_reg(p)) == -1) {
+                return -1;
+        }
+        insn->reg = reg;
+        insn->mask = UINT64_MAX;
+
+        if (**p == '&' && (*p)[1] != '&') {
+                *p = trig_skip(*p + 1);
+                if (trig_number(p, &insn->mask) == -1)
+                        return -1;
+        }
+
+        if (trig_word(p, "in")) {
+                if (trig_number(p, &insn->lo) == -1 ||
+                    strncmp(*p, "..", 2)) {
+                        return -1;
+                }
+                *p = trig_skip(*p + 2);
+                if (trig_number(p, &hi) == -1 || hi < insn->lo)
+                        return -1;
+                insn->span = hi - insn->lo;
+                return 0;
+        }
+
+        if (!strncmp(*p, "==", 2) || !strncmp(*p, "!=", 2)) {
+                insn->negate = **p == '!';
+                *p = trig_skip(*p + 2);
+                return trig_number(p, &insn->lo);
+        }
+
+        if (**p == '<' || **p == '>') {
+                int less = **p == '<', equal = (*p)[1] == '=';
+
+                *p = trig_skip(*p + 1 + equal);
+                if (trig_number(p, &v) == -1)
+                        return -1;
+
+                /* < 0 and > max never hold: outside of everything */
+                if ((less && !equal && v == 0) ||
+                    (!less && !equal && v == UINT64_MAX)) {
+                        insn->span = UINT64_MAX;
+                        insn->negate = 1;
+                } else if (less) {
+                        insn->span = equal ? v : v - 1;
+                } else {
+                        insn->lo = equal ? v : v + 1;
+                        insn->span = UINT64_MAX - insn->lo;
+                }
+                return 0;
+        }
+
+        return -1;
+}
+
+int
+trig_add(struct trig_set *ts, const char *expr)
+{
+        struct trig_insn insns[TRIG_MAX_TERMS];
+        const char *p = trig_skip(expr);
+        unsigned int n = 0, i;
+        uint64_t hold = 1;
+        struct trig *t;
+
+        for (;;) {
+                if (n == TRIG_MAX_TERMS || trig_term(&p, &insns[n]) == -1) {
+                        goto err;
+                }
+                n++;
+
+                if (strncmp(p, "&&", 2))
+                        break;
+                p = trig_skip(p + 2);
+        }
+
+        if (trig_word(&p, "for") &&
+            (trig_number(&p, &hold) == -1 || hold == 0 || hold > UINT32_MAX)) {
+                goto err;
+        }
+
+        if (*p != '\0') {
+                goto err;
+        }
+
+        ts->insns = xrealloc(ts->insns, (ts->ninsns + n) *
+                             sizeof(struct trig_insn));
+        memcpy(&ts->insns[ts->ninsns], insns, n * sizeof(struct trig_insn));
+        for (i = 0; i < n; i++)
+                ts->used |= 1ULL << insns[i].reg;
+
+        ts->trigs = xrealloc(ts->trigs, (ts->count + 1) * sizeof(struct trig));
+        t = &ts->trigs[ts->count];
+        memset(t, 0, sizeof(struct trig));
+        t->expr = strdup(expr);
+        t->first = ts->ninsns;
+        t->count = n;
+        t->hold = hold;
+
+        ts->ninsns += n;
+
+        /* the columns and the streaks are laid out per trigger */
+        ts->size = 0;
+        ts->slots = 0;
+
+        return ts->count++;
+
+err:
+        dprintf("trigger: cannot parse '%s' at '%s'\n", expr, p);
+        return -1;
+}
+
+static unsigned int
+trig_col(const struct trig_set *ts, unsigned int reg)
+{
+        return __builtin_popcountll(ts->used & ((1ULL << reg) - 1));
+}
+
+/* one column per register the checks read, the padding lanes are 0 */
+static void
+trig_transpose(struct trig_set *ts, const struct qregs *regs, unsigned int n)
+{
+        unsigned int reg, i;
+        uint64_t *col;
+
+        for (reg = 0; reg < TRIG_NREGS; reg++) {
+                if (!(ts->used & (1ULL << reg)))
+                        continue;
+
+                col = ts->cols + (size_t) trig_col(ts, reg) * ts->width;
+                for (i = 0; i < n; i++)
+                        col[i] = *(const uint64_t *) ((const char *) &regs[i] +
+                                                      trig_regs[reg].off);
+                for (; i < ts->width; i++)
+                        col[i] = 0;
+        }
+}
+
+/* the lanes of the snapshots all checks of 't' hold for are all ones */
+static void
+trig_run(struct trig_set *ts, const struct trig *t)
+{
+        unsigned int k, i;
+
+        for (i = 0; i < ts->width; i += TRIG_LANES)
+                *(trig_u64v *) &ts->lanes[i] = ~(trig_u64v) { 0 };
+
+        for (k = t->first; k < t->first + t->count; k++) {
+                const struct trig_insn *insn = &ts->insns[k];
+                const uint64_t *col = ts->cols +
+                                      (size_t) trig_col(ts, insn->reg) *
+                                      ts->width;
+                uint64_t neg = insn->negate ? UINT64_MAX : 0;
+
+                for (i = 0; i < ts->width; i += TRIG_LANES) {
+                        trig_u64v v = *(const trig_u64v *) &col[i];
+                        trig_u64v ok;
+
+                        v = (v & insn->mask) - insn->lo;
+                        ok = (trig_u64v) (v <= insn->span) ^ neg;
+                        *(trig_u64v *) &ts->lanes[i] &= ok;
+                }
+        }
+}
+
+static void
+trig_fire(struct trig_set *ts, unsigned int trigger, unsigned int slot,
+          const struct qregs *regs)
+{
+        struct trig_record *rec = &ts->records[ts->nrecords++ %
+                                               TRIG_RECORDS];
+
+        rec->when = xclock_ns();
+        rec->trigger = trigger;
+        rec->slot = slot;
+        rec->pc = regs->pc;
+        rec->cr3 = regs->cr3;
+
+        ts->trigs[trigger].fired++;
+        if (ts->fire)
+                ts->fire(rec, regs, ts->arg);
+}
+
+void
+trig_eval(struct trig_set *ts, const struct qregs *regs, unsigned int n)
+{
+        unsigned int width = (n + TRIG_LANES - 1) & ~(TRIG_LANES - 1);
+        unsigned int used = __builtin_popcountll(ts->used), t, i;
+
+        if (ts->count == 0 || n == 0)
+                return;
+
+        if (width > ts->size) {
+                ts->size = width;
+                ts->cols = xrealloc(ts->cols, (size_t) used * width *
+                                    sizeof(uint64_t));
+                ts->lanes = xrealloc(ts->lanes, width * sizeof(uint64_t));
+        }
+        ts->width = width;
+
+        if (ts->slots != n) {
+                ts->streaks = xrealloc(ts->streaks, (size_t) ts->count * n *
+                                       sizeof(unsigned int));
+                memset(ts->streaks, 0, (size_t) ts->count * n *
+                       sizeof(unsigned int));
+                ts->slots = n;
+        }
+
+        trig_transpose(ts, regs, n);
+
+        for (t = 0; t < ts->count; t++) {
+                unsigned int *streak = ts->streaks + (size_t) t * n;
+                unsigned int hold = ts->trigs[t].hold;
+
+                trig_run(ts, &ts->trigs[t]);
+
+                for (i = 0; i < n; i++) {
+                        if (!ts->lanes[i]) {
+                                streak[i] = 0;
+                                continue;
+                        }
+                        /* once per streak */
+                        if (streak[i] < hold && ++streak[i] == hold)
+                                trig_fire(ts, t, i, &regs[i]);
+                }
+        }
+}
+
+const struct trig_record *
+trig_record(const struct trig_set *ts, unsigned int i)
+{
+        uint64_t kept = ts->nrecords < TRIG_RECORDS ? ts->nrecords :
+                        TRIG_RECORDS;
+
+        if (i >= kept)
+                return NULL;
+
+        return &ts->records[(ts->nrecords - kept + i) % TRIG_RECORDS];
+}
+
+void
+trig_release(struct trig_set *ts)
+{
+        unsigned int i;
+
+        for (i = 0; i < ts->count; i++)
+                xfree(ts->trigs[i].expr);
+
+        xfree(ts->trigs);
+        xfree(ts->insns);
+        xfree(ts->cols);
+        xfree(ts->lanes);
+        xfree(ts->streaks);
+        memset(ts, 0, sizeof(struct trig_set));
+}
@@ -0,0 +1,114 @@
+#ifndef __TRIGGER_H
+#define __TRIGGER_H
+
+/*
+ * Watchpoints over sampled registers. A condition such as
+ *
+ *      rip in 0xffffffff81000000..0xffffffff81200000 && cpl == 0
+ *      cr3 == 0x7a2e4000
+ *      pc in 0xffff800008000000..0xffff800008800000
+ *      rflags & 0x200 == 0 for 10
+ *
+ * is compiled once into range checks, (reg & mask) - lo <= hi - lo, every
+ * comparison being one. A batch of snapshots, all vCPUs of all VMs of a
+ * sample, is turned into one column per register so that each check runs
+ * over all of them four lanes at a time.
+ */
+
+/* 64 bit lanes per vector, the batch is padded to a multiple of it */
+#define TRIG_LANES              (4)
+/* checks per condition */
+#define TRIG_MAX_TERMS          (8)
+/* records kept, the oldest are overwritten */
+#define TRIG_RECORDS            (1024)
+/* how often the watched VMs are sampled, in ms */
+#define TRIG_INTERVAL           (100)
+
+struct qregs;
+
+/* one range check, the condition holds when all of its checks do */
+struct trig_insn {
+        /* index into the register table */
+        uint8_t reg;
+        /* the check holds when the register is outside the range */
+        uint8_t negate;
+        uint64_t mask, lo, span;
+};
+
+struct trig_record {
+        /* CLOCK_MONOTONIC ns */
+        uint64_t when;
+        unsigned int trigger;
+        /* index of the snapshot in the batch */
+        unsigned int slot;
+        uint64_t pc, cr3;
+};
+
+/*
+ * called once per streak, when a condition held for the samples it asks
+ * for; 'regs' is the snapshot that completed the streak
+ */
+typedef void (*trig_fire_fn)(const struct trig_record *rec,
+                             const struct qregs *regs, void *arg);
+
+struct trig {
+        char *expr;
+        /* its checks, insns[first .. first + count] */
+        unsigned int first, count;
+        /* consecutive samples the condition has to hold */
+        unsigned int hold;
+        uint64_t fired;
+};
+
+struct trig_set {
+        struct trig *trigs;
+        unsigned int count;
+        struct trig_insn *insns;
+        unsigned int ninsns;
+        /* registers read by any check, by table index */
+        uint64_t used;
+
+        /* columns of the current batch, one per used register */
+        uint64_t *cols;
+        uint64_t *lanes;
+        unsigned int width, size;
+        /* per trigger and slot, samples the condition has held */
+        unsigned int *streaks;
+        unsigned int slots;
+
+        struct trig_record records[TRIG_RECORDS];
+        uint64_t nrecords;
+
+        trig_fire_fn fire;
+        void *arg;
+};
+
+extern void
+trig_init(struct trig_set *ts, trig_fire_fn fire, void *arg);
+
+/**
+ * @brief compile a condition
+ * @retval the trigger number, -1 if 'expr' does not parse
+ */
+extern int
+trig_add(struct trig_set *ts, const char *expr);
+
+/**
+ * @brief check every condition against 'n' snapshots; a snapshot is
+ * matched with the one at the same index of the previous batch for the
+ * 'for' streaks, which start over when 'n' changes
+ */
+extern void
+trig_eval(struct trig_set *ts, const struct qregs *regs, unsigned int n);
+
+/**
+ * @brief the i-th of the records still kept, 0 being the oldest
+ * @retval the record, NULL past the last one
+ */
+extern const struct trig_record *
+trig_record(const struct trig_set *ts, unsigned int i);
+
+extern void
+trig_release(struct trig_set *ts);
+
+#endif /* __TRIGGER_H */
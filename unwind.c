@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "regs.h"
+#include "qmp.h"
+#include "unwind.h"
+
+#define UNWIND_PAGE_MASK        (~(uint64_t) (UNWIND_PAGE - 1))
+/* CR3 without the PCID and the no-flush bit */
+#define UNWIND_CR3_MASK         (0x000ffffffffff000ULL)
+
+/* where a frame record keeps the caller's frame pointer and return address */
+struct unwind_frame {
+        int next_off;
+        int ret_off;
+};
+
+static const struct unwind_frame unwind_x64 = { 0, 8 };
+static const struct unwind_frame unwind_aarch64 = { 0, 8 };
+static const struct unwind_frame unwind_riscv64 = { -16, -8 };
+
+void
+unwind_init(struct unwind_cache *uc)
+{
+        memset(uc, 0, sizeof(struct unwind_cache));
+        uc->pages = xcalloc(UNWIND_CACHE_PAGES, sizeof(struct unwind_page));
+        uc->count = UNWIND_CACHE_PAGES;
+}
+
+static const struct unwind_frame *
+unwind_frame_get(enum qregs_arch mode)
+{
+        switch (mode) {
+        case X64:
+                return &unwind_x64;
+        case AARCH64:
+                return &unwind_aarch64;
+        case RISCV64:
+                return &unwind_riscv64;
+        default:
+                return NULL;
+        }
+}
+
+/*
+ * @retval 0 with the address space 'va' is in, -1 if it cannot be told
+ * and the page is not to be kept
+ */
+static int
+unwind_as(const struct qregs *regs, uint64_t va, uint64_t *as)
+{
+        /* the kernel half is mapped the same in every process */
+        if (va >> 63) {
+                *as = 0;
+                return 0;
+        }
+
+        switch (regs->mode) {
+        case X64:
+                *as = regs->cr3 & UNWIND_CR3_MASK;
+                return 0;
+        case RISCV64:
+                *as = regs->riscv64.satp;
+                return 0;
+        default:
+                /* TTBR0_EL1 is not in 'info registers' */
+                return -1;
+        }
+}
+
+/*
+ * the page at 'va', from the cache or from qemu
+ * @param fresh 1 if a copy read before this walk will not do
+ */
+static const struct unwind_page *
+unwind_page_get(struct unwind_cache *uc, const struct qmp_conn *qmpc,
+                unsigned int cpu, const struct qregs *regs, uint64_t va,
+                int fresh)
+{
+        struct unwind_page *pg = NULL, *victim = &uc->pages[0];
+        uint64_t now = xclock_ns(), as = 0;
+        int keep = unwind_as(regs, va, &as) == 0;
+        unsigned int i;
+
+        for (i = 0; i < uc->count; i++) {
+                struct unwind_page *p = &uc->pages[i];
+
+                /* within a walk the address space is that of the walk */
+                if (p->va == va && (p->walk == uc->clock ||
+                    (keep && p->ts && p->as == as))) {
+                        pg = p;
+                        break;
+                }
+                if (p->used < victim->used)
+                        victim = p;
+        }
+
+        if (pg && (pg->walk == uc->clock || (!fresh &&
+            now - pg->ts < UNWIND_PAGE_TTL * 1000000ULL))) {
+                uc->hits++;
+                pg->used = uc->clock;
+                return pg;
+        }
+
+        /* stale, or the least recently used slot */
+        if (!pg)
+                pg = victim;
+
+        uc->misses++;
+        if (qmp_read_guest(qmpc, cpu, va, pg->data, UNWIND_PAGE) == -1) {
+                pg->ts = pg->used = pg->walk = 0;
+                return NULL;
+        }
+
+        pg->as = as;
+        pg->va = va;
+        /* good for this walk only */
+        pg->ts = keep ? now : 0;
+        pg->used = pg->walk = uc->clock;
+        return pg;
+}
+
+static int
+unwind_read(struct unwind_cache *uc, const struct qmp_conn *qmpc,
+            unsigned int cpu, const struct qregs *regs, uint64_t va,
+            uint64_t *v)
+{
+        uint64_t page = va & UNWIND_PAGE_MASK;
+        const struct unwind_page *pg;
+
+        pg = unwind_page_get(uc, qmpc, cpu, regs, page,
+                             page == (regs->sp & UNWIND_PAGE_MASK));
+        if (!pg)
+                return -1;
+
+        memcpy(v, pg->data + (va - page), sizeof(uint64_t));
+        return 0;
+}
+
+unsigned int
+unwind_stack(struct unwind_cache *uc, const struct qmp_conn *qmpc,
+             unsigned int cpu, const struct qregs *regs, uint64_t *pcs,
+             unsigned int depth)
+{
+        const struct unwind_frame *f = unwind_frame_get(regs->mode);
+        uint64_t fp = regs->fp, sp = regs->sp, next, ret;
+        unsigned int n = 0;
+
+        if (depth == 0)
+                return 0;
+
+        pcs[n++] = regs->pc;
+        if (!f)
+                return n;
+
+        uc->clock++;
+        while (n < depth) {
+                /* a record is aligned, above the previous one and not far */
+                if (fp & 7 || fp < sp || fp - sp > UNWIND_MAX_FRAME)
+                        break;
+
+                if (unwind_read(uc, qmpc, cpu, regs, fp + f->next_off,
+                                &next) == -1 ||
+                    unwind_read(uc, qmpc, cpu, regs, fp + f->ret_off,
+                                &ret) == -1)
+                        break;
+
+                /* the outermost frame */
+                if (ret == 0)
+                        break;
+                pcs[n++] = ret;
+
+                /* stacks grow down, callers are further up */
+                if (next <= fp)
+                        break;
+                sp = fp;
+                fp = next;
+        }
+
+        return n;
+}
+
+void
+unwind_release(struct unwind_cache *uc)
+{
+        xfree(uc->pages);
+        memset(uc, 0, sizeof(struct unwind_cache));
+}
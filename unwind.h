@@ -0,0 +1,78 @@
+#ifndef __UNWIND_H
+#define __UNWIND_H
+
+/*
+ * Guest call stacks from frame pointers. From the registers of a sample
+ * the chain of frame records is followed up the stack, each record giving
+ * the caller's frame pointer and the return address into the caller:
+ *
+ *      x86-64          [rbp] = caller's rbp, [rbp + 8] = return address
+ *      aarch64         [x29] = caller's x29, [x29 + 8] = lr
+ *      riscv64         [s0 - 16] = caller's s0, [s0 - 8] = ra
+ *
+ * Guest memory is read a page at a time through the page tables of the
+ * vCPU, and pages are kept in a small LRU per VM, keyed by address space
+ * (CR3 or satp; the kernel half is one space for all) and page. A page
+ * is good for UNWIND_PAGE_TTL ms but the one the stack pointer is in,
+ * where the frames come and go, is read for every sample: outer frames
+ * mostly outlive a few samples, so consecutive samples of a busy vCPU
+ * rarely read more than a page. 32 bit x86 stacks are not followed.
+ *
+ * The guest runs on while it is sampled: the registers are read first and
+ * the stack after, each page at its own time, and a cached page is older
+ * still. A frame may have returned or been pushed in between, so unless
+ * the VM is stopped a stack can be torn, its outer frames from another
+ * call chain than the PC. The walk stops at a frame pointer that goes
+ * down or jumps too far, not at one that is merely stale.
+ */
+
+#define UNWIND_MAX_DEPTH        (32)
+#define UNWIND_PAGE             (4096)
+/* pages kept per VM */
+#define UNWIND_CACHE_PAGES      (64)
+#define UNWIND_PAGE_TTL         (1000)
+/* farthest a frame record may be from the previous one */
+#define UNWIND_MAX_FRAME        (64 * 1024)
+
+struct qmp_conn;
+struct qregs;
+
+struct unwind_page {
+        /* address space and page address, 'ts' 0 if the slot is free */
+        uint64_t as;
+        uint64_t va;
+        uint64_t ts;
+        /* the walk that last used it, for LRU, and the one that read it */
+        uint64_t used;
+        uint64_t walk;
+        uint8_t data[UNWIND_PAGE];
+};
+
+struct unwind_cache {
+        struct unwind_page *pages;
+        unsigned int count;
+        /* walks so far */
+        uint64_t clock;
+
+        uint64_t hits;
+        uint64_t misses;
+};
+
+extern void
+unwind_init(struct unwind_cache *uc);
+
+/**
+ * @brief walk the stack of vCPU 'cpu', whose registers are in 'regs'
+ * @param pcs filled with the PC then the return addresses, innermost first
+ * @param depth the most entries of 'pcs' filled
+ * @retval the amount of entries, at least 1 for the PC
+ */
+extern unsigned int
+unwind_stack(struct unwind_cache *uc, const struct qmp_conn *qmpc,
+             unsigned int cpu, const struct qregs *regs, uint64_t *pcs,
+             unsigned int depth);
+
+extern void
+unwind_release(struct unwind_cache *uc);
+
+#endif /* __UNWIND_H */
@@ -0,0 +1,696 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "qmp.h"
+#include "uring.h"
+
+/* the low bits of user_data tell what completed */
+#define URING_OP_RECV           (0)
+#define URING_OP_SEND           (1)
+#define URING_OP_CANCEL         (2)
+#define URING_OP_MASK           (3)
+
+#define NSEC_PER_MSEC           (1000000ULL)
+
+struct uring {
+        int fd;
+
+        /* submission ring */
+        unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned int sq_entries;
+        /* tail of the sqes filled so far, published on enter */
+        unsigned int sq_local_tail;
+        struct io_uring_sqe *sqes;
+
+        /* completion ring */
+        unsigned int *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        /* provided receive buffers */
+        struct io_uring_buf_ring *br;
+        unsigned short br_tail;
+        char *bufs;
+
+        void *ring_map;
+        size_t ring_map_len, sqes_len, br_len;
+
+        /* connections attached */
+        unsigned int refs;
+        /* recv stays armed across completions, linux 6.0 */
+        int multishot;
+};
+
+struct uring_conn {
+        struct uring *ur;
+        int fd;
+        /* bytes received and not handed over yet */
+        char *rbuf;
+        size_t rlen, rsize;
+        /* bytes being sent */
+        char *tbuf;
+        size_t tsize;
+        /* recv in flight */
+        int armed;
+        /* the peer went away or an error occurred */
+        int closed;
+        unsigned int sends;
+        /* when data last arrived */
+        uint64_t last_rx;
+};
+
+static __thread struct uring *uring_self;
+
+static int
+uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+        return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr)
+{
+        return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static void
+uring_buf_add(struct uring *ur, unsigned short bid)
+{
+        struct io_uring_buf *b;
+
+        b = &ur->br->bufs[ur->br_tail & (QMP_URING_BUFS - 1)];
+        b->addr = (uint64_t) (uintptr_t) (ur->bufs + bid * QMP_URING_BUF_SIZE);
+        b->len = QMP_URING_BUF_SIZE;
+        b->bid = bid;
+
+        ur->br_tail++;
+        __atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+}
+
+static void
+uring_free(struct uring *ur)
+{
+        if (ur->br) {
+                struct io_uring_buf_reg reg;
+
+                memset(&reg, 0, sizeof(reg));
+                reg.bgid = QMP_URING_BGID;
+                uring_register(ur->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+                munmap(ur->br, ur->br_len);
+        }
+
+        if (ur->sqes)
+                munmap(ur->sqes, ur->sqes_len);
+        if (ur->ring_map)
+                munmap(ur->ring_map, ur->ring_map_len);
+
+        close(ur->fd);
+        xfree(ur->bufs);
+        xfree(ur);
+}
+
+static struct uring *
+uring_new(void)
+{
+        struct io_uring_params params;
+        struct io_uring_buf_reg reg;
+        struct uring *ur;
+        size_t sq_len, cq_len;
+        char *map;
+        unsigned int i;
+        int fd;
+
+        memset(&params, 0, sizeof(params));
+        if ((fd = uring_setup(QMP_URING_ENTRIES, &params)) == -1) {
+                dprintf("io_uring_setup() ('%s')\n", strerror(errno));
+                return NULL;
+        }
+
+        /* timed waits and a single ring mapping, linux 5.11 */
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+            !(params.features & IORING_FEAT_EXT_ARG)) {
+                dprintf("io_uring lacks required features\n");
+                close(fd);
+                return NULL;
+        }
+
+        ur = xmalloc(sizeof(struct uring));
+        ur->fd = fd;
+
+        sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        cq_len = params.cq_off.cqes +
+                 params.cq_entries * sizeof(struct io_uring_cqe);
+        ur->ring_map_len = sq_len > cq_len ? sq_len : cq_len;
+
+        map = mmap(NULL, ur->ring_map_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (map == MAP_FAILED) {
+                ur->ring_map = NULL;
+                goto err_exit;
+        }
+        ur->ring_map = map;
+
+        ur->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+        ur->sqes = mmap(NULL, ur->sqes_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (ur->sqes == MAP_FAILED) {
+                ur->sqes = NULL;
+                goto err_exit;
+        }
+
+        ur->sq_head = (unsigned int *) (map + params.sq_off.head);
+        ur->sq_tail = (unsigned int *) (map + params.sq_off.tail);
+        ur->sq_mask = (unsigned int *) (map + params.sq_off.ring_mask);
+        ur->sq_array = (unsigned int *) (map + params.sq_off.array);
+        ur->sq_entries = params.sq_entries;
+        ur->sq_local_tail = *ur->sq_tail;
+
+        ur->cq_head = (unsigned int *) (map + params.cq_off.head);
+        ur->cq_tail = (unsigned int *) (map + params.cq_off.tail);
+        ur->cq_mask = (unsigned int *) (map + params.cq_off.ring_mask);
+        ur->cqes = (struct io_uring_cqe *) (map + params.cq_off.cqes);
+
+        /* the buffer ring has to be page aligned */
+        ur->br_len = QMP_URING_BUFS * sizeof(struct io_uring_buf);
+        ur->br = mmap(NULL, ur->br_len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ur->br == MAP_FAILED) {
+                ur->br = NULL;
+                goto err_exit;
+        }
+
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t) (uintptr_t) ur->br;
+        reg.ring_entries = QMP_URING_BUFS;
+        reg.bgid = QMP_URING_BGID;
+
+        if (uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+                dprintf("io_uring buffer ring ('%s')\n", strerror(errno));
+                munmap(ur->br, ur->br_len);
+                ur->br = NULL;
+                goto err_exit;
+        }
+
+        ur->bufs = xmalloc(QMP_URING_BUFS * QMP_URING_BUF_SIZE);
+        for (i = 0; i < QMP_URING_BUFS; i++)
+                uring_buf_add(ur, i);
+
+        return ur;
+
+err_exit:
+        uring_free(ur);
+        return NULL;
+}
+
+static struct io_uring_sqe *
+uring_get_sqe(struct uring *ur)
+{
+        struct io_uring_sqe *sqe;
+        unsigned int head, idx;
+
+        head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+        if (ur->sq_local_tail - head >= ur->sq_entries) {
+                return NULL;
+        }
+
+        idx = ur->sq_local_tail & *ur->sq_mask;
+        sqe = &ur->sqes[idx];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        ur->sq_array[idx] = idx;
+        ur->sq_local_tail++;
+
+        return sqe;
+}
+
+static void
+uring_conn_append(struct uring_conn *uc, const char *data, size_t len)
+{
+        if (uc->rlen + len + 1 > uc->rsize) {
+                while (uc->rlen + len + 1 > uc->rsize)
+                        uc->rsize *= 2;
+                uc->rbuf = xrealloc(uc->rbuf, uc->rsize);
+        }
+
+        memcpy(uc->rbuf + uc->rlen, data, len);
+        uc->rlen += len;
+}
+
+static void
+uring_complete(struct uring *ur, const struct io_uring_cqe *cqe)
+{
+        struct uring_conn *uc;
+
+        uc = (struct uring_conn *) (uintptr_t) (cqe->user_data &
+                                                ~(uint64_t) URING_OP_MASK);
+
+        switch (cqe->user_data & URING_OP_MASK) {
+        case URING_OP_RECV:
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                        unsigned short bid;
+
+                        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                        if (cqe->res > 0) {
+                                uring_conn_append(uc, ur->bufs +
+                                                  bid * QMP_URING_BUF_SIZE,
+                                                  cqe->res);
+                                uc->last_rx = xclock_ns();
+                        }
+                        uring_buf_add(ur, bid);
+                }
+
+                /* multishot stopped, re-armed by the next wait unless gone */
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                        uc->armed = 0;
+                        if (cqe->res == 0 ||
+                            (cqe->res < 0 && cqe->res != -ENOBUFS))
+                                uc->closed = 1;
+                }
+        break;
+        case URING_OP_SEND:
+                uc->sends--;
+                if (cqe->res < 0)
+                        uc->closed = 1;
+        break;
+        case URING_OP_CANCEL:
+        break;
+        }
+}
+
+static void
+uring_reap(struct uring *ur)
+{
+        unsigned int head, tail;
+
+        head = *ur->cq_head;
+        tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++)
+                uring_complete(ur, &ur->cqes[head & *ur->cq_mask]);
+
+        __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * submit whatever is queued and wait for 'min_complete' completions, at
+ * most 'timeout_ns', in a single syscall; the completions are left there
+ */
+static void
+uring_enter(struct uring *ur, unsigned int min_complete, uint64_t timeout_ns)
+{
+        struct io_uring_getevents_arg arg;
+        struct __kernel_timespec ts;
+        unsigned int to_submit;
+
+        __atomic_store_n(ur->sq_tail, ur->sq_local_tail, __ATOMIC_RELEASE);
+        to_submit = ur->sq_local_tail -
+                    __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+
+        ts.tv_sec = timeout_ns / 1000000000ULL;
+        ts.tv_nsec = timeout_ns % 1000000000ULL;
+
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+
+        syscall(__NR_io_uring_enter, ur->fd, to_submit, min_complete,
+                IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                &arg, sizeof(arg));
+        QMP_IO_COUNT(syscalls, 1);
+}
+
+static void
+uring_wait(struct uring *ur, unsigned int min_complete, uint64_t timeout_ns)
+{
+        uring_enter(ur, min_complete, timeout_ns);
+        uring_reap(ur);
+}
+
+static int
+uring_arm(struct uring_conn *uc)
+{
+        struct io_uring_sqe *sqe;
+
+        if (!(sqe = uring_get_sqe(uc->ur))) {
+                return -1;
+        }
+
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = uc->fd;
+        if (uc->ur->multishot)
+                sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = QMP_URING_BGID;
+        sqe->user_data = (uintptr_t) uc | URING_OP_RECV;
+
+        uc->armed = 1;
+        return 0;
+}
+
+/*
+ * a multishot recv on a socket holding a byte then shut down: it takes
+ * the byte and stays armed, then ends on the shutdown; a kernel without
+ * it refuses the flag with -EINVAL
+ * @retval 1 if recv stays armed, 0 if it does not, -1 if recv failed
+ */
+static int
+uring_probe(struct uring *ur)
+{
+        struct io_uring_sqe *sqe;
+        const struct io_uring_cqe *cqe;
+        unsigned int head, tail;
+        uint64_t now, deadline;
+        int sv[2], ret = -1, more = 0, done = 0;
+
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+                return -1;
+
+        if (write(sv[1], "", 1) != 1 || shutdown(sv[1], SHUT_WR) == -1 ||
+            !(sqe = uring_get_sqe(ur))) {
+                close(sv[0]);
+                close(sv[1]);
+                return -1;
+        }
+
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sv[0];
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = QMP_URING_BGID;
+        sqe->user_data = URING_OP_CANCEL;
+
+        deadline = xclock_ns() + QMP_URING_TIMEOUT * NSEC_PER_MSEC;
+        while (!done && (now = xclock_ns()) < deadline) {
+                uring_enter(ur, 1, deadline - now);
+
+                head = *ur->cq_head;
+                tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+                for (; head != tail; head++) {
+                        cqe = &ur->cqes[head & *ur->cq_mask];
+
+                        if (cqe->flags & IORING_CQE_F_BUFFER)
+                                uring_buf_add(ur, cqe->flags >>
+                                              IORING_CQE_BUFFER_SHIFT);
+                        if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_MORE))
+                                more = 1;
+                        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                                done = 1;
+                                if (cqe->res >= 0 || cqe->res == -EINVAL)
+                                        ret = more;
+                        }
+                }
+                __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        close(sv[0]);
+        close(sv[1]);
+
+        /* still armed on a closed socket, the ring is not to be reused */
+        if (!done)
+                return -1;
+        if (ret == -1)
+                dprintf("io_uring recv unavailable\n");
+        return ret;
+}
+
+static int
+uring_attach(struct qmp_conn *qmpc)
+{
+        struct uring_conn *uc;
+        int multishot;
+
+        if (!uring_self) {
+                if (!(uring_self = uring_new()))
+                        return -1;
+
+                if ((multishot = uring_probe(uring_self)) == -1) {
+                        uring_free(uring_self);
+                        uring_self = NULL;
+                        return -1;
+                }
+                /* single-shot, re-armed after every completion */
+                uring_self->multishot = multishot;
+        }
+
+        uc = xmalloc(sizeof(struct uring_conn));
+        uc->ur = uring_self;
+        uc->fd = qmpc->fd;
+        uc->rsize = QMP_BUF_LEN;
+        uc->rbuf = xmalloc(uc->rsize);
+
+        if (uring_arm(uc) == -1) {
+                xfree(uc->rbuf);
+                xfree(uc);
+                return -1;
+        }
+
+        uring_self->refs++;
+        qmpc->priv = uc;
+
+        return 0;
+}
+
+static void
+uring_detach(const struct qmp_conn *qmpc)
+{
+        struct uring_conn *uc = qmpc->priv;
+        struct uring *ur;
+        uint64_t deadline;
+
+        if (!uc) {
+                return;
+        }
+        ur = uc->ur;
+
+        if (uc->armed) {
+                struct io_uring_sqe *sqe = uring_get_sqe(ur);
+
+                if (sqe) {
+                        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                        sqe->addr = (uintptr_t) uc | URING_OP_RECV;
+                        sqe->user_data = (uintptr_t) uc | URING_OP_CANCEL;
+                }
+        }
+
+        /* nothing may complete on 'uc' once it is freed */
+        deadline = xclock_ns() + QMP_URING_TIMEOUT * NSEC_PER_MSEC;
+        while ((uc->armed || uc->sends) && xclock_ns() < deadline)
+                uring_wait(ur, 1, QMP_URING_TIMEOUT * NSEC_PER_MSEC);
+
+        if (uc->armed || uc->sends) {
+                dprintf("io_uring: leaking a connection still in flight\n");
+                return;
+        }
+
+        xfree(uc->rbuf);
+        xfree(uc->tbuf);
+        xfree(uc);
+
+        if (--ur->refs == 0) {
+                uring_free(ur);
+                uring_self = NULL;
+        }
+}
+
+static size_t
+uring_write(const struct qmp_conn *qmpc, const char *buf, size_t len)
+{
+        struct uring_conn *uc = qmpc->priv;
+        struct io_uring_sqe *sqe;
+
+        /* the send buffer may still be in use */
+        while (uc->sends && !uc->closed)
+                uring_wait(uc->ur, 1, QMP_URING_TIMEOUT * NSEC_PER_MSEC);
+
+        if (uc->closed) {
+                return 0;
+        }
+
+        if (len > uc->tsize) {
+                uc->tbuf = xrealloc(uc->tbuf, len);
+                uc->tsize = len;
+        }
+        memcpy(uc->tbuf, buf, len);
+
+        if (!(sqe = uring_get_sqe(uc->ur))) {
+                /* the ring is full, flush it and retry once */
+                uring_wait(uc->ur, 0, 0);
+                if (!(sqe = uring_get_sqe(uc->ur)))
+                        return 0;
+        }
+
+        /* queued only, the next wait submits it along with the others */
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = uc->fd;
+        sqe->addr = (uintptr_t) uc->tbuf;
+        sqe->len = len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = (uintptr_t) uc | URING_OP_SEND;
+        uc->sends++;
+
+        return len;
+}
+
+/* hand over everything received, as the poll transport would */
+static void
+uring_take(struct uring_conn *uc, char *buf, size_t size, size_t *len)
+{
+        size_t end = uc->rlen;
+
+        if (end > size - 1)
+                end = size - 1;
+
+        memcpy(buf, uc->rbuf, end);
+        buf[end] = '\0';
+        *len = end;
+
+        memmove(uc->rbuf, uc->rbuf + end, uc->rlen - end);
+        uc->rlen -= end;
+}
+
+/*
+ * as qmp_read(): until a reply is complete, QMP_POLL_TIMEOUT went by
+ * without anything more after the first bytes, or the deadline
+ */
+static int
+uring_read(const struct qmp_conn *qmpc, char *buf, size_t size, size_t *len)
+{
+        struct uring_conn *uc = qmpc->priv;
+        uint64_t now, wait, idle, deadline;
+
+        deadline = xclock_ns() + qmp_timeout(qmpc) * NSEC_PER_MSEC;
+
+        while (!uc->closed) {
+                if (uc->rlen && uc->rbuf[uc->rlen - 1] == '\n' &&
+                    qmp_reply_end(uc->rbuf, uc->rlen))
+                        break;
+                if (!uc->armed && uring_arm(uc) == -1)
+                        break;
+                if ((now = xclock_ns()) >= deadline)
+                        break;
+
+                /* the ring is shared, completions of others wake it too */
+                wait = deadline - now;
+                if (uc->rlen) {
+                        idle = uc->last_rx + QMP_POLL_TIMEOUT * NSEC_PER_MSEC;
+                        if (now >= idle)
+                                break;
+                        if (wait > idle - now)
+                                wait = idle - now;
+                }
+                uring_wait(uc->ur, 1, wait);
+        }
+
+        uring_take(uc, buf, size, len);
+
+        if (qmpc->timing) {
+                qmpc->timing->last_rx = uc->last_rx;
+        }
+
+        return 0;
+}
+
+static int
+uring_execute_all(struct qmp_conn **conns, unsigned int n, const char *cmd,
+                  char **bufs, size_t size, size_t *lens)
+{
+        size_t cmd_len = strlen(cmd);
+        char *done = xcalloc(n, 1);
+        unsigned int i, pending = 0, replies = 0;
+        uint64_t now, deadline;
+        struct uring *ur = NULL;
+
+        for (i = 0; i < n; i++) {
+                struct uring_conn *uc = conns[i]->priv;
+
+                lens[i] = 0;
+                if (uring_write(conns[i], cmd, cmd_len) != cmd_len) {
+                        done[i] = 1;
+                        continue;
+                }
+                ur = uc->ur;
+                pending++;
+        }
+
+        deadline = xclock_ns() + QMP_BATCH_TIMEOUT * NSEC_PER_MSEC;
+
+        while (pending && (now = xclock_ns()) < deadline) {
+                /* every pending connection completes at least once */
+                uring_wait(ur, pending, deadline - now);
+
+                for (i = 0; i < n; i++) {
+                        struct uring_conn *uc = conns[i]->priv;
+
+                        if (done[i])
+                                continue;
+
+                        if (qmp_reply_end(uc->rbuf, uc->rlen)) {
+                                uring_take(uc, bufs[i], size, &lens[i]);
+                                replies++;
+                        } else if (!uc->closed) {
+                                if (!uc->armed)
+                                        uring_arm(uc);
+                                continue;
+                        }
+
+                        done[i] = 1;
+                        pending--;
+                }
+        }
+
+        QMP_IO_COUNT(commands, n);
+
+        xfree(done);
+        return replies;
+}
+
+/* whatever the multishot recv gathered, once anything is in */
+static int
+uring_read_some(const struct qmp_conn *qmpc, char *buf, size_t size,
+                size_t *len)
+{
+        struct uring_conn *uc = qmpc->priv;
+        uint64_t now, deadline;
+
+        deadline = xclock_ns() + QMP_BATCH_TIMEOUT * NSEC_PER_MSEC;
+
+        while (uc->rlen == 0 && !uc->closed) {
+                if (!uc->armed && uring_arm(uc) == -1)
+                        break;
+                if ((now = xclock_ns()) >= deadline)
+                        break;
+                uring_wait(uc->ur, 1, deadline - now);
+        }
+
+        *len = 0;
+        if (uc->rlen == 0) {
+                return uc->closed ? -1 : 0;
+        }
+
+        uring_take(uc, buf, size, len);
+
+        if (qmpc->timing) {
+                qmpc->timing->last_rx = uc->last_rx;
+        }
+
+        return 0;
+}
+
+const struct qmp_transport qmp_uring_transport = {
+        .name = "uring",
+        .attach = uring_attach,
+        .detach = uring_detach,
+        .read = uring_read,
+        .write = uring_write,
+        .read_some = uring_read_some,
+        .execute_all = uring_execute_all,
+};
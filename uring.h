@@ -0,0 +1,27 @@
+#ifndef __URING_H
+#define __URING_H
+
+/*
+ * io_uring transport: one ring per thread shared by all the connections
+ * attached from that thread, a multishot recv armed per connection over
+ * a ring of provided buffers, and sends queued until the next wait so
+ * that commands to many connections go out in a single io_uring_enter().
+ * The ring is probed once: before linux 6.0 recv is single-shot and armed
+ * again after each completion, and a ring that cannot recv at all leaves
+ * the connection to the poll transport.
+ *
+ * Connections must be used from the thread that attached them.
+ */
+
+/* submission queue depth */
+#define QMP_URING_ENTRIES       (1024)
+/* provided receive buffers, a power of 2 */
+#define QMP_URING_BUFS          (512)
+#define QMP_URING_BUF_SIZE      (4096)
+#define QMP_URING_BGID          (0)
+/* ms a single connection waits for its reply */
+#define QMP_URING_TIMEOUT       (1000)
+
+extern const struct qmp_transport qmp_uring_transport;
+
+#endif /* __URING_H */
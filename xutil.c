@@ -4,6 +4,8 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <sys/stat.h>
 
@@ -380,6 +382,27 @@ xset_tcp_nodelay(int fd, int val)
         return 0;
 }
 
+int
+xset_tcp_keepalive_timers(int fd, int idle, int intvl, int cnt)
+{
+        /* keepalive only probes an idle link, not one with unacked data */
+        unsigned int user_timeout = (idle + intvl * cnt) * 1000;
+
+        if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle,
+                       sizeof(idle)) == -1 ||
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl,
+                       sizeof(intvl)) == -1 ||
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt,
+                       sizeof(cnt)) == -1 ||
+            setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout,
+                       sizeof(user_timeout)) == -1) {
+                dprintf("setsockopt TCP_KEEPIDLE/TCP_KEEPINTVL/TCP_KEEPCNT/"
+                        "TCP_USER_TIMEOUT\n");
+                return -1;
+        }
+        return 0;
+}
+
 int 
 xenable_tcp_nodelay(int fd)
 {
@@ -391,3 +414,12 @@ xdisable_tcp_nodelay(int fd)
 {
         return xset_tcp_nodelay(fd, 0);
 }
+
+uint64_t
+xclock_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -143,6 +143,14 @@ xset_tcp_keepalive(int fd);
 extern int
 xset_tcp_nodelay(int fd, int val);
 
+/**
+ * @brief probe an idle connection after 'idle' seconds, every 'intvl'
+ * seconds, and give up after 'cnt' unanswered probes; data sent and not
+ * acked for as long fails the connection too
+ */
+extern int
+xset_tcp_keepalive_timers(int fd, int idle, int intvl, int cnt);
+
 /**
  * @brief
  */
@@ -155,4 +163,11 @@ xenable_tcp_nodelay(int fd);
 extern int
 xdisable_tcp_nodelay(int fd);
 
+/**
+ * @brief monotonic clock
+ * @retval the current time in nanoseconds
+ */
+extern uint64_t
+xclock_ns(void);
+
 #endif /* __XUTIL_H */
@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "lz.h"
+#include "zio.h"
+
+#define ZIO_HEADER_LEN          (12)
+
+static uint32_t zio_crc_table[256];
+static int zio_crc_ready;
+
+static void
+zio_crc_setup(void)
+{
+        uint32_t c;
+        unsigned int i, k;
+
+        for (i = 0; i < 256; i++) {
+                for (c = i, k = 0; k < 8; k++)
+                        c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+                zio_crc_table[i] = c;
+        }
+        zio_crc_ready = 1;
+}
+
+static uint32_t
+zio_crc(const uint8_t *p, size_t len)
+{
+        uint32_t c = 0xffffffffU;
+
+        while (len--)
+                c = zio_crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+        return c ^ 0xffffffffU;
+}
+
+static void
+zio_put32(uint8_t *p, uint32_t v)
+{
+        p[0] = v;
+        p[1] = v >> 8;
+        p[2] = v >> 16;
+        p[3] = v >> 24;
+}
+
+static uint32_t
+zio_get32(const uint8_t *p)
+{
+        return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/* one block, compressed unless that makes it larger; 0 ends the file */
+static int
+zio_write_block(struct zio_writer *zw, const uint8_t *buf, size_t len)
+{
+        uint8_t *hdr = zw->out, *data = zw->out + ZIO_HEADER_LEN;
+        size_t clen = 0;
+        uint32_t stored = 0;
+
+        if (len)
+                clen = lz_compress(buf, len, data, LZ_BOUND(ZIO_BLOCK));
+        if (len && (clen == 0 || clen >= len)) {
+                memcpy(data, buf, len);
+                clen = len;
+                stored = ZIO_STORED;
+        }
+
+        zio_put32(hdr, len);
+        zio_put32(hdr + 4, clen | stored);
+        zio_put32(hdr + 8, zio_crc(buf, len));
+
+        if (xwrite(zw->fd, (const char *) zw->out, ZIO_HEADER_LEN + clen) !=
+            ZIO_HEADER_LEN + clen)
+                return -1;
+
+        zw->raw += len;
+        zw->packed += ZIO_HEADER_LEN + clen;
+        zw->blocks++;
+        return 0;
+}
+
+static void *
+zio_writer_run(void *arg)
+{
+        struct zio_writer *zw = arg;
+        int idx, r;
+
+        pthread_mutex_lock(&zw->lock);
+        for (;;) {
+                while (zw->pending == -1 && !zw->closing)
+                        pthread_cond_wait(&zw->cond, &zw->lock);
+                if (zw->pending == -1)
+                        break;
+
+                /* the other buffer keeps filling meanwhile */
+                idx = zw->pending;
+                pthread_mutex_unlock(&zw->lock);
+                r = zw->error ? -1 :
+                    zio_write_block(zw, zw->buf[idx], zw->len[idx]);
+                pthread_mutex_lock(&zw->lock);
+
+                if (r == -1 && !zw->error) {
+                        dprintf("zio: short write, the trace is truncated\n");
+                        zw->error = 1;
+                }
+                zw->len[idx] = 0;
+                zw->pending = -1;
+                pthread_cond_broadcast(&zw->cond);
+        }
+        pthread_mutex_unlock(&zw->lock);
+
+        return NULL;
+}
+
+struct zio_writer *
+zio_writer_open(int fd)
+{
+        struct zio_writer *zw;
+
+        if (!zio_crc_ready)
+                zio_crc_setup();
+
+        if (xwrite(fd, ZIO_MAGIC, ZIO_MAGIC_LEN) != ZIO_MAGIC_LEN) {
+                return NULL;
+        }
+
+        zw = xmalloc(sizeof(struct zio_writer));
+        memset(zw, 0, sizeof(struct zio_writer));
+        zw->fd = fd;
+        zw->buf[0] = xmalloc(ZIO_BLOCK);
+        zw->buf[1] = xmalloc(ZIO_BLOCK);
+        zw->out = xmalloc(ZIO_HEADER_LEN + LZ_BOUND(ZIO_BLOCK));
+        zw->pending = -1;
+        pthread_mutex_init(&zw->lock, NULL);
+        pthread_cond_init(&zw->cond, NULL);
+
+        if (pthread_create(&zw->thread, NULL, zio_writer_run, zw) != 0) {
+                dprintf("zio: cannot start the writer\n");
+                pthread_mutex_destroy(&zw->lock);
+                pthread_cond_destroy(&zw->cond);
+                xfree(zw->buf[0]);
+                xfree(zw->buf[1]);
+                xfree(zw->out);
+                xfree(zw);
+                return NULL;
+        }
+
+        return zw;
+}
+
+/* under the lock, with the thread idle */
+static void
+zio_hand_off(struct zio_writer *zw)
+{
+        zw->pending = zw->active;
+        zw->active ^= 1;
+        pthread_cond_broadcast(&zw->cond);
+}
+
+int
+zio_write(struct zio_writer *zw, const void *buf, size_t len)
+{
+        const uint8_t *p = buf;
+        size_t n;
+        int r;
+
+        pthread_mutex_lock(&zw->lock);
+        while (len && !zw->error) {
+                n = ZIO_BLOCK - zw->len[zw->active];
+                if (n > len)
+                        n = len;
+                memcpy(zw->buf[zw->active] + zw->len[zw->active], p, n);
+                zw->len[zw->active] += n;
+                p += n;
+                len -= n;
+
+                if (zw->len[zw->active] < ZIO_BLOCK)
+                        break;
+
+                /* both full, the compressor is behind */
+                while (zw->pending != -1)
+                        pthread_cond_wait(&zw->cond, &zw->lock);
+                zio_hand_off(zw);
+        }
+        r = zw->error ? -1 : 0;
+        pthread_mutex_unlock(&zw->lock);
+
+        return r;
+}
+
+void
+zio_flush(struct zio_writer *zw)
+{
+        pthread_mutex_lock(&zw->lock);
+        /* if busy, what is buffered goes with the next block */
+        if (zw->pending == -1 && zw->len[zw->active])
+                zio_hand_off(zw);
+        pthread_mutex_unlock(&zw->lock);
+}
+
+void
+zio_writer_close(struct zio_writer *zw)
+{
+        if (!zw)
+                return;
+
+        pthread_mutex_lock(&zw->lock);
+        while (zw->pending != -1)
+                pthread_cond_wait(&zw->cond, &zw->lock);
+        if (zw->len[zw->active])
+                zio_hand_off(zw);
+        zw->closing = 1;
+        pthread_cond_broadcast(&zw->cond);
+        pthread_mutex_unlock(&zw->lock);
+
+        pthread_join(zw->thread, NULL);
+
+        if (!zw->error)
+                zio_write_block(zw, NULL, 0);
+
+        pthread_mutex_destroy(&zw->lock);
+        pthread_cond_destroy(&zw->cond);
+        xfree(zw->buf[0]);
+        xfree(zw->buf[1]);
+        xfree(zw->out);
+        xfree(zw);
+}
+
+int
+zio_is_compressed(const void *buf, size_t len)
+{
+        return len >= ZIO_MAGIC_LEN && !memcmp(buf, ZIO_MAGIC, ZIO_MAGIC_LEN);
+}
+
+int
+zio_reader_open(struct zio_reader *zr, int fd)
+{
+        char magic[ZIO_MAGIC_LEN];
+
+        memset(zr, 0, sizeof(struct zio_reader));
+
+        if (!zio_crc_ready)
+                zio_crc_setup();
+
+        if (xread(fd, magic, ZIO_MAGIC_LEN) != ZIO_MAGIC_LEN ||
+            !zio_is_compressed(magic, ZIO_MAGIC_LEN)) {
+                return -1;
+        }
+
+        zr->fd = fd;
+        zr->in = xmalloc(LZ_BOUND(ZIO_BLOCK));
+        zr->block = xmalloc(ZIO_BLOCK);
+        return 0;
+}
+
+/* the next block into zr->block, 0 past the last one */
+static int
+zio_read_block(struct zio_reader *zr)
+{
+        uint8_t hdr[ZIO_HEADER_LEN];
+        uint32_t raw, clen;
+        ssize_t n;
+
+        if (xread(zr->fd, hdr, ZIO_HEADER_LEN) != ZIO_HEADER_LEN)
+                return -1;
+
+        raw = zio_get32(hdr);
+        clen = zio_get32(hdr + 4) & ~ZIO_STORED;
+        if (raw == 0) {
+                zr->eof = 1;
+                return 0;
+        }
+
+        if (raw > ZIO_BLOCK || clen > LZ_BOUND(ZIO_BLOCK) ||
+            xread(zr->fd, zr->in, clen) != clen)
+                return -1;
+
+        if (zio_get32(hdr + 4) & ZIO_STORED) {
+                if (clen != raw)
+                        return -1;
+                memcpy(zr->block, zr->in, raw);
+                n = raw;
+        } else {
+                n = lz_decompress(zr->in, clen, zr->block, ZIO_BLOCK);
+        }
+
+        if (n != raw || zio_crc(zr->block, raw) != zio_get32(hdr + 8))
+                return -1;
+
+        zr->len = raw;
+        zr->off = 0;
+        return 1;
+}
+
+ssize_t
+zio_read(struct zio_reader *zr, void *buf, size_t len)
+{
+        size_t n;
+        int r;
+
+        while (zr->off == zr->len) {
+                if (zr->eof)
+                        return 0;
+                if ((r = zio_read_block(zr)) == -1) {
+                        dprintf("zio: the trace is corrupt or cut short\n");
+                        return -1;
+                }
+                if (r == 0)
+                        return 0;
+        }
+
+        n = zr->len - zr->off;
+        if (n > len)
+                n = len;
+        memcpy(buf, zr->block + zr->off, n);
+        zr->off += n;
+
+        return n;
+}
+
+void
+zio_reader_close(struct zio_reader *zr)
+{
+        xfree(zr->in);
+        xfree(zr->block);
+        memset(zr, 0, sizeof(struct zio_reader));
+}
@@ -0,0 +1,109 @@
+#ifndef __ZIO_H
+#define __ZIO_H
+
+/*
+ * Compressed trace files: the magic, then blocks of at most ZIO_BLOCK
+ * bytes compressed each on their own with lz.c, each with a header of
+ * three little endian 32 bit words
+ *
+ *      raw     length once decompressed, 0 for the last block
+ *      len     length that follows, | ZIO_STORED if kept as is
+ *      crc     CRC-32 (IEEE) of the decompressed bytes
+ *
+ * A writer fills one buffer while a thread of its own compresses and
+ * writes the other one, so that whoever writes only ever copies. The
+ * reader decompresses one block at a time and checks it before handing
+ * out a byte of it; a file cut short is told from one that ended.
+ */
+
+#define ZIO_MAGIC               "QMPLZ001"
+#define ZIO_MAGIC_LEN           (8)
+#define ZIO_BLOCK               (256 * 1024)
+/* the block did not compress */
+#define ZIO_STORED              (1U << 31)
+
+struct zio_writer {
+        int fd;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+
+        /* 'active' fills while the thread works on 'pending', -1 if none */
+        uint8_t *buf[2];
+        size_t len[2];
+        int active;
+        int pending;
+        int closing;
+        /* set by the thread on a failed write, the rest is dropped */
+        int error;
+
+        /* kept by the thread */
+        uint8_t *out;
+        uint64_t raw;
+        uint64_t packed;
+        uint64_t blocks;
+};
+
+struct zio_reader {
+        int fd;
+        uint8_t *in;
+        uint8_t *block;
+        size_t len;
+        size_t off;
+        /* the last block was read */
+        int eof;
+};
+
+/**
+ * @brief start compressing to 'fd', the magic is written first
+ * @retval the writer, NULL on failure
+ */
+extern struct zio_writer *
+zio_writer_open(int fd);
+
+/**
+ * @brief append 'len' bytes, thread safe; waits only while both
+ * buffers are full
+ * @retval 0 on success, -1 if an earlier block failed to be written
+ */
+extern int
+zio_write(struct zio_writer *zw, const void *buf, size_t len);
+
+/**
+ * @brief compress and write what is buffered now, without waiting
+ */
+extern void
+zio_flush(struct zio_writer *zw);
+
+/**
+ * @brief write the rest and the last block, stop the thread; 'fd' stays
+ * open
+ */
+extern void
+zio_writer_close(struct zio_writer *zw);
+
+/**
+ * @brief check whether 'buf' starts like a compressed trace
+ */
+extern int
+zio_is_compressed(const void *buf, size_t len);
+
+/**
+ * @brief read the magic off 'fd'
+ * @retval 0 on success, -1 if 'fd' is not a compressed trace
+ */
+extern int
+zio_reader_open(struct zio_reader *zr, int fd);
+
+/**
+ * @brief decompress up to 'len' bytes
+ * @retval the amount read, 0 at the end, -1 if the file is corrupt or
+ * cut short
+ */
+extern ssize_t
+zio_read(struct zio_reader *zr, void *buf, size_t len);
+
+extern void
+zio_reader_close(struct zio_reader *zr);
+
+#endif /* __ZIO_H */